@@ -0,0 +1,49 @@
+/*******************************************************************************
+ *
+ * CPU placement of GeekChat threads.
+ *
+ * ****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "affinity.h"
+
+
+int onlineCpuCount()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+int pinToCpu(int cpu)
+{
+    cpu_set_t set;
+    int res;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu,&set);
+    if((res = pthread_setaffinity_np(pthread_self(),sizeof(set),&set)) != 0)
+    {
+        fprintf(stderr,"\nFailed to pin thread to CPU %d: %s",cpu,strerror(res));
+        return -1;
+    }
+    return 0;
+}
+
+int setFifoPriority(int priority)
+{
+    struct sched_param param;
+    int res;
+
+    memset(&param,0,sizeof(param));
+    param.sched_priority = priority;
+    if((res = pthread_setschedparam(pthread_self(),SCHED_FIFO,&param)) != 0)
+    {
+        fprintf(stderr,"\nFailed to set SCHED_FIFO priority %d: %s",priority,strerror(res));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,21 @@
+/*******************************************************************************
+ *
+ * CPU placement of GeekChat threads.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_AFFINITY_H
+#define GEEKCHAT_AFFINITY_H
+
+int onlineCpuCount();
+
+/*  Pins the calling thread to one CPU. Returns 0, or -1 on failure.  */
+int pinToCpu(int);
+
+/*
+ * Runs the calling thread under SCHED_FIFO at the given priority, 1 to 99.
+ * Needs CAP_SYS_NICE or an RLIMIT_RTPRIO that allows it. Returns 0, or -1
+ * on failure.
+ */
+int setFifoPriority(int);
+
+#endif
@@ -0,0 +1,92 @@
+/*******************************************************************************
+ *
+ * Command line handling shared by the GeekChat front-ends.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "args.h"
+
+
+void extractArgs(int argc,char **argv,const argSpec *specs,const char *usage)
+{
+    int i;
+    for (i=1;i<argc;i++)
+    {
+        const argSpec *spec;
+
+        for(spec=specs;spec->Name != NULL;spec++)
+        {
+            if(!strcmp(argv[i],spec->Name))
+                break;
+        }
+        if(spec->Name == NULL)
+        {
+            invalidArgs("Invalid arguments",usage);
+            exit(EXIT_FAILURE);
+        }
+
+        if(spec->Type == ARG_FLAG)
+        {
+            (*(int*)spec->Target)++;
+        }
+        else if(++i < argc)
+        {
+            *(char**)spec->Target = argv[i];
+        }
+        else
+        {
+            invalidArgs(spec->Missing,usage);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*  Returns the port, or -1 if portStr is not a valid port.  */
+int validateAndGetPort(const char *portStr)
+{
+    int i,port;
+    if(portStr == NULL || portStr[0] == 0)
+        return -1;
+    for(i=0;portStr[i] != '\0';i++)
+    {
+        if(isdigit((unsigned char)portStr[i]) == 0)
+            return -1;
+    }
+    port = atoi(portStr);
+    if(port >= MINPORT && port <= MAXPORT)
+        return port;
+    return -1;
+}
+
+/*  Returns the number, or -1 if numStr is not a number in [min,max].  */
+long validateAndGetNumber(const char *numStr,long min,long max)
+{
+    char *end;
+    long value;
+
+    if(numStr == NULL || numStr[0] == 0 || min < 0)
+        return -1;
+    value = strtol(numStr,&end,10);
+    if(*end != 0 || value < min || value > max)
+        return -1;
+    return value;
+}
+
+int validateHost(const char *hostStr)
+{
+    if(hostStr == NULL)
+        return -1;
+    if(hostStr[0] == 0)
+        return -1;
+    return 0;
+}
+
+void invalidArgs(const char *message,const char *usage)
+{
+    fprintf(stderr,"\n%s",message);
+    fprintf(stderr,"\n\nCommand should adhere to the following format:");
+    fprintf(stderr,"\n\n     %s\n\n",usage);
+}
@@ -0,0 +1,39 @@
+/*******************************************************************************
+ *
+ * Command line handling shared by the GeekChat front-ends.
+ *
+ * 1. Each front-end lists its options in an argSpec table ending with an
+ *    entry whose Name is NULL, and extractArgs() fills in the targets.
+ *
+ * 2. On any error the message and the front-end's usage line are printed
+ *    and the process exits.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_ARGS_H
+#define GEEKCHAT_ARGS_H
+
+/*  Macros of argument validation functions.  */
+#define MAXPORT 65535
+#define MINPORT 1
+
+typedef enum
+{
+    ARG_FLAG,    /* Counts how often it is given, Target is an int*. */
+    ARG_VALUE    /* Takes the next argument, Target is a char**. */
+}argType;
+
+typedef struct argSpec
+{
+    const char *Name;
+    argType Type;
+    void *Target;
+    const char *Missing;    /* Message when the value is missing. */
+}argSpec;
+
+void extractArgs(int,char**,const argSpec*,const char*);
+int validateAndGetPort(const char*);
+int validateHost(const char*);
+long validateAndGetNumber(const char*,long,long);
+void invalidArgs(const char*,const char*);
+
+#endif
@@ -0,0 +1,282 @@
+/*******************************************************************************
+ *
+ * Capture files: timestamped group datagrams and session frames.
+ *
+ * 1. Writers go through stdio, so recording costs a memcpy per record and
+ *    a write() per stdio buffer.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+
+#define CAPTURE_MAGIC "GCAP"
+#define INDEX_MAGIC "GIDX"
+#define HEADER_LENGTH 13
+#define TRAILER_LENGTH 12
+
+static void putVarint(FILE*,unsigned long long);
+static int getVarint(captureFile*,unsigned long long*);
+static void putU64(FILE*,unsigned long long);
+static unsigned long long getU64(const unsigned char*);
+static void readIndex(captureFile*);
+
+
+void createCapture(captureFile *cap,const char *path)
+{
+    memset(cap,0,sizeof(*cap));
+    if((cap->File = fopen(path,"wb")) == NULL)
+    {
+        perror("Error while creating the capture file");
+        exit(EXIT_FAILURE);
+    }
+    cap->Writing = 1;
+    fwrite(CAPTURE_MAGIC,1,4,cap->File);
+    fputc(CAPTURE_VERSION,cap->File);
+    /* Start time is filled in by the first record. */
+    putU64(cap->File,0);
+}
+
+/*  timeUs is wall clock time in microseconds.  */
+void writeCaptureRecord(captureFile *cap,unsigned long long timeUs,int kind,const void *data,size_t len)
+{
+    unsigned long long since;
+
+    if(cap->Records == 0)
+    {
+        cap->StartTimeUs = timeUs;
+        fseek(cap->File,5,SEEK_SET);
+        putU64(cap->File,timeUs);
+        fseek(cap->File,0,SEEK_END);
+    }
+    since = timeUs > cap->StartTimeUs ? timeUs - cap->StartTimeUs : 0;
+    if(since < cap->LastUs)
+        since = cap->LastUs;
+
+    if(cap->Records % CAPTURE_INDEX_INTERVAL == 0)
+    {
+        if(cap->IndexCount == cap->IndexCapacity)
+        {
+            cap->IndexCapacity = cap->IndexCapacity ? cap->IndexCapacity * 2 : 64;
+            if((cap->Index = (captureIndexEntry*)realloc(cap->Index,cap->IndexCapacity * sizeof(captureIndexEntry))) == NULL)
+            {
+                perror("Failed during memory allocation:");
+                exit(EXIT_FAILURE);
+            }
+        }
+        cap->Index[cap->IndexCount].Offset = ftell(cap->File);
+        cap->Index[cap->IndexCount].TimeUs = since;
+        cap->Index[cap->IndexCount].Record = cap->Records;
+        cap->IndexCount++;
+    }
+
+    putVarint(cap->File,since - cap->LastUs);
+    fputc(kind,cap->File);
+    putVarint(cap->File,len);
+    if(fwrite(data,1,len,cap->File) != len)
+    {
+        perror("Error while writing the capture file");
+        exit(EXIT_FAILURE);
+    }
+    cap->LastUs = since;
+    cap->Records++;
+}
+
+/*  For writers this writes the index; readers just close the file.  */
+void closeCapture(captureFile *cap)
+{
+    size_t i;
+
+    if(cap->Writing)
+    {
+        unsigned long long indexOffset = ftell(cap->File);
+        unsigned char count[4];
+
+        count[0] = cap->IndexCount & 0xFF;
+        count[1] = (cap->IndexCount >> 8) & 0xFF;
+        count[2] = (cap->IndexCount >> 16) & 0xFF;
+        count[3] = (cap->IndexCount >> 24) & 0xFF;
+        fwrite(count,1,4,cap->File);
+        for(i=0;i<cap->IndexCount;i++)
+        {
+            putU64(cap->File,cap->Index[i].Offset);
+            putU64(cap->File,cap->Index[i].TimeUs);
+            putU64(cap->File,cap->Index[i].Record);
+        }
+        putU64(cap->File,indexOffset);
+        fwrite(INDEX_MAGIC,1,4,cap->File);
+    }
+    if(fclose(cap->File) == EOF)
+        perror("Error while closing the capture file");
+    free(cap->Index);
+    cap->Index = NULL;
+}
+
+void openCapture(captureFile *cap,const char *path)
+{
+    unsigned char header[HEADER_LENGTH];
+
+    memset(cap,0,sizeof(*cap));
+    if((cap->File = fopen(path,"rb")) == NULL)
+    {
+        perror("Error while opening the capture file");
+        exit(EXIT_FAILURE);
+    }
+    if(fread(header,1,HEADER_LENGTH,cap->File) != HEADER_LENGTH ||
+       memcmp(header,CAPTURE_MAGIC,4) || header[4] != CAPTURE_VERSION)
+    {
+        fprintf(stderr,"\n%s is not a GeekChat capture.\n",path);
+        exit(EXIT_FAILURE);
+    }
+    cap->StartTimeUs = getU64(header + 5);
+    readIndex(cap);
+    fseek(cap->File,HEADER_LENGTH,SEEK_SET);
+}
+
+int readCaptureRecord(captureFile *cap,captureRecord *rec,char *buffer,size_t capacity)
+{
+    unsigned long long delta,length;
+    int kind;
+
+    if((unsigned long long)ftell(cap->File) >= cap->End)
+        return 0;
+    if(getVarint(cap,&delta) == -1)
+        return feof(cap->File) ? 0 : -1;
+    if((kind = fgetc(cap->File)) == EOF || getVarint(cap,&length) == -1 || length > capacity)
+        return -1;
+    if(fread(buffer,1,length,cap->File) != length)
+        return -1;
+
+    cap->LastUs += delta;
+    cap->Records++;
+    rec->TimeUs = cap->LastUs;
+    rec->Kind = kind;
+    rec->Length = length;
+    rec->Data = buffer;
+    return 1;
+}
+
+void seekCapture(captureFile *cap,unsigned long long timeUs)
+{
+    size_t low=0,high=cap->IndexCount;
+    unsigned long long delta;
+
+    if(cap->IndexCount == 0)
+        return;
+    /* Last entry with TimeUs <= timeUs. */
+    while(high - low > 1)
+    {
+        size_t mid = (low + high) / 2;
+        if(cap->Index[mid].TimeUs <= timeUs)
+            low = mid;
+        else
+            high = mid;
+    }
+    fseek(cap->File,cap->Index[low].Offset,SEEK_SET);
+    cap->LastUs = cap->Index[low].TimeUs;
+    cap->Records = cap->Index[low].Record;
+    /* Step back by that record's delta, readCaptureRecord() adds it again. */
+    if(getVarint(cap,&delta) == 0)
+        cap->LastUs -= delta;
+    fseek(cap->File,cap->Index[low].Offset,SEEK_SET);
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static void readIndex(captureFile *cap)
+{
+    unsigned char trailer[TRAILER_LENGTH],count[4],entry[24];
+    unsigned long long indexOffset;
+    long size;
+    size_t i;
+
+    fseek(cap->File,0,SEEK_END);
+    size = ftell(cap->File);
+    cap->End = size;
+    if(size < HEADER_LENGTH + TRAILER_LENGTH + 4)
+        return;
+    fseek(cap->File,size - TRAILER_LENGTH,SEEK_SET);
+    if(fread(trailer,1,TRAILER_LENGTH,cap->File) != TRAILER_LENGTH || memcmp(trailer + 8,INDEX_MAGIC,4))
+        return;
+    indexOffset = getU64(trailer);
+    if(indexOffset < HEADER_LENGTH || indexOffset + 4 > (unsigned long long)size)
+        return;
+
+    fseek(cap->File,indexOffset,SEEK_SET);
+    if(fread(count,1,4,cap->File) != 4)
+        return;
+    cap->IndexCount = count[0] | count[1] << 8 | count[2] << 16 | (size_t)count[3] << 24;
+    if(indexOffset + 4 + cap->IndexCount * 24 + TRAILER_LENGTH != (unsigned long long)size)
+    {
+        cap->IndexCount = 0;
+        return;
+    }
+    if(cap->IndexCount > 0 && (cap->Index = (captureIndexEntry*)malloc(cap->IndexCount * sizeof(captureIndexEntry))) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    for(i=0;i<cap->IndexCount;i++)
+    {
+        if(fread(entry,1,24,cap->File) != 24)
+        {
+            cap->IndexCount = 0;
+            return;
+        }
+        cap->Index[i].Offset = getU64(entry);
+        cap->Index[i].TimeUs = getU64(entry + 8);
+        cap->Index[i].Record = getU64(entry + 16);
+    }
+    cap->End = indexOffset;
+}
+
+static void putVarint(FILE *file,unsigned long long value)
+{
+    while(value >= 0x80)
+    {
+        fputc((int)(value & 0x7F) | 0x80,file);
+        value >>= 7;
+    }
+    fputc((int)value,file);
+}
+
+static int getVarint(captureFile *cap,unsigned long long *value)
+{
+    int shift=0,ch;
+
+    *value = 0;
+    do
+    {
+        if((ch = fgetc(cap->File)) == EOF || shift > 63)
+            return -1;
+        *value |= (unsigned long long)(ch & 0x7F) << shift;
+        shift += 7;
+    }while(ch & 0x80);
+    return 0;
+}
+
+static void putU64(FILE *file,unsigned long long value)
+{
+    unsigned char bytes[8];
+    int i;
+
+    for(i=0;i<8;i++)
+        bytes[i] = (value >> (8 * i)) & 0xFF;
+    fwrite(bytes,1,8,file);
+}
+
+static unsigned long long getU64(const unsigned char *bytes)
+{
+    unsigned long long value=0;
+    int i;
+
+    for(i=7;i>=0;i--)
+        value = value << 8 | bytes[i];
+    return value;
+}
@@ -0,0 +1,73 @@
+/*******************************************************************************
+ *
+ * Capture files: timestamped group datagrams and session frames.
+ *
+ * 1. Layout-
+ *      Header:  Magic "GCAP"(4) Version(1) StartTimeUs(8)
+ *      Record:  DeltaUs(varint) Kind(1) Length(varint) Bytes
+ *      Index:   Count(4) {Offset(8) TimeUs(8) Record(8)} per entry
+ *      Trailer: IndexOffset(8) Magic "GIDX"(4)
+ *    Integers are little endian. DeltaUs is the time since the previous
+ *    record, so a busy capture costs a few bytes of overhead per record.
+ *
+ * 2. Every CAPTURE_INDEX_INTERVAL records an index entry is kept, written
+ *    when the capture is closed, so a reader can start at any time offset
+ *    without scanning. A capture cut short has no index and is read from
+ *    the start.
+ *
+ * 3. Bytes are stored as they were on the wire: a whole group datagram,
+ *    or one session frame including its length field.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_CAPTURE_H
+#define GEEKCHAT_CAPTURE_H
+
+#include <stdio.h>
+
+#define CAPTURE_VERSION 1
+#define CAPTURE_INDEX_INTERVAL 1024
+
+/*  Record kinds.  */
+#define CAPTURE_GROUP 1
+#define CAPTURE_SESSION_AB 2    /* Session frame from the connecting side. */
+#define CAPTURE_SESSION_BA 3    /* Session frame from the accepting side. */
+
+typedef struct captureIndexEntry
+{
+    unsigned long long Offset;
+    unsigned long long TimeUs;
+    unsigned long long Record;
+}captureIndexEntry;
+
+typedef struct captureFile
+{
+    FILE *File;
+    int Writing;
+    unsigned long long StartTimeUs;   /* Wall clock at the first record. */
+    unsigned long long LastUs;        /* Time of the last record, from the start. */
+    unsigned long long Records;
+    unsigned long long End;           /* Where records stop, for readers. */
+    captureIndexEntry *Index;
+    size_t IndexCount;
+    size_t IndexCapacity;
+}captureFile;
+
+typedef struct captureRecord
+{
+    unsigned long long TimeUs;        /* From the start of the capture. */
+    int Kind;
+    size_t Length;
+    char *Data;                       /* Valid until the next read. */
+}captureRecord;
+
+void createCapture(captureFile*,const char*);
+void writeCaptureRecord(captureFile*,unsigned long long,int,const void*,size_t);
+void closeCapture(captureFile*);
+
+void openCapture(captureFile*,const char*);
+/*  Returns 1 with a record, 0 at the end and -1 if the file is damaged.  */
+int readCaptureRecord(captureFile*,captureRecord*,char*,size_t);
+/*  Positions the reader at the last indexed record at or before timeUs.  */
+void seekCapture(captureFile*,unsigned long long);
+
+#endif
@@ -0,0 +1,448 @@
+/*******************************************************************************
+ * 
+ * Capture and replay of group and session traffic.
+ * 
+ * 1. Record a group, or tap a session by sitting between its two ends-
+ * ./chatcapture -record burst.gcap -mcip 224.1.1.1 -port 3000
+ * ./chatcapture -record talk.gcap -listen 4000 -peer host -port 3000
+ *    For the tap, the passive chatApp listens on host:3000 and the active
+ *    one connects to port 4000 of this machine instead.
+ * 
+ * 2. Replay into a group, or into a passive chatApp-
+ * ./chatcapture -replay burst.gcap -mcip 224.1.1.1 -port 3000 [-speed 2|max] [-from SECS]
+ * ./chatcapture -replay talk.gcap -peer localhost -port 3000 [-speed 2|max]
+ *    A session replay sends the frames of the connecting side.
+ * 
+ * 3. Every datagram and frame goes through the same codec as the chat
+ *    front-ends before it is recorded or replayed; malformed ones are
+ *    still recorded, so bad bursts can be reproduced, but are counted.
+ * 
+ * 4. Ctrl+C ends a recording and writes the capture's index.
+ * 
+ * ****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "geekchat.h"
+#include "capture.h"
+
+#define USAGE "./chatcapture -record FILE (-mcip x.x.x.x -port XX | -listen XX -peer host -port XX)\n" \
+              "     ./chatcapture -replay FILE (-mcip x.x.x.x | -peer host) -port XX [-speed N|max] [-from SECS]"
+
+#define RECV_BATCH 32
+#define MAX_DATAGRAM 65507
+#define NS_PER_SEC 1000000000LL
+
+/*  One direction of a tapped session.  */
+typedef struct tapSide
+{
+    int From;
+    int To;
+    int Kind;
+    char *Buffer;
+    size_t Length;
+}tapSide;
+
+typedef struct captureStats
+{
+    unsigned long long Records;
+    unsigned long long Bytes;
+    unsigned long long Malformed;
+}captureStats;
+
+volatile sig_atomic_t stopRequested = 0;
+captureStats stats;
+
+/* Recording functions. */
+void recordGroup(captureFile*,struct in_addr,int);
+void recordSession(captureFile*,int,const char*,int);
+int pumpTap(captureFile*,tapSide*);
+
+/* Replay functions. */
+void replayCapture(captureFile*,int,const struct sockaddr_in*,double,double);
+void waitUntil(long long);
+
+/* Other Utility functions. */
+void writeAll(int,const char*,size_t);
+void stopCapture(int);
+
+/* Argument validation functions. */
+void processArgs(int,char**);
+
+
+char *recordPath=NULL,*replayPath=NULL,*multiIp=NULL,*peerHost=NULL;
+char *portStr=NULL,*listenStr=NULL,*speedStr=NULL,*fromStr=NULL;
+
+
+int main(int argc, char **argv)
+{
+    captureFile cap;
+    struct sigaction action;
+    int port;
+
+    processArgs(argc,argv);
+    port = validateAndGetPort(portStr);
+
+    /* No SA_RESTART, so Ctrl+C interrupts a blocking receive. */
+    memset(&action,0,sizeof(action));
+    action.sa_handler = stopCapture;
+    sigaction(SIGINT,&action,NULL);
+
+    if(recordPath != NULL)
+    {
+        createCapture(&cap,recordPath);
+        if(multiIp != NULL)
+        {
+            struct in_addr group;
+            getBinaryAddress(multiIp,&group);
+            recordGroup(&cap,group,port);
+        }
+        else
+        {
+            recordSession(&cap,validateAndGetPort(listenStr),peerHost,port);
+        }
+        closeCapture(&cap);
+        fprintf(stderr,"\nRecorded %llu records, %llu bytes, %llu malformed\n",
+                stats.Records,stats.Bytes,stats.Malformed);
+    }
+    else
+    {
+        struct sockaddr_in group;
+        double speed = 1,from = 0;
+        int sock;
+
+        if(speedStr != NULL)
+            speed = !strcmp(speedStr,"max") ? 0 : strtod(speedStr,NULL);
+        if(fromStr != NULL)
+            from = strtod(fromStr,NULL);
+        openCapture(&cap,replayPath);
+        memset(&group,0,sizeof(group));
+        if(multiIp != NULL)
+        {
+            sock = getMultiCastSender(1);
+            group.sin_family = AF_INET;
+            group.sin_port = htons(port);
+            getBinaryAddress(multiIp,&group.sin_addr);
+        }
+        else
+        {
+            sock = activeSock(peerHost,port);
+        }
+        replayCapture(&cap,sock,multiIp != NULL ? &group : NULL,speed,from);
+        closeSocket(sock,"Error while closing socket:");
+        closeCapture(&cap);
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ 
+ *                Recording functions.
+ 
+ ******************************************************************************/
+
+void recordGroup(captureFile *cap,struct in_addr group,int port)
+{
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iovs[RECV_BATCH];
+    char *buffers;
+    int sock,i;
+
+    sock = getMultiCastSock(group,port);
+    if((buffers = (char*)malloc((size_t)RECV_BATCH * MAX_DATAGRAM)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    memset(msgs,0,sizeof(msgs));
+    for(i=0;i<RECV_BATCH;i++)
+    {
+        iovs[i].iov_base = buffers + (size_t)i * MAX_DATAGRAM;
+        iovs[i].iov_len = MAX_DATAGRAM;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    fprintf(stderr,"\nRecording %s:%d, Ctrl+C to stop\n",inet_ntoa(group),port);
+    while(!stopRequested)
+    {
+        unsigned long long now;
+        int count;
+
+        if((count = recvmmsg(sock,msgs,RECV_BATCH,MSG_WAITFORONE,NULL)) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("Failed to read message:");
+            break;
+        }
+        /* One clock read per batch; the batch arrived within microseconds. */
+        now = wallClockUs();
+        for(i=0;i<count;i++)
+        {
+            packet msg;
+            if(decodePacket(&groupFormat,iovs[i].iov_base,msgs[i].msg_len,&msg) == -1)
+                stats.Malformed++;
+            writeCaptureRecord(cap,now,CAPTURE_GROUP,iovs[i].iov_base,msgs[i].msg_len);
+            stats.Records++;
+            stats.Bytes += msgs[i].msg_len;
+        }
+    }
+    free(buffers);
+    leaveGroup(sock,group);
+    closeSocket(sock,"Error while closing socket:");
+}
+
+void recordSession(captureFile *cap,int listenPort,const char *host,int port)
+{
+    tapSide sides[2];
+    int listener,client,server,i;
+
+    listener = passiveSock(listenPort,0);
+    fprintf(stderr,"\nWaiting for the active side on port %d\n",listenPort);
+    if((client = accept(listener,NULL,NULL)) == -1)
+    {
+        perror("Error while accepting connection:");
+        exit(EXIT_FAILURE);
+    }
+    closeSocket(listener,"Error while closing socket:");
+    server = activeSock(host,port);
+
+    sides[0] = (tapSide){client,server,CAPTURE_SESSION_AB,NULL,0};
+    sides[1] = (tapSide){server,client,CAPTURE_SESSION_BA,NULL,0};
+    for(i=0;i<2;i++)
+    {
+        if((sides[i].Buffer = (char*)malloc(2 * MAX_SESSION_PACKET_LENGTH)) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while(!stopRequested)
+    {
+        struct pollfd pfds[2] = {{client,POLLIN,0},{server,POLLIN,0}};
+
+        if(poll(pfds,2,-1) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("Error while waiting for the session");
+            break;
+        }
+        if((pfds[0].revents && pumpTap(cap,&sides[0]) == -1) ||
+           (pfds[1].revents && pumpTap(cap,&sides[1]) == -1))
+            break;
+    }
+    for(i=0;i<2;i++)
+        free(sides[i].Buffer);
+    closeSocket(client,"Error while closing socket:");
+    closeSocket(server,"Error while closing socket:");
+}
+
+/*  Forwards and records every complete frame. Returns -1 when the side closed.  */
+int pumpTap(captureFile *cap,tapSide *side)
+{
+    ssize_t ret;
+    size_t start=0;
+    unsigned long long now;
+
+    if((ret = read(side->From,side->Buffer + side->Length,2 * MAX_SESSION_PACKET_LENGTH - side->Length)) <= 0)
+    {
+        if(ret == -1 && errno == EINTR)
+            return 0;
+        return -1;
+    }
+    side->Length += ret;
+    now = wallClockUs();
+
+    while(1)
+    {
+        packet msg;
+        int len = frameLength(&sessionFormat,side->Buffer + start,side->Length - start);
+
+        if(len == -1)
+        {
+            /* Not a GeekChat stream any more; pass the rest through. */
+            stats.Malformed++;
+            writeAll(side->To,side->Buffer + start,side->Length - start);
+            start = side->Length;
+            break;
+        }
+        if(len == 0 || (size_t)len > side->Length - start)
+            break;
+        if(decodePacket(&sessionFormat,side->Buffer + start,len,&msg) == -1)
+            stats.Malformed++;
+        writeCaptureRecord(cap,now,side->Kind,side->Buffer + start,len);
+        writeAll(side->To,side->Buffer + start,len);
+        stats.Records++;
+        stats.Bytes += len;
+        start += len;
+    }
+    memmove(side->Buffer,side->Buffer + start,side->Length - start);
+    side->Length -= start;
+    return 0;
+}
+
+
+/******************************************************************************
+ 
+ *                Replay functions.
+ 
+ ******************************************************************************/
+
+/*
+ * Record i goes out at start + (time_i - from) / speed; speed 0 means as
+ * fast as possible. A session replay sends only the connecting side.
+ */
+void replayCapture(captureFile *cap,int sock,const struct sockaddr_in *group,double speed,double from)
+{
+    unsigned long long fromUs = (unsigned long long)(from * 1e6),sent=0,bytes=0,skipped=0;
+    long long start;
+    captureRecord rec;
+    char *buffer;
+    int ret;
+
+    if((buffer = (char*)malloc(MAX_GROUP_PACKET_LENGTH)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    seekCapture(cap,fromUs);
+    start = monotonicNs();
+
+    while(!stopRequested && (ret = readCaptureRecord(cap,&rec,buffer,MAX_GROUP_PACKET_LENGTH)) == 1)
+    {
+        packet msg;
+        int wanted = group != NULL ? rec.Kind == CAPTURE_GROUP : rec.Kind == CAPTURE_SESSION_AB;
+
+        if(rec.TimeUs < fromUs || !wanted)
+            continue;
+        if(decodePacket(group != NULL ? &groupFormat : &sessionFormat,rec.Data,rec.Length,&msg) == -1)
+            skipped++;
+        if(speed > 0)
+            waitUntil(start + (long long)((rec.TimeUs - fromUs) * 1000 / speed));
+
+        if(group != NULL)
+        {
+            if(sendto(sock,rec.Data,rec.Length,0,(struct sockaddr*)group,sizeof(*group)) == -1)
+                perror("\nPacket sent failed");
+        }
+        else
+        {
+            writeAll(sock,rec.Data,rec.Length);
+        }
+        sent++;
+        bytes += rec.Length;
+    }
+    if(ret == -1)
+        fprintf(stderr,"\nCapture file is damaged after record %llu\n",cap->Records);
+
+    fprintf(stderr,"\nReplayed %llu records, %llu bytes (%llu malformed) in %.3f s\n",
+            sent,bytes,skipped,(monotonicNs() - start) / 1e9);
+    free(buffer);
+}
+
+void waitUntil(long long due)
+{
+    struct timespec until;
+
+    if(monotonicNs() >= due)
+        return;
+    until.tv_sec = due / NS_PER_SEC;
+    until.tv_nsec = due % NS_PER_SEC;
+    while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&until,NULL) == EINTR && !stopRequested);
+}
+
+
+/******************************************************************************
+ 
+ *                Other Utility functions.
+ 
+ ******************************************************************************/
+
+void writeAll(int sock,const char *data,size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t ret;
+        if((ret = write(sock,data,len)) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("Failed to send message:");
+            return;
+        }
+        data += ret;
+        len -= ret;
+    }
+}
+
+/*  Signal Handler for SIGINT */
+void stopCapture(int signal_val)
+{
+    stopRequested = 1;
+}
+
+/*******************************************************************************
+
+ *      Arguments extraction and validation functions.
+
+ ******************************************************************************/
+
+void processArgs(int argc, char **argv)
+{
+    const argSpec specs[] =
+    {
+        {"-record",ARG_VALUE,&recordPath,"Capture file missing."},
+        {"-replay",ARG_VALUE,&replayPath,"Capture file missing."},
+        {"-mcip",ARG_VALUE,&multiIp,"Multicast IP address missing."},
+        {"-peer",ARG_VALUE,&peerHost,"Peer host missing."},
+        {"-port",ARG_VALUE,&portStr,"Port missing."},
+        {"-listen",ARG_VALUE,&listenStr,"Listen port missing."},
+        {"-speed",ARG_VALUE,&speedStr,"Speed missing."},
+        {"-from",ARG_VALUE,&fromStr,"Start time missing."},
+        {NULL}
+    };
+
+    extractArgs(argc,argv,specs,USAGE);
+    if((recordPath == NULL) == (replayPath == NULL))
+    {
+        invalidArgs("Give one of -record and -replay.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if((multiIp == NULL) == (peerHost == NULL))
+    {
+        invalidArgs("Give one of -mcip and -peer.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(validateAndGetPort(portStr) == -1)
+    {
+        invalidArgs("Invalid port.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(recordPath != NULL && peerHost != NULL && validateAndGetPort(listenStr) == -1)
+    {
+        invalidArgs("Invalid listen port.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(speedStr != NULL && strcmp(speedStr,"max") && strtod(speedStr,NULL) <= 0)
+    {
+        invalidArgs("Invalid speed.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(fromStr != NULL && strtod(fromStr,NULL) < 0)
+    {
+        invalidArgs("Invalid start time.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+}
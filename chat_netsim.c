@@ -0,0 +1,781 @@
+/*******************************************************************************
+ *
+ * Network simulator: the group and session protocols over impaired links,
+ * reproducible and faster than real time.
+ *
+ * 1. A group run is started as follows-
+ * ./chatnetsim -group [-members N] [-receivers N] [-rate MSGS] [-size SPEC]
+ *              [-fec SPEC] [-link SPEC] [-duration SECS] [-seed N]
+ *    Members send sequenced, timestamped messages as groupchat does, in
+ *    FEC fragments with -fec. Every datagram goes to every receiver over a
+ *    link of its own, impaired as -link says (netsim.h). Receivers run the
+ *    receive path of groupchat -shards: duplicate suppression, decoding,
+ *    the ordered merge with its 50 ms wait, and FEC reassembly.
+ *
+ * 2. A session run is started as follows-
+ * ./chatnetsim -session [-rate MSGS] [-size SPEC] [-channels N] [-link SPEC]
+ *              [-duration SECS] [-seed N] [-nodeflate] [-nochunks]
+ *    Two chatApp --channels peers, each a sessionMux without a socket, talk
+ *    over a stream link each way. They exchange names and capabilities,
+ *    then one sends messages over N channels the way chatApp sends typed
+ *    lines: in pieces, compressed and stamped as agreed, within each
+ *    channel's window. -rate 0 keeps every window full, for throughput;
+ *    it needs a link with a delay or a rate, or the clock never moves on.
+ *
+ * 3. Time is simulated. Messages are stamped and timed on the simulated
+ *    clock, so latency is what the links, the queues and the protocol add
+ *    and nothing else, and the same options and seed give the same report
+ *    on any machine.
+ *
+ * 4. The report gives what was sent and delivered, what the links did,
+ *    latency percentiles, goodput, and how much faster than real time the
+ *    run went.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "geekchat.h"
+
+#define USAGE "./chatnetsim -group|-session [-members N] [-receivers N] [-rate MSGS] [-size SPEC] " \
+              "[-fec SPEC] [-channels N] [-nodeflate] [-nochunks] [-link SPEC] [-duration SECS] [-seed N]"
+
+#define MAX_MEMBERS 100000
+#define MAX_RECEIVERS 256
+#define US_PER_SEC 1000000LL
+
+typedef struct member
+{
+    unsigned int SenderId;
+    unsigned int Sequence;
+    unsigned int ObjectId;
+    unsigned int NameLength;
+    char Name[16];
+}member;
+
+struct simRun;
+
+typedef struct receiver
+{
+    struct simRun *Run;
+    int Link;
+    dedupFilter Dedup;
+    reorderBuffer Reorder;
+    fecDecoder Fec;
+    long long TimerDue;         /* Of the pending expiry timer, -1 for none. */
+    unsigned long long Delivered;
+    unsigned long long Bytes;
+}receiver;
+
+/*  A decoded datagram held by the ordered merge; Pkt points into Data.  */
+typedef struct heldPacket
+{
+    packet Pkt;
+    char Data[];
+}heldPacket;
+
+typedef struct peer
+{
+    struct simRun *Run;
+    sessionMux Mux;
+    int Link;                   /* The one it sends on. */
+    sessionCaps Mine;
+    sessionCaps Agreed;
+    unsigned long long Pieces;
+    unsigned long long Delivered;
+    unsigned long long Bytes;
+}peer;
+
+typedef struct simRun
+{
+    netsim Sim;
+    netsimImpairment Link;
+    int Session;
+    long long DurationUs;
+    double Rate;
+    sizeDist Size;
+    char *Filler;
+    latencyTable Latency;
+    unsigned long long Sent;
+    unsigned long long SentBytes;
+    unsigned long long Datagrams;
+    long long Started;          /* When traffic started. */
+    long long LastDelivery;
+    /* Group runs. */
+    member *Members;
+    int MemberCount;
+    receiver *Receivers;
+    int ReceiverCount;
+    fecConfig Fec;
+    /* Session runs. */
+    peer Peers[2];              /* Sender, then receiver. */
+    int Channels;
+    int NextChannel;
+    unsigned int Features;
+    int Sending;
+}simRun;
+
+void initRun(simRun*,unsigned long long);
+void runSimulation(simRun*);
+void report(simRun*,double);
+void reportLinks(simRun*);
+
+/* Group runs. */
+void initGroup(simRun*);
+void groupTimer(simRun*,long);
+void sendGroupMessage(simRun*,member*);
+void sendDatagram(simRun*,packet*);
+void receiveDatagram(simRun*,receiver*,const char*,size_t);
+void expireReceiver(simRun*,receiver*);
+void deliverHeld(void*,void*);
+void deliverGroupText(simRun*,receiver*,packet*);
+void freeGroup(simRun*);
+
+/* Session runs. */
+void initSession(simRun*);
+void sessionTimer(simRun*);
+void sendSessionMessage(simRun*);
+void fillWindows(simRun*);
+void pumpOutput(simRun*);
+void peerHandler(sessionMux*,packet*,void*);
+void freeSession(simRun*);
+
+/* Argument validation functions. */
+void processArgs(int,char**,simRun*,unsigned long long*);
+
+
+int main(int argc, char **argv)
+{
+    simRun run;
+    unsigned long long seed=1;
+    long long start;
+
+    memset(&run,0,sizeof(run));
+    processArgs(argc,argv,&run,&seed);
+    initRun(&run,seed);
+    start = monotonicNs();
+    runSimulation(&run);
+    report(&run,(monotonicNs() - start) / 1e9);
+    if(run.Session)
+        freeSession(&run);
+    else
+        freeGroup(&run);
+    freeLatency(&run.Latency);
+    freeNetsim(&run.Sim);
+    free(run.Filler);
+    return 0;
+}
+
+void initRun(simRun *run,unsigned long long seed)
+{
+    int i;
+
+    initNetsim(&run->Sim,seed);
+    initLatency(&run->Latency);
+    if((run->Filler = (char*)malloc(MAX_TEXT_LENGTH)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    /* Random words: compressible about as much as chat, not a pattern. */
+    for(i=0;i<MAX_TEXT_LENGTH;i++)
+        run->Filler[i] = netsimRandom(&run->Sim) % 6 == 0 ? ' ' : 'a' + netsimRandom(&run->Sim) % 26;
+    if(run->Session)
+        initSession(run);
+    else
+        initGroup(run);
+}
+
+void runSimulation(simRun *run)
+{
+    netsimEvent ev;
+
+    while(netsimNext(&run->Sim,&ev))
+    {
+        if(run->Session)
+        {
+            if(ev.Kind == NETSIM_TIMER)
+                sessionTimer(run);
+            else if(muxReceive(&run->Peers[ev.Link == run->Peers[0].Link ? 1 : 0].Mux,ev.Data,ev.Length) == -1)
+            {
+                fprintf(stderr,"Session failed at %.3f s.\n",run->Sim.Now / 1e6);
+                exit(EXIT_FAILURE);
+            }
+            fillWindows(run);
+            pumpOutput(run);
+        }
+        else if(ev.Kind == NETSIM_TIMER)
+            groupTimer(run,ev.Tag);
+        else
+            receiveDatagram(run,&run->Receivers[ev.Link],ev.Data,ev.Length);
+    }
+}
+
+void report(simRun *run,double wallSeconds)
+{
+    const latencyHistogram *all = &run->Latency.All;
+    double simSeconds = run->Sim.Now / 1e6;
+    double busy = (run->LastDelivery - run->Started) / 1e6;
+    unsigned long long delivered=0,bytes=0;
+    int i;
+
+    if(run->Session)
+    {
+        delivered = run->Peers[1].Delivered;
+        bytes = run->Peers[1].Bytes;
+    }
+    else
+    {
+        for(i=0;i<run->ReceiverCount;i++)
+        {
+            delivered += run->Receivers[i].Delivered;
+            bytes += run->Receivers[i].Bytes;
+        }
+    }
+    if(wallSeconds <= 0)
+        wallSeconds = 1e-9;
+    if(busy <= 0)
+        busy = 1e-9;
+
+    printf("simulated: %.3f s in %.3f s, %.0fx real time\n",simSeconds,wallSeconds,simSeconds / wallSeconds);
+    if(run->Session)
+        printf("sent     : %llu messages, %llu text bytes\n",run->Sent,run->SentBytes);
+    else
+        printf("sent     : %llu messages in %llu datagrams, %llu text bytes\n",
+               run->Sent,run->Datagrams,run->SentBytes);
+    reportLinks(run);
+    if(run->Session)
+    {
+        printf("received : %llu messages in %llu pieces, %llu text bytes\n",
+               delivered,run->Peers[1].Pieces,bytes);
+        printf("goodput  : %.3f MB/s\n",bytes / busy / 1e6);
+    }
+    else
+    {
+        unsigned long long duplicates=0,recovered=0,lost=0;
+        double expected = (double)run->Sent * run->ReceiverCount;
+
+        for(i=0;i<run->ReceiverCount;i++)
+        {
+            duplicates += run->Receivers[i].Dedup.Duplicates;
+            recovered += run->Receivers[i].Fec.Recovered;
+            lost += run->Receivers[i].Fec.Lost;
+        }
+        printf("received : %.3f%% of messages by %d receivers, %llu duplicates dropped\n",
+               expected > 0 ? delivered * 100.0 / expected : 0,run->ReceiverCount,duplicates);
+        if(run->Fec.Scheme != FEC_NONE)
+            printf("fec      : %llu fragments rebuilt, %llu messages given up\n",recovered,lost);
+        printf("goodput  : %.3f MB/s per receiver\n",bytes / busy / 1e6 / run->ReceiverCount);
+    }
+    printf("latency  : p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f ms\n",
+           latencyPercentile(all,50) / 1000.0,latencyPercentile(all,90) / 1000.0,
+           latencyPercentile(all,99) / 1000.0,latencyPercentile(all,99.9) / 1000.0,all->Max / 1000.0);
+}
+
+/*  Totals over the links of one direction.  */
+void reportLinks(simRun *run)
+{
+    unsigned long long sent=0,bytes=0,lost=0,dropped=0,dups=0,reordered=0,resent=0;
+    int i;
+
+    for(i=0;i<run->Sim.LinkCount;i++)
+    {
+        netsimLink *link = &run->Sim.Links[i];
+        /* The session's other direction only carries credit. */
+        if(run->Session && i != run->Peers[0].Link)
+            continue;
+        sent += link->Sent;
+        bytes += link->Bytes;
+        lost += link->Lost;
+        dropped += link->Dropped;
+        dups += link->Duplicated;
+        reordered += link->Reordered;
+        resent += link->Retransmitted;
+    }
+    if(run->Session)
+        printf("link     : %llu bytes in %llu segments, %llu resent\n",bytes,sent,resent);
+    else
+        printf("links    : %llu datagrams, %llu bytes, %llu lost, %llu queue drops, "
+               "%llu duplicated, %llu reordered\n",sent,bytes,lost,dropped,dups,reordered);
+}
+
+
+/******************************************************************************
+
+ *                Group runs.
+
+ ******************************************************************************/
+
+void initGroup(simRun *run)
+{
+    int i;
+
+    run->Members = (member*)calloc(run->MemberCount,sizeof(member));
+    run->Receivers = (receiver*)calloc(run->ReceiverCount,sizeof(receiver));
+    if(run->Members == NULL || run->Receivers == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    for(i=0;i<run->ReceiverCount;i++)
+    {
+        receiver *r = &run->Receivers[i];
+        r->Run = run;
+        r->Link = netsimAddLink(&run->Sim,NETSIM_DATAGRAM,&run->Link);
+        r->TimerDue = -1;
+        initDedup(&r->Dedup);
+        initReorder(&r->Reorder,REORDER_TIMEOUT_MS,deliverHeld,r);
+        initFecDecoder(&r->Fec);
+    }
+    /* Timer tags below the member count are members' next messages. */
+    for(i=0;i<run->MemberCount;i++)
+    {
+        member *mb = &run->Members[i];
+        mb->SenderId = (unsigned int)netsimRandom(&run->Sim);
+        mb->NameLength = snprintf(mb->Name,sizeof(mb->Name),"bot%08x",mb->SenderId);
+        netsimTimer(&run->Sim,(long long)(netsimExp(&run->Sim,run->MemberCount / run->Rate) * US_PER_SEC),i);
+    }
+}
+
+void groupTimer(simRun *run,long tag)
+{
+    if(tag < run->MemberCount)
+    {
+        long long next;
+
+        sendGroupMessage(run,&run->Members[tag]);
+        next = run->Sim.Now + (long long)(netsimExp(&run->Sim,run->MemberCount / run->Rate) * US_PER_SEC);
+        if(next < run->DurationUs)
+            netsimTimer(&run->Sim,next,tag);
+    }
+    else
+    {
+        receiver *r = &run->Receivers[tag - run->MemberCount];
+        /* An earlier timer was replaced; the later one does the work. */
+        if(run->Sim.Now == r->TimerDue)
+        {
+            r->TimerDue = -1;
+            expireReceiver(run,r);
+        }
+    }
+}
+
+/*  As groupchat's writePacket(): whole, or as FEC fragments if it is big.  */
+void sendGroupMessage(simRun *run,member *mb)
+{
+    packet pkt;
+
+    memset(&pkt,0,sizeof(pkt));
+    pkt.Opcode = GROUP_OP_TEXT;
+    pkt.Flags = GROUP_FLAG_TIME;
+    pkt.SendTime = run->Sim.Now;
+    pkt.SenderId = mb->SenderId;
+    pkt.NameLength = mb->NameLength;
+    pkt.Name = mb->Name;
+    pkt.TextLength = randomSize(&run->Size,&run->Sim.Rng);
+    pkt.Text = run->Filler;
+    run->Sent++;
+    run->SentBytes += pkt.TextLength;
+
+    if(run->Fec.Scheme != FEC_NONE && encodedLength(&groupFormat,&pkt) + MAX_GROUP_HEADER_LENGTH > FEC_FRAGMENT_SIZE)
+    {
+        size_t objectLength = encodedLength(&groupFormat,&pkt),stride = FEC_HEADER_LENGTH + run->Fec.FragmentSize;
+        int count = fecFragmentCount(&run->Fec,objectLength),i;
+        char *object = (char*)malloc(objectLength);
+        char *fragments = (char*)malloc(count * stride);
+
+        if(object == NULL || fragments == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+        encodePacket(&groupFormat,&pkt,object,objectLength);
+        fecEncode(&run->Fec,mb->ObjectId++,object,objectLength,fragments);
+        for(i=0;i<count;i++)
+        {
+            packet frag;
+            memset(&frag,0,sizeof(frag));
+            frag.Opcode = GROUP_OP_FRAG;
+            frag.Flags = GROUP_FLAG_SEQ;
+            frag.SenderId = mb->SenderId;
+            frag.Sequence = mb->Sequence++;
+            frag.TextLength = stride;
+            frag.Text = fragments + i * stride;
+            sendDatagram(run,&frag);
+        }
+        free(object);
+        free(fragments);
+        return;
+    }
+    pkt.Flags |= GROUP_FLAG_SEQ;
+    pkt.Sequence = mb->Sequence++;
+    sendDatagram(run,&pkt);
+}
+
+/*  Multicast: one copy per receiver, each impaired on its own.  */
+void sendDatagram(simRun *run,packet *pkt)
+{
+    static char buffer[MAX_GROUP_PACKET_LENGTH];
+    int len,i;
+
+    if((len = encodePacket(&groupFormat,pkt,buffer,sizeof(buffer))) == -1)
+    {
+        fprintf(stderr,"Message too long to be sent.\n");
+        exit(EXIT_FAILURE);
+    }
+    run->Datagrams++;
+    for(i=0;i<run->ReceiverCount;i++)
+        netsimSend(&run->Sim,run->Receivers[i].Link,buffer,len);
+}
+
+/*  As a receive shard would, then the merge.  */
+void receiveDatagram(simRun *run,receiver *r,const char *data,size_t len)
+{
+    heldPacket *held;
+
+    if(dedupPacket(&r->Dedup,data,len))
+        return;
+    if((held = (heldPacket*)malloc(sizeof(heldPacket) + len)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(held->Data,data,len);
+    if(decodePacket(&groupFormat,held->Data,len,&held->Pkt) == -1 || !(held->Pkt.Flags & GROUP_FLAG_SEQ))
+    {
+        free(held);
+        return;
+    }
+    if(held->Pkt.Opcode != GROUP_OP_FRAG)
+        held->Pkt.TextLength = sanitizeText(held->Pkt.Text,held->Pkt.TextLength);
+    reorderInsert(&r->Reorder,held->Pkt.SenderId,held->Pkt.Sequence,held,run->Sim.Now / 1000);
+    if(r->TimerDue == -1)
+    {
+        r->TimerDue = run->Sim.Now + REORDER_TIMEOUT_MS * 1000;
+        netsimTimer(&run->Sim,r->TimerDue,run->MemberCount + (r - run->Receivers));
+    }
+}
+
+void expireReceiver(simRun *run,receiver *r)
+{
+    long long wait = reorderExpire(&r->Reorder,run->Sim.Now / 1000);
+
+    if(wait >= 0)
+    {
+        /* Whole milliseconds, as the merge counts; never the same instant. */
+        r->TimerDue = run->Sim.Now + (wait > 0 ? wait : 1) * 1000;
+        netsimTimer(&run->Sim,r->TimerDue,run->MemberCount + (r - run->Receivers));
+    }
+}
+
+/*  The merge's deliver callback.  */
+void deliverHeld(void *item,void *ctx)
+{
+    heldPacket *held = (heldPacket*)item;
+    receiver *r = (receiver*)ctx;
+    simRun *run = r->Run;
+    packet *pkt = &held->Pkt;
+
+    if(pkt->Opcode == GROUP_OP_TEXT)
+        deliverGroupText(run,r,pkt);
+    else if(pkt->Opcode == GROUP_OP_FRAG)
+    {
+        packet inner;
+        char *object;
+        int len;
+
+        if((len = fecReceive(&r->Fec,pkt->SenderId,pkt->Text,pkt->TextLength,run->Sim.Now / 1000,&object)) > 0 &&
+           decodePacket(&groupFormat,object,len,&inner) != -1 && inner.Opcode == GROUP_OP_TEXT)
+        {
+            inner.SenderId = pkt->SenderId;
+            inner.TextLength = sanitizeText(inner.Text,inner.TextLength);
+            deliverGroupText(run,r,&inner);
+        }
+    }
+    free(held);
+}
+
+void deliverGroupText(simRun *run,receiver *r,packet *pkt)
+{
+    r->Delivered++;
+    r->Bytes += pkt->TextLength;
+    run->LastDelivery = run->Sim.Now;
+    if(pkt->Flags & GROUP_FLAG_TIME)
+        latencyRecord(&run->Latency,pkt->SenderId,pkt->Name,pkt->NameLength,pkt->SendTime,run->Sim.Now);
+}
+
+void freeGroup(simRun *run)
+{
+    int i;
+
+    /* Whatever the merges still hold is delivered, as at shutdown. */
+    for(i=0;i<run->ReceiverCount;i++)
+    {
+        freeReorder(&run->Receivers[i].Reorder);
+        freeFecDecoder(&run->Receivers[i].Fec);
+    }
+    free(run->Receivers);
+    free(run->Members);
+}
+
+
+/******************************************************************************
+
+ *                Session runs.
+
+ ******************************************************************************/
+
+void initSession(simRun *run)
+{
+    static const char *names[2] = {"active","passive"};
+    packet pt;
+    int i;
+
+    for(i=0;i<2;i++)
+    {
+        peer *p = &run->Peers[i];
+        p->Run = run;
+        p->Link = netsimAddLink(&run->Sim,NETSIM_STREAM,&run->Link);
+        initMux(&p->Mux,-1,peerHandler,NULL,p);
+        localCaps(&p->Mine,run->Features);
+        baselineCaps(&p->Agreed);
+
+        memset(&pt,0,sizeof(pt));
+        pt.Opcode = SESSION_OP_NAME;
+        pt.TextLength = strlen(names[i]);
+        pt.Text = (char*)names[i];
+        muxSend(&p->Mux,&pt);
+        capsPacket(&p->Mine,&pt);
+        muxSend(&p->Mux,&pt);
+    }
+    pumpOutput(run);
+}
+
+/*  The only timer of a session run: the sender's next message.  */
+void sessionTimer(simRun *run)
+{
+    long long next;
+
+    sendSessionMessage(run);
+    next = run->Sim.Now + (long long)(netsimExp(&run->Sim,1 / run->Rate) * US_PER_SEC);
+    if(next < run->Started + run->DurationUs)
+        netsimTimer(&run->Sim,next,0);
+}
+
+/*  As chatApp's channelLine(): pieces, compressed and stamped as agreed.  */
+void sendSessionMessage(simRun *run)
+{
+    static char zipped[MAX_SESSION_TEXT_LENGTH];
+    peer *p = &run->Peers[0];
+    size_t len = randomSize(&run->Size,&run->Sim.Rng);
+    size_t limit = p->Agreed.MaxText - 8;
+    int chunks = p->Agreed.Caps & CAP_CHUNKS;
+    char *text = run->Filler;
+    packet pt;
+
+    if(!chunks && len > limit)
+        len = limit;
+    else if(chunks && limit > CHUNK_TEXT)
+        limit = CHUNK_TEXT;
+    run->Sent++;
+    run->SentBytes += len;
+    do
+    {
+        size_t piece = textPiece(text,len,limit);
+
+        memset(&pt,0,sizeof(pt));
+        pt.Opcode = SESSION_OP_TEXT;
+        pt.Channel = run->NextChannel;
+        pt.TextLength = piece;
+        pt.Text = text;
+        if(piece < len)
+            pt.Flags = SESSION_FLAG_MORE;
+        if(p->Agreed.Caps & CAP_TIMESTAMPS)
+        {
+            pt.Flags |= SESSION_FLAG_TIME;
+            pt.SendTime = run->Sim.Now;
+        }
+        if(p->Agreed.Caps & CAP_DEFLATE)
+            deflateText(&pt,zipped);
+        muxSend(&p->Mux,&pt);
+        text += piece;
+        len -= piece;
+    }while(len > 0);
+    run->NextChannel = (run->NextChannel + 1) % run->Channels;
+}
+
+/*  -rate 0: a new message whenever a channel has no backlog.  */
+void fillWindows(simRun *run)
+{
+    sessionMux *mux = &run->Peers[0].Mux;
+
+    if(run->Rate > 0 || !run->Sending || run->Sim.Now >= run->Started + run->DurationUs)
+        return;
+    /* Empty messages take no window; the output buffer bounds those. */
+    while(mux->Channels[run->NextChannel].QueueLength == 0 && mux->OutLength < NETSIM_SEND_BUFFER)
+        sendSessionMessage(run);
+}
+
+/*  Moves output into the links as far as their send buffers take it.  */
+void pumpOutput(simRun *run)
+{
+    static char buffer[NETSIM_SEND_BUFFER];
+    int i;
+
+    for(i=0;i<2;i++)
+    {
+        peer *p = &run->Peers[i];
+        size_t room,len;
+
+        while((room = netsimWritable(&run->Sim,p->Link)) > 0 &&
+              (len = muxOutput(&p->Mux,buffer,room)) > 0)
+            netsimSend(&run->Sim,p->Link,buffer,len);
+    }
+}
+
+/*  As chatApp's channelHandler(), counting instead of printing.  */
+void peerHandler(sessionMux *mux,packet *msg,void *ctx)
+{
+    static char expanded[MAX_SESSION_TEXT_LENGTH];
+    peer *p = (peer*)ctx;
+    simRun *run = p->Run;
+
+    if(msg->Opcode == SESSION_OP_CAPS && msg->Channel == 0)
+    {
+        negotiateCaps(&p->Mine,msg,&p->Agreed);
+        if(p == &run->Peers[0] && !run->Sending)
+        {
+            /* Traffic starts once the sender knows what it may use. */
+            if(run->Channels > 1 && !(p->Agreed.Caps & CAP_CHANNELS))
+                run->Channels = 1;
+            run->Sending = 1;
+            run->Started = run->Sim.Now;
+            if(run->Rate > 0)
+                netsimTimer(&run->Sim,run->Sim.Now,0);
+        }
+    }
+    else if(msg->Opcode == SESSION_OP_TEXT)
+    {
+        size_t len = msg->TextLength;
+
+        if(msg->Flags & SESSION_FLAG_TIME)
+            latencyRecord(&run->Latency,msg->Channel,"active",6,msg->SendTime,run->Sim.Now);
+        if((msg->Flags & SESSION_FLAG_DEFLATE) && inflateText(msg,expanded,sizeof(expanded)) == -1)
+        {
+            fprintf(stderr,"Dropped a message that failed to decompress.\n");
+            muxConsumed(mux,msg->Channel,len);
+            return;
+        }
+        msg->TextLength = sanitizeText(msg->Text,msg->TextLength);
+        p->Pieces++;
+        p->Bytes += msg->TextLength;
+        if(!(msg->Flags & SESSION_FLAG_MORE))
+            p->Delivered++;
+        run->LastDelivery = run->Sim.Now;
+        muxConsumed(mux,msg->Channel,len);
+    }
+}
+
+void freeSession(simRun *run)
+{
+    freeMux(&run->Peers[0].Mux);
+    freeMux(&run->Peers[1].Mux);
+}
+
+
+/*******************************************************************************
+
+ *      Arguments extraction and validation functions.
+
+ ******************************************************************************/
+
+void processArgs(int argc, char **argv, simRun *run, unsigned long long *seed)
+{
+    char *memberStr=NULL,*receiverStr=NULL,*rateStr=NULL,*sizeStr=NULL,*fecStr=NULL;
+    char *channelStr=NULL,*linkStr=NULL,*durationStr=NULL,*seedStr=NULL;
+    int group=0,noDeflate=0,noChunks=0;
+    long value;
+    const argSpec specs[] =
+    {
+        {"-group",ARG_FLAG,&group,NULL},
+        {"-session",ARG_FLAG,&run->Session,NULL},
+        {"-members",ARG_VALUE,&memberStr,"Member count missing."},
+        {"-receivers",ARG_VALUE,&receiverStr,"Receiver count missing."},
+        {"-rate",ARG_VALUE,&rateStr,"Message rate missing."},
+        {"-size",ARG_VALUE,&sizeStr,"Size distribution missing."},
+        {"-fec",ARG_VALUE,&fecStr,"FEC scheme missing."},
+        {"-channels",ARG_VALUE,&channelStr,"Channel count missing."},
+        {"-nodeflate",ARG_FLAG,&noDeflate,NULL},
+        {"-nochunks",ARG_FLAG,&noChunks,NULL},
+        {"-link",ARG_VALUE,&linkStr,"Link impairment missing."},
+        {"-duration",ARG_VALUE,&durationStr,"Duration missing."},
+        {"-seed",ARG_VALUE,&seedStr,"Seed missing."},
+        {NULL}
+    };
+
+    extractArgs(argc,argv,specs,USAGE);
+    if(group + run->Session != 1)
+    {
+        invalidArgs("Give one of -group and -session.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    run->MemberCount = 10;
+    run->ReceiverCount = 4;
+    run->Rate = 1000;
+    run->Channels = 1;
+    run->DurationUs = 10 * US_PER_SEC;
+    if(memberStr != NULL && (run->MemberCount = validateAndGetNumber(memberStr,1,MAX_MEMBERS)) == -1)
+    {
+        invalidArgs("Invalid member count.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(receiverStr != NULL && (run->ReceiverCount = validateAndGetNumber(receiverStr,1,MAX_RECEIVERS)) == -1)
+    {
+        invalidArgs("Invalid receiver count.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(rateStr != NULL)
+    {
+        /* Only a session can be driven by its windows alone. */
+        if((value = validateAndGetNumber(rateStr,run->Session ? 0 : 1,10000000)) == -1)
+        {
+            invalidArgs("Invalid message rate.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        run->Rate = value;
+    }
+    if(channelStr != NULL && (run->Channels = validateAndGetNumber(channelStr,1,MUX_MAX_CHANNELS)) == -1)
+    {
+        invalidArgs("Invalid channel count.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(durationStr != NULL)
+    {
+        if((value = validateAndGetNumber(durationStr,1,86400)) == -1)
+        {
+            invalidArgs("Invalid duration.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        run->DurationUs = value * US_PER_SEC;
+    }
+    if(seedStr != NULL)
+        *seed = strtoull(seedStr,NULL,10);
+    if(parseImpairment(linkStr,&run->Link) == -1)
+    {
+        invalidArgs("Invalid link, e.g. loss=1%,reorder=2%,delay=20ms,jitter=5ms,rate=10mbit.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    /* Over a link that takes no time, full windows refill at one instant forever. */
+    if(run->Session && run->Rate == 0 && run->Link.DelayUs == 0 && run->Link.JitterUs == 0 && run->Link.Rate == 0)
+    {
+        invalidArgs("-rate 0 needs a link with a delay or a rate, e.g. -link rate=100mbit.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(fecStr != NULL && parseFec(fecStr,&run->Fec) == -1)
+    {
+        invalidArgs("Invalid FEC scheme, use xor:K or rs:K,M.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    parseSize(sizeStr,&run->Size,MAX_SESSION_TEXT_LENGTH,USAGE);
+    run->Features = CAP_TIMESTAMPS | CAP_CHANNELS | (noDeflate ? 0 : CAP_DEFLATE) | (noChunks ? 0 : CAP_CHUNKS);
+}
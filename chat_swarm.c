@@ -0,0 +1,524 @@
+/*******************************************************************************
+ * 
+ * Load generator: a swarm of virtual group chat members in one process.
+ * 
+ * 1. The swarm can be started as follows-
+ * ./chatswarm -mcip 224.1.1.1 -port 3000 -members 5000 -rate 20000
+ *             [-size 16-512 | -size exp:200 | -size 64] [-churn 50]
+ *             [-byestorm 10] [-duration 30] [-seed 1] [-key FILE [-cipher NAME]]
+ *             [-timestamps]
+ * 
+ * 2. Every member has its own name, sender id and sequence numbers and sends
+ *    at rate/members messages per second on average, with exponentially
+ *    distributed gaps. Message sizes follow the -size distribution, up to
+ *    MAX_SWARM_TEXT bytes so that every message fits one datagram.
+ * 
+ * 3. -churn replaces that many members per second: the leaving member sends
+ *    OP_BYE and a fresh one takes its slot. -byestorm makes every member
+ *    say bye and rejoin at once, every that many seconds.
+ * 
+ * 4. With -key every packet is sealed as an encrypted group member would,
+ *    to measure what encryption costs. With -timestamps messages carry
+ *    their send time, so receivers can measure latency under load.
+ * 
+ * 5. One thread runs everything from a timer heap and sends due packets in
+ *    batches with sendmmsg(). Achieved rates, of what the kernel took, are
+ *    printed every second and at the end; sends it refused are counted as
+ *    errors, not retried.
+ * 
+ * ****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "geekchat.h"
+
+#define USAGE "./chatswarm -mcip x.x.x.x -port XX [-members N] [-rate MSGS] [-size SPEC] " \
+              "[-churn N] [-byestorm SECS] [-duration SECS] [-seed N] [-key FILE [-cipher NAME]] [-timestamps]"
+
+#define MAX_MEMBERS 1000000
+#define SEND_BATCH 64
+#define NS_PER_SEC 1000000000LL
+/* The largest IPv4 UDP payload, less a text packet's longest header and tag. */
+#define MAX_UDP_PAYLOAD 65507
+#define MAX_SWARM_TEXT (MAX_UDP_PAYLOAD - (1 + MAX_GROUP_HEADER_LENGTH + 8 + 1 + MAX_NAME_LENGTH + 2) - GROUP_TAG_LENGTH)
+
+typedef struct member
+{
+    unsigned int SenderId;
+    unsigned int Sequence;
+    unsigned int NameLength;
+    char Name[16];
+}member;
+
+/*  Min-heap of members by the time of their next message.  */
+typedef struct timerEntry
+{
+    long long Due;
+    int Member;
+}timerEntry;
+
+typedef struct swarmStats
+{
+    unsigned long long Messages;
+    unsigned long long Byes;
+    unsigned long long Bytes;
+    unsigned long long Errors;
+}swarmStats;
+
+typedef struct swarm
+{
+    int Sock;
+    struct sockaddr_in Group;
+    member *Members;
+    int MemberCount;
+    timerEntry *Heap;
+    double Rate;
+    double ChurnRate;
+    long long ByeStormNs;
+    long long DurationNs;
+    sizeDist Size;
+    unsigned long long Rng;
+    unsigned int NextId;
+    char *Filler;
+    groupKey Key;
+    groupCrypto Crypto;
+    int Encrypt;
+    int Timestamps;
+    /* Packets encoded and waiting for sendmmsg(). */
+    char *Buffers;
+    struct mmsghdr Msgs[SEND_BATCH];
+    struct iovec Iovs[SEND_BATCH];
+    unsigned int Opcodes[SEND_BATCH];   /* Counted once sendmmsg() took them. */
+    int Queued;
+    swarmStats Total;
+    swarmStats Interval;
+}swarm;
+
+volatile sig_atomic_t stopRequested = 0;
+
+void initSwarm(swarm*,int,double,unsigned long long);
+void runSwarm(swarm*);
+void resetMember(swarm*,int);
+void queueMessage(swarm*,int,unsigned int);
+void flushQueue(swarm*);
+void byeStorm(swarm*);
+void reportRates(swarm*,const swarmStats*,const char*,double);
+void addInterval(swarm*);
+
+/* Timer heap functions. */
+void heapDown(swarm*,int);
+
+/* Random numbers. */
+unsigned long long nextRandom(swarm*);
+double randomUnit(swarm*);
+double randomExp(swarm*,double);
+
+void stopSwarm(int);
+
+/* Argument validation functions. */
+void processArgs(int,char**,swarm*,int*,double*,unsigned long long*);
+
+
+int main(int argc, char **argv)
+{
+    swarm sw;
+    int members=1000;
+    double rate=1000;
+    unsigned long long seed=0;
+
+    memset(&sw,0,sizeof(sw));
+    processArgs(argc,argv,&sw,&members,&rate,&seed);
+    sw.Sock = getMultiCastSender(1);
+    initSwarm(&sw,members,rate,seed);
+    signal(SIGINT,stopSwarm);
+    runSwarm(&sw);
+    return 0;
+}
+
+void initSwarm(swarm *sw,int members,double rate,unsigned long long seed)
+{
+    long long now = monotonicNs();
+    int i;
+
+    sw->MemberCount = members;
+    sw->Rate = rate;
+    sw->Rng = seed ? seed : (unsigned long long)now ^ ((unsigned long long)getpid() << 32);
+    sw->NextId = (unsigned int)nextRandom(sw);
+    sw->Members = (member*)malloc(members * sizeof(member));
+    sw->Heap = (timerEntry*)malloc(members * sizeof(timerEntry));
+    sw->Filler = (char*)malloc(MAX_TEXT_LENGTH);
+    sw->Buffers = (char*)malloc((size_t)SEND_BATCH * MAX_GROUP_PACKET_LENGTH);
+    if(sw->Members == NULL || sw->Heap == NULL || sw->Filler == NULL || sw->Buffers == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    for(i=0;i<MAX_TEXT_LENGTH;i++)
+        sw->Filler[i] = 'a' + i % 26;
+
+    /* Start with random phases so the swarm does not send in lockstep. */
+    for(i=0;i<members;i++)
+    {
+        resetMember(sw,i);
+        sw->Heap[i].Member = i;
+        sw->Heap[i].Due = now + (long long)(randomExp(sw,members / rate) * NS_PER_SEC);
+    }
+    for(i=members/2 - 1;i>=0;i--)
+        heapDown(sw,i);
+
+    for(i=0;i<SEND_BATCH;i++)
+    {
+        sw->Iovs[i].iov_base = sw->Buffers + (size_t)i * MAX_GROUP_PACKET_LENGTH;
+        sw->Msgs[i].msg_hdr.msg_iov = &sw->Iovs[i];
+        sw->Msgs[i].msg_hdr.msg_iovlen = 1;
+        sw->Msgs[i].msg_hdr.msg_name = &sw->Group;
+        sw->Msgs[i].msg_hdr.msg_namelen = sizeof(sw->Group);
+    }
+}
+
+void runSwarm(swarm *sw)
+{
+    long long start = monotonicNs(),now = start;
+    long long nextReport = start + NS_PER_SEC,lastReport = start;
+    long long nextChurn = start,nextStorm = start + sw->ByeStormNs;
+    double memberGap = sw->MemberCount / sw->Rate;
+
+    if(sw->ChurnRate > 0)
+        nextChurn = start + (long long)(randomExp(sw,1 / sw->ChurnRate) * NS_PER_SEC);
+
+    while(!stopRequested && (sw->DurationNs == 0 || now - start < sw->DurationNs))
+    {
+        long long wake;
+        int budget = SEND_BATCH * 16;
+
+        /*
+         * Send what is due, then sleep until the next event. The budget
+         * keeps reports and churn going when the swarm falls behind.
+         */
+        while(sw->Heap[0].Due <= now && budget-- > 0)
+        {
+            int m = sw->Heap[0].Member;
+            queueMessage(sw,m,GROUP_OP_TEXT);
+            sw->Heap[0].Due += (long long)(randomExp(sw,memberGap) * NS_PER_SEC);
+            heapDown(sw,0);
+        }
+        if(sw->ChurnRate > 0 && nextChurn <= now)
+        {
+            int m = (int)(nextRandom(sw) % sw->MemberCount);
+            queueMessage(sw,m,GROUP_OP_BYE);
+            resetMember(sw,m);
+            nextChurn += (long long)(randomExp(sw,1 / sw->ChurnRate) * NS_PER_SEC);
+        }
+        if(sw->ByeStormNs > 0 && nextStorm <= now)
+        {
+            byeStorm(sw);
+            nextStorm += sw->ByeStormNs;
+        }
+        flushQueue(sw);
+
+        if(now >= nextReport)
+        {
+            char label[32];
+            snprintf(label,sizeof(label),"%6.1fs",(now - start) / 1e9);
+            reportRates(sw,&sw->Interval,label,(now - lastReport) / 1e9);
+            addInterval(sw);
+            lastReport = now;
+            nextReport += NS_PER_SEC;
+        }
+
+        wake = sw->Heap[0].Due;
+        if(sw->ChurnRate > 0 && nextChurn < wake)
+            wake = nextChurn;
+        if(sw->ByeStormNs > 0 && nextStorm < wake)
+            wake = nextStorm;
+        if(nextReport < wake)
+            wake = nextReport;
+        if((now = monotonicNs()) < wake)
+        {
+            struct timespec until;
+            until.tv_sec = wake / NS_PER_SEC;
+            until.tv_nsec = wake % NS_PER_SEC;
+            clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&until,NULL);
+            now = monotonicNs();
+        }
+    }
+
+    addInterval(sw);
+    reportRates(sw,&sw->Total,"total",(now - start) / 1e9);
+}
+
+void resetMember(swarm *sw,int m)
+{
+    member *mb = &sw->Members[m];
+
+    mb->SenderId = sw->NextId++;
+    mb->Sequence = 0;
+    mb->NameLength = snprintf(mb->Name,sizeof(mb->Name),"bot%08x",mb->SenderId);
+}
+
+/*  Encodes straight into the next send slot, flushing when full.  */
+void queueMessage(swarm *sw,int m,unsigned int opcode)
+{
+    member *mb = &sw->Members[m];
+    packet pkt;
+    int len;
+
+    if(sw->Queued == SEND_BATCH)
+        flushQueue(sw);
+
+    memset(&pkt,0,sizeof(pkt));
+    pkt.Opcode = opcode;
+    pkt.Flags = GROUP_FLAG_SEQ;
+    if(sw->Timestamps && opcode == GROUP_OP_TEXT)
+    {
+        pkt.Flags |= GROUP_FLAG_TIME;
+        pkt.SendTime = wallClockUs();
+    }
+    pkt.SenderId = mb->SenderId;
+    pkt.Sequence = mb->Sequence++;
+    pkt.NameLength = mb->NameLength;
+    pkt.Name = mb->Name;
+    pkt.TextLength = opcode == GROUP_OP_TEXT ? randomSize(&sw->Size,&sw->Rng) : 0;
+    pkt.Text = sw->Filler;
+
+    len = encodePacket(&groupFormat,&pkt,sw->Iovs[sw->Queued].iov_base,MAX_GROUP_PACKET_LENGTH - GROUP_TAG_LENGTH);
+    if(len != -1 && sw->Encrypt)
+        len = sealGroupPacket(&sw->Crypto,sw->Iovs[sw->Queued].iov_base,len,MAX_GROUP_PACKET_LENGTH);
+    if(len == -1)
+    {
+        sw->Interval.Errors++;
+        return;
+    }
+    sw->Iovs[sw->Queued].iov_len = len;
+    sw->Opcodes[sw->Queued] = opcode;
+    sw->Queued++;
+}
+
+/*  Only what sendmmsg() took counts towards the achieved rates.  */
+void flushQueue(swarm *sw)
+{
+    int done=0,i;
+
+    while(done < sw->Queued)
+    {
+        int ret = sendmmsg(sw->Sock,sw->Msgs + done,sw->Queued - done,0);
+        if(ret == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            /* ENOBUFS and the like: drop one packet and carry on. */
+            sw->Interval.Errors++;
+            done++;
+            continue;
+        }
+        for(i=done;i<done + ret;i++)
+        {
+            if(sw->Opcodes[i] == GROUP_OP_BYE)
+                sw->Interval.Byes++;
+            else
+                sw->Interval.Messages++;
+            sw->Interval.Bytes += sw->Msgs[i].msg_len;
+        }
+        done += ret;
+    }
+    sw->Queued = 0;
+}
+
+void byeStorm(swarm *sw)
+{
+    int m;
+
+    for(m=0;m<sw->MemberCount;m++)
+    {
+        queueMessage(sw,m,GROUP_OP_BYE);
+        resetMember(sw,m);
+    }
+}
+
+void reportRates(swarm *sw,const swarmStats *s,const char *label,double seconds)
+{
+    if(seconds <= 0)
+        seconds = 1e-9;
+    fprintf(stderr,"%s: %10.0f msg/s (target %.0f) %8.2f MB/s %8.0f bye/s %llu send errors\n",
+            label,s->Messages / seconds,sw->Rate,s->Bytes / seconds / 1e6,s->Byes / seconds,s->Errors);
+}
+
+void addInterval(swarm *sw)
+{
+    sw->Total.Messages += sw->Interval.Messages;
+    sw->Total.Byes += sw->Interval.Byes;
+    sw->Total.Bytes += sw->Interval.Bytes;
+    sw->Total.Errors += sw->Interval.Errors;
+    memset(&sw->Interval,0,sizeof(sw->Interval));
+}
+
+
+/******************************************************************************
+ 
+ *                Timer heap functions.
+ 
+ ******************************************************************************/
+
+void heapDown(swarm *sw,int i)
+{
+    timerEntry entry = sw->Heap[i];
+    int n = sw->MemberCount;
+
+    while(2*i + 1 < n)
+    {
+        int child = 2*i + 1;
+        if(child + 1 < n && sw->Heap[child + 1].Due < sw->Heap[child].Due)
+            child++;
+        if(entry.Due <= sw->Heap[child].Due)
+            break;
+        sw->Heap[i] = sw->Heap[child];
+        i = child;
+    }
+    sw->Heap[i] = entry;
+}
+
+
+/******************************************************************************
+ 
+ *                Random numbers.
+ 
+ ******************************************************************************/
+
+unsigned long long nextRandom(swarm *sw)
+{
+    return shapeRandom(&sw->Rng);
+}
+
+double randomUnit(swarm *sw)
+{
+    return shapeUnit(&sw->Rng);
+}
+
+double randomExp(swarm *sw,double mean)
+{
+    return -log(1.0 - randomUnit(sw)) * mean;
+}
+
+
+/******************************************************************************
+ 
+ *                Other Utility functions.
+ 
+ ******************************************************************************/
+
+/*  Signal Handler for SIGINT */
+void stopSwarm(int signal_val)
+{
+    stopRequested = 1;
+    signal(SIGINT,SIG_DFL);
+}
+
+/*******************************************************************************
+
+ *      Arguments extraction and validation functions.
+
+ ******************************************************************************/
+
+void processArgs(int argc, char **argv, swarm *sw, int *members, double *rate, unsigned long long *seed)
+{
+    char *multiIp=NULL,*portStr=NULL,*memberStr=NULL,*rateStr=NULL,*sizeStr=NULL;
+    char *churnStr=NULL,*stormStr=NULL,*durationStr=NULL,*seedStr=NULL,*keyFile=NULL,*cipherName=NULL;
+    groupCipher cipher;
+    long value;
+    int port;
+    const argSpec specs[] =
+    {
+        {"-mcip",ARG_VALUE,&multiIp,"Multicast IP address missing."},
+        {"-port",ARG_VALUE,&portStr,"Port missing."},
+        {"-members",ARG_VALUE,&memberStr,"Member count missing."},
+        {"-rate",ARG_VALUE,&rateStr,"Message rate missing."},
+        {"-size",ARG_VALUE,&sizeStr,"Size distribution missing."},
+        {"-churn",ARG_VALUE,&churnStr,"Churn rate missing."},
+        {"-byestorm",ARG_VALUE,&stormStr,"Bye storm interval missing."},
+        {"-duration",ARG_VALUE,&durationStr,"Duration missing."},
+        {"-seed",ARG_VALUE,&seedStr,"Seed missing."},
+        {"-key",ARG_VALUE,&keyFile,"Key file missing."},
+        {"-cipher",ARG_VALUE,&cipherName,"Cipher name missing."},
+        {"-timestamps",ARG_FLAG,&sw->Timestamps,NULL},
+        {NULL}
+    };
+
+    extractArgs(argc,argv,specs,USAGE);
+    if(validateHost(multiIp) == -1)
+    {
+        invalidArgs("Multicast IP not specified.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if((port = validateAndGetPort(portStr)) == -1)
+    {
+        invalidArgs("Invalid port.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    sw->Group.sin_family = AF_INET;
+    sw->Group.sin_port = htons(port);
+    getBinaryAddress(multiIp,&sw->Group.sin_addr);
+
+    if(memberStr != NULL && (*members = validateAndGetNumber(memberStr,1,MAX_MEMBERS)) == -1)
+    {
+        invalidArgs("Invalid member count.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(rateStr != NULL)
+    {
+        if((value = validateAndGetNumber(rateStr,1,100000000)) == -1)
+        {
+            invalidArgs("Invalid message rate.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        *rate = value;
+    }
+    if(churnStr != NULL)
+    {
+        if((value = validateAndGetNumber(churnStr,0,1000000)) == -1)
+        {
+            invalidArgs("Invalid churn rate.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        sw->ChurnRate = value;
+    }
+    if(stormStr != NULL)
+    {
+        if((value = validateAndGetNumber(stormStr,1,86400)) == -1)
+        {
+            invalidArgs("Invalid bye storm interval.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        sw->ByeStormNs = value * NS_PER_SEC;
+    }
+    if(durationStr != NULL)
+    {
+        if((value = validateAndGetNumber(durationStr,1,86400 * 365L)) == -1)
+        {
+            invalidArgs("Invalid duration.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        sw->DurationNs = value * NS_PER_SEC;
+    }
+    if(seedStr != NULL)
+        *seed = strtoull(seedStr,NULL,10);
+    parseSize(sizeStr,&sw->Size,MAX_SWARM_TEXT,USAGE);
+    if(parseCipher(cipherName,&cipher) == -1)
+    {
+        invalidArgs("Unknown cipher, use aes-gcm or chacha20.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(keyFile != NULL)
+    {
+        loadGroupKey(&sw->Key,keyFile,cipher,sw->Group.sin_addr,port);
+        initGroupCrypto(&sw->Crypto,&sw->Key);
+        sw->Encrypt = 1;
+    }
+}
@@ -0,0 +1,187 @@
+/*******************************************************************************
+ *
+ * Sliding-window duplicate suppression for sequenced group packets.
+ *
+ * 1. Senders live in a set associative table indexed by a hash of the
+ *    sender id. The window is a ring of bits, so moving it forward by one
+ *    clears one bit instead of shifting the whole bitmap.
+ *
+ * 2. Sequence numbers wrap and are only compared by signed difference.
+ *
+ * ****************************************************************************/
+#include <string.h>
+#include <arpa/inet.h>
+#include "dedup.h"
+#include "protocol.h"
+
+static int readHeader(const char*,size_t,unsigned int*,unsigned int*);
+static int seenSequence(dedupFilter*,unsigned int,unsigned int);
+static void recordSequence(dedupFilter*,unsigned int,unsigned int);
+static dedupSender* findSender(dedupFilter*,unsigned int,int);
+static int testBit(const dedupSender*,unsigned int);
+static void setBit(dedupSender*,unsigned int);
+static void clearBit(dedupSender*,unsigned int);
+
+
+void initDedup(dedupFilter *filter)
+{
+    memset(filter,0,sizeof(*filter));
+}
+
+int dedupSeen(dedupFilter *filter,const char *buffer,size_t len)
+{
+    unsigned int senderId,sequence;
+
+    if(readHeader(buffer,len,&senderId,&sequence) == -1)
+        return 0;
+    return seenSequence(filter,senderId,sequence);
+}
+
+void dedupRecord(dedupFilter *filter,const char *buffer,size_t len)
+{
+    unsigned int senderId,sequence;
+
+    if(readHeader(buffer,len,&senderId,&sequence) == -1)
+        return;
+    recordSequence(filter,senderId,sequence);
+}
+
+int dedupPacket(dedupFilter *filter,const char *buffer,size_t len)
+{
+    if(dedupSeen(filter,buffer,len))
+        return 1;
+    dedupRecord(filter,buffer,len);
+    return 0;
+}
+
+int dedupSequence(dedupFilter *filter,unsigned int senderId,unsigned int sequence)
+{
+    if(seenSequence(filter,senderId,sequence))
+        return 1;
+    recordSequence(filter,senderId,sequence);
+    return 0;
+}
+
+int dedupReplayed(dedupFilter *filter,unsigned int senderId,unsigned int sequence)
+{
+    dedupSender *sender = findSender(filter,senderId,0);
+
+    if(sender != NULL && (int)(sender->Highest - sequence) >= DEDUP_WINDOW)
+        return 0;
+    return dedupSequence(filter,senderId,sequence);
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static int readHeader(const char *buffer,size_t len,unsigned int *senderId,unsigned int *sequence)
+{
+    if(len < GROUP_SEQUENCE_OFFSET + 4 || !((unsigned char)buffer[0] & GROUP_FLAG_SEQ))
+        return -1;
+    memcpy(senderId,buffer + GROUP_SENDER_OFFSET,4);
+    memcpy(sequence,buffer + GROUP_SEQUENCE_OFFSET,4);
+    *senderId = ntohl(*senderId);
+    *sequence = ntohl(*sequence);
+    return 0;
+}
+
+static int seenSequence(dedupFilter *filter,unsigned int senderId,unsigned int sequence)
+{
+    dedupSender *sender;
+    int distance;
+
+    if((sender = findSender(filter,senderId,0)) == NULL)
+        return 0;
+
+    distance = (int)(sender->Highest - sequence);
+    if(distance < 0)
+        return 0;
+    if(distance >= DEDUP_WINDOW || testBit(sender,sequence))
+    {
+        filter->Duplicates++;
+        return 1;
+    }
+    return 0;
+}
+
+static void recordSequence(dedupFilter *filter,unsigned int senderId,unsigned int sequence)
+{
+    dedupSender *sender;
+    int ahead;
+
+    sender = findSender(filter,senderId,1);
+    if(!sender->InUse)
+    {
+        memset(sender->Seen,0,sizeof(sender->Seen));
+        sender->InUse = 1;
+        sender->SenderId = senderId;
+        sender->Highest = sequence;
+    }
+
+    ahead = (int)(sequence - sender->Highest);
+    if(ahead >= DEDUP_WINDOW)
+    {
+        memset(sender->Seen,0,sizeof(sender->Seen));
+        sender->Highest = sequence;
+    }
+    else if(ahead > 0)
+    {
+        /* Slots the window moves over belong to sequence numbers not seen yet. */
+        while(sender->Highest != sequence)
+            clearBit(sender,++sender->Highest);
+    }
+    else if(-ahead >= DEDUP_WINDOW)
+    {
+        return;
+    }
+    setBit(sender,sequence);
+}
+
+/*  With create set, returns a slot for the sender, evicting if needed.  */
+static dedupSender* findSender(dedupFilter *filter,unsigned int senderId,int create)
+{
+    dedupSender *set = filter->Senders[(senderId * 2654435761u) >> 24 & (DEDUP_SETS - 1)];
+    dedupSender *victim = &set[0];
+    int way;
+
+    filter->Clock++;
+    for(way=0;way<DEDUP_WAYS;way++)
+    {
+        if(set[way].InUse && set[way].SenderId == senderId)
+        {
+            set[way].LastUse = filter->Clock;
+            return &set[way];
+        }
+        if(!set[way].InUse)
+            victim = &set[way];
+        else if(victim->InUse && (int)(set[way].LastUse - victim->LastUse) < 0)
+            victim = &set[way];
+    }
+    if(!create)
+        return NULL;
+    victim->InUse = 0;
+    victim->LastUse = filter->Clock;
+    return victim;
+}
+
+static int testBit(const dedupSender *sender,unsigned int sequence)
+{
+    unsigned int bit = sequence % DEDUP_WINDOW;
+    return (sender->Seen[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void setBit(dedupSender *sender,unsigned int sequence)
+{
+    unsigned int bit = sequence % DEDUP_WINDOW;
+    sender->Seen[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static void clearBit(dedupSender *sender,unsigned int sequence)
+{
+    unsigned int bit = sequence % DEDUP_WINDOW;
+    sender->Seen[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
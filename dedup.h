@@ -0,0 +1,71 @@
+/*******************************************************************************
+ *
+ * Sliding-window duplicate suppression for sequenced group packets.
+ *
+ * 1. Works on raw datagrams: the sender id and sequence number are read
+ *    straight from the header, before any decoding, decryption or copy.
+ *    Unsequenced packets cannot be told apart and always pass.
+ *
+ * 2. Memory is fixed: DEDUP_SETS x DEDUP_WAYS senders, each remembering the
+ *    last DEDUP_WINDOW sequence numbers in a bitmap. When a set is full the
+ *    sender used least recently is forgotten. Packets older than the
+ *    window of their sender are treated as duplicates.
+ *
+ * 3. For encrypted groups call dedupSeen() before opening a packet and
+ *    dedupRecord() only once it authenticated, so forged packets cannot
+ *    mark sequence numbers as seen. Plain groups use dedupPacket().
+ *
+ * 4. dedupSequence() takes the sender id and sequence number of a packet
+ *    already decoded, for copies that reach a member along different paths.
+ *
+ * 5. Not thread safe. Receive shards each keep their own filter; copies of
+ *    one packet always land on the same shard.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_DEDUP_H
+#define GEEKCHAT_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEDUP_WINDOW 1024
+#define DEDUP_SETS 256
+#define DEDUP_WAYS 4
+
+typedef struct dedupSender
+{
+    unsigned int SenderId;
+    unsigned int Highest;       /* Highest sequence number seen. */
+    unsigned int LastUse;
+    int InUse;
+    uint64_t Seen[DEDUP_WINDOW / 64];   /* Bit seq % DEDUP_WINDOW. */
+}dedupSender;
+
+typedef struct dedupFilter
+{
+    dedupSender Senders[DEDUP_SETS][DEDUP_WAYS];
+    unsigned int Clock;
+    unsigned long Duplicates;
+}dedupFilter;
+
+void initDedup(dedupFilter*);
+
+/*  Returns 1 if the datagram is a duplicate, without recording it.  */
+int dedupSeen(dedupFilter*,const char*,size_t);
+
+/*  Records the datagram as seen.  */
+void dedupRecord(dedupFilter*,const char*,size_t);
+
+/*  dedupSeen() and, if new, dedupRecord(). Returns 1 for duplicates.  */
+int dedupPacket(dedupFilter*,const char*,size_t);
+
+/*  The same for a decoded packet's sender id and sequence number.  */
+int dedupSequence(dedupFilter*,unsigned int,unsigned int);
+
+/*
+ * dedupSequence() for packets replayed from history, which reach back past
+ * the window: those older than it count as new and are not recorded.
+ */
+int dedupReplayed(dedupFilter*,unsigned int,unsigned int);
+
+#endif
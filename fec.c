@@ -0,0 +1,647 @@
+/*******************************************************************************
+ *
+ * Forward error correction for large group packets.
+ *
+ * 1. GF(256) uses the polynomial x^8+x^4+x^3+x^2+1 (0x11D). Reed-Solomon
+ *    parity row j, data column i holds 1/(j + (FEC_MAX_PARITY + i)), a
+ *    Cauchy matrix, so any DataCount of the data and parity fragments of a
+ *    block are enough to rebuild it.
+ *
+ * 2. The vector multiply splits every byte into two nibbles and looks both
+ *    up in 16 entry product tables with one shuffle each, 16 or 32 bytes
+ *    at a time.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "fec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#define GF_POLYNOMIAL 0x11D
+
+typedef void (*xorFunc)(unsigned char*,const unsigned char*,size_t);
+typedef void (*mulAddFunc)(unsigned char*,const unsigned char*,unsigned char,size_t);
+
+static unsigned char gfExp[512];
+static unsigned char gfLog[256];
+static pthread_once_t gfOnce = PTHREAD_ONCE_INIT;
+
+static void initGf();
+static unsigned char gfMul(unsigned char,unsigned char);
+static unsigned char gfInv(unsigned char);
+static unsigned char cauchy(int,int);
+static int invertMatrix(unsigned char*,int);
+
+static void xorScalar(unsigned char*,const unsigned char*,size_t);
+static void mulAddScalar(unsigned char*,const unsigned char*,unsigned char,size_t);
+static void xorDispatch(unsigned char*,const unsigned char*,size_t);
+static void mulAddDispatch(unsigned char*,const unsigned char*,unsigned char,size_t);
+static void mulAddRegion(unsigned char*,const unsigned char*,unsigned char,size_t);
+
+static xorFunc xorKernel = xorDispatch;
+static mulAddFunc mulAddKernel = mulAddDispatch;
+
+static int blockData(const fecConfig*,size_t,int);
+static fecObject* findObject(fecDecoder*,unsigned int,unsigned int,long long);
+static void startObject(fecObject*,const fecConfig*,size_t);
+static void recoverBlock(fecDecoder*,fecObject*,int);
+
+
+int parseFec(const char *spec,fecConfig *config)
+{
+    char extra;
+
+    memset(config,0,sizeof(*config));
+    config->FragmentSize = FEC_FRAGMENT_SIZE;
+    if(sscanf(spec,"xor:%d%c",&config->DataCount,&extra) == 1)
+    {
+        config->Scheme = FEC_XOR;
+        config->ParityCount = 1;
+    }
+    else if(sscanf(spec,"rs:%d,%d%c",&config->DataCount,&config->ParityCount,&extra) == 2)
+    {
+        config->Scheme = FEC_RS;
+    }
+    else
+    {
+        return -1;
+    }
+    if(config->DataCount < 1 || config->DataCount > FEC_MAX_DATA ||
+       config->ParityCount < 1 || config->ParityCount > FEC_MAX_PARITY)
+        return -1;
+    return 0;
+}
+
+int fecFragmentCount(const fecConfig *config,size_t len)
+{
+    int fragments = (len + config->FragmentSize - 1) / config->FragmentSize;
+    int blocks = (fragments + config->DataCount - 1) / config->DataCount;
+    return fragments + blocks * config->ParityCount;
+}
+
+void fecEncode(const fecConfig *config,unsigned int objectId,const char *object,size_t len,char *out)
+{
+    size_t stride = FEC_HEADER_LENGTH + config->FragmentSize;
+    int fragments = (len + config->FragmentSize - 1) / config->FragmentSize;
+    int blocks = (fragments + config->DataCount - 1) / config->DataCount;
+    unsigned int netObject = htonl(objectId),netLength = htonl(len);
+    unsigned short int netSize = htons(config->FragmentSize);
+    int b,i,j;
+
+    pthread_once(&gfOnce,initGf);
+    for(b=0;b<blocks;b++)
+    {
+        int k = blockData(config,len,b);
+        unsigned short int netBlock = htons(b);
+
+        for(i=0;i<k + config->ParityCount;i++)
+        {
+            unsigned char *frag = (unsigned char*)out + i * stride;
+            memcpy(frag,&netObject,4);
+            memcpy(frag + 4,&netLength,4);
+            memcpy(frag + 8,&netBlock,2);
+            frag[10] = i;
+            frag[11] = config->DataCount;
+            frag[12] = config->ParityCount;
+            frag[13] = config->Scheme;
+            memcpy(frag + 14,&netSize,2);
+        }
+
+        for(i=0;i<k;i++)
+        {
+            size_t offset = ((size_t)b * config->DataCount + i) * config->FragmentSize;
+            size_t size = len - offset < (size_t)config->FragmentSize ? len - offset : (size_t)config->FragmentSize;
+            char *payload = out + i * stride + FEC_HEADER_LENGTH;
+            memcpy(payload,object + offset,size);
+            memset(payload + size,0,config->FragmentSize - size);
+        }
+
+        for(j=0;j<config->ParityCount;j++)
+        {
+            unsigned char *parity = (unsigned char*)out + (k + j) * stride + FEC_HEADER_LENGTH;
+            memset(parity,0,config->FragmentSize);
+            for(i=0;i<k;i++)
+            {
+                const unsigned char *data = (unsigned char*)out + i * stride + FEC_HEADER_LENGTH;
+                if(config->Scheme == FEC_XOR)
+                    xorKernel(parity,data,config->FragmentSize);
+                else
+                    mulAddRegion(parity,data,cauchy(j,i),config->FragmentSize);
+            }
+        }
+        out += (k + config->ParityCount) * stride;
+    }
+}
+
+void initFecDecoder(fecDecoder *dec)
+{
+    memset(dec,0,sizeof(*dec));
+    pthread_once(&gfOnce,initGf);
+}
+
+void freeFecDecoder(fecDecoder *dec)
+{
+    int i;
+    for(i=0;i<FEC_MAX_OBJECTS;i++)
+    {
+        free(dec->Objects[i].Data);
+        free(dec->Objects[i].Parity);
+        free(dec->Objects[i].Have);
+        free(dec->Objects[i].BlockHave);
+    }
+    memset(dec,0,sizeof(*dec));
+}
+
+int fecReceive(fecDecoder *dec,unsigned int senderId,const char *frag,size_t len,long long nowMs,char **object)
+{
+    const unsigned char *head = (const unsigned char*)frag;
+    unsigned int objectId,objectLength;
+    unsigned short int block,size;
+    fecConfig config;
+    fecObject *obj;
+    char *dest;
+    int index,slot,k,b;
+
+    if(len < FEC_HEADER_LENGTH)
+        return -1;
+    memcpy(&objectId,head,4);
+    memcpy(&objectLength,head + 4,4);
+    memcpy(&block,head + 8,2);
+    memcpy(&size,head + 14,2);
+    objectId = ntohl(objectId);
+    objectLength = ntohl(objectLength);
+    block = ntohs(block);
+    index = head[10];
+    config.DataCount = head[11];
+    config.ParityCount = head[12];
+    config.Scheme = (fecScheme)head[13];
+    config.FragmentSize = ntohs(size);
+
+    if((config.Scheme != FEC_XOR && config.Scheme != FEC_RS) ||
+       config.DataCount < 1 || config.DataCount > FEC_MAX_DATA ||
+       config.ParityCount < 1 || config.ParityCount > FEC_MAX_PARITY ||
+       (config.Scheme == FEC_XOR && config.ParityCount != 1) ||
+       config.FragmentSize < FEC_MIN_FRAGMENT_SIZE || len != FEC_HEADER_LENGTH + (size_t)config.FragmentSize ||
+       objectLength < 1 || objectLength > FEC_MAX_OBJECT_LENGTH)
+        return -1;
+    /* Checked before anything is allocated for the object. */
+    if(((objectLength + config.FragmentSize - 1) / config.FragmentSize + config.DataCount - 1) / config.DataCount > FEC_MAX_BLOCKS)
+        return -1;
+
+    obj = findObject(dec,senderId,objectId,nowMs);
+    if(!obj->InUse)
+    {
+        startObject(obj,&config,objectLength);
+        obj->InUse = 1;
+        obj->SenderId = senderId;
+        obj->ObjectId = objectId;
+        obj->Started = nowMs;
+    }
+    else if(memcmp(&obj->Config,&config,sizeof(config)) || obj->Length != objectLength)
+    {
+        return -1;
+    }
+    /* Already delivered, this is a late parity fragment. */
+    if(obj->BlocksReady == obj->BlockCount)
+        return 0;
+
+    b = block;
+    if(b >= obj->BlockCount || index >= (k = blockData(&config,objectLength,b)) + config.ParityCount)
+        return -1;
+    if(index < k)
+    {
+        slot = b * config.DataCount + index;
+        dest = obj->Data + ((size_t)b * config.DataCount + index) * config.FragmentSize;
+    }
+    else
+    {
+        slot = obj->BlockCount * config.DataCount + b * config.ParityCount + index - k;
+        dest = obj->Parity + ((size_t)b * config.ParityCount + index - k) * config.FragmentSize;
+    }
+    if(obj->Have[slot] || obj->BlockHave[b] >= k)
+        return 0;
+    obj->Have[slot] = 1;
+    memcpy(dest,frag + FEC_HEADER_LENGTH,config.FragmentSize);
+    if(++obj->BlockHave[b] < k)
+        return 0;
+
+    recoverBlock(dec,obj,b);
+    if(++obj->BlocksReady < obj->BlockCount)
+        return 0;
+    *object = obj->Data;
+    return obj->Length;
+}
+
+
+/******************************************************************************
+
+ *                Reassembly.
+
+ ******************************************************************************/
+
+/*  Data fragments in block b; only the last block can be short.  */
+static int blockData(const fecConfig *config,size_t len,int b)
+{
+    int fragments = (len + config->FragmentSize - 1) / config->FragmentSize;
+    int left = fragments - b * config->DataCount;
+    return left < config->DataCount ? left : config->DataCount;
+}
+
+/*
+ * The slot of this object, or one to start it in: a free slot, then a
+ * finished one, then the oldest, which is given up on.
+ */
+static fecObject* findObject(fecDecoder *dec,unsigned int senderId,unsigned int objectId,long long nowMs)
+{
+    fecObject *victim = NULL;
+    int i;
+
+    for(i=0;i<FEC_MAX_OBJECTS;i++)
+    {
+        fecObject *obj = &dec->Objects[i];
+        if(obj->InUse && obj->SenderId == senderId && obj->ObjectId == objectId)
+            return obj;
+    }
+    for(i=0;i<FEC_MAX_OBJECTS;i++)
+    {
+        fecObject *obj = &dec->Objects[i];
+        if(obj->InUse && obj->BlocksReady < obj->BlockCount && nowMs - obj->Started > FEC_TIMEOUT_MS)
+        {
+            obj->InUse = 0;
+            dec->Lost++;
+        }
+        if(!obj->InUse)
+            return obj;
+        if(victim == NULL ||
+           (obj->BlocksReady == obj->BlockCount) > (victim->BlocksReady == victim->BlockCount) ||
+           ((obj->BlocksReady == obj->BlockCount) == (victim->BlocksReady == victim->BlockCount) &&
+            obj->Started < victim->Started))
+            victim = obj;
+    }
+    if(victim->BlocksReady < victim->BlockCount)
+        dec->Lost++;
+    victim->InUse = 0;
+    return victim;
+}
+
+static void startObject(fecObject *obj,const fecConfig *config,size_t len)
+{
+    int fragments = (len + config->FragmentSize - 1) / config->FragmentSize;
+    int blocks = (fragments + config->DataCount - 1) / config->DataCount;
+    size_t dataLength = (size_t)blocks * config->DataCount * config->FragmentSize;
+    size_t parityLength = (size_t)blocks * config->ParityCount * config->FragmentSize;
+    size_t slots = (size_t)blocks * (config->DataCount + config->ParityCount);
+
+    if((obj->Data = (char*)realloc(obj->Data,dataLength)) == NULL ||
+       (obj->Parity = (char*)realloc(obj->Parity,parityLength)) == NULL ||
+       (obj->Have = (unsigned char*)realloc(obj->Have,slots)) == NULL ||
+       (obj->BlockHave = (unsigned char*)realloc(obj->BlockHave,blocks)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    memset(obj->Have,0,slots);
+    memset(obj->BlockHave,0,blocks);
+    obj->Config = *config;
+    obj->Length = len;
+    obj->BlockCount = blocks;
+    obj->BlocksReady = 0;
+}
+
+/*  Rebuilds the missing data fragments of a block that has enough.  */
+static void recoverBlock(fecDecoder *dec,fecObject *obj,int b)
+{
+    const fecConfig *config = &obj->Config;
+    size_t size = config->FragmentSize;
+    int k = blockData(config,obj->Length,b);
+    unsigned char *data = (unsigned char*)obj->Data + (size_t)b * config->DataCount * size;
+    unsigned char *parity = (unsigned char*)obj->Parity + (size_t)b * config->ParityCount * size;
+    unsigned char *have = obj->Have + b * config->DataCount;
+    unsigned char *parityHave = obj->Have + obj->BlockCount * config->DataCount + b * config->ParityCount;
+    int missing[FEC_MAX_PARITY],rows[FEC_MAX_PARITY],e=0,r=0,i,j,c;
+    unsigned char matrix[FEC_MAX_PARITY * FEC_MAX_PARITY];
+    unsigned char *syndromes;
+
+    for(i=0;i<k;i++)
+    {
+        if(!have[i])
+            missing[e++] = i;
+    }
+    if(e == 0)
+        return;
+    for(j=0;j<config->ParityCount && r < e;j++)
+    {
+        if(parityHave[j])
+            rows[r++] = j;
+    }
+
+    if((syndromes = (unsigned char*)malloc(e * size)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    /* Parity minus the contribution of the data we have. */
+    for(r=0;r<e;r++)
+    {
+        unsigned char *syn = syndromes + r * size;
+        memcpy(syn,parity + rows[r] * size,size);
+        for(i=0;i<k;i++)
+        {
+            if(!have[i])
+                continue;
+            if(config->Scheme == FEC_XOR)
+                xorKernel(syn,data + i * size,size);
+            else
+                mulAddRegion(syn,data + i * size,cauchy(rows[r],i),size);
+        }
+    }
+
+    if(config->Scheme == FEC_XOR)
+    {
+        memcpy(data + missing[0] * size,syndromes,size);
+    }
+    else
+    {
+        for(r=0;r<e;r++)
+            for(c=0;c<e;c++)
+                matrix[r * e + c] = cauchy(rows[r],missing[c]);
+        invertMatrix(matrix,e);
+        for(c=0;c<e;c++)
+        {
+            unsigned char *dest = data + missing[c] * size;
+            memset(dest,0,size);
+            for(r=0;r<e;r++)
+                mulAddRegion(dest,syndromes + r * size,matrix[c * e + r],size);
+        }
+    }
+    dec->Recovered += e;
+    free(syndromes);
+}
+
+
+/******************************************************************************
+
+ *                GF(256) arithmetic.
+
+ ******************************************************************************/
+
+static void initGf()
+{
+    int i,x=1;
+
+    for(i=0;i<255;i++)
+    {
+        gfExp[i] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if(x & 0x100)
+            x ^= GF_POLYNOMIAL;
+    }
+    for(i=255;i<512;i++)
+        gfExp[i] = gfExp[i - 255];
+}
+
+static unsigned char gfMul(unsigned char a,unsigned char b)
+{
+    if(a == 0 || b == 0)
+        return 0;
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static unsigned char gfInv(unsigned char a)
+{
+    return gfExp[255 - gfLog[a]];
+}
+
+static unsigned char cauchy(int parity,int data)
+{
+    return gfInv((unsigned char)(parity ^ (FEC_MAX_PARITY + data)));
+}
+
+/*  Gauss-Jordan in place. Cauchy submatrices are always invertible.  */
+static int invertMatrix(unsigned char *m,int n)
+{
+    unsigned char inv[FEC_MAX_PARITY * FEC_MAX_PARITY];
+    int row,col,k;
+
+    memset(inv,0,sizeof(inv));
+    for(row=0;row<n;row++)
+        inv[row * n + row] = 1;
+
+    for(col=0;col<n;col++)
+    {
+        unsigned char scale;
+        int pivot = col;
+
+        while(pivot < n && m[pivot * n + col] == 0)
+            pivot++;
+        if(pivot == n)
+            return -1;
+        if(pivot != col)
+        {
+            for(k=0;k<n;k++)
+            {
+                unsigned char t = m[col * n + k];
+                m[col * n + k] = m[pivot * n + k];
+                m[pivot * n + k] = t;
+                t = inv[col * n + k];
+                inv[col * n + k] = inv[pivot * n + k];
+                inv[pivot * n + k] = t;
+            }
+        }
+        scale = gfInv(m[col * n + col]);
+        for(k=0;k<n;k++)
+        {
+            m[col * n + k] = gfMul(m[col * n + k],scale);
+            inv[col * n + k] = gfMul(inv[col * n + k],scale);
+        }
+        for(row=0;row<n;row++)
+        {
+            unsigned char factor = m[row * n + col];
+            if(row == col || factor == 0)
+                continue;
+            for(k=0;k<n;k++)
+            {
+                m[row * n + k] ^= gfMul(factor,m[col * n + k]);
+                inv[row * n + k] ^= gfMul(factor,inv[col * n + k]);
+            }
+        }
+    }
+    memcpy(m,inv,n * n);
+    return 0;
+}
+
+
+/******************************************************************************
+
+ *                Region kernels.
+
+ ******************************************************************************/
+
+static void mulAddRegion(unsigned char *dst,const unsigned char *src,unsigned char c,size_t len)
+{
+    if(c == 0)
+        return;
+    if(c == 1)
+        xorKernel(dst,src,len);
+    else
+        mulAddKernel(dst,src,c,len);
+}
+
+static void xorScalar(unsigned char *dst,const unsigned char *src,size_t len)
+{
+    size_t i=0;
+
+    for(;i + 8 <= len;i += 8)
+    {
+        uint64_t a,b;
+        memcpy(&a,dst + i,8);
+        memcpy(&b,src + i,8);
+        a ^= b;
+        memcpy(dst + i,&a,8);
+    }
+    for(;i<len;i++)
+        dst[i] ^= src[i];
+}
+
+static void mulAddScalar(unsigned char *dst,const unsigned char *src,unsigned char c,size_t len)
+{
+    unsigned char row[256];
+    size_t i;
+    int x;
+
+    for(x=0;x<256;x++)
+        row[x] = gfMul(c,x);
+    for(i=0;i<len;i++)
+        dst[i] ^= row[src[i]];
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/*  Products of c with every low nibble, and with every high nibble.  */
+static void nibbleTables(unsigned char c,unsigned char *low,unsigned char *high)
+{
+    int x;
+    for(x=0;x<16;x++)
+    {
+        low[x] = gfMul(c,x);
+        high[x] = gfMul(c,x << 4);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void xorSsse3(unsigned char *dst,const unsigned char *src,size_t len)
+{
+    size_t i=0;
+
+    for(;i + 16 <= len;i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i),_mm_xor_si128(a,b));
+    }
+    xorScalar(dst + i,src + i,len - i);
+}
+
+__attribute__((target("ssse3")))
+static void mulAddSsse3(unsigned char *dst,const unsigned char *src,unsigned char c,size_t len)
+{
+    unsigned char lowTable[16],highTable[16];
+    __m128i low,high,mask = _mm_set1_epi8(0x0F);
+    size_t i=0;
+
+    nibbleTables(c,lowTable,highTable);
+    low = _mm_loadu_si128((const __m128i*)lowTable);
+    high = _mm_loadu_si128((const __m128i*)highTable);
+    for(;i + 16 <= len;i += 16)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i lo = _mm_shuffle_epi8(low,_mm_and_si128(in,mask));
+        __m128i hi = _mm_shuffle_epi8(high,_mm_and_si128(_mm_srli_epi64(in,4),mask));
+        __m128i out = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i),_mm_xor_si128(out,_mm_xor_si128(lo,hi)));
+    }
+    for(;i<len;i++)
+        dst[i] ^= lowTable[src[i] & 0x0F] ^ highTable[src[i] >> 4];
+}
+
+__attribute__((target("avx2")))
+static void xorAvx2(unsigned char *dst,const unsigned char *src,size_t len)
+{
+    size_t i=0;
+
+    for(;i + 32 <= len;i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i),_mm256_xor_si256(a,b));
+    }
+    xorScalar(dst + i,src + i,len - i);
+}
+
+__attribute__((target("avx2")))
+static void mulAddAvx2(unsigned char *dst,const unsigned char *src,unsigned char c,size_t len)
+{
+    unsigned char lowTable[16],highTable[16];
+    __m256i low,high,mask = _mm256_set1_epi8(0x0F);
+    size_t i=0;
+
+    nibbleTables(c,lowTable,highTable);
+    low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lowTable));
+    high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)highTable));
+    for(;i + 32 <= len;i += 32)
+    {
+        __m256i in = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i lo = _mm256_shuffle_epi8(low,_mm256_and_si256(in,mask));
+        __m256i hi = _mm256_shuffle_epi8(high,_mm256_and_si256(_mm256_srli_epi64(in,4),mask));
+        __m256i out = _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i),_mm256_xor_si256(out,_mm256_xor_si256(lo,hi)));
+    }
+    for(;i<len;i++)
+        dst[i] ^= lowTable[src[i] & 0x0F] ^ highTable[src[i] >> 4];
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+/*  Picks the widest kernels the CPU supports on first use.  */
+static void pickKernels()
+{
+    xorFunc xorPick = xorScalar;
+    mulAddFunc mulAddPick = mulAddScalar;
+
+    #ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        xorPick = xorAvx2;
+        mulAddPick = mulAddAvx2;
+    }
+    else if(__builtin_cpu_supports("ssse3"))
+    {
+        xorPick = xorSsse3;
+        mulAddPick = mulAddSsse3;
+    }
+    #endif
+    __atomic_store_n(&xorKernel,xorPick,__ATOMIC_RELAXED);
+    __atomic_store_n(&mulAddKernel,mulAddPick,__ATOMIC_RELAXED);
+}
+
+static void xorDispatch(unsigned char *dst,const unsigned char *src,size_t len)
+{
+    pickKernels();
+    xorKernel(dst,src,len);
+}
+
+static void mulAddDispatch(unsigned char *dst,const unsigned char *src,unsigned char c,size_t len)
+{
+    pickKernels();
+    mulAddKernel(dst,src,c,len);
+}
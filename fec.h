@@ -0,0 +1,100 @@
+/*******************************************************************************
+ *
+ * Forward error correction for large group packets.
+ *
+ * 1. A packet too big for one datagram (the object) is cut into fragments
+ *    of FragmentSize bytes, and every DataCount fragments form a block.
+ *    Each block gets ParityCount parity fragments: one XOR of the block, or
+ *    Reed-Solomon parity over GF(256) from a Cauchy matrix. A receiver
+ *    that has any DataCount fragments of a block rebuilds the rest itself.
+ *
+ * 2. Every fragment travels as the Text of an OP_FRAG packet and starts
+ *    with this header-
+ *      ObjectId(4) ObjectLength(4) Block(2) Index(1) DataCount(1)
+ *      ParityCount(1) Scheme(1) FragmentSize(2)
+ *    Index counts the data fragments of the block first, then its parity.
+ *    The last data fragment is zero padded to FragmentSize.
+ *
+ * 3. The region kernels (XOR, and multiply-accumulate in GF(256)) pick an
+ *    AVX2, SSSE3 or scalar version at first use, like utf8.c.
+ *
+ * 4. A fecDecoder reassembles a bounded number of objects at a time and
+ *    gives up on one when FEC_TIMEOUT_MS pass without it completing.
+ *    Fragments come unauthenticated in plain groups, so it only takes
+ *    headers whose object fits the 16 bit Block field, in fragments of at
+ *    least FEC_MIN_FRAGMENT_SIZE; one fragment cannot make it allocate
+ *    more than about 17 MB.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_FEC_H
+#define GEEKCHAT_FEC_H
+
+#include <stddef.h>
+
+#define FEC_HEADER_LENGTH 16
+#define FEC_FRAGMENT_SIZE 1200
+#define FEC_MIN_FRAGMENT_SIZE 512
+#define FEC_MAX_BLOCKS 65536
+#define FEC_MAX_DATA 64
+#define FEC_MAX_PARITY 16
+#define FEC_MAX_OBJECTS 16
+#define FEC_MAX_OBJECT_LENGTH (1 << 20)
+#define FEC_TIMEOUT_MS 2000
+
+typedef enum {FEC_NONE,FEC_XOR,FEC_RS} fecScheme;
+
+typedef struct fecConfig
+{
+    fecScheme Scheme;
+    int DataCount;
+    int ParityCount;
+    int FragmentSize;
+}fecConfig;
+
+typedef struct fecObject
+{
+    int InUse;
+    unsigned int SenderId;
+    unsigned int ObjectId;
+    size_t Length;
+    fecConfig Config;
+    int BlockCount;
+    int BlocksReady;
+    long long Started;
+    char *Data;                 /* BlockCount * DataCount fragments. */
+    char *Parity;               /* BlockCount * ParityCount fragments. */
+    unsigned char *Have;        /* Per fragment, data then parity by block. */
+    unsigned char *BlockHave;   /* Fragments received per block. */
+}fecObject;
+
+typedef struct fecDecoder
+{
+    fecObject Objects[FEC_MAX_OBJECTS];
+    unsigned long Recovered;    /* Data fragments rebuilt from parity. */
+    unsigned long Lost;         /* Objects given up on. */
+}fecDecoder;
+
+/*  "xor:K" or "rs:K,M". Returns 0, or -1 if spec is not valid.  */
+int parseFec(const char*,fecConfig*);
+
+/*  Number of fragments, parity included, for an object of that length.  */
+int fecFragmentCount(const fecConfig*,size_t);
+
+/*
+ * Writes every fragment, header included, to out; fragment i starts at
+ * i * (FEC_HEADER_LENGTH + FragmentSize).
+ */
+void fecEncode(const fecConfig*,unsigned int,const char*,size_t,char*);
+
+void initFecDecoder(fecDecoder*);
+void freeFecDecoder(fecDecoder*);
+
+/*
+ * Takes one fragment from a sender. Returns the object length and points
+ * object at it once the fragment completes it, 0 if more are needed and
+ * -1 if the fragment is malformed. The object stays valid until the next
+ * call.
+ */
+int fecReceive(fecDecoder*,unsigned int,const char*,size_t,long long,char**);
+
+#endif
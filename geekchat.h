@@ -0,0 +1,37 @@
+/*******************************************************************************
+ *
+ * libgeekchat: everything the GeekChat front-ends share.
+ *
+ * 1. Tools that speak the chat protocols (bots, benchmarks) include this
+ *    header and link against libgeekchat.a.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_H
+#define GEEKCHAT_H
+
+#include "protocol.h"
+#include "netutil.h"
+#include "args.h"
+#include "utf8.h"
+#include "line_editor.h"
+#include "reorder.h"
+#include "recv_shards.h"
+#include "affinity.h"
+#include "packet_ring.h"
+#include "group_crypto.h"
+#include "dedup.h"
+#include "fec.h"
+#include "spool.h"
+#include "session_mux.h"
+#include "screen.h"
+#include "latency.h"
+#include "hub.h"
+#include "session_caps.h"
+#include "netsim.h"
+#include "local_group.h"
+#include "group_channels.h"
+#include "keywords.h"
+#include "history.h"
+#include "load_shape.h"
+
+#endif
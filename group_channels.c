@@ -0,0 +1,194 @@
+/*******************************************************************************
+ *
+ * Channels of a group, spread over several multicast addresses.
+ *
+ * 1. Channels hash onto addresses with a multiplicative hash, so runs of
+ *    channel numbers spread over all of them.
+ *
+ * 2. A stream's sender id is the member's id, offset by the address, put
+ *    through MurmurHash3's finaliser, which is a bijection and so can be
+ *    undone. Ids of members that are close, as chatswarm's are, end up
+ *    far apart on every address.
+ *
+ * 3. Linux lets a socket join 20 addresses by default
+ *    (net.ipv4.igmp_max_memberships); following more fails with ENOBUFS.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "group_channels.h"
+
+static int setMembership(int,struct in_addr,int);
+static unsigned int mixId(unsigned int);
+static unsigned int unmixId(unsigned int);
+
+
+void initGroupChannels(groupChannels *channels,struct in_addr group,int count)
+{
+    memset(channels,0,sizeof(*channels));
+    channels->Group = group;
+    channels->Count = count;
+    channels->Followed[0] = 1;
+    channels->Members[0] = 1;
+    pthread_mutex_init(&channels->Lock,NULL);
+}
+
+void freeGroupChannels(groupChannels *channels)
+{
+    pthread_mutex_destroy(&channels->Lock);
+}
+
+int channelAddress(const groupChannels *channels,unsigned int channel)
+{
+    if(channel == 0 || channels->Count == 0)
+        return 0;
+    return 1 + (int)(((channel * 2654435761u) >> 16) % (unsigned int)channels->Count);
+}
+
+struct in_addr channelIp(const groupChannels *channels,int index)
+{
+    struct in_addr ip;
+    ip.s_addr = htonl(ntohl(channels->Group.s_addr) + index);
+    return ip;
+}
+
+unsigned int channelSender(unsigned int senderId,int index)
+{
+    if(index == 0)
+        return senderId;
+    return mixId(senderId ^ (index * 2654435769u));
+}
+
+unsigned int channelMember(unsigned int streamId,int index)
+{
+    if(index == 0)
+        return streamId;
+    return unmixId(streamId) ^ (index * 2654435769u);
+}
+
+void addChannelSocket(groupChannels *channels,int sock)
+{
+    int value=0,index;
+
+    pthread_mutex_lock(&channels->Lock);
+    if(channels->SockCount == MAX_CHANNEL_SOCKETS)
+    {
+        fprintf(stderr,"\nToo many sockets for the group's channels.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(setsockopt(sock,IPPROTO_IP,IP_MULTICAST_ALL,&value,sizeof(value)) == -1)
+    {
+        perror("\nError during setting IP_MULTICAST_ALL socket options:");
+        exit(EXIT_FAILURE);
+    }
+    /* The group's own address the socket joined when it was opened. */
+    for(index=1;index<=channels->Count;index++)
+    {
+        if(channels->Members[index] > 0)
+            setMembership(sock,channelIp(channels,index),IP_ADD_MEMBERSHIP);
+    }
+    channels->Socks[channels->SockCount++] = sock;
+    pthread_mutex_unlock(&channels->Lock);
+}
+
+int followChannel(groupChannels *channels,unsigned int channel)
+{
+    int index = channelAddress(channels,channel);
+    int i,ret=0;
+
+    if(channel >= GROUP_CHANNELS)
+        return -1;
+    pthread_mutex_lock(&channels->Lock);
+    if(!channels->Followed[channel])
+    {
+        if(channels->Members[index] == 0)
+        {
+            for(i=0;i<channels->SockCount;i++)
+            {
+                if(setMembership(channels->Socks[i],channelIp(channels,index),IP_ADD_MEMBERSHIP) == -1)
+                    break;
+            }
+            if(i < channels->SockCount)
+            {
+                ret = -1;
+                while(--i >= 0)
+                    setMembership(channels->Socks[i],channelIp(channels,index),IP_DROP_MEMBERSHIP);
+            }
+        }
+        if(ret == 0)
+        {
+            channels->Members[index]++;
+            __atomic_store_n(&channels->Followed[channel],1,__ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&channels->Lock);
+    return ret;
+}
+
+void unfollowChannel(groupChannels *channels,unsigned int channel)
+{
+    int index = channelAddress(channels,channel);
+    int i;
+
+    /* Every member hears channel 0; Bye travels there. */
+    if(channel == 0 || channel >= GROUP_CHANNELS)
+        return;
+    pthread_mutex_lock(&channels->Lock);
+    if(channels->Followed[channel])
+    {
+        __atomic_store_n(&channels->Followed[channel],0,__ATOMIC_RELAXED);
+        if(--channels->Members[index] == 0)
+        {
+            for(i=0;i<channels->SockCount;i++)
+                setMembership(channels->Socks[i],channelIp(channels,index),IP_DROP_MEMBERSHIP);
+        }
+    }
+    pthread_mutex_unlock(&channels->Lock);
+}
+
+int followsChannel(const groupChannels *channels,unsigned int channel)
+{
+    if(channel >= GROUP_CHANNELS)
+        return 0;
+    return __atomic_load_n(&channels->Followed[channel],__ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static int setMembership(int sock,struct in_addr ip,int option)
+{
+    struct ip_mreq multiProp;
+
+    multiProp.imr_multiaddr = ip;
+    multiProp.imr_interface.s_addr = INADDR_ANY;
+    return setsockopt(sock,IPPROTO_IP,option,(char*)&multiProp,sizeof(multiProp));
+}
+
+static unsigned int mixId(unsigned int id)
+{
+    id ^= id >> 16;
+    id *= 0x85EBCA6Bu;
+    id ^= id >> 13;
+    id *= 0xC2B2AE35u;
+    id ^= id >> 16;
+    return id;
+}
+
+/*  mixId() backwards, with the multipliers' inverses mod 2^32.  */
+static unsigned int unmixId(unsigned int id)
+{
+    id ^= id >> 16;
+    id *= 0x7ED1B41Du;
+    id ^= (id >> 13) ^ (id >> 26);
+    id *= 0xA5CB9243u;
+    id ^= id >> 16;
+    return id;
+}
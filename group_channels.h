@@ -0,0 +1,70 @@
+/*******************************************************************************
+ *
+ * Channels of a group, spread over several multicast addresses.
+ *
+ * 1. Channel 0 stays on the group's address, where every member listens.
+ *    With Count addresses for channels, the other channels hash onto the
+ *    Count addresses that follow it, so group 239.1.1.1 with Count 4 uses
+ *    239.1.1.2 to 239.1.1.5 for them. Members of a group must agree on
+ *    Count, as they do on the port.
+ *
+ * 2. A member joins the address of a channel only while it follows one of
+ *    the channels on it. The NIC and switches with IGMP snooping then drop
+ *    the traffic of the other addresses before it reaches the host. Within
+ *    an address, channels sharing it are told apart after decoding.
+ *
+ * 3. Every socket added must be bound to the group's port. It is switched
+ *    to IP_MULTICAST_ALL off: Linux otherwise hands a socket the addresses
+ *    any socket on the host joined.
+ *
+ * 4. Each address carries its own stream of sequence numbers under its own
+ *    sender id, channelSender(). A member that skips an address then sees no
+ *    gaps in the streams it does hear, which reordering would wait on.
+ *    Address 0 uses the member's own id; the others a hash of the id and
+ *    the address, so one member's stream does not take the id of another's.
+ *
+ * 5. Thread safe; followsChannel() takes no lock.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_GROUP_CHANNELS_H
+#define GEEKCHAT_GROUP_CHANNELS_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define GROUP_CHANNELS 65536
+#define MAX_CHANNEL_ADDRESSES 64
+#define MAX_CHANNEL_SOCKETS 64
+
+typedef struct groupChannels
+{
+    struct in_addr Group;       /* Channel 0's address. */
+    int Count;                  /* Addresses after it for the other channels. */
+    int Socks[MAX_CHANNEL_SOCKETS];
+    int SockCount;
+    int Members[MAX_CHANNEL_ADDRESSES + 1];     /* Followed channels per address. */
+    unsigned char Followed[GROUP_CHANNELS];
+    pthread_mutex_t Lock;
+}groupChannels;
+
+/*  Count 0 keeps every message on the group's address.  */
+void initGroupChannels(groupChannels*,struct in_addr,int);
+void freeGroupChannels(groupChannels*);
+
+/*  Index of the address a channel is sent to, 0 for the group's own.  */
+int channelAddress(const groupChannels*,unsigned int);
+struct in_addr channelIp(const groupChannels*,int);
+
+/*  The sender id of a member's stream on an address, and back.  */
+unsigned int channelSender(unsigned int,int);
+unsigned int channelMember(unsigned int,int);
+
+/*  Makes a socket hear the addresses of the followed channels.  */
+void addChannelSocket(groupChannels*,int);
+
+/*  Returns 0, or -1 if the address could not be joined.  */
+int followChannel(groupChannels*,unsigned int);
+void unfollowChannel(groupChannels*,unsigned int);
+int followsChannel(const groupChannels*,unsigned int);
+
+#endif
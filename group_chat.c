@@ -7,60 +7,142 @@
  * 
  * 2. To leave the group chat press Ctrl+C.
  * 
+ * 3. -shards K spreads receiving over K sockets and threads, one per CPU,
+ *    for busy groups; messages of each sender are still shown in order.
+ *    -legacy sends packets without the sequence header, for old peers.
+ * 
+ * 4. -key FILE encrypts and authenticates the group's traffic with a key
+ *    derived from FILE, which every member must share; -cipher picks
+ *    aes-gcm (default) or chacha20.
+ * 
+ * 5. -fec xor:K or -fec rs:K,M sends messages too big for one datagram as
+ *    fragments, with parity that lets receivers rebuild lost ones.
+ * 
+ * 6. -screen runs the chat full screen, with messages above the input line;
+ *    busy groups are drawn a frame at a time instead of a line per message.
+ * 
+ * 7. -timestamps puts the send time in every message. Members keep latency
+ *    histograms for senders that do, shown by typing /latency.
+ * 
+ * 8. Members on the same host reach each other through shared memory
+ *    (local_group.h) and use multicast only for other hosts. -nolocal
+ *    leaves the local ring out.
+ * 
+ * 9. -channels K spreads channels other than 0 over the K multicast
+ *    addresses after -mcip (group_channels.h); a member joins only those
+ *    of the channels it follows. /ch N follows channel N and sends typed
+ *    messages to it, /close stops following the current channel.
+ * 
+ * 10. Incoming messages show the member's name and the keywords of
+ *    -highlight FILE, one per line, in reverse video (keywords.h).
+ *    /hl WORD adds a keyword.
+ * 
+ * 11. Members keep the last hour of messages (history.h). One that joins
+ *    asks for the last -history MIN minutes, 10 by default, and a single
+ *    member sends them over TCP; -history 0 asks for none.
+ * 
+ * 12. -busypoll US reads the socket and the local ring without sleeping for
+ *    up to US microseconds before blocking, and sets SO_BUSY_POLL. -cpus R,S
+ *    pins the receive threads to CPU R and the sender to CPU S, -fifo PRIO
+ *    runs them under SCHED_FIFO. /ping N times N round trips to the group.
+ * 
  * ****************************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
-#include <netdb.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <netinet/ip.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <errno.h>
-#include <termios.h>
+#include <locale.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include "geekchat.h"
 
 
 
-/*  Macros of argument validation functions.  */
-#define MAXPORT 65535
-#define MINPORT 1
-
 /* Macro defining maximum buffer size. */
 #define BUFFSIZE 65536
 
-/*  Macros for chat packet.  */
-#define OPCODE_FIELD_SIZE 1
-#define NAMELENGTH_FIELD_SIZE 1
-#define TEXTLENGTH_FIELD_SIZE 2
-#define OP_TEXT 1
-#define OP_BYE 2
-#define FIXEDLENGTH_FIELDS_SIZE 4
-#define MAX_NAME_LENGTH 255
-#define MAX_TEXT_LENGTH 65535
-#define MAX_PACKET_LENGTH FIXEDLENGTH_FIELDS_SIZE + MAX_NAME_LENGTH + MAX_TEXT_LENGTH
+/*  Datagrams up to this long are encoded on the stack.  */
+#define FRAME_INLINE 512
 
+/*  Opcodes of the group wire format, see protocol.h.  */
+#define OP_TEXT GROUP_OP_TEXT
+#define OP_BYE GROUP_OP_BYE
 
+/*  Highlighted keywords; at most MAX_HIGHLIGHTS runs per message.  */
+#define HIGHLIGHT_ON "\033[7m"
+#define HIGHLIGHT_OFF "\033[27m"
+#define MAX_HIGHLIGHTS 64
+
+/*  Catch-up requests this member waits to answer, see history.h.  */
+#define MAX_PENDING_ANSWERS 16
+#define DEFAULT_HISTORY_MINUTES 10
+
+/*  /ping: round trips timed by default, and how long one may take.  */
+#define DEFAULT_PINGS 100
+#define MAX_PINGS 1000000
+#define PING_TIMEOUT_MS 1000
+#define MAX_BUSY_POLL_US 10000
+
+#define USAGE "./groupChat -mcip x.x.x.x -port XX [-shards K] [-legacy] [-key FILE [-cipher NAME]] [-fec SPEC] [-screen] [-timestamps] [-nolocal] [-channels K] [-highlight FILE] [-history MIN] [-busypoll US] [-cpus R,S] [-fifo PRIO]"
 
-typedef struct packet
-{
-    char Opcode;
-    char NameLength;
-    char *Name;
-    unsigned short int TextLength;
-    char *Text;
-}packet;
 
 char myName[MAX_NAME_LENGTH+1];
 pthread_t recvT,sendT;
-pthread_mutex_t bufferLock;
+lineEditor editor;
+packetDecoder recvDecoder;
+dedupFilter recvDedup;
 struct sockaddr_in multicastAddr;
-char msgBuffer[BUFFSIZE];
+shardSet shards;
+int shardCount=1,useSequence=1;
+unsigned int mySenderId,mySequence[MAX_CHANNEL_ADDRESSES + 1];
+char *keyFile=NULL,*cipherName=NULL;
+groupKey myGroupKey;
+groupCrypto sendCrypto,recvCrypto;
+fecConfig myFec;
+unsigned int myObjectId;
+fecDecoder recvFec;
+int useScreen;
+screen chatScreen;
+int useTimestamps;
+latencyTable recvLatency;
+int useLocal=1;
+localGroup myLocal;
+pthread_t localT;
+dedupFilter localDedup;
+groupCrypto localCrypto;
+dedupFilter pathDedup;
+pthread_mutex_t deliverLock = PTHREAD_MUTEX_INITIALIZER;
+groupChannels myChannels;
+int channelCount;
+unsigned int currentChannel;
+char *keywordFile;
+keywordList myKeywords;
+keywordMatcher *myMatcher;
+groupHistory myHistory;
+int historyMinutes=DEFAULT_HISTORY_MINUTES;
+pthread_t catchupT,answerT;
+groupCrypto answerCrypto,catchupCrypto;
+pthread_mutex_t sendLock = PTHREAD_MUTEX_INITIALIZER;
+catchupRequest pendingAnswers[MAX_PENDING_ANSWERS];
+pthread_mutex_t answerLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t answerWake;
+int replaying;
+int busyPollUs;
+int recvCpu=-1,sendCpu=-1,fifoPriority;
+int groupSock;
+latencyTable pingLatency;
+unsigned long long pingStamp;
+int pingAnswered;
+pthread_mutex_t pingLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pingWake;
 
 
 void startGroupChat(struct in_addr,int);
@@ -69,51 +151,78 @@ void chatSession(int);
 /* Thread functions. */
 void* receiver(void*);
 void* sender(void*);
+void* merger(void*);
+void* localReceiver(void*);
+void* catchUp(void*);
+void* answerer(void*);
 
 /* Functions to send different packets. */
 void sendTextMsg(int,char*);
 void sendByeMsg(int);
+void sendCatchup(int,struct in_addr,int);
+void sendClaim(int,unsigned int);
+void sendPing(int,unsigned long long);
+void sendPong(int,unsigned int,unsigned long long);
 
-/* Read packet functions. */
+/* Packet IO functions. */
 int readPacket(int,packet *);
-int getTextLength(packet *,char **,int *);
-int getOpcode(packet *,char **,int *);
-int getNameLength(packet *,char **,int *);
-int getName(packet *,char **,int *);
-int getText(packet *,char **,int *);
-
-/* Write packet functions. */
 int writePacket(int, const packet *);
-void setTextLength(const packet *,char **);
-void setOpcode(const packet *,char **);
-void setNameLength(const packet *,char **);
-void setName(const packet *,char **);
-void setText(const packet *,char **);
+int writeFecPacket(int, const packet *, int);
+int sendDatagram(int, packet *, int);
 
 /* Other Utility function. */
-char getch();
-int readMsg(char*);
 void setMyName();
+void setMySenderId();
+void stampPacket(packet*,int);
+void stopMerger(void*);
+void preparePacket(packet*);
+void deliverOnce(packet*);
+void unlockDeliver(void*);
+void deliverPacket(packet*);
+void deliverFragment(packet*);
+long long currentMs();
+void showLatency(latencyTable*);
 void sessionKiller(int);
+void switchChannel(const char*);
+void closeChannel();
+void setKeywords();
+void addHighlight(const char*);
+char* markKeywords(const char*,size_t,size_t*);
+void keepDatagram(const char*,size_t);
+void initAnswers();
+void unlockSend(void*);
+void queueAnswer(const packet*);
+void dropAnswer(unsigned int);
+void nextAnswer(catchupRequest*);
+void unlockAnswers(void*);
+void answerCatchup(const catchupRequest*);
+void streamHistory(int,char*,const char*,size_t);
+int sendChunk(int,const char*,size_t,size_t*,long long);
+int connectMember(const struct sockaddr_in*);
+int localAddress(struct in_addr*);
+void replayHistory(int);
+void deliverHistory(packet*);
+void closeDescriptors(void*);
+void placeThread(int);
+int receiveLocal(char*);
+void initPings();
+void pingMembers(int,const char*);
+int pingOnce(int);
+void answerPing(const packet*);
+void notePong(const packet*);
+void unlockPings(void*);
 
 /* Display functions. */
 void displayMsg(packet);
 void displayBye(packet);
-void restoreDisplay();
-
-/* Network Utility functions. */
-void getBinaryAddress(char*, struct in_addr*);
-int getMultiCastSock(struct in_addr, int);
-void closeSocket(int,char *);
-void leaveGroup(int);
 
 /* Argument validation functions. */
 void processArgs(int,char**,char**,int*);
-void extractArgs(int,char**,char**,char**);
 void validateArgs(const char*,const char*,int*);
-int validateAndGetPort(const char*);
-int validateHost(const char*);
-void invalidArgs(const char*);
+void validateShards(const char*);
+void validateChannels(const char*);
+void validateHistory(const char*);
+void validateLowLatency(const char*,const char*,const char*);
 
 
 int main(int argc, char **argv)
@@ -122,11 +231,29 @@ int main(int argc, char **argv)
     int port=0;
     struct in_addr multicastIp;
 
+    setlocale(LC_CTYPE,"");
     processArgs(argc,argv,&multiIp,&port);
     getBinaryAddress(multiIp,&multicastIp);
     multicastAddr.sin_family = AF_INET;
     multicastAddr.sin_addr.s_addr = multicastIp.s_addr;
     multicastAddr.sin_port = htons(port);
+    /* The addresses after -mcip must still be multicast ones. */
+    if(channelCount > 0 && (ntohl(multicastIp.s_addr) + channelCount) >> 28 != 0xE)
+    {
+        invalidArgs("The channel addresses run out of the multicast range.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(keyFile != NULL)
+    {
+        groupCipher cipher;
+        parseCipher(cipherName,&cipher);
+        loadGroupKey(&myGroupKey,keyFile,cipher,multicastIp,port);
+        initGroupCrypto(&sendCrypto,&myGroupKey);
+        initGroupCrypto(&recvCrypto,&myGroupKey);
+        initGroupCrypto(&localCrypto,&myGroupKey);
+        initGroupCrypto(&answerCrypto,&myGroupKey);
+        initGroupCrypto(&catchupCrypto,&myGroupKey);
+    }
     startGroupChat(multicastIp,port);
 }
 
@@ -134,10 +261,28 @@ void startGroupChat(struct in_addr multicastIp,int port)
 {
     int sock;
     sock = getMultiCastSock(multicastIp,port);
+    /* Spinning still helps where the kernel will not busy poll. */
+    if(busyPollUs > 0)
+        setBusyPoll(sock,busyPollUs);
+    initGroupChannels(&myChannels,multicastIp,channelCount);
+    if(channelCount > 0)
+        addChannelSocket(&myChannels,sock);
+    if(useLocal && joinLocalGroup(&myLocal,multicastIp,port) == -1)
+    {
+        fprintf(stderr,"\n Members on this host cannot be reached, only other hosts.\n");
+        useLocal = 0;
+    }
     setMyName();
+    setKeywords();
+    setMySenderId();
     chatSession(sock);
-    leaveGroup(sock);
+    if(useLocal)
+        leaveLocalGroup(&myLocal);
+    leaveGroup(sock,multicastIp);
     closeSocket(sock,"Error while closing socket:");
+    freeGroupChannels(&myChannels);
+    freeMatcher(myMatcher);
+    freeKeywords(&myKeywords);
 }
 
 
@@ -149,10 +294,26 @@ void chatSession(int newSock)
     sendT_result = NULL;
     recvT_result = NULL;
     
-    pthread_mutex_init(&bufferLock,NULL);
+    initLineEditor(&editor,STDIN_FILENO,"You> ",BUFFSIZE);
+    if(useScreen)
+    {
+        screenOpen(&chatScreen,STDOUT_FILENO);
+        lineEditorUseScreen(&editor,&chatScreen);
+    }
+    initDecoder(&recvDecoder,&groupFormat);
+    initDedup(&recvDedup);
+    initFecDecoder(&recvFec);
+    initDedup(&localDedup);
+    initDedup(&pathDedup);
+    initLatency(&recvLatency);
+    initHistory(&myHistory);
+    initAnswers();
+    initLatency(&pingLatency);
+    initPings();
+    groupSock = newSock;
     signal(SIGINT,sessionKiller);
     
-    if((res = pthread_create(&recvT,NULL,receiver,(void*)&newSock)) != 0)
+    if((res = pthread_create(&recvT,NULL,shardCount > 1 ? merger : receiver,(void*)&newSock)) != 0)
     {
         fprintf(stderr,"\nThread creation failed : %s",strerror(res));
         exit(EXIT_FAILURE);
@@ -162,6 +323,23 @@ void chatSession(int newSock)
         fprintf(stderr,"\nThread creation failed : %s",strerror(res));
         exit(EXIT_FAILURE);
     }
+    if(useLocal && (res = pthread_create(&localT,NULL,localReceiver,NULL)) != 0)
+    {
+        fprintf(stderr,"\nThread creation failed : %s",strerror(res));
+        exit(EXIT_FAILURE);
+    }
+    /* Requests and claims name members by their sender id. */
+    if(useSequence && (res = pthread_create(&answerT,NULL,answerer,(void*)&newSock)) != 0)
+    {
+        fprintf(stderr,"\nThread creation failed : %s",strerror(res));
+        exit(EXIT_FAILURE);
+    }
+    if(useSequence && historyMinutes > 0 &&
+       (res = pthread_create(&catchupT,NULL,catchUp,(void*)&newSock)) != 0)
+    {
+        fprintf(stderr,"\nThread creation failed : %s",strerror(res));
+        exit(EXIT_FAILURE);
+    }
     
     if((res = pthread_join(recvT,(void**)&recvT_result)) != 0)
     {
@@ -173,13 +351,27 @@ void chatSession(int newSock)
         perror("Send Thread join failed:");
         exit(EXIT_FAILURE);
     }
+    if(useLocal)
+    {
+        pthread_cancel(localT);
+        pthread_join(localT,NULL);
+    }
+    if(useSequence)
+    {
+        pthread_cancel(answerT);
+        pthread_join(answerT,NULL);
+    }
+    if(useSequence && historyMinutes > 0)
+    {
+        pthread_cancel(catchupT);
+        pthread_join(catchupT,NULL);
+    }
 
     if(recvT_result == PTHREAD_CANCELED)
     {
         sendByeMsg(newSock);
         printf("\n\n    Leaving group chat\n");
         fflush(stdout);
-        restoreDisplay();
     }
     else
     {
@@ -187,6 +379,16 @@ void chatSession(int newSock)
         free(recvT_result);
         
     }
+    if(useScreen)
+    {
+        lineEditorUseScreen(&editor,NULL);
+        screenClose(&chatScreen);
+    }
+    destroyLineEditor(&editor);
+    freeDecoder(&recvDecoder);
+    freeFecDecoder(&recvFec);
+    freeHistory(&myHistory);
+    freeLatency(&pingLatency);
 }
 
 
@@ -200,6 +402,7 @@ void* receiver(void *newSock)
     int *retval,readReturnVal;
     int sock = *(int*)newSock;
     
+    placeThread(recvCpu);
     /*Start receiving.*/
     while(1)
     {
@@ -223,34 +426,139 @@ void* receiver(void *newSock)
         }
         else if(readReturnVal == -2)
         {
-	    printf("\rYou> ");
-	    fflush(stdout);
+            lineEditorRedraw(&editor);
             continue;
         }
            
-        if(msg.Opcode == OP_TEXT)
-        {
-            displayMsg(msg);
-	    free(msg.Text);
-        }
-        else if(msg.Opcode == OP_BYE)
-        {
-            displayBye(msg);
-        }
-	free(msg.Name);
+        deliverOnce(&msg);
     }
     fflush(stdout);
     pthread_exit(NULL);
 
 }
 
+/*  Receiver used with -shards, runs until cancelled.  */
+void* merger(void *newSock)
+{
+    int sock = *(int*)newSock;
+
+    placeThread(recvCpu);
+    pthread_cleanup_push(stopMerger,NULL);
+    startShards(&shards,sock,multicastAddr.sin_addr,ntohs(multicastAddr.sin_port),
+                shardCount,keyFile != NULL ? &myGroupKey : NULL,preparePacket,deliverOnce,keepDatagram);
+    if(channelCount > 0)
+    {
+        int i;
+        for(i=1;i<shards.Count;i++)
+            addChannelSocket(&myChannels,shards.Shards[i].Sock);
+    }
+    runMerge(&shards);
+    pthread_cleanup_pop(1);
+    pthread_exit(NULL);
+}
+
+/*  Reads what members on this host send, checked like datagrams from the socket.  */
+void* localReceiver(void *unused)
+{
+    char *buffer = (char*)malloc(MAX_GROUP_PACKET_LENGTH);
+    packet msg;
+    int len;
+
+    if(buffer == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    placeThread(recvCpu);
+    pthread_cleanup_push(free,buffer);
+    while(1)
+    {
+        /* The futex wait is no cancellation point; it times out instead. */
+        pthread_testcancel();
+        if((len = receiveLocal(buffer)) == 0)
+            continue;
+        if(dedupSeen(&localDedup,buffer,len))
+            continue;
+        if(keyFile != NULL && (len = openGroupPacket(&localCrypto,buffer,len)) == -1)
+            continue;
+        dedupRecord(&localDedup,buffer,len);
+        keepDatagram(buffer,len);
+        if(decodePacket(&groupFormat,buffer,len,&msg) == -1)
+            continue;
+        preparePacket(&msg);
+        deliverOnce(&msg);
+    }
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+/*
+ * Asks the group for its recent messages and shows what the member that
+ * claims the request sends. Gives up after CATCHUP_WAIT_MS without one.
+ */
+void* catchUp(void *newSock)
+{
+    int sock = *(int*)newSock;
+    int fds[2] = {-1,-1};
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    struct in_addr local;
+    struct pollfd pfd;
+
+    pthread_cleanup_push(closeDescriptors,fds);
+    fds[0] = passiveSock(0,0);
+    if(getsockname(fds[0],(struct sockaddr*)&addr,&len) == -1)
+    {
+        perror("\nError while reading socket address:");
+        exit(EXIT_FAILURE);
+    }
+    if(localAddress(&local) == 0)
+    {
+        sendCatchup(sock,local,ntohs(addr.sin_port));
+        pfd.fd = fds[0];
+        pfd.events = POLLIN;
+        if(poll(&pfd,1,CATCHUP_WAIT_MS) == 1 && (fds[1] = accept(fds[0],NULL,NULL)) != -1)
+        {
+            /* Only the first member to connect is listened to. */
+            close(fds[0]);
+            fds[0] = -1;
+            replayHistory(fds[1]);
+            lineEditorPrint(&editor," Caught up on the last %d minutes.",historyMinutes);
+        }
+    }
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+/*  Answers catch-up requests no other member claimed first; runs until cancelled.  */
+void* answerer(void *newSock)
+{
+    int sock = *(int*)newSock;
+    catchupRequest request;
+
+    while(1)
+    {
+        nextAnswer(&request);
+        sendClaim(sock,request.Target);
+        answerCatchup(&request);
+    }
+    return NULL;
+}
+
 void* sender(void *newSock)
 {
     int sock = *(int*)newSock;
     char *msg;
 
-    printf("\n Chat session started with group\n");
-    fflush(stdout);
+    placeThread(sendCpu);
+    /* Full screen, everything goes through the editor's screen. */
+    if(useScreen)
+        lineEditorPrint(&editor," Chat session started with group");
+    else
+    {
+        printf("\n Chat session started with group\n");
+        fflush(stdout);
+    }
     
     msg = (char*)malloc(BUFFSIZE);
     if(msg == NULL)
@@ -258,20 +566,36 @@ void* sender(void *newSock)
         perror("Failed during memory allocation:");
         exit(EXIT_FAILURE);
     }
-    printf("\n");
+    if(!useScreen)
+        printf("\n");
     /* Start sending.*/
     while(1)
     {
-        printf("You> ");
-        fflush(stdout);
-        
-        memset(msg,0,BUFFSIZE);
-
-        if(readMsg(msg) == -1)
+        if(readLine(&editor,msg) == -1)
         {
             free(msg);
             pthread_exit(NULL);
         }
+        else if(!strcmp(msg,"/latency"))
+        {
+            showLatency(&recvLatency);
+        }
+        else if(!strncmp(msg,"/ping",5) && (msg[5] == 0 || msg[5] == ' '))
+        {
+            pingMembers(sock,msg + 5);
+        }
+        else if(!strncmp(msg,"/ch ",4))
+        {
+            switchChannel(msg + 4);
+        }
+        else if(!strcmp(msg,"/close"))
+        {
+            closeChannel();
+        }
+        else if(!strncmp(msg,"/hl ",4))
+        {
+            addHighlight(msg + 4);
+        }
         else
         {
             sendTextMsg(sock,msg);
@@ -292,7 +616,18 @@ void sendTextMsg(int sock,char *text)
 {
     packet pkt;
     
+    memset(&pkt,0,sizeof(pkt));
     pkt.Opcode = OP_TEXT;
+    if(useTimestamps)
+    {
+        pkt.Flags = GROUP_FLAG_TIME;
+        pkt.SendTime = wallClockUs();
+    }
+    if(currentChannel != 0)
+    {
+        pkt.Flags |= GROUP_FLAG_CHANNEL;
+        pkt.Channel = currentChannel;
+    }
     pkt.NameLength = strlen(myName);
     pkt.Name = myName;
     pkt.TextLength = strlen(text);
@@ -304,6 +639,7 @@ void sendByeMsg(int sock)
 {
     packet pkt;
     
+    memset(&pkt,0,sizeof(pkt));
     pkt.Opcode = OP_BYE;
     pkt.NameLength = strlen(myName);
     pkt.Name = myName;
@@ -312,249 +648,220 @@ void sendByeMsg(int sock)
     writePacket(sock,&pkt);    
 }
 
-
-/******************************************************************************
- 
- *                Write packet functions.
- 
- ******************************************************************************/
-
-int writePacket(int sock, const packet *msg)
+/*  Asks for the last historyMinutes of messages, sent to address:port.  */
+void sendCatchup(int sock,struct in_addr address,int port)
 {
-    int totalLen,ret;
-    char *bufPtr,*iterator;
-    
-    if(msg->Opcode == OP_TEXT )
-    {
-        totalLen = FIXEDLENGTH_FIELDS_SIZE + msg->NameLength + msg->TextLength;
-    
-        if((bufPtr = (char*)malloc(totalLen)) ==  NULL)
-        {
-	    fprintf(stderr,"\nFailed to allocate memory for host.");
-	    exit(EXIT_FAILURE);         
-        }
-        iterator = bufPtr;
-        memset(iterator,0,totalLen);
-    
-        setOpcode(msg,&iterator);
-        setNameLength(msg,&iterator);
-        setName(msg,&iterator);    
-        setTextLength(msg,&iterator);
-        setText(msg,&iterator);
-    }
-    else if(msg->Opcode == OP_BYE)
-    {
-        totalLen = OPCODE_FIELD_SIZE + msg->NameLength;
-        if((bufPtr = (char*)malloc(totalLen)) ==  NULL)
-        {
-	    fprintf(stderr,"\nFailed to allocate memory for host.");
-	    exit(EXIT_FAILURE);         
-        }
-        iterator = bufPtr;
-        memset(iterator,0,totalLen);
-        
-        setOpcode(msg,&iterator);
-        setName(msg,&iterator);
-    }
-    
-    if((ret = sendto(sock,bufPtr,totalLen,0,(struct sockaddr*)&multicastAddr,sizeof(multicastAddr))) == -1)
-    {
-        perror("\nPacket sent failed");
-        return -1;
-    }
-    free(bufPtr);
+    packet pkt;
 
-    return 0;
+    memset(&pkt,0,sizeof(pkt));
+    pkt.Opcode = GROUP_OP_CATCHUP;
+    pkt.Address = ntohl(address.s_addr);
+    pkt.Port = port;
+    pkt.Seconds = historyMinutes * 60;
+    writePacket(sock,&pkt);
 }
 
-void setTextLength(const packet *msg,char **buffer)
+/*  The receiver's answer carries stamp back.  */
+void sendPing(int sock,unsigned long long stamp)
 {
-    unsigned short int length;
-    length = htons(msg->TextLength);
-    memcpy(*buffer,(char*)&length,sizeof(length));
-    *buffer = *buffer + sizeof(length);
-}
+    packet pkt;
 
-void setOpcode(const packet *msg,char **buffer)
-{
-    char opcode;
-    opcode = msg->Opcode;
-    memcpy(*buffer,&opcode,sizeof(opcode));
-    *buffer = *buffer + sizeof(opcode);
+    memset(&pkt,0,sizeof(pkt));
+    pkt.Opcode = GROUP_OP_PING;
+    pkt.SendTime = stamp;
+    writePacket(sock,&pkt);
 }
 
-void setNameLength(const packet *msg,char **buffer)
+void sendPong(int sock,unsigned int target,unsigned long long stamp)
 {
-    char nlength;
-    nlength = msg->NameLength;
-    memcpy(*buffer,&nlength,sizeof(nlength));
-    *buffer = *buffer + sizeof(nlength);
-}
+    packet pkt;
 
-void setName(const packet *msg,char **buffer)
-{
-    memcpy(*buffer,msg->Name,msg->NameLength);
-    *buffer = *buffer + msg->NameLength;
+    memset(&pkt,0,sizeof(pkt));
+    pkt.Opcode = GROUP_OP_PONG;
+    pkt.Target = target;
+    pkt.SendTime = stamp;
+    pkt.NameLength = strlen(myName);
+    pkt.Name = myName;
+    writePacket(sock,&pkt);
 }
 
-void setText(const packet *msg,char **buffer)
+/*  Tells the other members this one answers target's request.  */
+void sendClaim(int sock,unsigned int target)
 {
-    memcpy(*buffer,msg->Text,msg->TextLength); 
+    packet pkt;
+
+    memset(&pkt,0,sizeof(pkt));
+    pkt.Opcode = GROUP_OP_CLAIM;
+    pkt.Target = target;
+    writePacket(sock,&pkt);
 }
 
+
 /******************************************************************************
  
- *                Read packet functions.
+ *                Packet IO functions.
  
  ******************************************************************************/
 
+/*
+ * Returns 0 on success, -1 if the socket failed and -2 if the datagram was
+ * malformed. Name and Text of msg point into the receive buffer and stay
+ * valid until the next call.
+ */
 int readPacket(int sock,packet *msg)
 {
-    int ret,pktLen;
-    char *bufPtr,*iterator;
-    
-    if((bufPtr = (char*)malloc(MAX_PACKET_LENGTH)) == NULL)
+    int ret;
+    size_t avail;
+    char *space;
+    struct sockaddr_in from;
+    socklen_t fromLen;
+
+    space = decoderSpace(&recvDecoder,&avail);
+    do
     {
-	fprintf(stderr,"\nFailed to allocate memory for host.");
-	exit(EXIT_FAILURE); 
-    }
-    iterator = bufPtr;
-    
-    if((ret = read(sock,bufPtr,MAX_PACKET_LENGTH)) == -1)
+        fromLen = sizeof(from);
+        if((ret = busyPollUs > 0 ? spinRecv(sock,space,avail,&from,busyPollUs) :
+                  recvfrom(sock,space,avail,0,(struct sockaddr*)&from,&fromLen)) == -1)
+        {
+            perror("Failed to read message:");
+            return -1;
+        }
+        /* Copies of one message, e.g. via two interfaces, are read past. */
+    }while(dedupSeen(&recvDedup,space,ret));
+    if(keyFile != NULL && (ret = openGroupPacket(&recvCrypto,space,ret)) == -1)
     {
-        perror("Failed to read message:");
-        return -1;
-    }
-    pktLen = ret;
-    
-    if(getOpcode(msg,&iterator,&pktLen) == -1)
+        fprintf(stderr,"\nDropped a packet that failed authentication.\n");
         return -2;
-    if(msg->Opcode == OP_TEXT)
-    {
-        if(getNameLength(msg,&iterator,&pktLen) == -1)
-            return -2;
-        if(getName(msg,&iterator,&pktLen) == -1)
-            return -2;
-        if(getTextLength(msg,&iterator,&pktLen) == -1)
-            return -2;
-        if(getText(msg,&iterator,&pktLen) == -1)
-            return -2;
     }
-    else if(msg->Opcode == OP_BYE)
+    dedupRecord(&recvDedup,space,ret);
+    keepDatagram(space,ret);
+    decoderCommit(&recvDecoder,ret);
+
+    if(nextPacket(&recvDecoder,msg) != DECODE_PACKET)
     {
-        msg->NameLength = ret - OPCODE_FIELD_SIZE;
-        if(getName(msg,&iterator,&pktLen) == -1)
-            return -2;
+        fprintf(stderr,"\nInvalid incoming message of %d bytes.\n",ret);
+        return -2;
     }
-    free(bufPtr);
-    
+    if(catchupForged(msg,&from))
+        return -2;
+    preparePacket(msg);
     return 0;
 }
 
-int getTextLength(packet *msg,char **buffer,int *pktLen)
+/*
+ * Sends msg with the sequence header. With FEC on, messages that do not fit
+ * one fragment go out as OP_FRAG packets instead.
+ */
+int writePacket(int sock, const packet *msg)
 {
-    unsigned short int length;
-    
-    if(*pktLen >= TEXTLENGTH_FIELD_SIZE)
-    {
-        memcpy((char*)&length,*buffer,sizeof(length));
-        msg->TextLength = ntohs(length);
-        *buffer = *buffer + sizeof(msg->TextLength);
-        *pktLen = *pktLen - sizeof(msg->TextLength);
-        return 0;
-    }
+    packet pkt = *msg;
+    int address = channelAddress(&myChannels,msg->Flags & GROUP_FLAG_CHANNEL ? msg->Channel : 0);
+    int ret;
+
+    /* The catch-up threads send too, and sequence numbers must not repeat. */
+    pthread_mutex_lock(&sendLock);
+    pthread_cleanup_push(unlockSend,NULL);
+    if(myFec.Scheme != FEC_NONE && encodedLength(&groupFormat,msg) + MAX_GROUP_HEADER_LENGTH > FEC_FRAGMENT_SIZE)
+        ret = writeFecPacket(sock,msg,address);
     else
     {
-        fprintf(stderr,"\nInvalid incoming message:Missing Text Length field.\n");
-        return -1;
+        stampPacket(&pkt,address);
+        ret = sendDatagram(sock,&pkt,address);
     }
+    pthread_cleanup_pop(1);
+    return ret;
 }
 
-int getOpcode(packet *msg,char **buffer,int *pktLen)
+/*  The message is encoded without a header; each fragment gets its own.  */
+int writeFecPacket(int sock, const packet *msg, int address)
 {
-    char opcode;
-    if(*pktLen >= OPCODE_FIELD_SIZE)
+    size_t objectLength,stride = FEC_HEADER_LENGTH + myFec.FragmentSize;
+    char *object,*fragments;
+    packet inner = *msg;
+    int count,i,ret=0;
+
+    /* The send time and channel travel inside the rebuilt message. */
+    inner.Flags &= GROUP_FLAG_TIME | GROUP_FLAG_CHANNEL;
+    objectLength = encodedLength(&groupFormat,&inner);
+    count = fecFragmentCount(&myFec,objectLength);
+    object = (char*)malloc(objectLength);
+    fragments = (char*)malloc(count * stride);
+    if(object == NULL || fragments == NULL)
     {
-        memcpy(&opcode,*buffer,sizeof(opcode));
-        msg->Opcode = opcode;
-    
-       *buffer = *buffer + sizeof(opcode);
-       *pktLen = *pktLen - sizeof(opcode);
-       return 0;
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
     }
-    else
+    if(encodePacket(&groupFormat,&inner,object,objectLength) == -1)
     {
-        fprintf(stderr,"\nInvalid incoming message:Missing Opcode.\n");
+        fprintf(stderr,"\nMessage too long to be sent.\n");
+        free(object);
+        free(fragments);
         return -1;
     }
-    
-}
 
-int getNameLength(packet *msg,char **buffer,int *pktLen)
-{
-    char nlength;
-    if(*pktLen >= NAMELENGTH_FIELD_SIZE)
+    fecEncode(&myFec,myObjectId++,object,objectLength,fragments);
+    for(i=0;i<count;i++)
     {
-        memcpy(&nlength,*buffer,sizeof(nlength));    
-        msg->NameLength = nlength;
-        *buffer = *buffer + sizeof(nlength);
-        *pktLen = *pktLen - sizeof(nlength);
-        return 0;
-    }
-    else
-    {
-        fprintf(stderr,"\nInvalid incoming message:Missing NameLength field.\n");
-        return -1;
+        packet frag;
+        memset(&frag,0,sizeof(frag));
+        frag.Opcode = GROUP_OP_FRAG;
+        frag.TextLength = stride;
+        frag.Text = fragments + i * stride;
+        stampPacket(&frag,address);
+        if(sendDatagram(sock,&frag,address) == -1)
+            ret = -1;
     }
+    free(object);
+    free(fragments);
+    return ret;
 }
 
-int getName(packet *msg,char **buffer,int *pktLen)
+/*
+ * Sends one stamped packet as one datagram to the group's address of that
+ * index, sealed for encrypted groups.
+ */
+int sendDatagram(int sock, packet *msg, int address)
 {
-    if(*pktLen >= msg->NameLength)
-    {
-        msg->Name = (char*)malloc(msg->NameLength + 1);
-        if(msg->Name == NULL)
-        {
-	    fprintf(stderr,"\nFailed to allocate memory for host.");
-	    exit(EXIT_FAILURE);         
-        }
-        memset(msg->Name,0,msg->NameLength + 1);
-        memcpy(msg->Name,*buffer,msg->NameLength);
-    
-        *buffer = *buffer + msg->NameLength;
-        *pktLen = *pktLen - msg->NameLength;
-        return 0;
+    int totalLen,ret=0;
+    char small[FRAME_INLINE + GROUP_TAG_LENGTH],*bufPtr = small;
+    struct sockaddr_in destAddr = multicastAddr;
     
+    destAddr.sin_addr = channelIp(&myChannels,address);
+    totalLen = encodedLength(&groupFormat,msg);
+    if(totalLen > FRAME_INLINE && (bufPtr = (char*)malloc(totalLen + GROUP_TAG_LENGTH)) ==  NULL)
+    {
+        fprintf(stderr,"\nFailed to allocate memory for host.");
+        exit(EXIT_FAILURE);         
     }
-    else
+    if(encodePacket(&groupFormat,msg,bufPtr,totalLen) == -1)
     {
-        fprintf(stderr,"\nInvalid incoming message:The NameLength field "
-        "advertises %d bytes but actually is  %d bytes.\n",msg->NameLength,*pktLen);
+        fprintf(stderr,"\nMessage too long to be sent.\n");
+        if(bufPtr != small)
+            free(bufPtr);
         return -1;
     }
-}
-
-int getText(packet *msg,char **buffer,int *pktLen)
-{
-    if(*pktLen >= msg->TextLength)
+    /* Kept opened, as the members that receive it keep it. */
+    keepDatagram(bufPtr,totalLen);
+    if(keyFile != NULL && (totalLen = sealGroupPacket(&sendCrypto,bufPtr,totalLen,totalLen + GROUP_TAG_LENGTH)) == -1)
     {
-        msg->Text = (char*)malloc(msg->TextLength + 1);
-        if(msg->Text == NULL)
-        {
-            fprintf(stderr,"\nFailed to allocate memory for host.");
-	    exit(EXIT_FAILURE);         
-        }
-        memset(msg->Text,0,msg->TextLength + 1);
-        memcpy(msg->Text,*buffer,msg->TextLength);
-        *pktLen = *pktLen - msg->TextLength;
-        return 0;
+        fprintf(stderr,"\nFailed to encrypt message.\n");
+        ret = -1;
     }
     else
     {
-        fprintf(stderr,"\nInvalid incoming message:The TextLength field "
-        "advertises %d bytes but actually is %d bytes\n",msg->TextLength,*pktLen);
-        return -1;
+        /* Members on this host first; the socket does not loop back to them. */
+        if(useLocal)
+            localSend(&myLocal,bufPtr,totalLen);
+        if(sendto(sock,bufPtr,totalLen,0,(struct sockaddr*)&destAddr,sizeof(destAddr)) == -1)
+        {
+            perror("\nPacket sent failed");
+            ret = -1;
+        }
     }
+    if(bufPtr != small)
+        free(bufPtr);
+
+    return ret;
 }
 
 
@@ -563,84 +870,198 @@ int getText(packet *msg,char **buffer,int *pktLen)
  *                Other Utility functions.
  
  ******************************************************************************/
-char getch()
+void setMyName()
 {
-    char buf = 0;
-    struct termios old = {0};
-    if (tcgetattr(0, &old) == -1)
-    {
-        perror("Error while fetching stdin properties:");
-        exit(EXIT_FAILURE);
-    }
-    old.c_lflag &= ~ICANON;
-    old.c_lflag &= ~ECHO;
-    old.c_cc[VMIN] = 1;
-    old.c_cc[VTIME] = 0;
-    if (tcsetattr(0, TCSANOW, &old) == -1)
+    printf("\n Enter your name: ");
+    scanf("%255s",myName);
+}
+
+/*  The member's name and the keywords of -highlight.  */
+void setKeywords()
+{
+    initKeywords(&myKeywords);
+    if(keywordFile != NULL && loadKeywords(&myKeywords,keywordFile) == -1)
     {
-        perror("Error while setting stdin properties:");
+        perror("Error while reading keyword file:");
         exit(EXIT_FAILURE);
     }
-    if (read(0, &buf, 1) == -1)
+    addKeyword(&myKeywords,myName,strlen(myName));
+    myMatcher = compileKeywords(&myKeywords);
+}
+
+/*  /hl WORD: the new matcher is swapped in between two deliveries.  */
+void addHighlight(const char *keyword)
+{
+    keywordMatcher *old,*fresh;
+
+    if(addKeyword(&myKeywords,keyword,strlen(keyword)) == -1)
     {
-        perror ("Error while reading character from stdin:");
-        exit(EXIT_FAILURE);
+        lineEditorPrint(&editor," Keywords are 1 to %d bytes.",MAX_KEYWORD_LENGTH);
+        return;
     }
-    old.c_lflag |= ICANON;
-    old.c_lflag |= ECHO;
-    if (tcsetattr(0, TCSADRAIN, &old) == -1)
+    fresh = compileKeywords(&myKeywords);
+    pthread_mutex_lock(&deliverLock);
+    old = myMatcher;
+    myMatcher = fresh;
+    pthread_mutex_unlock(&deliverLock);
+    freeMatcher(old);
+    lineEditorPrint(&editor," Highlighting %zu keywords.",myKeywords.Count);
+}
+
+/*  Random id that tells this member's sequence numbers apart from others.  */
+void setMySenderId()
+{
+    FILE *random;
+
+    if((random = fopen("/dev/urandom","rb")) == NULL ||
+       fread(&mySenderId,sizeof(mySenderId),1,random) != 1)
     {
-        perror("Error while setting stdin properties:");
-        exit(EXIT_FAILURE);
+        mySenderId = (unsigned int)getpid() ^ (unsigned int)time(NULL);
     }
-    return (buf);
+    if(random != NULL)
+        fclose(random);
 }
 
-int readMsg(char *msg)
+/*
+ * Sets the sequence header; encrypted groups need it for the nonce. Each
+ * address of the group gets a stream of its own.
+ */
+void stampPacket(packet *pkt,int address)
 {
-    int i=0;
-    char ch=0;
-    
-    while(i < BUFFSIZE-1)
+    pkt->Flags = (pkt->Flags & (GROUP_FLAG_TIME | GROUP_FLAG_CHANNEL)) | (useSequence ? GROUP_FLAG_SEQ : 0);
+    pkt->SenderId = channelSender(mySenderId,address);
+    pkt->Sequence = mySequence[address]++;
+    /* A nonce must never repeat, so a wrapped sender starts afresh. */
+    if(mySequence[address] == 0)
+        setMySenderId();
+}
+
+void stopMerger(void *unused)
+{
+    stopShards(&shards);
+}
+
+/*  Runs on the receiving thread, or on a shard thread with -shards.  */
+void preparePacket(packet *msg)
+{
+    /* Fragments are binary; the message they rebuild is sanitized later. */
+    if(msg->Opcode == GROUP_OP_FRAG)
+        return;
+    msg->NameLength = sanitizeText(msg->Name,msg->NameLength);
+    msg->TextLength = sanitizeText(msg->Text,msg->TextLength);
+}
+
+/*
+ * Where the network loops traffic between members of one host back, as a
+ * multicast route over lo does, packets come both from the socket and from
+ * the local ring; only the first copy is delivered. Catch-up replays the
+ * same messages once more. The lock lets the receive threads share recvFec
+ * and recvLatency.
+ */
+void deliverOnce(packet *msg)
+{
+    pthread_mutex_lock(&deliverLock);
+    pthread_cleanup_push(unlockDeliver,NULL);
+    if(!(msg->Flags & GROUP_FLAG_SEQ) || !dedupSequence(&pathDedup,msg->SenderId,msg->Sequence))
+        deliverPacket(msg);
+    pthread_cleanup_pop(1);
+}
+
+void unlockDeliver(void *unused)
+{
+    pthread_mutex_unlock(&deliverLock);
+}
+
+void deliverPacket(packet *msg)
+{
+    if(msg->Opcode == OP_TEXT)
     {
-        ch = getch();
-        if(ch == 10)
-        {
-            printf("%c",ch);
-            break;
-        }
-        else if(ch == 127 && i > 0)
-        {
-            printf("\033[1D");
-            printf(" ");
-            printf("\033[1D");
-            i--;
-            pthread_mutex_lock(&bufferLock);
-                msgBuffer[i] = 0;
-            pthread_mutex_unlock(&bufferLock);
-        }
-        else if(ch >= 32 && ch <= 126)
+        unsigned int member = msg->SenderId;
+
+        /* Channels that share an address with a followed one. */
+        if(msg->Flags & GROUP_FLAG_CHANNEL)
         {
-            msg[i] = ch;
-            pthread_mutex_lock(&bufferLock);
-               msgBuffer[i++] = ch;
-               msgBuffer[i] = 0;
-            pthread_mutex_unlock(&bufferLock);
-            printf("%c",ch);
+            if(!followsChannel(&myChannels,msg->Channel))
+                return;
+            member = channelMember(msg->SenderId,channelAddress(&myChannels,msg->Channel));
         }
-        fflush(stdout);
+        /* Measured at delivery, so time spent reordering counts too. */
+        if(msg->Flags & GROUP_FLAG_TIME && !replaying)
+            latencyRecord(&recvLatency,member,msg->Name,msg->NameLength,msg->SendTime,wallClockUs());
+        displayMsg(*msg);
+    }
+    else if(msg->Opcode == OP_BYE)
+    {
+        displayBye(*msg);
+    }
+    else if(msg->Opcode == GROUP_OP_FRAG)
+    {
+        deliverFragment(msg);
+    }
+    else if(msg->Opcode == GROUP_OP_CATCHUP)
+    {
+        queueAnswer(msg);
+    }
+    else if(msg->Opcode == GROUP_OP_CLAIM)
+    {
+        dropAnswer(msg->Target);
+    }
+    else if(msg->Opcode == GROUP_OP_PING)
+    {
+        answerPing(msg);
+    }
+    else if(msg->Opcode == GROUP_OP_PONG)
+    {
+        notePong(msg);
     }
-    pthread_mutex_lock(&bufferLock);
-        msgBuffer[0] = 0;
-    pthread_mutex_unlock(&bufferLock);
-    msg[i] = 0;
-    return i;
 }
 
-void setMyName()
+/*  Runs where deliverPacket() does, under deliverLock.  */
+void deliverFragment(packet *msg)
 {
-    printf("\n Enter your name: ");
-    scanf("%s",myName);
+    packet inner;
+    char *object;
+    int len;
+
+    if(!(msg->Flags & GROUP_FLAG_SEQ))
+        return;
+    if((len = fecReceive(&recvFec,msg->SenderId,msg->Text,msg->TextLength,currentMs(),&object)) <= 0)
+        return;
+    if(decodePacket(&groupFormat,object,len,&inner) == -1 || inner.Opcode == GROUP_OP_FRAG)
+        return;
+    /* The rebuilt message has no header of its own. */
+    inner.SenderId = msg->SenderId;
+    preparePacket(&inner);
+    deliverPacket(&inner);
+}
+
+long long currentMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void showLatency(latencyTable *table)
+{
+    char *report=NULL;
+    size_t len=0;
+    FILE *out;
+
+    if((out = open_memstream(&report,&len)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&deliverLock);
+    latencyReport(table,out);
+    pthread_mutex_unlock(&deliverLock);
+    fclose(out);
+    /* lineEditorPrint() ends the text with its own newline. */
+    if(len > 0 && report[len - 1] == '\n')
+        report[len - 1] = 0;
+    lineEditorPrint(&editor,"%s",report);
+    free(report);
 }
 
 /*  Signal Handler for SIGINT */
@@ -660,136 +1081,514 @@ void sessionKiller(int signal_val)
     signal(SIGINT,SIG_DFL);
 }
 
-/******************************************************************************
- 
- *                Display functions.
- 
- ******************************************************************************/
+/*  /ch N: follows channel N and sends typed messages to it.  */
+void switchChannel(const char *arg)
+{
+    char *end;
+    long channel = strtol(arg,&end,10);
+
+    if(end == arg || *end != 0 || channel < 0 || channel >= GROUP_CHANNELS)
+        lineEditorPrint(&editor," Channels are 0 to %d.",GROUP_CHANNELS - 1);
+    else if(channel != 0 && channelCount == 0)
+        lineEditorPrint(&editor," Channels need -channels K.");
+    else if(followChannel(&myChannels,channel) == -1)
+        lineEditorPrint(&editor," Cannot join the address of channel %ld: %s",channel,strerror(errno));
+    else
+    {
+        currentChannel = channel;
+        lineEditorPrint(&editor," On channel %u, on %s.",currentChannel,
+                        inet_ntoa(channelIp(&myChannels,channelAddress(&myChannels,currentChannel))));
+    }
+}
 
-void displayMsg(packet msg)
-{    
-    printf("\r%s> %s",msg.Name,msg.Text);
-    printf("\033[K");
-    pthread_mutex_lock(&bufferLock);
-        printf("\nYou> %s",msgBuffer);
-    pthread_mutex_unlock(&bufferLock);
-    fflush(stdout);
+/*  /close: stops following the current channel and goes back to channel 0.  */
+void closeChannel()
+{
+    if(currentChannel == 0)
+        return;
+    unfollowChannel(&myChannels,currentChannel);
+    lineEditorPrint(&editor," Left channel %u.",currentChannel);
+    currentChannel = 0;
 }
 
-void displayBye(packet msg)
+/*  Keeps a datagram, opened, for members that join later.  */
+void keepDatagram(const char *datagram,size_t len)
 {
-    printf("\r%s> Bye",msg.Name);
-    printf("\033[K");
-    printf("\n\n");
-    printf("    %s left the group\n",msg.Name);
-    pthread_mutex_lock(&bufferLock);
-        printf("\nYou> %s",msgBuffer);
-    pthread_mutex_unlock(&bufferLock);
-    fflush(stdout);
+    historyAdd(&myHistory,datagram,len,currentMs());
+}
+
+void unlockSend(void *unused)
+{
+    pthread_mutex_unlock(&sendLock);
 }
 
-void restoreDisplay()
+/*  Waits on answerWake are timed on the clock currentMs() reads.  */
+void initAnswers()
 {
-    struct termios old = {0};
-    if (tcgetattr(0, &old) == -1)
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    pthread_cond_init(&answerWake,&attr);
+    pthread_condattr_destroy(&attr);
+    srandom(mySenderId);
+}
+
+/*
+ * Runs under deliverLock. The wait is random so that members seldom end
+ * theirs together; those whose history covers the time asked for go first.
+ */
+void queueAnswer(const packet *msg)
+{
+    long long now = currentMs(),oldest = historyOldest(&myHistory),delay;
+    int i,slot=-1;
+
+    if(!(msg->Flags & GROUP_FLAG_SEQ) || msg->SenderId == channelSender(mySenderId,0) ||
+       oldest == -1 || msg->Port == 0)
+        return;
+    delay = random() % CATCHUP_SPREAD_MS;
+    if(oldest > now - msg->Seconds * 1000LL)
+        delay += CATCHUP_SPREAD_MS;
+    pthread_mutex_lock(&answerLock);
+    for(i=0;i<MAX_PENDING_ANSWERS;i++)
     {
-        perror("Error while fetching stdin properties:");
-        exit(EXIT_FAILURE);
+        if(pendingAnswers[i].Due != 0 && pendingAnswers[i].Target == msg->SenderId)
+        {
+            slot = i;
+            break;
+        }
+        if(slot == -1 && pendingAnswers[i].Due == 0)
+            slot = i;
     }
-    old.c_lflag |= ICANON;
-    old.c_lflag |= ECHO;
-    if (tcsetattr(0, TCSADRAIN, &old) == -1)
+    if(slot != -1)
     {
-        perror("Error while setting stdin properties:");
-        exit(EXIT_FAILURE);
-    }    
+        catchupRequest *request = &pendingAnswers[slot];
+        request->Target = msg->SenderId;
+        memset(&request->Addr,0,sizeof(request->Addr));
+        request->Addr.sin_family = AF_INET;
+        request->Addr.sin_addr.s_addr = htonl(msg->Address);
+        request->Addr.sin_port = htons(msg->Port);
+        request->Seconds = msg->Seconds;
+        request->Due = now + delay;
+        pthread_cond_signal(&answerWake);
+    }
+    pthread_mutex_unlock(&answerLock);
 }
-/******************************************************************************
- 
- *                Network Utility functions.
- 
- ******************************************************************************/
 
+/*  Another member claimed target's request.  */
+void dropAnswer(unsigned int target)
+{
+    int i;
+
+    pthread_mutex_lock(&answerLock);
+    for(i=0;i<MAX_PENDING_ANSWERS;i++)
+    {
+        if(pendingAnswers[i].Due != 0 && pendingAnswers[i].Target == target)
+            pendingAnswers[i].Due = 0;
+    }
+    pthread_mutex_unlock(&answerLock);
+}
 
-void getBinaryAddress(char *hostname,struct in_addr *hostaddress)
+/*  Waits for the first request whose wait ends unclaimed and takes it.  */
+void nextAnswer(catchupRequest *request)
 {
-    struct hostent *hostaddr;
+    int i,first;
 
-    if ((hostaddr = gethostbyname(hostname)) == NULL)
+    pthread_mutex_lock(&answerLock);
+    pthread_cleanup_push(unlockAnswers,NULL);
+    while(1)
     {
-        perror("Error during hostname resolution");
-        exit(EXIT_FAILURE);
+        first = -1;
+        for(i=0;i<MAX_PENDING_ANSWERS;i++)
+        {
+            if(pendingAnswers[i].Due != 0 && (first == -1 || pendingAnswers[i].Due < pendingAnswers[first].Due))
+                first = i;
+        }
+        if(first == -1)
+            pthread_cond_wait(&answerWake,&answerLock);
+        else if(pendingAnswers[first].Due > currentMs())
+        {
+            struct timespec until;
+            until.tv_sec = pendingAnswers[first].Due / 1000;
+            until.tv_nsec = pendingAnswers[first].Due % 1000 * 1000000;
+            pthread_cond_timedwait(&answerWake,&answerLock,&until);
+        }
+        else
+            break;
     }
-    hostaddress->s_addr = *(int*)*(hostaddr->h_addr_list);
+    *request = pendingAnswers[first];
+    pendingAnswers[first].Due = 0;
+    pthread_cleanup_pop(1);
 }
 
+void unlockAnswers(void *unused)
+{
+    pthread_mutex_unlock(&answerLock);
+}
 
-int getMultiCastSock(struct in_addr multicastIp, int port)
+/*  Sends the joiner the history it asked for; the cleanup handlers close and free what is open.  */
+void answerCatchup(const catchupRequest *request)
 {
-    int socketd,value;
-    struct sockaddr_in bindAddr;
-    struct ip_mreq multiProp;
+    int fds[2] = {-1,-1};
+    char *history=NULL,*chunk;
+    size_t len;
 
-    if ((socketd = socket(AF_INET,SOCK_DGRAM,0)) == -1)
-    {	
-	perror("Error during multicast socket creation");
+    if((fds[0] = connectMember(&request->Addr)) == -1)
+        return;
+    if((chunk = (char*)malloc(CATCHUP_CHUNK + 2 + 0xFFFF + GROUP_TAG_LENGTH)) == NULL)
+    {
+        perror("Failed during memory allocation:");
         exit(EXIT_FAILURE);
     }
+    pthread_cleanup_push(closeDescriptors,fds);
+    pthread_cleanup_push(free,chunk);
+    historyCopy(&myHistory,currentMs() - request->Seconds * 1000LL,&history,&len);
+    pthread_cleanup_push(free,history);
+    streamHistory(fds[0],chunk,history,len);
+    pthread_cleanup_pop(1);
+    pthread_cleanup_pop(1);
+    pthread_cleanup_pop(1);
+}
+
+/*
+ * Sends the history as frames, CATCHUP_CHUNK bytes at a time and no faster
+ * than CATCHUP_RATE.
+ */
+void streamHistory(int sock,char *chunk,const char *history,size_t len)
+{
+    size_t pos=0,fill=0,sent=0;
+    long long start = currentMs();
+    unsigned long unsealed=0;
 
-    bindAddr.sin_family = AF_INET;
-    bindAddr.sin_port = htons(port);
-    bindAddr.sin_addr.s_addr = INADDR_ANY;
-    if(bind(socketd,(struct sockaddr*)&bindAddr,sizeof(bindAddr)) == -1)
+    while(pos < len)
     {
-	perror("Error during socket bind.");
-	exit(EXIT_FAILURE);
+        size_t frameLen = ((unsigned char)history[pos] << 8) | (unsigned char)history[pos + 1];
+        int sealedLen = frameLen;
+
+        memcpy(chunk + fill + 2,history + pos + 2,frameLen);
+        pos += 2 + frameLen;
+        /* Under its own sender id and sequence number it seals to the bytes that were sent. */
+        if(keyFile != NULL &&
+           (sealedLen = sealGroupPacket(&answerCrypto,chunk + fill + 2,frameLen,frameLen + GROUP_TAG_LENGTH)) == -1)
+        {
+            unsealed++;
+            continue;
+        }
+        chunk[fill] = (char)(sealedLen >> 8);
+        chunk[fill + 1] = (char)sealedLen;
+        fill += 2 + sealedLen;
+        if(fill >= CATCHUP_CHUNK)
+        {
+            if(sendChunk(sock,chunk,fill,&sent,start) == -1)
+                return;
+            fill = 0;
+        }
     }
+    if(fill > 0)
+        sendChunk(sock,chunk,fill,&sent,start);
+    if(unsealed > 0)
+        lineEditorPrint(&editor," %lu messages of history could not be sealed for a joiner.",unsealed);
+}
 
-    value = 1;
-    if(setsockopt(socketd,SOL_SOCKET,SO_REUSEADDR,(char*)&value,sizeof(value)) == -1)
+/*  Sends a chunk, then sleeps as long as the stream is ahead of CATCHUP_RATE.  */
+int sendChunk(int sock,const char *chunk,size_t len,size_t *sent,long long start)
+{
+    size_t done=0;
+    long long ahead;
+    ssize_t ret;
+
+    while(done < len)
     {
-        perror("\nError during setting SO_REUSEADDR socket options:");
-        exit(EXIT_FAILURE);
+        if((ret = send(sock,chunk + done,len - done,MSG_NOSIGNAL)) == -1)
+            return -1;
+        done += ret;
     }
+    *sent += len;
+    ahead = (long long)*sent * 1000 / CATCHUP_RATE - (currentMs() - start);
+    if(ahead > 0)
+        usleep(ahead * 1000);
+    return 0;
+}
 
-    multiProp.imr_multiaddr.s_addr = multicastIp.s_addr;
-    multiProp.imr_interface.s_addr = INADDR_ANY;
+/*  Returns a connected socket, or -1 if the joiner is not there within CATCHUP_WAIT_MS.  */
+int connectMember(const struct sockaddr_in *addr)
+{
+    int sock,err;
+    socklen_t len = sizeof(err);
+    struct pollfd pfd;
 
-    if(setsockopt(socketd,IPPROTO_IP,IP_ADD_MEMBERSHIP,(char*)&multiProp,sizeof(multiProp)) == -1)
+    if((sock = socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK,0)) == -1)
+        return -1;
+    if(connect(sock,(const struct sockaddr*)addr,sizeof(*addr)) == -1 && errno != EINPROGRESS)
     {
-        perror("\nError during setting IP_ADD_MEMBERSHIP socket options:");
-        exit(EXIT_FAILURE);
+        close(sock);
+        return -1;
     }
+    pfd.fd = sock;
+    pfd.events = POLLOUT;
+    if(poll(&pfd,1,CATCHUP_WAIT_MS) != 1 ||
+       getsockopt(sock,SOL_SOCKET,SO_ERROR,&err,&len) == -1 || err != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock,F_SETFL,fcntl(sock,F_GETFL) & ~O_NONBLOCK);
+    return sock;
+}
+
+/*  The address of this host that traffic to the group leaves from.  */
+int localAddress(struct in_addr *local)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int sock,ret=0;
 
-    value = 0;
-    if(setsockopt(socketd,IPPROTO_IP,IP_MULTICAST_LOOP,&value,sizeof(value)) == -1)
+    if((sock = socket(AF_INET,SOCK_DGRAM,0)) == -1)
+        return -1;
+    if(connect(sock,(struct sockaddr*)&multicastAddr,sizeof(multicastAddr)) == -1 ||
+       getsockname(sock,(struct sockaddr*)&addr,&len) == -1)
+        ret = -1;
+    else
+        *local = addr.sin_addr;
+    close(sock);
+    return ret;
+}
+
+/*
+ * Reads frames until the member sending them closes the stream or stalls
+ * for CATCHUP_WAIT_MS, and checks each like a datagram from the socket.
+ */
+void replayHistory(int sock)
+{
+    struct timeval timeout;
+    unsigned short length;
+    char *frame;
+    packet msg;
+    int len;
+
+    timeout.tv_sec = CATCHUP_WAIT_MS / 1000;
+    timeout.tv_usec = CATCHUP_WAIT_MS % 1000 * 1000;
+    setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+    if((frame = (char*)malloc(0xFFFF)) == NULL)
     {
-        perror("\nError during setting IP_MULTICAST_LOOP socket options:");
+        perror("Failed during memory allocation:");
         exit(EXIT_FAILURE);
     }
+    pthread_cleanup_push(free,frame);
+    while(recv(sock,&length,2,MSG_WAITALL) == 2)
+    {
+        len = ntohs(length);
+        if(len == 0 || recv(sock,frame,len,MSG_WAITALL) != len)
+            break;
+        if(keyFile != NULL && (len = openGroupPacket(&catchupCrypto,frame,len)) == -1)
+            continue;
+        if(decodePacket(&groupFormat,frame,len,&msg) == -1)
+            continue;
+        preparePacket(&msg);
+        deliverHistory(&msg);
+    }
+    pthread_cleanup_pop(1);
+}
 
-    return socketd;
+/*  deliverOnce() for messages from history, which may be older than the dedup window.  */
+void deliverHistory(packet *msg)
+{
+    pthread_mutex_lock(&deliverLock);
+    pthread_cleanup_push(unlockDeliver,NULL);
+    if(msg->Flags & GROUP_FLAG_SEQ && !dedupReplayed(&pathDedup,msg->SenderId,msg->Sequence))
+    {
+        replaying = 1;
+        deliverPacket(msg);
+        replaying = 0;
+    }
+    pthread_cleanup_pop(1);
+}
+
+/*  Pins the calling thread to cpu, if one was given, and applies -fifo.  */
+void placeThread(int cpu)
+{
+    if(cpu >= 0)
+        pinToCpu(cpu);
+    if(fifoPriority > 0)
+        setFifoPriority(fifoPriority);
 }
 
-void closeSocket(int sd,char *message)
+/*  localReceive(), polling the ring for busyPollUs first as spinRecv() does the socket.  */
+int receiveLocal(char *buffer)
 {
-    if(close(sd) == -1)
+    unsigned long long until = monotonicUs() + busyPollUs;
+    int len;
+
+    while(busyPollUs > 0 && monotonicUs() < until)
     {
-        perror(message);
+        if((len = localReceive(&myLocal,buffer,MAX_GROUP_PACKET_LENGTH,0)) > 0)
+            return len;
     }
+    return localReceive(&myLocal,buffer,MAX_GROUP_PACKET_LENGTH,LOCAL_WAIT_MS);
 }
 
-void leaveGroup(int sd)
+/*  Waits on pingWake are timed on the clock currentMs() reads.  */
+void initPings()
 {
-    struct ip_mreq multiProp;
-    multiProp.imr_multiaddr.s_addr = multicastAddr.sin_addr.s_addr;
-    multiProp.imr_interface.s_addr = INADDR_ANY;
-    
-    if(setsockopt(sd,IPPROTO_IP,IP_DROP_MEMBERSHIP,(char*)&multiProp,sizeof(multiProp)) == -1)
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    pthread_cond_init(&pingWake,&attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/*
+ * /ping N: sends N pings one at a time, the next as soon as the first pong
+ * to the last one is back, and shows the round trips to each member.
+ */
+void pingMembers(int sock,const char *arg)
+{
+    long count=DEFAULT_PINGS,i,answered=0;
+
+    while(*arg == ' ')
+        arg++;
+    if(*arg != 0 && (count = validateAndGetNumber(arg,1,MAX_PINGS)) == -1)
     {
-        perror("\nError while leaving the group");
+        lineEditorPrint(&editor," /ping takes 1 to %d pings.",MAX_PINGS);
+        return;
+    }
+    if(!useSequence)
+    {
+        lineEditorPrint(&editor," Pings need the sequence header, drop -legacy.");
+        return;
+    }
+    pthread_mutex_lock(&deliverLock);
+    freeLatency(&pingLatency);
+    initLatency(&pingLatency);
+    pthread_mutex_unlock(&deliverLock);
+    for(i=0;i<count && answered == i;i++)
+        answered += pingOnce(sock);
+    if(answered < count)
+        lineEditorPrint(&editor," No pong within %d ms, stopped after %ld pings.",PING_TIMEOUT_MS,i);
+    if(answered > 0)
+        showLatency(&pingLatency);
+}
+
+/*  Returns 1 if a pong came back within PING_TIMEOUT_MS, 0 if none did.  */
+int pingOnce(int sock)
+{
+    long long deadline = currentMs() + PING_TIMEOUT_MS;
+    unsigned long long stamp = monotonicUs();
+    struct timespec until;
+    int answered;
+
+    until.tv_sec = deadline / 1000;
+    until.tv_nsec = deadline % 1000 * 1000000;
+    pthread_mutex_lock(&pingLock);
+    pingStamp = stamp;
+    pingAnswered = 0;
+    pthread_mutex_unlock(&pingLock);
+    sendPing(sock,stamp);
+    pthread_mutex_lock(&pingLock);
+    pthread_cleanup_push(unlockPings,NULL);
+    while(!pingAnswered && pthread_cond_timedwait(&pingWake,&pingLock,&until) != ETIMEDOUT)
+        ;
+    answered = pingAnswered;
+    pthread_cleanup_pop(1);
+    return answered;
+}
+
+/*  Runs under deliverLock; the pong goes out from the receiving thread.  */
+void answerPing(const packet *ping)
+{
+    if(!(ping->Flags & GROUP_FLAG_SEQ) || ping->SenderId == channelSender(mySenderId,0))
+        return;
+    sendPong(groupSock,ping->SenderId,ping->SendTime);
+}
+
+/*  Runs under deliverLock, which guards pingLatency.  */
+void notePong(const packet *pong)
+{
+    if(pong->Target != channelSender(mySenderId,0))
+        return;
+    latencyRecord(&pingLatency,pong->SenderId,pong->Name,pong->NameLength,pong->SendTime,monotonicUs());
+    pthread_mutex_lock(&pingLock);
+    if(pong->SendTime == pingStamp)
+    {
+        pingAnswered = 1;
+        pthread_cond_signal(&pingWake);
+    }
+    pthread_mutex_unlock(&pingLock);
+}
+
+void unlockPings(void *unused)
+{
+    pthread_mutex_unlock(&pingLock);
+}
+
+void closeDescriptors(void *fds)
+{
+    int i;
+
+    for(i=0;i<2;i++)
+    {
+        if(((int*)fds)[i] != -1)
+            close(((int*)fds)[i]);
+    }
+}
+
+/******************************************************************************
+ 
+ *                Display functions.
+ 
+ ******************************************************************************/
+
+void displayMsg(packet msg)
+{    
+    size_t len = msg.TextLength;
+    char *marked = markKeywords(msg.Text,msg.TextLength,&len);
+    const char *text = marked != NULL ? marked : msg.Text;
+
+    if(msg.Flags & GROUP_FLAG_CHANNEL)
+        lineEditorPrint(&editor,"[%u] %.*s> %.*s",msg.Channel,(int)msg.NameLength,msg.Name,
+                        (int)len,text);
+    else
+        lineEditorPrint(&editor,"%.*s> %.*s",(int)msg.NameLength,msg.Name,
+                        (int)len,text);
+    free(marked);
+}
+
+/*  Returns the text with its keywords highlighted, or NULL if it has none.  */
+char* markKeywords(const char *text,size_t len,size_t *markedLen)
+{
+    keywordSpan spans[MAX_HIGHLIGHTS];
+    size_t count,i,pos=0,out=0;
+    char *marked;
+
+    if(myMatcher == NULL || (count = findKeywords(myMatcher,text,len,spans,MAX_HIGHLIGHTS)) == 0)
+        return NULL;
+    if((marked = (char*)malloc(len + count * (sizeof(HIGHLIGHT_ON) + sizeof(HIGHLIGHT_OFF)))) == NULL)
+    {
+        perror("Failed during memory allocation:");
         exit(EXIT_FAILURE);
     }
+    for(i=0;i<count;i++)
+    {
+        memcpy(marked + out,text + pos,spans[i].Start - pos);
+        out += spans[i].Start - pos;
+        memcpy(marked + out,HIGHLIGHT_ON,sizeof(HIGHLIGHT_ON) - 1);
+        out += sizeof(HIGHLIGHT_ON) - 1;
+        memcpy(marked + out,text + spans[i].Start,spans[i].End - spans[i].Start);
+        out += spans[i].End - spans[i].Start;
+        memcpy(marked + out,HIGHLIGHT_OFF,sizeof(HIGHLIGHT_OFF) - 1);
+        out += sizeof(HIGHLIGHT_OFF) - 1;
+        pos = spans[i].End;
+    }
+    memcpy(marked + out,text + pos,len - pos);
+    *markedLen = out + len - pos;
+    return marked;
+}
+
+void displayBye(packet msg)
+{
+    lineEditorPrint(&editor,"%.*s> Bye\n\n    %.*s left the group\n",
+                    (int)msg.NameLength,msg.Name,(int)msg.NameLength,msg.Name);
 }
 
 /*******************************************************************************
@@ -800,46 +1599,69 @@ void leaveGroup(int sd)
 
 void processArgs(int argc, char **argv, char **multiIp, int *port)
 {
-    char *portStr=NULL;
-    extractArgs(argc,argv,multiIp,&portStr);
+    char *portStr=NULL,*shardStr=NULL,*fecStr=NULL,*channelStr=NULL,*historyStr=NULL;
+    char *busyPollStr=NULL,*cpuStr=NULL,*fifoStr=NULL;
+    int legacy=0,noLocal=0;
+    const argSpec specs[] =
+    {
+        {"-port",ARG_VALUE,&portStr,"Port missing."},
+        {"-mcip",ARG_VALUE,multiIp,"Multicast IP address missing."},
+        {"-shards",ARG_VALUE,&shardStr,"Shard count missing."},
+        {"-legacy",ARG_FLAG,&legacy,NULL},
+        {"-screen",ARG_FLAG,&useScreen,NULL},
+        {"-timestamps",ARG_FLAG,&useTimestamps,NULL},
+        {"-nolocal",ARG_FLAG,&noLocal,NULL},
+        {"-channels",ARG_VALUE,&channelStr,"Address count missing."},
+        {"-highlight",ARG_VALUE,&keywordFile,"Keyword file missing."},
+        {"-history",ARG_VALUE,&historyStr,"Minutes of history missing."},
+        {"-busypoll",ARG_VALUE,&busyPollStr,"Busy poll time missing."},
+        {"-cpus",ARG_VALUE,&cpuStr,"CPUs missing."},
+        {"-fifo",ARG_VALUE,&fifoStr,"SCHED_FIFO priority missing."},
+        {"-key",ARG_VALUE,&keyFile,"Key file missing."},
+        {"-cipher",ARG_VALUE,&cipherName,"Cipher name missing."},
+        {"-fec",ARG_VALUE,&fecStr,"FEC scheme missing."},
+        {NULL}
+    };
+
+    extractArgs(argc,argv,specs,USAGE);
     validateArgs(*multiIp,portStr,port);
-}
-
-void extractArgs(int argc, char **argv, char **multiIp, char **port)
-{
-    int i;
-    for (i=1;i<argc;i++)
-    {
-	char *argument = argv[i];
-        if(!strcmp(argument,"-port"))
-	{
-	    if(++i < argc)
-	    {
-	        *port = argv[i];
-	    }
-	    else
-	    {
-	        invalidArgs("Port missing.");
-		exit(EXIT_FAILURE);
-	    }
-	}
-	else if(!strcmp(argument,"-mcip"))
-	{
-	    if(++i < argc)
-	    {
-		 *multiIp = argv[i];
-            }
-	    else
-	    {
-		 invalidArgs("Multicast IP address missing.");
-		 exit(EXIT_FAILURE);
-            }
-	}
-        else
+    validateShards(shardStr);
+    validateChannels(channelStr);
+    validateHistory(historyStr);
+    validateLowLatency(busyPollStr,cpuStr,fifoStr);
+    useSequence = !legacy;
+    useLocal = !noLocal;
+    if(fecStr != NULL)
+    {
+        if(parseFec(fecStr,&myFec) == -1)
+        {
+            invalidArgs("Invalid FEC scheme, use xor:K or rs:K,M.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        if(legacy)
+        {
+            invalidArgs("FEC needs the sequence header, drop -legacy.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(cipherName != NULL && keyFile == NULL)
+    {
+        invalidArgs("-cipher needs -key.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(keyFile != NULL)
+    {
+        groupCipher cipher;
+        if(legacy)
         {
-	   invalidArgs("Invalid arguments");
-	   exit(EXIT_FAILURE);
-	}   
+            invalidArgs("Encrypted groups need the sequence header, drop -legacy.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        if(parseCipher(cipherName,&cipher) == -1)
+        {
+            invalidArgs("Unknown cipher, use aes-gcm or chacha20.",USAGE);
+            exit(EXIT_FAILURE);
+        }
     }
 }
 
@@ -848,52 +1670,98 @@ void validateArgs(const char *multiIp,const char *strPort,int *port)
 {
     if(multiIp == NULL || multiIp[0] == 0)
     {
-        invalidArgs("Multicast IP not specified.");
+        invalidArgs("Multicast IP not specified.",USAGE);
         exit(EXIT_FAILURE);
     }
     if(strPort == NULL || strPort[0] == 0)
     {
-        invalidArgs("No port specified.");
+        invalidArgs("No port specified.",USAGE);
         exit(EXIT_FAILURE);
     }
     if(validateHost(multiIp) == -1)
     {
-        invalidArgs("Invalid Peer hostname.");
+        invalidArgs("Invalid Peer hostname.",USAGE);
         exit(EXIT_FAILURE);
     }
     if((*port = validateAndGetPort(strPort)) == -1)
     {
-        invalidArgs("Invalid Peer port.");
+        invalidArgs("Invalid Peer port.",USAGE);
         exit(EXIT_FAILURE);
     }
 }
 
-int validateAndGetPort(const char *portStr)
+void validateShards(const char *strShards)
 {
-    int i,port;
-    for(i=0;portStr[i] != '\0';i++)
+    char *end;
+    long count;
+
+    if(strShards == NULL)
+        return;
+    count = strtol(strShards,&end,10);
+    if(*end != 0 || count < 1 || count > MAX_SHARDS)
     {
-        if(isdigit(portStr[i]) == 0)
-            return -1;
+        invalidArgs("Invalid shard count.",USAGE);
+        exit(EXIT_FAILURE);
     }
-    port = atoi(portStr);
-    if(port >= MINPORT && port <= MAXPORT)
-	return port;
-    return -1;
+    shardCount = (int)count;
 }
 
-int validateHost(const char *hostStr)
+void validateChannels(const char *strChannels)
 {
-    if(hostStr == NULL)
-        return -1;
-    if(hostStr[0] == 0)
-	return -1;
-    return 0;
+    char *end;
+    long count;
+
+    if(strChannels == NULL)
+        return;
+    count = strtol(strChannels,&end,10);
+    if(*end != 0 || count < 1 || count > MAX_CHANNEL_ADDRESSES)
+    {
+        invalidArgs("Invalid channel address count.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    channelCount = (int)count;
 }
 
-void invalidArgs(const char*message)
+/*  History is kept for HISTORY_KEEP_MS; 0 asks for none.  */
+void validateHistory(const char *strMinutes)
 {
-    fprintf(stderr,"\n%s",message);
-    fprintf(stderr,"\n\nCommand should adhere to the following format:");
-    fprintf(stderr,"\n\n     ./groupChat -mcip x.x.x.x -port XX\n\n");
+    long minutes;
+
+    if(strMinutes == NULL)
+        return;
+    if((minutes = validateAndGetNumber(strMinutes,0,HISTORY_KEEP_MS / 60000)) == -1)
+    {
+        invalidArgs("Invalid minutes of history.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    historyMinutes = (int)minutes;
+}
+
+void validateLowLatency(const char *strBusyPoll,const char *strCpus,const char *strFifo)
+{
+    char extra;
+
+    if(strBusyPoll != NULL && (busyPollUs = validateAndGetNumber(strBusyPoll,1,MAX_BUSY_POLL_US)) == -1)
+    {
+        invalidArgs("Invalid busy poll time, 1 to 10000 us.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    /* Shards read with recvmmsg() on threads of their own. */
+    if(busyPollUs > 0 && shardCount > 1)
+    {
+        invalidArgs("Busy polling reads one socket, drop -shards.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(strCpus != NULL &&
+       (sscanf(strCpus,"%d,%d%c",&recvCpu,&sendCpu,&extra) != 2 || recvCpu < 0 || sendCpu < 0 ||
+        recvCpu >= onlineCpuCount() || sendCpu >= onlineCpuCount()))
+    {
+        invalidArgs("Invalid CPUs, use R,S.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(strFifo != NULL && (fifoPriority = validateAndGetNumber(strFifo,1,99)) == -1)
+    {
+        invalidArgs("Invalid SCHED_FIFO priority, 1 to 99.",USAGE);
+        exit(EXIT_FAILURE);
+    }
 }
@@ -0,0 +1,73 @@
+/*******************************************************************************
+ *
+ * Authenticated encryption of group packets with a pre-shared key.
+ *
+ * 1. A sealed packet keeps the opcode byte and the SenderId/Sequence header
+ *    in the clear, as associated data, so receive shards can still filter
+ *    on them. The rest of the packet is encrypted and a 16 byte tag is
+ *    appended-
+ *      Opcode|SEQ|ENC(1) SenderId(4) Sequence(4) Ciphertext Tag(16)
+ *
+ * 2. The nonce is SenderId, Sequence and four zero bytes. A sender must pick
+ *    a new random SenderId before its sequence number wraps.
+ *
+ * 3. The group key is derived with HKDF-SHA256 from the key file and the
+ *    group address and port, so one key file can serve several groups.
+ *    Every member of a group must use the same cipher.
+ *
+ * 4. A groupKey is shared; each thread that seals or opens packets keeps its
+ *    own groupCrypto, which holds the expanded key for reuse across
+ *    packets and batches.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_GROUP_CRYPTO_H
+#define GEEKCHAT_GROUP_CRYPTO_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define GROUP_KEY_LENGTH 32
+#define GROUP_TAG_LENGTH 16
+#define GROUP_NONCE_LENGTH 12
+#define GROUP_SEALED_HEADER 9
+
+struct mmsghdr;
+
+typedef enum {CIPHER_AES_GCM,CIPHER_CHACHA20_POLY1305} groupCipher;
+
+typedef struct groupKey
+{
+    groupCipher Cipher;
+    unsigned char Key[GROUP_KEY_LENGTH];
+}groupKey;
+
+typedef struct groupCrypto
+{
+    const groupKey *Key;
+    void *Seal;     /* EVP_CIPHER_CTX, kept out of this header. */
+    void *Open;
+}groupCrypto;
+
+void loadGroupKey(groupKey*,const char*,groupCipher,struct in_addr,int);
+int parseCipher(const char*,groupCipher*);
+
+void initGroupCrypto(groupCrypto*,const groupKey*);
+void freeGroupCrypto(groupCrypto*);
+
+/*
+ * Seals an encoded, sequenced packet in place. capacity must leave room for
+ * the tag. Returns the sealed length, or -1.
+ */
+int sealGroupPacket(groupCrypto*,char*,size_t,size_t);
+
+/*  Opens a sealed packet in place. Returns the plain length, or -1.  */
+int openGroupPacket(groupCrypto*,char*,size_t);
+
+/*
+ * Opens a recvmmsg() batch in place; msg_len becomes the plain length, or
+ * 0 for packets that fail authentication.
+ */
+void openGroupBatch(groupCrypto*,struct mmsghdr*,int);
+
+#endif
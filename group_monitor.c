@@ -0,0 +1,202 @@
+/*******************************************************************************
+ * 
+ * Passive monitor for group chats, using a PACKET_MMAP ring.
+ * 
+ * 1. The monitor can be started as follows-
+ * ./groupmonitor -groups 224.1.1.1:3000,224.1.1.2:3000 [-if eth0] [-key FILE [-cipher NAME]]
+ * 
+ * 2. Every message sent to one of the groups is printed with the group it
+ *    was sent to. The monitor never sends and needs CAP_NET_RAW.
+ * 
+ * 3. With -key every group is treated as encrypted with that key file.
+ * 
+ * 4. To stop press Ctrl+C; packet and drop counts are printed on exit.
+ * 
+ * 5. Messages that carry a send time are timed from the sender's clock to
+ *    the tap; kill -USR1 prints the latency histograms, and they are
+ *    printed with the counts on exit.
+ * 
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include "geekchat.h"
+
+#define USAGE "./groupmonitor -groups x.x.x.x:XX[,x.x.x.x:XX...] [-if name] [-key FILE [-cipher NAME]]"
+
+volatile sig_atomic_t stopRequested = 0;
+volatile sig_atomic_t reportRequested = 0;
+latencyTable tapLatency;
+groupKey groupKeys[MAX_RING_GROUPS];
+groupCrypto groupCryptos[MAX_RING_GROUPS];
+
+void monitorGroups(packetRing*);
+void displayPacket(int,packet*,void*);
+void stopMonitor(int);
+void requestReport(int);
+
+/* Argument validation functions. */
+void processArgs(int,char**,ringGroup*,int*,char**);
+void setupKeys(ringGroup*,int,const char*,const char*);
+void parseGroups(char*,ringGroup*,int*);
+
+
+int main(int argc, char **argv)
+{
+    ringGroup groups[MAX_RING_GROUPS];
+    int groupCount=0;
+    char *ifname=NULL;
+    packetRing ring;
+
+    processArgs(argc,argv,groups,&groupCount,&ifname);
+    openPacketRing(&ring,ifname,groups,groupCount);
+    initLatency(&tapLatency);
+    signal(SIGINT,stopMonitor);
+    signal(SIGUSR1,requestReport);
+    monitorGroups(&ring);
+    fprintf(stderr,"\n%lu packets, %lu malformed, %lu duplicates, %u dropped by the kernel\n",
+            ring.Packets,ring.Malformed,ring.Duplicates,ringDrops(&ring));
+    if(tapLatency.All.Total > 0)
+        latencyReport(&tapLatency,stderr);
+    freeLatency(&tapLatency);
+    closePacketRing(&ring);
+    return 0;
+}
+
+void monitorGroups(packetRing *ring)
+{
+    while(!stopRequested)
+    {
+        if(readRingBlock(ring,displayPacket,ring,RING_BLOCK_TIMEOUT_MS * 4) == -1)
+            break;
+        /* One flush per block rather than per message. */
+        fflush(stdout);
+        if(reportRequested)
+        {
+            reportRequested = 0;
+            latencyReport(&tapLatency,stderr);
+        }
+    }
+}
+
+/*  Text is sanitized in place, inside the ring.  */
+void displayPacket(int group,packet *msg,void *context)
+{
+    packetRing *ring = (packetRing*)context;
+
+    msg->NameLength = sanitizeText(msg->Name,msg->NameLength);
+    msg->TextLength = sanitizeText(msg->Text,msg->TextLength);
+    if(msg->Opcode == GROUP_OP_TEXT)
+    {
+        if(msg->Flags & GROUP_FLAG_TIME)
+            latencyRecord(&tapLatency,msg->SenderId,msg->Name,msg->NameLength,msg->SendTime,wallClockUs());
+        printf("[%s:%d] %.*s> %.*s\n",inet_ntoa(ring->Groups[group].Group),ring->Groups[group].Port,
+               (int)msg->NameLength,msg->Name,(int)msg->TextLength,msg->Text);
+    }
+    else if(msg->Opcode == GROUP_OP_BYE)
+    {
+        printf("[%s:%d] %.*s left the group\n",inet_ntoa(ring->Groups[group].Group),
+               ring->Groups[group].Port,(int)msg->NameLength,msg->Name);
+    }
+}
+
+/*  Signal Handler for SIGINT */
+void stopMonitor(int signal_val)
+{
+    stopRequested = 1;
+    signal(SIGINT,SIG_DFL);
+}
+
+/*  Signal Handler for SIGUSR1, the report is printed between blocks.  */
+void requestReport(int signal_val)
+{
+    reportRequested = 1;
+}
+
+/*******************************************************************************
+
+ *      Arguments extraction and validation functions.
+
+ ******************************************************************************/
+
+void processArgs(int argc, char **argv, ringGroup *groups, int *groupCount, char **ifname)
+{
+    char *groupStr=NULL,*keyFile=NULL,*cipherName=NULL;
+    const argSpec specs[] =
+    {
+        {"-groups",ARG_VALUE,&groupStr,"Group list missing."},
+        {"-if",ARG_VALUE,ifname,"Interface name missing."},
+        {"-key",ARG_VALUE,&keyFile,"Key file missing."},
+        {"-cipher",ARG_VALUE,&cipherName,"Cipher name missing."},
+        {NULL}
+    };
+
+    extractArgs(argc,argv,specs,USAGE);
+    if(groupStr == NULL || groupStr[0] == 0)
+    {
+        invalidArgs("No groups specified.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    parseGroups(groupStr,groups,groupCount);
+    setupKeys(groups,*groupCount,keyFile,cipherName);
+}
+
+/*  Keys are derived per group, from its address and port.  */
+void setupKeys(ringGroup *groups,int groupCount,const char *keyFile,const char *cipherName)
+{
+    groupCipher cipher;
+    int i;
+
+    if(parseCipher(cipherName,&cipher) == -1)
+    {
+        invalidArgs("Unknown cipher, use aes-gcm or chacha20.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(keyFile == NULL)
+        return;
+    for(i=0;i<groupCount;i++)
+    {
+        loadGroupKey(&groupKeys[i],keyFile,cipher,groups[i].Group,groups[i].Port);
+        initGroupCrypto(&groupCryptos[i],&groupKeys[i]);
+        groups[i].Crypto = &groupCryptos[i];
+    }
+}
+
+/*  Splits "ip:port,ip:port" in place.  */
+void parseGroups(char *list,ringGroup *groups,int *groupCount)
+{
+    char *entry,*save=NULL;
+
+    for(entry = strtok_r(list,",",&save);entry != NULL;entry = strtok_r(NULL,",",&save))
+    {
+        char *colon = strchr(entry,':');
+
+        if(*groupCount == MAX_RING_GROUPS)
+        {
+            invalidArgs("Too many groups.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        if(colon == NULL)
+        {
+            invalidArgs("Group without port.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        *colon = 0;
+        if(validateHost(entry) == -1)
+        {
+            invalidArgs("Invalid multicast IP.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        getBinaryAddress(entry,&groups[*groupCount].Group);
+        if((groups[*groupCount].Port = validateAndGetPort(colon + 1)) == -1)
+        {
+            invalidArgs("Invalid group port.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        groups[*groupCount].MemberSock = -1;
+        groups[*groupCount].Crypto = NULL;
+        (*groupCount)++;
+    }
+}
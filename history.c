@@ -0,0 +1,146 @@
+/*******************************************************************************
+ *
+ * Recent messages of a group, for members that join late.
+ *
+ * 1. Each message is one allocation, referenced from a fixed ring of
+ *    pointers; receive shards allocate per message as well.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "history.h"
+#include "protocol.h"
+
+static void dropOldest(groupHistory*);
+static int isMessage(const char*,size_t);
+
+
+void initHistory(groupHistory *history)
+{
+    memset(history,0,sizeof(*history));
+    if((history->Entries = (historyEntry**)calloc(HISTORY_MESSAGES,sizeof(historyEntry*))) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    initDedup(&history->Seen);
+    pthread_mutex_init(&history->Lock,NULL);
+}
+
+void freeHistory(groupHistory *history)
+{
+    while(history->Count > 0)
+        dropOldest(history);
+    free(history->Entries);
+    pthread_mutex_destroy(&history->Lock);
+}
+
+void historyAdd(groupHistory *history,const char *datagram,size_t len,long long nowMs)
+{
+    historyEntry *entry;
+
+    if(!isMessage(datagram,len))
+        return;
+    pthread_mutex_lock(&history->Lock);
+    if(dedupPacket(&history->Seen,datagram,len))
+    {
+        pthread_mutex_unlock(&history->Lock);
+        return;
+    }
+    while(history->Count > 0 &&
+          (history->Count == HISTORY_MESSAGES || history->Bytes + len > HISTORY_BYTES ||
+           history->Entries[history->First]->Time < nowMs - HISTORY_KEEP_MS))
+        dropOldest(history);
+    if((entry = (historyEntry*)malloc(sizeof(historyEntry) + len)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    entry->Time = nowMs;
+    entry->Length = len;
+    memcpy(entry->Data,datagram,len);
+    history->Entries[(history->First + history->Count++) % HISTORY_MESSAGES] = entry;
+    history->Bytes += len;
+    pthread_mutex_unlock(&history->Lock);
+}
+
+long long historyOldest(groupHistory *history)
+{
+    long long oldest = -1;
+
+    pthread_mutex_lock(&history->Lock);
+    if(history->Count > 0)
+        oldest = history->Entries[history->First]->Time;
+    pthread_mutex_unlock(&history->Lock);
+    return oldest;
+}
+
+size_t historyCopy(groupHistory *history,long long since,char **buffer,size_t *len)
+{
+    size_t i,start,size=0,count;
+    char *out;
+
+    pthread_mutex_lock(&history->Lock);
+    /* Entries are kept in the order they came, so the wanted ones are the last. */
+    for(start=history->Count;start > 0;start--)
+    {
+        historyEntry *entry = history->Entries[(history->First + start - 1) % HISTORY_MESSAGES];
+        if(entry->Time < since)
+            break;
+        size += 2 + entry->Length;
+    }
+    count = history->Count - start;
+    if((out = (char*)malloc(size ? size : 1)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    *buffer = out;
+    *len = size;
+    for(i=start;i<history->Count;i++)
+    {
+        historyEntry *entry = history->Entries[(history->First + i) % HISTORY_MESSAGES];
+        unsigned short length = htons((unsigned short)entry->Length);
+        memcpy(out,&length,2);
+        memcpy(out + 2,entry->Data,entry->Length);
+        out += 2 + entry->Length;
+    }
+    pthread_mutex_unlock(&history->Lock);
+    return count;
+}
+
+int catchupForged(const packet *msg,const struct sockaddr_in *from)
+{
+    return msg->Opcode == GROUP_OP_CATCHUP && msg->Address != ntohl(from->sin_addr.s_addr);
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static void dropOldest(groupHistory *history)
+{
+    historyEntry *entry = history->Entries[history->First];
+
+    history->Bytes -= entry->Length;
+    free(entry);
+    history->Entries[history->First] = NULL;
+    history->First = (history->First + 1) % HISTORY_MESSAGES;
+    history->Count--;
+}
+
+/*  Messages and the fragments they travel in; no control packets.  */
+static int isMessage(const char *datagram,size_t len)
+{
+    unsigned int opcode;
+
+    if(len == 0 || len > HISTORY_MAX_DATAGRAM)
+        return 0;
+    opcode = (unsigned char)datagram[0] & GROUP_OPCODE_MASK;
+    return opcode == GROUP_OP_TEXT || opcode == GROUP_OP_BYE || opcode == GROUP_OP_FRAG;
+}
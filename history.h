@@ -0,0 +1,95 @@
+/*******************************************************************************
+ *
+ * Recent messages of a group, for members that join late.
+ *
+ * 1. Members keep the messages they saw, the datagrams as they were after
+ *    opening and before decoding, with the time they came. Control
+ *    packets are left out, and so are datagrams over HISTORY_MAX_DATAGRAM,
+ *    which no UDP datagram is. The oldest go once HISTORY_MESSAGES or
+ *    HISTORY_BYTES are held, or once they are older than HISTORY_KEEP_MS.
+ *
+ * 2. A member that joins sends OP_CATCHUP with the TCP port it listens on.
+ *    Members with history wait a random moment, shorter for those whose
+ *    history goes back the whole time asked for, and the first whose wait
+ *    ends sends OP_CLAIM; the others drop the request when they see it.
+ *    Only the claimant connects, and it sends the history at no more than
+ *    CATCHUP_RATE bytes a second, so a join does not set the group off.
+ *    Requests whose address is not the one they came from are dropped on
+ *    receipt (catchupForged()); otherwise any host could make the members
+ *    stream history at a third.
+ *
+ * 3. The stream is made of frames, Length(2) Datagram, one per message.
+ *    In encrypted groups each datagram is sealed again under its original
+ *    sender id and sequence number, which gives back the bytes that went
+ *    on the wire; the joiner checks them like any other datagram and drops
+ *    the ones it has already seen live.
+ *
+ * 4. Thread safe.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_HISTORY_H
+#define GEEKCHAT_HISTORY_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "dedup.h"
+#include "protocol.h"
+#include "group_crypto.h"
+
+#define HISTORY_MESSAGES 65536
+#define HISTORY_BYTES (8 * 1024 * 1024)
+#define HISTORY_KEEP_MS (60 * 60 * 1000LL)
+/* Sealed again it still fits a frame's Length(2). */
+#define HISTORY_MAX_DATAGRAM (0xFFFF - GROUP_TAG_LENGTH)
+
+#define CATCHUP_RATE (4 * 1024 * 1024)
+#define CATCHUP_CHUNK (32 * 1024)
+#define CATCHUP_WAIT_MS 1000
+#define CATCHUP_SPREAD_MS 100
+
+typedef struct historyEntry
+{
+    long long Time;             /* Ms, on the monotonic clock. */
+    size_t Length;
+    char Data[];
+}historyEntry;
+
+/*  An OP_CATCHUP request a member may answer.  */
+typedef struct catchupRequest
+{
+    unsigned int Target;        /* The joiner's sender id. */
+    struct sockaddr_in Addr;    /* Where it listens. */
+    unsigned int Seconds;
+    long long Due;              /* Ms when the wait ends; 0 if none. */
+}catchupRequest;
+
+typedef struct groupHistory
+{
+    historyEntry **Entries;     /* Ring of HISTORY_MESSAGES. */
+    size_t First;
+    size_t Count;
+    size_t Bytes;
+    dedupFilter Seen;           /* Copies of one message, from several paths. */
+    pthread_mutex_t Lock;
+}groupHistory;
+
+void initHistory(groupHistory*);
+void freeHistory(groupHistory*);
+
+/*  Keeps a datagram, opened, that came at the time given in ms.  */
+void historyAdd(groupHistory*,const char*,size_t,long long);
+
+/*  Time of the oldest message kept, or -1 if there is none.  */
+long long historyOldest(groupHistory*);
+
+/*
+ * Copies the messages that came at or after since, as frames, into a
+ * buffer the caller frees. Returns the number of messages.
+ */
+size_t historyCopy(groupHistory*,long long,char**,size_t*);
+
+/*  Whether msg is an OP_CATCHUP naming an address other than from, its source.  */
+int catchupForged(const packet*,const struct sockaddr_in*);
+
+#endif
@@ -0,0 +1,788 @@
+/*******************************************************************************
+ *
+ * Chat hub: a session server relaying text between many peers.
+ *
+ * 1. Sessions are only freed at the end of an epoll batch, so a session
+ *    that fails while another one is being handled is just marked Dead and
+ *    skipped by the rest of the batch.
+ *
+ * 2. Inboxes are Treiber stacks: pushing is a compare and swap on the head
+ *    and the owner takes the whole stack with one exchange, then reverses
+ *    it to get the messages in the order they were pushed. As nodes are
+ *    never popped one at a time there is no ABA problem.
+ *
+ * 3. Memory counts and the counters in reports are owned by their reactor,
+ *    which alone writes them, with relaxed atomic stores; the budget check
+ *    and hubReport() sum all reactors' with relaxed loads and no lock, so
+ *    they may be off by what the others are doing at that moment.
+ *
+ * ****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "hub.h"
+#include "netutil.h"
+#include "affinity.h"
+#include "session_mux.h"
+
+static void* reactorLoop(void*);
+static void acceptSessions(hubReactor*);
+static void readSession(hubReactor*,hubSession*);
+static void handlePacket(hubReactor*,hubSession*,packet*);
+static void relayText(hubReactor*,hubSession*,const char*,size_t,const packet*);
+static void broadcast(hubReactor*,hubSession*,packet*,int);
+static void deliverMessage(hubReactor*,hubMessage*,hubSession*);
+static void pushInbox(hubReactor*,hubNode*);
+static void drainInbox(hubReactor*,int);
+static void releaseMessage(hubMessage*);
+static void sendPacket(hubReactor*,hubSession*,packet*);
+static void queueFrame(hubReactor*,hubSession*,const char*,size_t);
+static void flushDirty(hubReactor*);
+static void writeSession(hubReactor*,hubSession*);
+static void closeSession(hubReactor*,hubSession*);
+static void reapSessions(hubReactor*);
+static void shutdownReactor(hubReactor*);
+static void wakeReactor(hubReactor*);
+static void account(hubReactor*,hubSession*);
+static int overBudget(hubServer*,size_t);
+static long residentKb();
+
+
+void startHub(hubServer *server,int port,int count,const char *name,size_t budget)
+{
+    struct epoll_event ev;
+    int i,res;
+
+    memset(server,0,sizeof(*server));
+    server->Count = count;
+    server->Name = name;
+    server->Budget = budget;
+    localCaps(&server->Caps,CAP_TIMESTAMPS);
+    for(i=0;i<count;i++)
+    {
+        hubReactor *r = &server->Reactors[i];
+        int flags;
+
+        r->Server = server;
+        r->Index = i;
+        r->Listener = passiveSock(port,1);
+        if((flags = fcntl(r->Listener,F_GETFL)) == -1 || fcntl(r->Listener,F_SETFL,flags | O_NONBLOCK) == -1)
+        {
+            perror("Error while setting socket non-blocking");
+            exit(EXIT_FAILURE);
+        }
+        if((r->Epoll = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+           (r->WakeFd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        {
+            perror("Error while creating reactor");
+            exit(EXIT_FAILURE);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &r->Listener;
+        if(epoll_ctl(r->Epoll,EPOLL_CTL_ADD,r->Listener,&ev) == -1)
+        {
+            perror("Error while adding listener to epoll");
+            exit(EXIT_FAILURE);
+        }
+        ev.data.ptr = &r->WakeFd;
+        if(epoll_ctl(r->Epoll,EPOLL_CTL_ADD,r->WakeFd,&ev) == -1)
+        {
+            perror("Error while adding eventfd to epoll");
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* Only once every inbox exists, since any reactor may push to any. */
+    for(i=0;i<count;i++)
+    {
+        if((res = pthread_create(&server->Reactors[i].Thread,NULL,reactorLoop,&server->Reactors[i])) != 0)
+        {
+            fprintf(stderr,"\nThread creation failed : %s",strerror(res));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void joinHub(hubServer *server)
+{
+    int i;
+
+    for(i=0;i<server->Count;i++)
+        pthread_join(server->Reactors[i].Thread,NULL);
+    /* Messages pushed after their reactor stopped. */
+    for(i=0;i<server->Count;i++)
+    {
+        drainInbox(&server->Reactors[i],0);
+        closeSocket(server->Reactors[i].WakeFd,"Error while closing eventfd:");
+    }
+}
+
+void stopHub(hubServer *server)
+{
+    int i;
+
+    __atomic_store_n(&server->Stop,1,__ATOMIC_RELAXED);
+    for(i=0;i<server->Count;i++)
+        wakeReactor(&server->Reactors[i]);
+}
+
+void hubReport(hubServer *server,FILE *out)
+{
+    unsigned long accepted=0,open=0,shed=0,refused=0;
+    unsigned long long received=0,sent=0;
+    size_t held=0;
+    long rss;
+    int i;
+
+    for(i=0;i<server->Count;i++)
+    {
+        hubReactor *r = &server->Reactors[i];
+        unsigned long rAccepted = __atomic_load_n(&r->Accepted,__ATOMIC_RELAXED);
+        unsigned long long rReceived = __atomic_load_n(&r->Received,__ATOMIC_RELAXED);
+        unsigned long long rSent = __atomic_load_n(&r->Sent,__ATOMIC_RELAXED);
+
+        fprintf(out,"reactor %2d: %8lu sessions %12llu messages in %12llu frames out\n",
+                i,rAccepted,rReceived,rSent);
+        accepted += rAccepted;
+        received += rReceived;
+        sent += rSent;
+    }
+    fprintf(out,"total     : %8lu sessions %12llu messages in %12llu frames out\n",accepted,received,sent);
+
+    for(i=0;i<server->Count;i++)
+    {
+        hubReactor *r = &server->Reactors[i];
+        open += __atomic_load_n(&r->Open,__ATOMIC_RELAXED);
+        held += __atomic_load_n(&r->Held,__ATOMIC_RELAXED);
+        shed += __atomic_load_n(&r->Shed,__ATOMIC_RELAXED);
+        refused += __atomic_load_n(&r->Refused,__ATOMIC_RELAXED);
+    }
+    rss = residentKb();
+    fprintf(out,"memory    : %8lu open     %12zu KB held    %12ld KB resident",open,held / 1024,rss);
+    /* The process as a whole over the sessions, not what any one takes. */
+    if(open > 0 && rss > 0)
+        fprintf(out,", %.1f KB resident / open",(double)rss / open);
+    fprintf(out,"\n");
+    if(server->Budget > 0 || shed > 0 || refused > 0)
+        fprintf(out,"budget    : %8lu shed     %12lu refused  %12zu KB\n",shed,refused,server->Budget / 1024);
+}
+
+
+/******************************************************************************
+
+ *                Reactor functions.
+
+ ******************************************************************************/
+
+static void* reactorLoop(void *arg)
+{
+    hubReactor *r = (hubReactor*)arg;
+    struct epoll_event events[HUB_EPOLL_BATCH];
+
+    /* Best effort; an unpinned reactor still works. */
+    pinToCpu(r->Index % onlineCpuCount());
+    while(!__atomic_load_n(&r->Server->Stop,__ATOMIC_RELAXED))
+    {
+        int n,i;
+
+        if((n = epoll_wait(r->Epoll,events,HUB_EPOLL_BATCH,-1)) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("Error while waiting for events");
+            exit(EXIT_FAILURE);
+        }
+        for(i=0;i<n;i++)
+        {
+            void *ptr = events[i].data.ptr;
+            hubSession *s;
+
+            if(ptr == &r->Listener)
+            {
+                acceptSessions(r);
+                continue;
+            }
+            if(ptr == &r->WakeFd)
+            {
+                drainInbox(r,1);
+                continue;
+            }
+            s = (hubSession*)ptr;
+            if(!s->Dead && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                readSession(r,s);
+            if(!s->Dead && (events[i].events & EPOLLOUT))
+                writeSession(r,s);
+        }
+        /* Closing a session announces it, which may fail more sessions. */
+        flushDirty(r);
+        while(r->DeadCount > 0)
+        {
+            reapSessions(r);
+            flushDirty(r);
+        }
+    }
+    shutdownReactor(r);
+    return NULL;
+}
+
+static void acceptSessions(hubReactor *r)
+{
+    while(1)
+    {
+        struct epoll_event ev;
+        hubSession *s;
+        packet name;
+        int sock;
+
+        if((sock = accept4(r->Listener,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* EAGAIN: this listener's backlog is empty. */
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("\nError during connection accept: ");
+            return;
+        }
+        if(overBudget(r->Server,sizeof(hubSession)))
+        {
+            char frame[SESSION_HEADER_LENGTH];
+            packet bye;
+            int len;
+
+            memset(&bye,0,sizeof(bye));
+            bye.Opcode = SESSION_OP_BYE;
+            if((len = encodePacket(&sessionFormat,&bye,frame,sizeof(frame))) != -1 &&
+               send(sock,frame,len,MSG_NOSIGNAL) == -1)
+            {
+                /* It is going away either way. */
+            }
+            closeSocket(sock,"Error while closing socket:");
+            __atomic_store_n(&r->Refused,r->Refused + 1,__ATOMIC_RELAXED);
+            continue;
+        }
+        setSessionOptions(sock);
+        if((s = (hubSession*)calloc(1,sizeof(hubSession))) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+        s->Sock = sock;
+        s->MaxText = MAX_SESSION_TEXT_LENGTH;
+        s->Out = s->OutInline;
+        s->OutCapacity = HUB_INLINE_OUT;
+        initDecoder(&s->Decoder,&sessionFormat);
+        account(r,s);
+        __atomic_store_n(&r->Open,r->Open + 1,__ATOMIC_RELAXED);
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        if(epoll_ctl(r->Epoll,EPOLL_CTL_ADD,sock,&ev) == -1)
+        {
+            perror("Error while adding session to epoll");
+            exit(EXIT_FAILURE);
+        }
+        s->Next = r->Sessions;
+        if(r->Sessions != NULL)
+            r->Sessions->Prev = s;
+        r->Sessions = s;
+        __atomic_store_n(&r->Accepted,r->Accepted + 1,__ATOMIC_RELAXED);
+
+        memset(&name,0,sizeof(name));
+        name.Opcode = SESSION_OP_NAME;
+        name.TextLength = strlen(r->Server->Name);
+        name.Text = (char*)r->Server->Name;
+        sendPacket(r,s,&name);
+        capsPacket(&r->Server->Caps,&name);
+        sendPacket(r,s,&name);
+    }
+}
+
+/*  One read per readiness, so a busy peer cannot starve the others.  */
+static void readSession(hubReactor *r,hubSession *s)
+{
+    packet pkt;
+    size_t avail;
+    char *space = decoderSpace(&s->Decoder,&avail);
+    ssize_t ret;
+    int res;
+
+    if((ret = read(s->Sock,space,avail)) == -1)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        closeSession(r,s);
+        return;
+    }
+    if(ret == 0)
+    {
+        closeSession(r,s);
+        return;
+    }
+    decoderCommit(&s->Decoder,ret);
+    while(!s->Dead && (res = nextPacket(&s->Decoder,&pkt)) == DECODE_PACKET)
+        handlePacket(r,s,&pkt);
+    if(!s->Dead && res == DECODE_ERROR)
+        closeSession(r,s);
+    decoderCompact(&s->Decoder);
+    account(r,s);
+}
+
+static void handlePacket(hubReactor *r,hubSession *s,packet *pkt)
+{
+    char note[MAX_NAME_LENGTH + 32];
+    int len;
+
+    /* The hub only speaks channel 0. */
+    if(pkt->Channel != 0)
+        return;
+    if(pkt->Opcode == SESSION_OP_NAME && s->NameLength == 0 && pkt->TextLength > 0)
+    {
+        s->NameLength = pkt->TextLength < MAX_NAME_LENGTH ? pkt->TextLength : MAX_NAME_LENGTH;
+        memcpy(s->Name,pkt->Text,s->NameLength);
+        s->Name[s->NameLength] = 0;
+        len = snprintf(note,sizeof(note),"%s joined the hub",s->Name);
+        relayText(r,s,note,len,NULL);
+    }
+    else if(pkt->Opcode == SESSION_OP_CAPS)
+    {
+        sessionCaps agreed;
+        negotiateCaps(&r->Server->Caps,pkt,&agreed);
+        s->Caps = agreed.Caps;
+        s->MaxText = agreed.MaxText;
+    }
+    else if(pkt->Opcode == SESSION_OP_TEXT)
+    {
+        __atomic_store_n(&r->Received,r->Received + 1,__ATOMIC_RELAXED);
+        /* Never offered, so not relayed. */
+        if(pkt->Flags & SESSION_FLAG_DEFLATE)
+            return;
+        relayText(r,s,pkt->Text,pkt->TextLength,pkt);
+        /* Credit for peers running --channels, ignored by the others. */
+        if((s->Consumed += pkt->TextLength) >= MUX_WINDOW / 2)
+        {
+            packet credit;
+            memset(&credit,0,sizeof(credit));
+            credit.Opcode = SESSION_OP_WINDOW;
+            credit.Credit = s->Consumed;
+            s->Consumed = 0;
+            sendPacket(r,s,&credit);
+        }
+    }
+    else if(pkt->Opcode == SESSION_OP_BYE)
+        closeSession(r,s);
+}
+
+/*  Relays "name> text" from s, or a note from the hub if from is NULL.  */
+static void relayText(hubReactor *r,hubSession *s,const char *text,size_t len,const packet *from)
+{
+    char body[MAX_SESSION_TEXT_LENGTH];
+    /* Room for the send time, whether or not this one has it. */
+    size_t limit = MAX_SESSION_TEXT_LENGTH - 8;
+    packet out;
+
+    memset(&out,0,sizeof(out));
+    out.Opcode = SESSION_OP_TEXT;
+    if(from != NULL)
+    {
+        out.TextLength = snprintf(body,limit,"%s> ",s->NameLength ? s->Name : "?");
+        if(len > limit - out.TextLength)
+            len = limit - out.TextLength;
+        memcpy(body + out.TextLength,text,len);
+        out.TextLength += len;
+        out.Text = body;
+        out.SendTime = from->SendTime;
+    }
+    else
+    {
+        out.TextLength = len < limit ? len : limit;
+        out.Text = (char*)text;
+    }
+    broadcast(r,s,&out,from != NULL && (from->Flags & SESSION_FLAG_TIME));
+}
+
+/*
+ * To every session but the origin, on every reactor. Timed messages are
+ * encoded twice, for sessions with and without CAP_TIMESTAMPS.
+ */
+static void broadcast(hubReactor *r,hubSession *origin,packet *out,int timed)
+{
+    hubServer *server = r->Server;
+    size_t baseLength,length;
+    hubMessage *msg;
+    int i;
+
+    out->Flags = 0;
+    baseLength = encodedLength(&sessionFormat,out);
+    out->Flags = timed ? SESSION_FLAG_TIME : 0;
+    length = timed ? encodedLength(&sessionFormat,out) : 0;
+
+    msg = (hubMessage*)malloc(sizeof(hubMessage) + server->Count * sizeof(hubNode) + baseLength + length);
+    if(msg == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    msg->Refs = server->Count;
+    msg->TextLength = out->TextLength;
+    msg->BaseLength = baseLength;
+    msg->BaseFrame = (char*)(msg->Nodes + server->Count);
+    msg->Length = timed ? length : baseLength;
+    msg->Frame = timed ? msg->BaseFrame + baseLength : msg->BaseFrame;
+    if(timed && encodePacket(&sessionFormat,out,msg->Frame,length) == -1)
+    {
+        free(msg);
+        return;
+    }
+    out->Flags = 0;
+    if(encodePacket(&sessionFormat,out,msg->BaseFrame,baseLength) == -1)
+    {
+        free(msg);
+        return;
+    }
+
+    deliverMessage(r,msg,origin);
+    for(i=0;i<server->Count;i++)
+    {
+        if(i == r->Index)
+            continue;
+        msg->Nodes[i].Msg = msg;
+        pushInbox(&server->Reactors[i],&msg->Nodes[i]);
+    }
+    releaseMessage(msg);
+}
+
+static void deliverMessage(hubReactor *r,hubMessage *msg,hubSession *origin)
+{
+    hubSession *s;
+
+    for(s=r->Sessions;s != NULL;s = s->Next)
+    {
+        if(s == origin || s->Dead || msg->TextLength > s->MaxText)
+            continue;
+        if(s->Caps & CAP_TIMESTAMPS)
+            queueFrame(r,s,msg->Frame,msg->Length);
+        else
+            queueFrame(r,s,msg->BaseFrame,msg->BaseLength);
+        __atomic_store_n(&r->Sent,r->Sent + 1,__ATOMIC_RELAXED);
+    }
+}
+
+static void pushInbox(hubReactor *to,hubNode *node)
+{
+    hubNode *head = __atomic_load_n(&to->Inbox,__ATOMIC_RELAXED);
+
+    do
+        node->Next = head;
+    while(!__atomic_compare_exchange_n(&to->Inbox,&head,node,1,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    /* A non-empty inbox already has a wakeup on its way. */
+    if(head == NULL)
+        wakeReactor(to);
+}
+
+/*  Delivers, or with deliver 0 only releases, what was pushed so far.  */
+static void drainInbox(hubReactor *r,int deliver)
+{
+    hubNode *list,*ordered=NULL,*next;
+    uint64_t value;
+
+    if(read(r->WakeFd,&value,sizeof(value)) == -1)
+    {
+        /* EAGAIN: woken by stopHub(), or the counter was read already. */
+    }
+    list = __atomic_exchange_n(&r->Inbox,NULL,__ATOMIC_ACQUIRE);
+    for(;list != NULL;list = next)
+    {
+        next = list->Next;
+        list->Next = ordered;
+        ordered = list;
+    }
+    for(;ordered != NULL;ordered = next)
+    {
+        hubMessage *msg = ordered->Msg;
+
+        next = ordered->Next;
+        if(deliver)
+            deliverMessage(r,msg,NULL);
+        releaseMessage(msg);
+    }
+}
+
+static void releaseMessage(hubMessage *msg)
+{
+    if(__atomic_sub_fetch(&msg->Refs,1,__ATOMIC_ACQ_REL) == 0)
+        free(msg);
+}
+
+static void wakeReactor(hubReactor *r)
+{
+    uint64_t one = 1;
+
+    if(write(r->WakeFd,&one,sizeof(one)) == -1)
+    {
+        /* Only fails if the counter is full, and then it is readable. */
+    }
+}
+
+
+/******************************************************************************
+
+ *                Session output functions.
+
+ ******************************************************************************/
+
+static void sendPacket(hubReactor *r,hubSession *s,packet *pkt)
+{
+    char frame[MAX_SESSION_PACKET_LENGTH];
+    int len;
+
+    if((len = encodePacket(&sessionFormat,pkt,frame,sizeof(frame))) != -1)
+        queueFrame(r,s,frame,len);
+}
+
+/*  Output is only buffered here and written by flushDirty().  */
+static void queueFrame(hubReactor *r,hubSession *s,const char *frame,size_t len)
+{
+    if(s->Dead)
+        return;
+    if(s->OutLength - s->OutStart + len > HUB_MAX_BACKLOG)
+    {
+        closeSession(r,s);
+        return;
+    }
+    if(s->OutLength + len > s->OutCapacity)
+    {
+        size_t capacity = s->OutCapacity ? s->OutCapacity : 4096;
+
+        /* Reclaim what was written before growing. */
+        if(s->OutStart > 0)
+        {
+            memmove(s->Out,s->Out + s->OutStart,s->OutLength - s->OutStart);
+            s->OutLength -= s->OutStart;
+            s->OutStart = 0;
+        }
+        while(capacity < s->OutLength + len)
+            capacity *= 2;
+        /* Over budget, the sessions already behind go first. */
+        if(capacity != s->OutCapacity && s->Writing && overBudget(r->Server,capacity))
+        {
+            __atomic_store_n(&r->Shed,r->Shed + 1,__ATOMIC_RELAXED);
+            closeSession(r,s);
+            return;
+        }
+        if(capacity != s->OutCapacity && s->Out == s->OutInline)
+        {
+            if((s->Out = (char*)malloc(capacity)) == NULL)
+            {
+                perror("Failed during memory allocation:");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(s->Out,s->OutInline,s->OutLength);
+            s->OutCapacity = capacity;
+            account(r,s);
+        }
+        else if(capacity != s->OutCapacity)
+        {
+            if((s->Out = (char*)realloc(s->Out,capacity)) == NULL)
+            {
+                perror("Failed during memory allocation:");
+                exit(EXIT_FAILURE);
+            }
+            s->OutCapacity = capacity;
+            account(r,s);
+        }
+    }
+    memcpy(s->Out + s->OutLength,frame,len);
+    s->OutLength += len;
+    if(!s->Dirty)
+    {
+        s->Dirty = 1;
+        s->NextDirty = r->DirtyList;
+        r->DirtyList = s;
+    }
+}
+
+static void flushDirty(hubReactor *r)
+{
+    hubSession *s,*next;
+
+    for(s=r->DirtyList;s != NULL;s = next)
+    {
+        next = s->NextDirty;
+        s->Dirty = 0;
+        if(!s->Dead && !s->Writing)
+            writeSession(r,s);
+    }
+    r->DirtyList = NULL;
+}
+
+/*  Writes what the socket takes and waits for EPOLLOUT for the rest.  */
+static void writeSession(hubReactor *r,hubSession *s)
+{
+    struct epoll_event ev;
+    int pending;
+
+    while(s->OutStart < s->OutLength)
+    {
+        ssize_t ret;
+        if((ret = send(s->Sock,s->Out + s->OutStart,s->OutLength - s->OutStart,MSG_NOSIGNAL)) == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if(errno == EINTR)
+                continue;
+            closeSession(r,s);
+            return;
+        }
+        s->OutStart += ret;
+    }
+    if(s->OutStart == s->OutLength)
+    {
+        s->OutStart = s->OutLength = 0;
+        if(s->Out != s->OutInline)
+        {
+            free(s->Out);
+            s->Out = s->OutInline;
+            s->OutCapacity = HUB_INLINE_OUT;
+            account(r,s);
+        }
+    }
+
+    pending = s->OutStart < s->OutLength;
+    if(pending != s->Writing)
+    {
+        ev.events = EPOLLIN | (pending ? EPOLLOUT : 0);
+        ev.data.ptr = s;
+        if(epoll_ctl(r->Epoll,EPOLL_CTL_MOD,s->Sock,&ev) == -1)
+        {
+            closeSession(r,s);
+            return;
+        }
+        s->Writing = pending;
+    }
+}
+
+static void closeSession(hubReactor *r,hubSession *s)
+{
+    if(s->Dead)
+        return;
+    s->Dead = 1;
+    r->DeadCount++;
+}
+
+/*  Frees the sessions marked Dead, then tells the others they left.  */
+static void reapSessions(hubReactor *r)
+{
+    hubSession *s,*next,*gone=NULL;
+
+    for(s=r->Sessions;s != NULL;s = next)
+    {
+        next = s->Next;
+        if(!s->Dead)
+            continue;
+        if(s->Prev != NULL)
+            s->Prev->Next = s->Next;
+        else
+            r->Sessions = s->Next;
+        if(s->Next != NULL)
+            s->Next->Prev = s->Prev;
+        /* Closing the socket takes it out of the epoll set. */
+        closeSocket(s->Sock,"Error while closing socket:");
+        s->Next = gone;
+        gone = s;
+    }
+    r->DeadCount = 0;
+
+    for(s=gone;s != NULL;s = next)
+    {
+        next = s->Next;
+        if(s->NameLength > 0)
+        {
+            char note[MAX_NAME_LENGTH + 32];
+            int len = snprintf(note,sizeof(note),"%s left the hub",s->Name);
+            relayText(r,NULL,note,len,NULL);
+        }
+        freeDecoder(&s->Decoder);
+        if(s->Out != s->OutInline)
+            free(s->Out);
+        __atomic_store_n(&r->Held,r->Held - s->Held,__ATOMIC_RELAXED);
+        __atomic_store_n(&r->Open,r->Open - 1,__ATOMIC_RELAXED);
+        free(s);
+    }
+}
+
+/*  Says bye to every session, as far as their sockets take it now.  */
+static void shutdownReactor(hubReactor *r)
+{
+    hubSession *s,*next;
+    packet bye;
+
+    memset(&bye,0,sizeof(bye));
+    bye.Opcode = SESSION_OP_BYE;
+    for(s=r->Sessions;s != NULL;s = next)
+    {
+        next = s->Next;
+        sendPacket(r,s,&bye);
+        if(!s->Dead)
+            writeSession(r,s);
+        closeSocket(s->Sock,"Error while closing socket:");
+        freeDecoder(&s->Decoder);
+        if(s->Out != s->OutInline)
+            free(s->Out);
+        free(s);
+    }
+    r->Sessions = NULL;
+    __atomic_store_n(&r->Open,0,__ATOMIC_RELAXED);
+    __atomic_store_n(&r->Held,0,__ATOMIC_RELAXED);
+    r->DirtyList = NULL;
+    closeSocket(r->Listener,"Error while closing socket:");
+    closeSocket(r->Epoll,"Error while closing epoll:");
+}
+
+
+/******************************************************************************
+
+ *                Memory accounting functions.
+
+ ******************************************************************************/
+
+/*  Brings the reactor's count up to date with what s holds now.  */
+static void account(hubReactor *r,hubSession *s)
+{
+    size_t held = sizeof(hubSession) + s->Decoder.Capacity + (s->Out != s->OutInline ? s->OutCapacity : 0);
+
+    __atomic_store_n(&r->Held,r->Held - s->Held + held,__ATOMIC_RELAXED);
+    s->Held = held;
+}
+
+/*  Whether taking extra more bytes would go over the budget.  */
+static int overBudget(hubServer *server,size_t extra)
+{
+    size_t held = extra;
+    int i;
+
+    if(server->Budget == 0)
+        return 0;
+    for(i=0;i<server->Count;i++)
+        held += __atomic_load_n(&server->Reactors[i].Held,__ATOMIC_RELAXED);
+    return held > server->Budget;
+}
+
+/*  Resident set of the whole process, or -1 if it cannot be read.  */
+static long residentKb()
+{
+    long pages,resident=-1;
+    FILE *statm;
+
+    if((statm = fopen("/proc/self/statm","r")) == NULL)
+        return -1;
+    if(fscanf(statm,"%ld %ld",&pages,&resident) != 2)
+        resident = -1;
+    fclose(statm);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
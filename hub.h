@@ -0,0 +1,139 @@
+/*******************************************************************************
+ *
+ * Chat hub: a session server relaying text between many peers.
+ *
+ * 1. startHub() runs count reactor threads. Each has its own SO_REUSEPORT
+ *    listener on the port, so the kernel spreads new connections over them,
+ *    its own epoll set and its own CPU. A session stays on the reactor that
+ *    accepted it for its whole life and only that thread touches it; there
+ *    is no session table shared between reactors and no lock.
+ *
+ * 2. Peers are ordinary session peers (chatApp --active). The hub sends its
+ *    name and OP_CAPS, then relays every OP_TEXT of channel 0 to all other
+ *    sessions as "name> text". It offers only CAP_TIMESTAMPS: timestamped
+ *    messages keep their send time for the sessions that negotiated it.
+ *
+ * 3. A relayed message is encoded once. The reactor that read it delivers
+ *    it to its own sessions and pushes it on the inbox of every other
+ *    reactor: a lock-free list that producers push on with compare and
+ *    swap and the owner empties with one exchange. An eventfd wakes the
+ *    owner when its inbox goes from empty to not empty. The message is
+ *    freed by the last reactor done with it.
+ *
+ * 4. Output is gathered per session during an epoll batch and written once
+ *    at its end. A session whose peer does not read HUB_MAX_BACKLOG bytes
+ *    is dropped rather than let it hold memory for everyone else.
+ *
+ * 5. Idle sessions hold no heap memory: output goes into a small buffer in
+ *    the session and only a larger batch takes one from the heap, given
+ *    back once written, and the decoder gives its buffer back between
+ *    frames. Each reactor counts what its sessions hold. With a budget,
+ *    a hub over it says bye to new peers instead of taking them on and
+ *    drops sessions that are already behind when they need more.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_HUB_H
+#define GEEKCHAT_HUB_H
+
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include "protocol.h"
+#include "session_caps.h"
+
+#define HUB_MAX_REACTORS 64
+#define HUB_EPOLL_BATCH 64
+#define HUB_MAX_BACKLOG (4 * 1024 * 1024)
+#define HUB_INLINE_OUT 512
+
+struct hubMessage;
+
+/*  One reactor's link to a message on its inbox.  */
+typedef struct hubNode
+{
+    struct hubNode *Next;
+    struct hubMessage *Msg;
+}hubNode;
+
+typedef struct hubMessage
+{
+    int Refs;               /* Reactors yet to deliver it. */
+    unsigned int TextLength;
+    size_t Length;
+    char *Frame;            /* Encoded session frame. */
+    size_t BaseLength;
+    char *BaseFrame;        /* Without the send time, may be Frame. */
+    hubNode Nodes[];        /* One per reactor, the frames follow. */
+}hubMessage;
+
+typedef struct hubSession
+{
+    struct hubSession *Prev;
+    struct hubSession *Next;
+    struct hubSession *NextDirty;
+    int Sock;
+    int Dirty;          /* On the reactor's DirtyList. */
+    int Writing;        /* Waiting for EPOLLOUT. */
+    int Dead;           /* Closed at the end of the batch. */
+    unsigned int NameLength;
+    char Name[MAX_NAME_LENGTH + 1];   /* Empty until the peer's OP_NAME. */
+    size_t Consumed;                   /* Text not credited back yet. */
+    unsigned int Caps;                 /* Negotiated, CAP_ bits. */
+    unsigned int MaxText;
+    size_t Held;                       /* Counted in the reactor's Held. */
+    packetDecoder Decoder;
+    char *Out;                         /* Frames the socket has not taken. */
+    size_t OutStart;
+    size_t OutLength;
+    size_t OutCapacity;
+    char OutInline[HUB_INLINE_OUT];    /* Out unless a batch needs more. */
+}hubSession;
+
+struct hubServer;
+
+typedef struct hubReactor
+{
+    struct hubServer *Server;
+    int Index;
+    int Listener;
+    int Epoll;
+    int WakeFd;
+    /* Other reactors write the inbox; it gets a cache line to itself. */
+    hubNode *Inbox __attribute__((aligned(64)));   /* Newest first. */
+    hubSession *Sessions __attribute__((aligned(64)));
+    hubSession *DirtyList;    /* Sessions with output from this batch. */
+    int DeadCount;
+    size_t Held;              /* Bytes of its sessions; others read it. */
+    /* Written by the reactor alone, read by hubReport(); atomic both ways. */
+    unsigned long Open;
+    unsigned long Shed;       /* Dropped for the budget. */
+    unsigned long Refused;
+    unsigned long Accepted;
+    unsigned long long Received;
+    unsigned long long Sent;
+    pthread_t Thread;
+}hubReactor;
+
+typedef struct hubServer
+{
+    int Count;
+    hubReactor Reactors[HUB_MAX_REACTORS];
+    const char *Name;
+    size_t Budget;            /* Bytes for all sessions, 0 for no limit. */
+    sessionCaps Caps;
+    volatile sig_atomic_t Stop;
+}hubServer;
+
+/*  Port, reactor count, hub name and memory budget in bytes (0: none).  */
+void startHub(hubServer*,int,int,const char*,size_t);
+
+/*  Waits for the reactors to finish after stopHub().  */
+void joinHub(hubServer*);
+
+/*  Async signal safe.  */
+void stopHub(hubServer*);
+
+/*  Sessions and frames per reactor and in all, then memory held and shed.  */
+void hubReport(hubServer*,FILE*);
+
+#endif
@@ -0,0 +1,251 @@
+/*******************************************************************************
+ *
+ * Keyword matching: finds many keywords in a text in one pass.
+ *
+ * 1. Only bytes that occur in some keyword get a column of their own; all
+ *    others share column 0, and a letter shares its column with the other
+ *    case. Rows are then a few dozen entries wide instead of 256, so the
+ *    rows in use stay in cache, and no byte needs folding while scanning.
+ *
+ * 2. Entries hold the row offset of the next state rather than its number,
+ *    so a step is a load and an add. The flag bit on an entry says a keyword
+ *    ends in the state it leads to; only then is Match read.
+ *
+ * 3. The trie is built straight into the table. A breadth first pass then
+ *    fills each missing entry from the state's failure state, which lies
+ *    closer to the root and so is complete already.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "keywords.h"
+
+static unsigned char fold(unsigned char);
+static void* allocate(size_t);
+
+
+void initKeywords(keywordList *list)
+{
+    memset(list,0,sizeof(*list));
+}
+
+void freeKeywords(keywordList *list)
+{
+    free(list->Text);
+    free(list->Lengths);
+    memset(list,0,sizeof(*list));
+}
+
+int addKeyword(keywordList *list,const char *keyword,size_t len)
+{
+    size_t i;
+
+    if(len == 0 || len > MAX_KEYWORD_LENGTH)
+        return -1;
+    if(list->Length + len > list->Capacity)
+    {
+        list->Capacity = (list->Length + len) * 2;
+        if((list->Text = (char*)realloc(list->Text,list->Capacity)) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(list->Count == list->Slots)
+    {
+        list->Slots = list->Slots ? list->Slots * 2 : 64;
+        if((list->Lengths = (unsigned char*)realloc(list->Lengths,list->Slots)) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(i=0;i<len;i++)
+        list->Text[list->Length + i] = (char)fold((unsigned char)keyword[i]);
+    list->Length += len;
+    list->Lengths[list->Count++] = (unsigned char)len;
+    return 0;
+}
+
+int loadKeywords(keywordList *list,const char *fileName)
+{
+    FILE *file;
+    char *line=NULL;
+    size_t size=0;
+    ssize_t len;
+    int added=0;
+
+    if((file = fopen(fileName,"r")) == NULL)
+        return -1;
+    while((len = getline(&line,&size,file)) != -1)
+    {
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            len--;
+        if(addKeyword(list,line,len) == 0)
+            added++;
+    }
+    free(line);
+    fclose(file);
+    return added;
+}
+
+keywordMatcher* compileKeywords(const keywordList *list)
+{
+    keywordMatcher *m;
+    unsigned int *fail,*queue,head=0,tail=0,c;
+    unsigned char used[256];
+    size_t pos=0,k,maxStates,i;
+
+    if(list->Count == 0)
+        return NULL;
+    m = (keywordMatcher*)allocate(sizeof(keywordMatcher));
+    memset(m,0,sizeof(*m));
+
+    /* Columns, in order of first appearance. */
+    memset(used,0,sizeof(used));
+    m->Classes = 1;
+    for(i=0;i<list->Length;i++)
+    {
+        unsigned char b = (unsigned char)list->Text[i];
+        if(!used[b])
+        {
+            used[b] = 1;
+            m->Class[b] = (unsigned char)m->Classes++;
+        }
+    }
+    for(c='A';c<='Z';c++)
+        m->Class[c] = m->Class[c - 'A' + 'a'];
+
+    maxStates = list->Length + 1;
+    if(maxStates * m->Classes >= KEYWORD_MATCH)
+    {
+        fprintf(stderr,"\nToo many keywords.\n");
+        exit(EXIT_FAILURE);
+    }
+    m->Next = (unsigned int*)allocate(maxStates * m->Classes * sizeof(unsigned int));
+    memset(m->Next,0,maxStates * m->Classes * sizeof(unsigned int));
+    m->Match = (unsigned char*)allocate(maxStates);
+    memset(m->Match,0,maxStates);
+    m->States = 1;
+
+    /* The trie; offset 0 is the root, which no entry of it leads to. */
+    for(k=0;k<list->Count;pos+=list->Lengths[k++])
+    {
+        unsigned int state=0;
+        for(i=0;i<list->Lengths[k];i++)
+        {
+            unsigned int *entry = &m->Next[state + m->Class[(unsigned char)list->Text[pos + i]]];
+            if(*entry == 0)
+                *entry = m->States++ * m->Classes;
+            state = *entry;
+        }
+        m->Match[state / m->Classes] = list->Lengths[k];
+    }
+
+    /* Failure states, breadth first, completing every row. */
+    fail = (unsigned int*)allocate(m->States * sizeof(unsigned int));
+    queue = (unsigned int*)allocate(m->States * sizeof(unsigned int));
+    fail[0] = 0;
+    for(c=0;c<m->Classes;c++)
+    {
+        unsigned int child = m->Next[c];
+        if(child != 0)
+        {
+            fail[child / m->Classes] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while(head < tail)
+    {
+        unsigned int state = queue[head++];
+        unsigned int back = fail[state / m->Classes];
+
+        for(c=0;c<m->Classes;c++)
+        {
+            unsigned int *entry = &m->Next[state + c];
+            if(*entry == 0)
+            {
+                *entry = m->Next[back + c];
+                continue;
+            }
+            fail[*entry / m->Classes] = m->Next[back + c];
+            /* A keyword of its own is longer than any its failure state ends. */
+            if(m->Match[*entry / m->Classes] == 0)
+                m->Match[*entry / m->Classes] = m->Match[m->Next[back + c] / m->Classes];
+            queue[tail++] = *entry;
+        }
+    }
+    free(fail);
+    free(queue);
+
+    for(i=0;i<(size_t)m->States * m->Classes;i++)
+    {
+        if(m->Match[m->Next[i] / m->Classes])
+            m->Next[i] |= KEYWORD_MATCH;
+    }
+    return m;
+}
+
+void freeMatcher(keywordMatcher *m)
+{
+    if(m == NULL)
+        return;
+    free(m->Next);
+    free(m->Match);
+    free(m);
+}
+
+size_t findKeywords(const keywordMatcher *m,const char *text,size_t len,keywordSpan *spans,size_t max)
+{
+    unsigned int state=0;
+    size_t i,n=0;
+
+    for(i=0;i<len;i++)
+    {
+        unsigned int next = m->Next[state + m->Class[(unsigned char)text[i]]];
+        state = next & ~KEYWORD_MATCH;
+        if(next & KEYWORD_MATCH)
+        {
+            size_t start = i + 1 - m->Match[state / m->Classes];
+
+            /* A longer match may cover several earlier ones. */
+            while(n > 0 && start <= spans[n - 1].End)
+            {
+                if(spans[n - 1].Start < start)
+                    start = spans[n - 1].Start;
+                n--;
+            }
+            if(n < max)
+            {
+                spans[n].Start = start;
+                spans[n].End = i + 1;
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static unsigned char fold(unsigned char b)
+{
+    return b >= 'A' && b <= 'Z' ? b - 'A' + 'a' : b;
+}
+
+static void* allocate(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+    if(p == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
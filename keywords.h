@@ -0,0 +1,75 @@
+/*******************************************************************************
+ *
+ * Keyword matching: finds many keywords in a text in one pass.
+ *
+ * 1. Keywords are collected in a keywordList and compiled into a
+ *    keywordMatcher, an Aho-Corasick automaton with every transition worked
+ *    out in advance. Scanning then costs one table lookup per byte, however
+ *    many keywords there are, and never steps back in the text.
+ *
+ * 2. ASCII letters match either case. Other bytes match exactly, so UTF-8
+ *    keywords work but are case sensitive. Keywords match anywhere, inside
+ *    words too.
+ *
+ * 3. A matcher is read only once compiled and can be shared by threads.
+ *    To change the keywords, compile a new one and swap it in.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_KEYWORDS_H
+#define GEEKCHAT_KEYWORDS_H
+
+#include <stddef.h>
+
+#define MAX_KEYWORD_LENGTH 255
+
+typedef struct keywordList
+{
+    char *Text;                 /* The keywords, folded, back to back. */
+    size_t Length;
+    size_t Capacity;
+    unsigned char *Lengths;     /* One per keyword. */
+    size_t Count;
+    size_t Slots;
+}keywordList;
+
+typedef struct keywordMatcher
+{
+    unsigned char Class[256];   /* Byte to column; 0 for bytes in no keyword. */
+    unsigned int Classes;
+    /*
+     * Row per state, Classes entries each. Entries hold the next state's
+     * row offset, with KEYWORD_MATCH set if a keyword ends there.
+     */
+    unsigned int *Next;
+    unsigned char *Match;       /* Per state, the longest keyword ending there. */
+    unsigned int States;
+}keywordMatcher;
+
+#define KEYWORD_MATCH 0x80000000u
+
+typedef struct keywordSpan
+{
+    size_t Start;
+    size_t End;                 /* One past the last byte. */
+}keywordSpan;
+
+void initKeywords(keywordList*);
+void freeKeywords(keywordList*);
+
+/*  Returns 0, or -1 for an empty keyword or one over MAX_KEYWORD_LENGTH.  */
+int addKeyword(keywordList*,const char*,size_t);
+
+/*  Reads one keyword per line; returns the number added or -1.  */
+int loadKeywords(keywordList*,const char*);
+
+/*  Returns NULL for an empty list.  */
+keywordMatcher* compileKeywords(const keywordList*);
+void freeMatcher(keywordMatcher*);
+
+/*
+ * Finds the keywords in text and stores where they are, overlapping
+ * matches merged, in order. Returns the number of spans, at most max.
+ */
+size_t findKeywords(const keywordMatcher*,const char*,size_t,keywordSpan*,size_t);
+
+#endif
@@ -0,0 +1,192 @@
+/*******************************************************************************
+ *
+ * End-to-end latency histograms per sender, from send timestamps.
+ *
+ * 1. Bucket index: values below 2 * LATENCY_SUB_BUCKETS map to themselves.
+ *    Larger ones are shifted right until LATENCY_SUB_BITS + 1 bits are
+ *    left; the shift picks the row and the remaining low bits the bucket.
+ *
+ * 2. Senders are found by a linear scan; with LATENCY_SENDERS entries that
+ *    is cheaper than the locking around it.
+ *
+ * ****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "latency.h"
+
+static unsigned int bucketIndex(unsigned long long);
+static unsigned long long bucketHighest(unsigned int);
+static void addSample(latencyHistogram*,unsigned long long,int);
+static latencySender* findSender(latencyTable*,unsigned int,const char*,size_t);
+static void reportLine(FILE*,const char*,int,const latencyHistogram*);
+
+
+void initLatency(latencyTable *table)
+{
+    memset(table,0,sizeof(*table));
+    pthread_mutex_init(&table->Lock,NULL);
+}
+
+void freeLatency(latencyTable *table)
+{
+    pthread_mutex_destroy(&table->Lock);
+}
+
+void latencyRecord(latencyTable *table,unsigned int senderId,const char *name,size_t nameLen,
+                   unsigned long long sendUs,unsigned long long nowUs)
+{
+    latencySender *sender;
+    unsigned long long value = nowUs >= sendUs ? nowUs - sendUs : 0;
+    int early = nowUs < sendUs;
+
+    if(nameLen > MAX_NAME_LENGTH)
+        nameLen = MAX_NAME_LENGTH;
+    pthread_mutex_lock(&table->Lock);
+        sender = findSender(table,senderId,name,nameLen);
+        addSample(&sender->Histogram,value,early);
+        addSample(&table->All,value,early);
+    pthread_mutex_unlock(&table->Lock);
+}
+
+unsigned long long latencyPercentile(const latencyHistogram *hist,double percent)
+{
+    unsigned long long wanted,seen=0;
+    unsigned int i;
+
+    if(hist->Total == 0)
+        return 0;
+    wanted = (unsigned long long)(hist->Total * percent / 100.0 + 0.5);
+    if(wanted == 0)
+        wanted = 1;
+    for(i=0;i<LATENCY_BUCKETS;i++)
+    {
+        seen += hist->Counts[i];
+        if(seen >= wanted)
+            break;
+    }
+    if(i == LATENCY_BUCKETS)
+        return hist->Max;
+    /* The top of the bucket, but never more than was actually seen. */
+    return bucketHighest(i) < hist->Max ? bucketHighest(i) : hist->Max;
+}
+
+void latencyReport(latencyTable *table,FILE *out)
+{
+    int i;
+
+    pthread_mutex_lock(&table->Lock);
+        fprintf(out,"%-20s %10s %9s %9s %9s %9s %9s  (ms)\n",
+                "sender","count","p50","p90","p99","p99.9","max");
+        for(i=0;i<LATENCY_SENDERS;i++)
+        {
+            latencySender *sender = &table->Senders[i];
+            if(sender->InUse)
+                reportLine(out,sender->Name,sender->NameLength,&sender->Histogram);
+        }
+        reportLine(out,"all",3,&table->All);
+        if(table->All.Early > 0)
+            fprintf(out,"%llu packets arrived before they were sent, check the clocks\n",table->All.Early);
+        if(table->Evicted > 0)
+            fprintf(out,"%lu senders forgotten to make room\n",table->Evicted);
+    pthread_mutex_unlock(&table->Lock);
+}
+
+unsigned long long wallClockUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME,&now);
+    return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+unsigned long long monotonicUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+long long monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/******************************************************************************
+
+ *                Histogram functions.
+
+ ******************************************************************************/
+
+static unsigned int bucketIndex(unsigned long long value)
+{
+    int shift;
+
+    if(value > LATENCY_MAX_US)
+        value = LATENCY_MAX_US;
+    if(value < 2 * LATENCY_SUB_BUCKETS)
+        return (unsigned int)value;
+    shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + (unsigned int)(value >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+static unsigned long long bucketHighest(unsigned int index)
+{
+    int shift;
+
+    if(index < 2 * LATENCY_SUB_BUCKETS)
+        return index;
+    shift = index / LATENCY_SUB_BUCKETS - 1;
+    return ((unsigned long long)(index % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void addSample(latencyHistogram *hist,unsigned long long value,int early)
+{
+    hist->Counts[bucketIndex(value)]++;
+    hist->Total++;
+    hist->Early += early;
+    if(value > hist->Max)
+        hist->Max = value;
+}
+
+/*  Takes the least recently used slot for senders not in the table.  */
+static latencySender* findSender(latencyTable *table,unsigned int senderId,const char *name,size_t nameLen)
+{
+    latencySender *victim = &table->Senders[0];
+    int i;
+
+    table->Clock++;
+    for(i=0;i<LATENCY_SENDERS;i++)
+    {
+        latencySender *sender = &table->Senders[i];
+        if(sender->InUse && sender->SenderId == senderId && sender->NameLength == nameLen &&
+           !memcmp(sender->Name,name,nameLen))
+        {
+            sender->LastUse = table->Clock;
+            return sender;
+        }
+        if(victim->InUse && (!sender->InUse || sender->LastUse < victim->LastUse))
+            victim = sender;
+    }
+
+    if(victim->InUse)
+        table->Evicted++;
+    memset(&victim->Histogram,0,sizeof(victim->Histogram));
+    victim->InUse = 1;
+    victim->SenderId = senderId;
+    victim->NameLength = nameLen;
+    memcpy(victim->Name,name,nameLen);
+    victim->Name[nameLen] = 0;
+    victim->LastUse = table->Clock;
+    return victim;
+}
+
+static void reportLine(FILE *out,const char *name,int nameLen,const latencyHistogram *hist)
+{
+    fprintf(out,"%-20.*s %10llu %9.3f %9.3f %9.3f %9.3f %9.3f\n",nameLen,name,hist->Total,
+            latencyPercentile(hist,50) / 1000.0,latencyPercentile(hist,90) / 1000.0,
+            latencyPercentile(hist,99) / 1000.0,latencyPercentile(hist,99.9) / 1000.0,
+            hist->Max / 1000.0);
+}
@@ -0,0 +1,91 @@
+/*******************************************************************************
+ *
+ * End-to-end latency histograms per sender, from send timestamps.
+ *
+ * 1. Latency is the receiver's wall clock minus the SendTime a sender put
+ *    in its packets (protocol.h), in microseconds. Members on different
+ *    hosts need synchronised clocks (NTP, PTP); packets that seem to arrive
+ *    before they were sent are counted as Early and recorded as 0.
+ *
+ * 2. Histograms are log-linear, as in HdrHistogram: values below
+ *    2 * LATENCY_SUB_BUCKETS have a bucket each, above that every power of
+ *    two is split into LATENCY_SUB_BUCKETS buckets, so any value is known
+ *    to within about 3%. Values above LATENCY_MAX_US count as that.
+ *
+ * 3. Memory is fixed: LATENCY_SENDERS histograms plus one over all of
+ *    them. When the table is full the sender heard from least recently is
+ *    forgotten; its samples stay in the overall histogram.
+ *
+ * 4. Thread safe, so receive shards can record while another thread reports.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_LATENCY_H
+#define GEEKCHAT_LATENCY_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include "protocol.h"
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_VALUE_BITS 36
+#define LATENCY_MAX_US ((1ULL << LATENCY_VALUE_BITS) - 1)
+#define LATENCY_BUCKETS ((LATENCY_VALUE_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+#define LATENCY_SENDERS 64
+
+typedef struct latencyHistogram
+{
+    unsigned int Counts[LATENCY_BUCKETS];
+    unsigned long long Total;
+    unsigned long long Max;
+    unsigned long long Early;
+}latencyHistogram;
+
+typedef struct latencySender
+{
+    unsigned int SenderId;
+    unsigned int NameLength;
+    char Name[MAX_NAME_LENGTH + 1];
+    unsigned int LastUse;
+    int InUse;
+    latencyHistogram Histogram;
+}latencySender;
+
+typedef struct latencyTable
+{
+    latencySender Senders[LATENCY_SENDERS];
+    latencyHistogram All;
+    unsigned int Clock;
+    unsigned long Evicted;
+    pthread_mutex_t Lock;
+}latencyTable;
+
+void initLatency(latencyTable*);
+void freeLatency(latencyTable*);
+
+/*
+ * Records one packet. Senders are told apart by id and name, so members
+ * without the sequence header (id 0) are still kept apart by name.
+ */
+void latencyRecord(latencyTable*,unsigned int,const char*,size_t,
+                   unsigned long long,unsigned long long);
+
+/*  Smallest value at or below which the given percent of samples lie.  */
+unsigned long long latencyPercentile(const latencyHistogram*,double);
+
+/*
+ * Prints count, p50, p90, p99, p99.9 and max in milliseconds, a line per
+ * sender and one for all of them.
+ */
+void latencyReport(latencyTable*,FILE*);
+
+/*  Microseconds since the epoch, what senders put in SendTime.  */
+unsigned long long wallClockUs();
+
+/*  Microseconds on the monotonic clock, for times that stay on one host.  */
+unsigned long long monotonicUs();
+
+/*  The same clock in nanoseconds, for pacing load.  */
+long long monotonicNs();
+
+#endif
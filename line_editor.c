@@ -0,0 +1,455 @@
+/*******************************************************************************
+ *
+ * Raw-mode line editor for the chat prompt.
+ *
+ * 1. Output for one read batch, and for one lineEditorPrint() call, is put
+ *    together in memory and sent with a single write().
+ *
+ * 2. Escape sequences other than the bracketed paste markers (arrow keys,
+ *    function keys) are swallowed, since the editor has no cursor motion.
+ *
+ * 3. An input line longer than the terminal is wide wraps. Clearing it
+ *    goes up to the row the prompt is on and clears from there down, with
+ *    the rows worked out from the display width and the terminal's width.
+ *    A tab becomes a space, as sanitizeText() would send it anyway.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include "line_editor.h"
+#include "utf8.h"
+
+#define KEY_CTRL_H 8
+#define KEY_CTRL_U 21
+#define KEY_ESC 27
+#define KEY_DEL 127
+
+#define PASTE_BEGIN "\033[200~"
+#define PASTE_END "\033[201~"
+#define BRACKETED_PASTE_ON "\033[?2004h"
+#define BRACKETED_PASTE_OFF "\033[?2004l"
+
+/*  Growable output buffer for one batch.  */
+typedef struct outBuf
+{
+    char *Data;
+    size_t Length;
+    size_t Capacity;
+}outBuf;
+
+static struct termios savedTermios;
+static int rawFd = -1;
+
+static void enterRawMode(int);
+static int processByte(lineEditor*,unsigned char,outBuf*);
+static void processEscape(lineEditor*);
+static void appendOut(outBuf*,const char*,size_t);
+static void appendPrompt(lineEditor*,outBuf*);
+static int terminalColumns();
+static int shownWidth(const lineEditor*);
+static void appendClear(outBuf*,int);
+static void flushOut(outBuf*);
+
+
+void initLineEditor(lineEditor *ed,int fd,const char *prompt,size_t capacity)
+{
+    memset(ed,0,sizeof(*ed));
+    ed->Fd = fd;
+    ed->Prompt = prompt;
+    ed->Capacity = capacity;
+    if((ed->Line = (char*)malloc(capacity)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&ed->Lock,NULL);
+    enterRawMode(fd);
+}
+
+void destroyLineEditor(lineEditor *ed)
+{
+    restoreTerminal();
+    pthread_mutex_destroy(&ed->Lock);
+    free(ed->Line);
+    ed->Line = NULL;
+}
+
+void lineEditorUseScreen(lineEditor *ed,screen *scr)
+{
+    pthread_mutex_lock(&ed->Lock);
+        ed->Screen = scr;
+    pthread_mutex_unlock(&ed->Lock);
+}
+
+int readLine(lineEditor *ed,char *msg)
+{
+    outBuf out = {NULL,0,0};
+    int cancelState,done=0,len=0;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+    pthread_mutex_lock(&ed->Lock);
+        if(ed->Screen != NULL)
+            screenSetInput(ed->Screen,ed->Prompt,ed->Line,ed->Length);
+        else if(!ed->PromptShown)
+        {
+            appendPrompt(ed,&out);
+            flushOut(&out);
+        }
+    pthread_mutex_unlock(&ed->Lock);
+    pthread_setcancelstate(cancelState,NULL);
+
+    while(!done)
+    {
+        if(ed->PendingStart == ed->PendingEnd)
+        {
+            ssize_t ret;
+            /* The only blocking point, and a cancellation point. */
+            if((ret = read(ed->Fd,ed->Pending,sizeof(ed->Pending))) <= 0)
+            {
+                if(ret == -1 && errno != EINTR)
+                    perror("Error while reading from stdin:");
+                free(out.Data);
+                return -1;
+            }
+            ed->PendingStart = 0;
+            ed->PendingEnd = ret;
+        }
+
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+        pthread_mutex_lock(&ed->Lock);
+            while(ed->PendingStart < ed->PendingEnd && !done)
+                done = processByte(ed,(unsigned char)ed->Pending[ed->PendingStart++],&out);
+            if(done)
+            {
+                len = ed->Length;
+                memcpy(msg,ed->Line,len);
+                ed->Length = 0;
+                ed->PromptShown = 0;
+            }
+            /* The screen draws the input pane itself, echo is not needed. */
+            if(ed->Screen != NULL)
+            {
+                out.Length = 0;
+                screenSetInput(ed->Screen,ed->Prompt,ed->Line,ed->Length);
+            }
+            else
+                flushOut(&out);
+        pthread_mutex_unlock(&ed->Lock);
+        pthread_setcancelstate(cancelState,NULL);
+    }
+    free(out.Data);
+    /* Replaces partial or invalid sequences with '?', e.g. from a non UTF-8 terminal. */
+    len = sanitizeText(msg,len);
+    msg[len] = 0;
+    /* Sent lines stay in the message pane, as they would on a terminal. */
+    if(ed->Screen != NULL)
+        screenPrint(ed->Screen,"%s%s",ed->Prompt,msg);
+    return len;
+}
+
+void lineEditorPrint(lineEditor *ed,const char *format,...)
+{
+    outBuf out = {NULL,0,0};
+    va_list args;
+    int cancelState,len;
+
+    va_start(args,format);
+    len = vsnprintf(NULL,0,format,args);
+    va_end(args);
+    if(len < 0)
+        return;
+
+    if(ed->Screen != NULL)
+    {
+        appendOut(&out,NULL,len + 1);
+        va_start(args,format);
+        vsnprintf(out.Data,len + 1,format,args);
+        va_end(args);
+        screenAddText(ed->Screen,out.Data,len);
+        free(out.Data);
+        return;
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+    pthread_mutex_lock(&ed->Lock);
+        appendClear(&out,shownWidth(ed));
+        if(out.Length + len + 1 > out.Capacity)
+            appendOut(&out,NULL,len + 1);
+        va_start(args,format);
+        vsnprintf(out.Data + out.Length,len + 1,format,args);
+        va_end(args);
+        out.Length += len;
+        appendOut(&out,"\n",1);
+        appendPrompt(ed,&out);
+        appendOut(&out,ed->Line,ed->Length);
+        flushOut(&out);
+    pthread_mutex_unlock(&ed->Lock);
+    pthread_setcancelstate(cancelState,NULL);
+    free(out.Data);
+}
+
+void lineEditorRedraw(lineEditor *ed)
+{
+    outBuf out = {NULL,0,0};
+    int cancelState;
+
+    if(ed->Screen != NULL)
+    {
+        pthread_mutex_lock(&ed->Lock);
+            screenSetInput(ed->Screen,ed->Prompt,ed->Line,ed->Length);
+        pthread_mutex_unlock(&ed->Lock);
+        return;
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+    pthread_mutex_lock(&ed->Lock);
+        appendClear(&out,shownWidth(ed));
+        appendPrompt(ed,&out);
+        appendOut(&out,ed->Line,ed->Length);
+        flushOut(&out);
+    pthread_mutex_unlock(&ed->Lock);
+    pthread_setcancelstate(cancelState,NULL);
+    free(out.Data);
+}
+
+/*  The one place where the terminal settings are put back.  */
+void restoreTerminal()
+{
+    if(rawFd == -1)
+        return;
+    if(write(STDOUT_FILENO,BRACKETED_PASTE_OFF,strlen(BRACKETED_PASTE_OFF)) == -1)
+    {
+        /* Nothing sensible to do while restoring. */
+    }
+    if(tcsetattr(rawFd,TCSADRAIN,&savedTermios) == -1)
+    {
+        perror("Error while setting stdin properties:");
+    }
+    rawFd = -1;
+}
+
+
+/******************************************************************************
+
+ *                Input processing.
+
+ ******************************************************************************/
+
+static void enterRawMode(int fd)
+{
+    static int atexitDone = 0;
+    struct termios raw;
+
+    if(rawFd != -1 || !isatty(fd))
+        return;
+    if(tcgetattr(fd,&savedTermios) == -1)
+    {
+        perror("Error while fetching stdin properties:");
+        exit(EXIT_FAILURE);
+    }
+    raw = savedTermios;
+    /* ISIG stays on, Ctrl+C still ends the session. */
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if(tcsetattr(fd,TCSANOW,&raw) == -1)
+    {
+        perror("Error while setting stdin properties:");
+        exit(EXIT_FAILURE);
+    }
+    rawFd = fd;
+    if(!atexitDone)
+    {
+        atexit(restoreTerminal);
+        atexitDone = 1;
+    }
+    if(write(STDOUT_FILENO,BRACKETED_PASTE_ON,strlen(BRACKETED_PASTE_ON)) == -1)
+    {
+        perror("Error while writing to stdout:");
+    }
+}
+
+/*  Returns 1 when the byte completes the line.  */
+static int processByte(lineEditor *ed,unsigned char ch,outBuf *out)
+{
+    if(ed->EscapeLength > 0 || ch == KEY_ESC)
+    {
+        if(ed->EscapeLength < EDITOR_ESC_SIZE)
+            ed->Escape[ed->EscapeLength++] = ch;
+        processEscape(ed);
+        return 0;
+    }
+
+    if(ch == '\n' || ch == '\r')
+    {
+        if(!ed->InPaste)
+        {
+            appendOut(out,"\n",1);
+            return 1;
+        }
+        ch = ' ';
+    }
+
+    if(ch == '\t')
+        ch = ' ';
+
+    if(ch == KEY_DEL || ch == KEY_CTRL_H)
+    {
+        size_t start;
+        int width,before = shownWidth(ed),columns = terminalColumns();
+        char erase[32];
+
+        if(ed->Length == 0)
+            return 0;
+        start = utf8PrevCharStart(ed->Line,ed->Length);
+        width = utf8DisplayWidth(ed->Line + start,ed->Length - start);
+        ed->Length = start;
+        /*
+         * Within one row the cursor steps back. Across rows, or to a row's
+         * end where the terminal holds the cursor until the next character,
+         * it is redrawn.
+         */
+        if(before % columns != 0 && (before - width) % columns != 0 &&
+           (before - width) / columns == before / columns)
+        {
+            if(width > 0)
+                appendOut(out,erase,snprintf(erase,sizeof(erase),"\033[%dD\033[K",width));
+        }
+        else
+        {
+            appendClear(out,before);
+            appendPrompt(ed,out);
+            appendOut(out,ed->Line,ed->Length);
+        }
+    }
+    else if(ch == KEY_CTRL_U)
+    {
+        appendClear(out,shownWidth(ed));
+        ed->Length = 0;
+        appendPrompt(ed,out);
+    }
+    else if((ch >= 32 && ch <= 126) || ch >= 0x80)
+    {
+        if(ed->Length + 1 < ed->Capacity)
+        {
+            ed->Line[ed->Length++] = ch;
+            appendOut(out,(char*)&ch,1);
+        }
+    }
+    return 0;
+}
+
+/*  Acts on a complete escape sequence, waits for the rest otherwise.  */
+static void processEscape(lineEditor *ed)
+{
+    char last = ed->Escape[ed->EscapeLength - 1];
+    int complete;
+
+    if(ed->EscapeLength == 1)
+        complete = 0;
+    else if(ed->Escape[1] == '[')
+        complete = ed->EscapeLength > 2 && last >= 0x40 && last <= 0x7E;
+    else if(ed->Escape[1] == 'O')
+        complete = ed->EscapeLength == 3;
+    else
+        complete = 1;
+
+    if(!complete && ed->EscapeLength < EDITOR_ESC_SIZE)
+        return;
+
+    if(ed->EscapeLength == strlen(PASTE_BEGIN) && !memcmp(ed->Escape,PASTE_BEGIN,ed->EscapeLength))
+        ed->InPaste = 1;
+    else if(ed->EscapeLength == strlen(PASTE_END) && !memcmp(ed->Escape,PASTE_END,ed->EscapeLength))
+        ed->InPaste = 0;
+    ed->EscapeLength = 0;
+}
+
+
+/******************************************************************************
+
+ *                Output buffer functions.
+
+ ******************************************************************************/
+
+/*  Appends len bytes, or only reserves room for them if data is NULL.  */
+static void appendOut(outBuf *out,const char *data,size_t len)
+{
+    if(out->Length + len > out->Capacity)
+    {
+        size_t capacity = out->Capacity ? out->Capacity : 256;
+        while(capacity < out->Length + len)
+            capacity *= 2;
+        if((out->Data = (char*)realloc(out->Data,capacity)) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+        out->Capacity = capacity;
+    }
+    if(data != NULL)
+    {
+        memcpy(out->Data + out->Length,data,len);
+        out->Length += len;
+    }
+}
+
+static void appendPrompt(lineEditor *ed,outBuf *out)
+{
+    appendOut(out,ed->Prompt,strlen(ed->Prompt));
+    ed->PromptShown = 1;
+}
+
+/*  Columns of the terminal, 80 if it cannot tell.  */
+static int terminalColumns()
+{
+    struct winsize ws;
+
+    if(ioctl(STDOUT_FILENO,TIOCGWINSZ,&ws) == 0 && ws.ws_col > 0)
+        return ws.ws_col;
+    return 80;
+}
+
+/*  Columns the prompt and input take on screen, 0 if they are not shown.  */
+static int shownWidth(const lineEditor *ed)
+{
+    if(!ed->PromptShown)
+        return 0;
+    return utf8DisplayWidth(ed->Prompt,strlen(ed->Prompt)) + utf8DisplayWidth(ed->Line,ed->Length);
+}
+
+/*  Clears what width columns of prompt and input took, from their first row down.  */
+static void appendClear(outBuf *out,int width)
+{
+    char up[32];
+    int rows = width > 0 ? (width - 1) / terminalColumns() : 0;
+
+    appendOut(out,"\r",1);
+    if(rows > 0)
+        appendOut(out,up,snprintf(up,sizeof(up),"\033[%dA",rows));
+    appendOut(out,"\033[J",3);
+}
+
+static void flushOut(outBuf *out)
+{
+    size_t done=0;
+
+    while(done < out->Length)
+    {
+        ssize_t ret;
+        if((ret = write(STDOUT_FILENO,out->Data + done,out->Length - done)) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("Error while writing to stdout:");
+            break;
+        }
+        done += ret;
+    }
+    out->Length = 0;
+}
@@ -0,0 +1,67 @@
+/*******************************************************************************
+ *
+ * Raw-mode line editor for the chat prompt.
+ *
+ * 1. The terminal is put in raw mode once per session by initLineEditor()
+ *    and put back by restoreTerminal(), which is also registered with
+ *    atexit(). No other code touches the terminal settings.
+ *
+ * 2. Keystrokes are read in bulk and the input line is echoed with one
+ *    write per read batch, so a paste costs a handful of syscalls.
+ *
+ * 3. Bracketed paste is turned on; newlines inside a paste become spaces
+ *    instead of sending the half-pasted message.
+ *
+ * 4. Other threads print through lineEditorPrint(), which writes the text
+ *    above the input line and redraws the prompt and the pending input.
+ *
+ * 5. With a screen attached (screen.h) nothing is written directly: the
+ *    input goes to the screen's input pane and printed text to its message
+ *    pane, and the screen decides when to draw.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_LINE_EDITOR_H
+#define GEEKCHAT_LINE_EDITOR_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "screen.h"
+
+#define EDITOR_READ_SIZE 4096
+#define EDITOR_ESC_SIZE 16
+
+typedef struct lineEditor
+{
+    int Fd;
+    const char *Prompt;
+    char *Line;              /* Input typed so far, not NUL terminated. */
+    size_t Length;
+    size_t Capacity;
+    int InPaste;
+    int PromptShown;
+    char Pending[EDITOR_READ_SIZE];  /* Read ahead past the last Enter. */
+    size_t PendingStart;
+    size_t PendingEnd;
+    char Escape[EDITOR_ESC_SIZE];    /* Escape sequence split across reads. */
+    size_t EscapeLength;
+    screen *Screen;                  /* NULL to write to the terminal. */
+    pthread_mutex_t Lock;
+}lineEditor;
+
+void initLineEditor(lineEditor*,int,const char*,size_t);
+void destroyLineEditor(lineEditor*);
+void lineEditorUseScreen(lineEditor*,screen*);
+
+/* Blocks until Enter. Returns the line length, or -1 on EOF or error. */
+int readLine(lineEditor*,char*);
+
+/* printf above the input line, then redraws the prompt and pending input. */
+void lineEditorPrint(lineEditor*,const char*,...)
+    __attribute__((format(printf,2,3)));
+
+/* Redraws the prompt and pending input on the current line. */
+void lineEditorRedraw(lineEditor*);
+
+void restoreTerminal();
+
+#endif
@@ -0,0 +1,81 @@
+/*******************************************************************************
+ *
+ * Load shapes shared by the traffic generators (chatswarm, chatnetsim).
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "load_shape.h"
+#include "args.h"
+
+
+/*  "N" fixed, "A-B" uniform, "exp:MEAN" exponential; 64 by default.  */
+void parseSize(const char *spec,sizeDist *size,unsigned int limit,const char *usage)
+{
+    char buf[64],*dash;
+    long a,b;
+
+    size->Kind = SIZE_FIXED;
+    size->Min = size->Max = 64;
+    size->Limit = limit;
+    if(spec == NULL)
+        return;
+
+    if(!strncmp(spec,"exp:",4))
+    {
+        if((a = validateAndGetNumber(spec + 4,1,limit)) == -1)
+        {
+            invalidArgs("Invalid mean size.",usage);
+            exit(EXIT_FAILURE);
+        }
+        size->Kind = SIZE_EXP;
+        size->Mean = a;
+        return;
+    }
+
+    snprintf(buf,sizeof(buf),"%s",spec);
+    if((dash = strchr(buf,'-')) != NULL)
+        *dash = 0;
+    a = validateAndGetNumber(buf,0,limit);
+    b = dash != NULL ? validateAndGetNumber(dash + 1,0,limit) : a;
+    if(a == -1 || b == -1 || b < a)
+    {
+        invalidArgs("Invalid size distribution.",usage);
+        exit(EXIT_FAILURE);
+    }
+    size->Kind = dash != NULL ? SIZE_UNIFORM : SIZE_FIXED;
+    size->Min = a;
+    size->Max = b;
+}
+
+unsigned int randomSize(const sizeDist *size,unsigned long long *rng)
+{
+    double value;
+
+    switch(size->Kind)
+    {
+    case SIZE_UNIFORM:
+        return size->Min + shapeRandom(rng) % (size->Max - size->Min + 1);
+    case SIZE_EXP:
+        value = -log(1.0 - shapeUnit(rng)) * size->Mean;
+        return value >= size->Limit ? size->Limit : (unsigned int)value;
+    default:
+        return size->Min;
+    }
+}
+
+/*  xorshift64*, plenty for load shapes and reproducible with -seed.  */
+unsigned long long shapeRandom(unsigned long long *rng)
+{
+    *rng ^= *rng >> 12;
+    *rng ^= *rng << 25;
+    *rng ^= *rng >> 27;
+    return *rng * 2685821657736338717ULL;
+}
+
+double shapeUnit(unsigned long long *rng)
+{
+    return (shapeRandom(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
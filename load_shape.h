@@ -0,0 +1,32 @@
+/*******************************************************************************
+ *
+ * Load shapes shared by the traffic generators (chatswarm, chatnetsim).
+ *
+ * 1. Message sizes are "N" fixed, "A-B" uniform or "exp:MEAN" exponential,
+ *    64 bytes when no -size is given. Each tool passes the largest text
+ *    its protocol carries; exponential draws are cut off there.
+ *
+ * 2. Draws come from the caller's xorshift64* state, so a run is
+ *    reproducible with -seed. A fixed size uses no draw.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_LOAD_SHAPE_H
+#define GEEKCHAT_LOAD_SHAPE_H
+
+typedef enum {SIZE_FIXED,SIZE_UNIFORM,SIZE_EXP} sizeKind;
+
+typedef struct sizeDist
+{
+    sizeKind Kind;
+    unsigned int Min;
+    unsigned int Max;
+    double Mean;
+    unsigned int Limit;
+}sizeDist;
+
+void parseSize(const char*,sizeDist*,unsigned int,const char*);
+unsigned int randomSize(const sizeDist*,unsigned long long*);
+unsigned long long shapeRandom(unsigned long long*);
+double shapeUnit(unsigned long long*);
+
+#endif
@@ -0,0 +1,424 @@
+/*******************************************************************************
+ *
+ * Same-host transport for group members: a shared-memory broadcast ring.
+ *
+ * 1. The memfd holds a page with the localRing header, then Capacity
+ *    bytes of records. A record is a localRecord header and the datagram,
+ *    padded to RECORD_ALIGN; one that would run past the end is put at the
+ *    start instead, after a padding record. Head starts at Capacity, so
+ *    the zeroed memory of a new ring never looks like a written record.
+ *
+ * 2. A reader checks after copying a record that no writer has reserved
+ *    space over it meanwhile, as with a seqlock; if one has, the copy may
+ *    be torn and is dropped.
+ *
+ * 3. A writer that dies between reserving and writing would stop readers
+ *    at its record for good; readers skip past it after LOCAL_STALL_MS.
+ *
+ * 4. The ring is sealed against resizing, so no member can shrink it under
+ *    the others' mappings.
+ *
+ * ****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "local_group.h"
+
+#define RING_MAGIC 0x47434C52
+#define RING_VERSION 1
+#define RING_HEADER 4096
+#define RECORD_ALIGN 16
+#define RECORD_PAD 0xFFFFFFFFu
+#define SERVE_RETRY_MS 50
+
+typedef struct localRecord
+{
+    unsigned long long Position;    /* Where it was reserved, once written. */
+    unsigned int Length;            /* Of the datagram, or RECORD_PAD. */
+    unsigned int Origin;
+}localRecord;
+
+static int fetchRing(localGroup*);
+static int createRing(localGroup*);
+static int mapRing(localGroup*,int);
+static void unmapRing(localGroup*);
+static int serveRing(localGroup*);
+static void* serverLoop(void*);
+static void handOver(localGroup*,int);
+static size_t recordSize(size_t);
+static long long monotonicMs();
+
+
+int joinLocalGroup(localGroup *lg,struct in_addr group,int port)
+{
+    int res,i;
+
+    memset(lg,0,sizeof(*lg));
+    lg->Fd = -1;
+    lg->Listener = -1;
+    lg->Origin = (unsigned int)getpid();
+    lg->Address.sun_family = AF_UNIX;
+    /* Abstract names start with a NUL and vanish with their socket. */
+    res = snprintf(lg->Address.sun_path + 1,sizeof(lg->Address.sun_path) - 1,"geekchat/%u/%s:%d",
+                   (unsigned int)geteuid(),inet_ntoa(group),port);
+    lg->AddressLength = offsetof(struct sockaddr_un,sun_path) + 1 + res;
+
+    /* Nobody serving may mean one member just left and another is taking over. */
+    for(i=0;i<2 && lg->Fd == -1;i++)
+    {
+        if(fetchRing(lg) == 0)
+            break;
+        if(i == 0)
+            usleep(LOCAL_HANDOVER_MS * 1000);
+    }
+    if(lg->Fd == -1)
+    {
+        if(createRing(lg) == -1)
+            return -1;
+        /* Someone set up the same group at the same moment: use theirs. */
+        if(serveRing(lg) == -1)
+        {
+            unmapRing(lg);
+            if(fetchRing(lg) == -1)
+                return -1;
+        }
+    }
+
+    lg->ReadPosition = __atomic_load_n(&lg->Ring->Head,__ATOMIC_ACQUIRE);
+    if((res = pthread_create(&lg->Server,NULL,serverLoop,lg)) != 0)
+    {
+        fprintf(stderr,"\nThread creation failed : %s",strerror(res));
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+void leaveLocalGroup(localGroup *lg)
+{
+    lg->Stop = 1;
+    pthread_join(lg->Server,NULL);
+    if(lg->Listener != -1)
+        close(lg->Listener);
+    unmapRing(lg);
+}
+
+void localSend(localGroup *lg,const char *data,size_t len)
+{
+    localRing *ring = lg->Ring;
+    unsigned long long mask = ring->Capacity - 1;
+    unsigned long long pos,skip;
+    size_t need = recordSize(len);
+    localRecord *rec;
+
+    if(need > ring->Capacity / 4)
+        return;
+    pos = __atomic_load_n(&ring->Head,__ATOMIC_ACQUIRE);
+    do
+    {
+        unsigned long long offset = pos & mask;
+        skip = offset + need > ring->Capacity ? ring->Capacity - offset : 0;
+    }while(!__atomic_compare_exchange_n(&ring->Head,&pos,pos + skip + need,0,
+                                        __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE));
+
+    if(skip > 0)
+    {
+        rec = (localRecord*)(lg->Records + (pos & mask));
+        rec->Length = RECORD_PAD;
+        rec->Origin = lg->Origin;
+        __atomic_store_n(&rec->Position,pos,__ATOMIC_RELEASE);
+        pos += skip;
+    }
+    rec = (localRecord*)(lg->Records + (pos & mask));
+    memcpy(rec + 1,data,len);
+    rec->Length = len;
+    rec->Origin = lg->Origin;
+    __atomic_store_n(&rec->Position,pos,__ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&ring->Wake,1,__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->Waiters,__ATOMIC_SEQ_CST) > 0)
+        syscall(SYS_futex,&ring->Wake,FUTEX_WAKE,INT_MAX,NULL,NULL,0);
+}
+
+int localReceive(localGroup *lg,char *buffer,size_t size,int timeoutMs)
+{
+    localRing *ring = lg->Ring;
+    unsigned long long mask = ring->Capacity - 1;
+    long long deadline = monotonicMs() + timeoutMs;
+
+    while(1)
+    {
+        unsigned int wake = __atomic_load_n(&ring->Wake,__ATOMIC_SEQ_CST);
+        unsigned long long head = __atomic_load_n(&ring->Head,__ATOMIC_ACQUIRE);
+        unsigned long long pos = lg->ReadPosition;
+        localRecord *rec = (localRecord*)(lg->Records + (pos & mask));
+        long long now,left;
+
+        if(head - pos > ring->Capacity)
+        {
+            /* Lapped: whatever was here is gone. */
+            lg->Missed++;
+            lg->ReadPosition = head;
+            continue;
+        }
+        if(pos != head && __atomic_load_n(&rec->Position,__ATOMIC_ACQUIRE) == pos)
+        {
+            unsigned int len = rec->Length,origin = rec->Origin;
+
+            lg->StalledSince = 0;
+            if(len == RECORD_PAD)
+            {
+                lg->ReadPosition = pos + ring->Capacity - (pos & mask);
+                continue;
+            }
+            if(len > size || recordSize(len) > ring->Capacity - (pos & mask))
+            {
+                lg->Missed++;
+                lg->ReadPosition = head;
+                continue;
+            }
+            if(origin != lg->Origin)
+                memcpy(buffer,rec + 1,len);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            /* Overwritten while copying; the next turn finds it lapped. */
+            if(__atomic_load_n(&ring->Head,__ATOMIC_ACQUIRE) > pos + ring->Capacity)
+                continue;
+            lg->ReadPosition = pos + recordSize(len);
+            if(origin == lg->Origin)
+                continue;
+            return len;
+        }
+
+        now = monotonicMs();
+        if(pos != head)
+        {
+            /* Reserved but not written yet; normally only for a moment. */
+            if(lg->StalledSince == 0)
+                lg->StalledSince = now;
+            else if(now - lg->StalledSince > LOCAL_STALL_MS)
+            {
+                lg->Missed++;
+                lg->StalledSince = 0;
+                lg->ReadPosition = head;
+                continue;
+            }
+        }
+        if((left = deadline - now) <= 0)
+            return 0;
+        {
+            struct timespec wait;
+            wait.tv_sec = left / 1000;
+            wait.tv_nsec = (left % 1000) * 1000000;
+            __atomic_add_fetch(&ring->Waiters,1,__ATOMIC_SEQ_CST);
+            syscall(SYS_futex,&ring->Wake,FUTEX_WAIT,wake,&wait,NULL,0);
+            __atomic_sub_fetch(&ring->Waiters,1,__ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+
+/******************************************************************************
+
+ *                Sharing the ring.
+
+ ******************************************************************************/
+
+/*  Asks the member serving the ring for its memfd.  */
+static int fetchRing(localGroup *lg)
+{
+    char byte,control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&byte,1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int sock,fd=-1;
+
+    if((sock = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0)) == -1)
+        return -1;
+    /* Anyone may bind the name first; a ring of theirs would see and forge traffic. */
+    if(connect(sock,(struct sockaddr*)&lg->Address,lg->AddressLength) == -1 ||
+       getsockopt(sock,SOL_SOCKET,SO_PEERCRED,&cred,&len) == -1 || cred.uid != geteuid())
+    {
+        close(sock);
+        return -1;
+    }
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if(recvmsg(sock,&msg,MSG_CMSG_CLOEXEC) == 1 && (cmsg = CMSG_FIRSTHDR(&msg)) != NULL &&
+       cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd,CMSG_DATA(cmsg),sizeof(fd));
+    close(sock);
+    if(fd == -1)
+        return -1;
+    return mapRing(lg,fd);
+}
+
+static int createRing(localGroup *lg)
+{
+    localRing *ring;
+    int fd;
+
+    if((fd = memfd_create("geekchat-group",MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1)
+        return -1;
+    if(ftruncate(fd,RING_HEADER + LOCAL_RING_SIZE) == -1 ||
+       fcntl(fd,F_ADD_SEALS,F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if((ring = (localRing*)mmap(NULL,RING_HEADER,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0)) == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    ring->Capacity = LOCAL_RING_SIZE;
+    ring->Head = LOCAL_RING_SIZE;
+    ring->Version = RING_VERSION;
+    __atomic_store_n(&ring->Magic,RING_MAGIC,__ATOMIC_RELEASE);
+    munmap(ring,RING_HEADER);
+    return mapRing(lg,fd);
+}
+
+/*  Takes over fd; checks it is a ring before using it.  */
+static int mapRing(localGroup *lg,int fd)
+{
+    struct stat st;
+    localRing *ring;
+    char *map;
+
+    if(fstat(fd,&st) == -1 || st.st_size <= RING_HEADER ||
+       (map = (char*)mmap(NULL,st.st_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0)) == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    ring = (localRing*)map;
+    if(ring->Magic != RING_MAGIC || ring->Version != RING_VERSION || ring->Capacity == 0 ||
+       (ring->Capacity & (ring->Capacity - 1)) != 0 || (unsigned long long)st.st_size != RING_HEADER + ring->Capacity)
+    {
+        munmap(map,st.st_size);
+        close(fd);
+        return -1;
+    }
+    lg->Fd = fd;
+    lg->Ring = ring;
+    lg->Records = map + RING_HEADER;
+    lg->MapLength = st.st_size;
+    return 0;
+}
+
+static void unmapRing(localGroup *lg)
+{
+    if(lg->Ring != NULL)
+        munmap(lg->Ring,lg->MapLength);
+    if(lg->Fd != -1)
+        close(lg->Fd);
+    lg->Ring = NULL;
+    lg->Fd = -1;
+}
+
+/*  Takes the group's name, if nobody holds it.  */
+static int serveRing(localGroup *lg)
+{
+    int sock;
+
+    if((sock = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0)) == -1)
+        return -1;
+    if(bind(sock,(struct sockaddr*)&lg->Address,lg->AddressLength) == -1 || listen(sock,16) == -1)
+    {
+        close(sock);
+        return -1;
+    }
+    lg->Listener = sock;
+    return 0;
+}
+
+/*  Serves the memfd, or waits to take the name over from whoever does.  */
+static void* serverLoop(void *arg)
+{
+    localGroup *lg = (localGroup*)arg;
+    struct pollfd pfd;
+    int sock;
+
+    while(!lg->Stop)
+    {
+        if(lg->Listener == -1)
+        {
+            if(serveRing(lg) == -1)
+                usleep(SERVE_RETRY_MS * 1000);
+            continue;
+        }
+        pfd.fd = lg->Listener;
+        pfd.events = POLLIN;
+        if(poll(&pfd,1,SERVE_RETRY_MS) <= 0)
+            continue;
+        if((sock = accept4(lg->Listener,NULL,NULL,SOCK_CLOEXEC)) != -1)
+        {
+            handOver(lg,sock);
+            close(sock);
+        }
+    }
+    return NULL;
+}
+
+static void handOver(localGroup *lg,int sock)
+{
+    char byte=0,control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&byte,1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    /* Other users could read the group's traffic off the ring. */
+    if(getsockopt(sock,SOL_SOCKET,SO_PEERCRED,&cred,&len) == -1 || cred.uid != geteuid())
+        return;
+    memset(&msg,0,sizeof(msg));
+    memset(control,0,sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg),&lg->Fd,sizeof(int));
+    sendmsg(sock,&msg,MSG_NOSIGNAL);
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static size_t recordSize(size_t len)
+{
+    return (sizeof(localRecord) + len + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+static long long monotonicMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,91 @@
+/*******************************************************************************
+ *
+ * Same-host transport for group members: a shared-memory broadcast ring.
+ *
+ * 1. Multicast sockets are opened with IP_MULTICAST_LOOP off, so members
+ *    on one host do not hear each other through the network. They share a
+ *    ring in a memfd instead: every datagram a member sends to the group
+ *    is also written to the ring, and every other member on the host reads
+ *    it from there. Multicast then only carries traffic between hosts.
+ *
+ * 2. The ring holds the datagrams exactly as they go on the wire, sealed
+ *    in encrypted groups, and readers put them through the same checks as
+ *    datagrams from the socket.
+ *
+ * 3. A member hands the memfd to the next one over an abstract UNIX
+ *    socket named after the group and the user id. Abstract names carry no
+ *    permissions, so both ends check the other is the same user
+ *    (SO_PEERCRED); a member that finds the name held by another user goes
+ *    without the ring and uses multicast only. When the member serving it
+ *    leaves, another one takes the name over; the ring lives as long as
+ *    any member maps it and leaves nothing behind in the file system.
+ *
+ * 4. Writers reserve space with a compare and swap on Head and commit a
+ *    record by storing its position in its header. Readers never hold
+ *    writers up: one that falls a whole ring behind skips to the newest
+ *    record and counts what it missed. Waiting readers sleep on a futex
+ *    that writers bump after every record, and a record is read a few
+ *    microseconds after it was written.
+ *
+ * 5. One thread reads a localGroup; any thread may write to it.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_LOCAL_GROUP_H
+#define GEEKCHAT_LOCAL_GROUP_H
+
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+
+#define LOCAL_RING_SIZE (4 * 1024 * 1024)
+#define LOCAL_WAIT_MS 200
+#define LOCAL_STALL_MS 1000
+#define LOCAL_HANDOVER_MS 100
+
+typedef struct localRing
+{
+    unsigned int Magic;
+    unsigned int Version;
+    unsigned long long Capacity;    /* Bytes of records, a power of two. */
+    /* Written by every sender; each word gets a cache line to itself. */
+    unsigned long long Head __attribute__((aligned(64)));   /* Bytes ever reserved. */
+    unsigned int Wake __attribute__((aligned(64)));   /* Futex, bumped per record. */
+    unsigned int Waiters;
+}localRing;
+
+typedef struct localGroup
+{
+    int Fd;                     /* The memfd. */
+    int Listener;               /* Serving the memfd, -1 if another member is. */
+    struct sockaddr_un Address;
+    socklen_t AddressLength;
+    localRing *Ring;
+    char *Records;
+    size_t MapLength;
+    unsigned int Origin;        /* Marks this member's own records. */
+    unsigned long long ReadPosition;
+    long long StalledSince;     /* Ms, while a record is reserved but not written. */
+    unsigned long Missed;       /* Records overwritten before they were read. */
+    pthread_t Server;
+    volatile sig_atomic_t Stop;
+}localGroup;
+
+/*
+ * Joins or sets up the ring of the group on this host. Returns 0, or -1 if
+ * it cannot be had; the member then reaches only other hosts.
+ */
+int joinLocalGroup(localGroup*,struct in_addr,int);
+void leaveLocalGroup(localGroup*);
+
+/*  Writes one datagram for the other members on the host.  */
+void localSend(localGroup*,const char*,size_t);
+
+/*
+ * Copies the next datagram another member wrote into buffer and returns its
+ * length, or 0 if none came within timeoutMs.
+ */
+int localReceive(localGroup*,char*,size_t,int);
+
+#endif
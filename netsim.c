@@ -0,0 +1,386 @@
+/*******************************************************************************
+ *
+ * Simulated network: links with loss, reordering, duplication, delay,
+ * jitter and limited bandwidth, on a virtual clock.
+ *
+ * 1. Pending events sit in a binary heap ordered by due time and then by
+ *    a counter taken when they were scheduled, which keeps runs identical
+ *    whatever order the heap happens to hold equal times in.
+ *
+ * 2. A lost stream segment is sent again after max(NETSIM_MIN_RTO_US, two
+ *    delays and jitter), doubled for every further loss of it, as TCP's
+ *    retransmission timer would. Fast retransmit, which often recovers a
+ *    busy connection sooner, is not modelled, so the figures err long.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "netsim.h"
+#include "load_shape.h"
+
+static long long sendTime(const netsimLink*,size_t);
+static long long jitter(netsim*,const netsimLink*);
+static void schedule(netsim*,netsimEvent*);
+static void heapUp(netsim*,size_t);
+static void heapDown(netsim*,size_t);
+static int earlier(const netsimEvent*,const netsimEvent*);
+static int parseProbability(const char*,double*);
+static int parseTime(const char*,long long*);
+static int parseRate(const char*,double*);
+
+
+void initNetsim(netsim *sim,unsigned long long seed)
+{
+    memset(sim,0,sizeof(*sim));
+    sim->Rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+void freeNetsim(netsim *sim)
+{
+    size_t i;
+    for(i=0;i<sim->Count;i++)
+        free(sim->Heap[i].Data);
+    free(sim->Heap);
+    free(sim->Links);
+    free(sim->Current);
+    memset(sim,0,sizeof(*sim));
+}
+
+int netsimAddLink(netsim *sim,netsimFraming framing,const netsimImpairment *imp)
+{
+    netsimLink *link;
+
+    if((sim->Links = (netsimLink*)realloc(sim->Links,(sim->LinkCount + 1) * sizeof(netsimLink))) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    link = &sim->Links[sim->LinkCount];
+    memset(link,0,sizeof(*link));
+    link->Framing = framing;
+    link->Impairment = *imp;
+    if(link->Impairment.HoldUs == 0)
+        link->Impairment.HoldUs = NETSIM_HOLD_US;
+    return sim->LinkCount++;
+}
+
+void netsimSend(netsim *sim,int index,const char *data,size_t len)
+{
+    netsimLink *link = &sim->Links[index];
+    const netsimImpairment *imp = &link->Impairment;
+    netsimEvent ev;
+    size_t pos;
+    int copies,tries,i;
+
+    memset(&ev,0,sizeof(ev));
+    ev.Kind = NETSIM_DELIVERY;
+    ev.Link = index;
+    if(link->BusyUntil < sim->Now)
+        link->BusyUntil = sim->Now;
+
+    if(link->Framing == NETSIM_STREAM)
+    {
+        for(pos=0;pos<len;pos+=ev.Length)
+        {
+            long long rto = 2 * (imp->DelayUs + imp->JitterUs);
+
+            ev.Length = len - pos < NETSIM_SEGMENT ? len - pos : NETSIM_SEGMENT;
+            link->BusyUntil += sendTime(link,ev.Length);
+            ev.Due = link->BusyUntil + imp->DelayUs + jitter(sim,link);
+            if(rto < NETSIM_MIN_RTO_US)
+                rto = NETSIM_MIN_RTO_US;
+            /* TCP gives up after 15 tries, the connection with it. */
+            for(tries=0;tries<15 && netsimUnit(sim) < imp->Loss;tries++)
+            {
+                link->Retransmitted++;
+                ev.Due += rto;
+                rto *= 2;
+            }
+            /* Nothing overtakes a segment still to be resent. */
+            if(ev.Due < link->LastArrival)
+                ev.Due = link->LastArrival;
+            link->LastArrival = ev.Due;
+            if((ev.Data = (char*)malloc(ev.Length)) == NULL)
+            {
+                perror("Failed during memory allocation:");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(ev.Data,data + pos,ev.Length);
+            schedule(sim,&ev);
+            link->Sent++;
+        }
+        link->InFlight += len;
+        link->Bytes += len;
+        return;
+    }
+
+    if(imp->QueueUs > 0 && link->BusyUntil - sim->Now > imp->QueueUs)
+    {
+        link->Dropped++;
+        return;
+    }
+    link->BusyUntil += sendTime(link,len);
+    link->Sent++;
+    link->Bytes += len;
+    if(netsimUnit(sim) < imp->Loss)
+    {
+        link->Lost++;
+        return;
+    }
+    copies = 1;
+    if(netsimUnit(sim) < imp->Dup)
+    {
+        link->Duplicated++;
+        copies = 2;
+    }
+    for(i=0;i<copies;i++)
+    {
+        ev.Length = len;
+        ev.Due = link->BusyUntil + imp->DelayUs + jitter(sim,link);
+        if(netsimUnit(sim) < imp->Reorder)
+        {
+            link->Reordered++;
+            ev.Due += imp->HoldUs;
+        }
+        if((ev.Data = (char*)malloc(len ? len : 1)) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(ev.Data,data,len);
+        schedule(sim,&ev);
+    }
+}
+
+size_t netsimWritable(netsim *sim,int index)
+{
+    netsimLink *link = &sim->Links[index];
+    return link->InFlight < NETSIM_SEND_BUFFER ? NETSIM_SEND_BUFFER - link->InFlight : 0;
+}
+
+void netsimTimer(netsim *sim,long long due,long tag)
+{
+    netsimEvent ev;
+
+    memset(&ev,0,sizeof(ev));
+    ev.Kind = NETSIM_TIMER;
+    ev.Due = due < sim->Now ? sim->Now : due;
+    ev.Tag = tag;
+    schedule(sim,&ev);
+}
+
+int netsimNext(netsim *sim,netsimEvent *ev)
+{
+    free(sim->Current);
+    sim->Current = NULL;
+    if(sim->Count == 0)
+        return 0;
+
+    *ev = sim->Heap[0];
+    sim->Heap[0] = sim->Heap[--sim->Count];
+    if(sim->Count > 0)
+        heapDown(sim,0);
+    sim->Now = ev->Due;
+    sim->Current = ev->Data;
+    if(ev->Kind == NETSIM_DELIVERY && sim->Links[ev->Link].Framing == NETSIM_STREAM)
+        sim->Links[ev->Link].InFlight -= ev->Length;
+    return 1;
+}
+
+
+/******************************************************************************
+
+ *                Random numbers.
+
+ ******************************************************************************/
+
+/*  xorshift64*, as chatswarm uses.  */
+unsigned long long netsimRandom(netsim *sim)
+{
+    return shapeRandom(&sim->Rng);
+}
+
+double netsimUnit(netsim *sim)
+{
+    return shapeUnit(&sim->Rng);
+}
+
+double netsimExp(netsim *sim,double mean)
+{
+    return -log(1.0 - netsimUnit(sim)) * mean;
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static long long sendTime(const netsimLink *link,size_t len)
+{
+    if(link->Impairment.Rate <= 0)
+        return 0;
+    return (long long)ceil(len * 8 * 1e6 / link->Impairment.Rate);
+}
+
+static long long jitter(netsim *sim,const netsimLink *link)
+{
+    if(link->Impairment.JitterUs <= 0)
+        return 0;
+    return (long long)(netsimRandom(sim) % (unsigned long long)(link->Impairment.JitterUs + 1));
+}
+
+static void schedule(netsim *sim,netsimEvent *ev)
+{
+    if(sim->Count == sim->Capacity)
+    {
+        sim->Capacity = sim->Capacity ? sim->Capacity * 2 : 1024;
+        if((sim->Heap = (netsimEvent*)realloc(sim->Heap,sim->Capacity * sizeof(netsimEvent))) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ev->Order = sim->Order++;
+    sim->Heap[sim->Count] = *ev;
+    heapUp(sim,sim->Count++);
+}
+
+static void heapUp(netsim *sim,size_t i)
+{
+    netsimEvent ev = sim->Heap[i];
+
+    while(i > 0 && earlier(&ev,&sim->Heap[(i - 1) / 2]))
+    {
+        sim->Heap[i] = sim->Heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim->Heap[i] = ev;
+}
+
+static void heapDown(netsim *sim,size_t i)
+{
+    netsimEvent ev = sim->Heap[i];
+
+    while(2*i + 1 < sim->Count)
+    {
+        size_t child = 2*i + 1;
+        if(child + 1 < sim->Count && earlier(&sim->Heap[child + 1],&sim->Heap[child]))
+            child++;
+        if(!earlier(&sim->Heap[child],&ev))
+            break;
+        sim->Heap[i] = sim->Heap[child];
+        i = child;
+    }
+    sim->Heap[i] = ev;
+}
+
+static int earlier(const netsimEvent *a,const netsimEvent *b)
+{
+    return a->Due < b->Due || (a->Due == b->Due && a->Order < b->Order);
+}
+
+
+/******************************************************************************
+
+ *                Impairment parsing.
+
+ ******************************************************************************/
+
+int parseImpairment(const char *spec,netsimImpairment *imp)
+{
+    char buf[256],*item,*save,*value;
+    int ret=0;
+
+    memset(imp,0,sizeof(*imp));
+    if(spec == NULL)
+        return 0;
+    if(strlen(spec) >= sizeof(buf))
+        return -1;
+    strcpy(buf,spec);
+
+    for(item=strtok_r(buf,",",&save);item!=NULL && ret==0;item=strtok_r(NULL,",",&save))
+    {
+        if((value = strchr(item,'=')) == NULL)
+            return -1;
+        *value++ = 0;
+        if(!strcmp(item,"loss"))
+            ret = parseProbability(value,&imp->Loss);
+        else if(!strcmp(item,"dup"))
+            ret = parseProbability(value,&imp->Dup);
+        else if(!strcmp(item,"reorder"))
+            ret = parseProbability(value,&imp->Reorder);
+        else if(!strcmp(item,"hold"))
+            ret = parseTime(value,&imp->HoldUs);
+        else if(!strcmp(item,"delay"))
+            ret = parseTime(value,&imp->DelayUs);
+        else if(!strcmp(item,"jitter"))
+            ret = parseTime(value,&imp->JitterUs);
+        else if(!strcmp(item,"queue"))
+            ret = parseTime(value,&imp->QueueUs);
+        else if(!strcmp(item,"rate"))
+            ret = parseRate(value,&imp->Rate);
+        else
+            return -1;
+    }
+    return ret;
+}
+
+/*  "2%" or "0.02".  */
+static int parseProbability(const char *str,double *p)
+{
+    char *end;
+    double value = strtod(str,&end);
+
+    if(end == str)
+        return -1;
+    if(*end == '%')
+    {
+        value /= 100;
+        end++;
+    }
+    if(*end != 0 || value < 0 || value > 1)
+        return -1;
+    *p = value;
+    return 0;
+}
+
+static int parseTime(const char *str,long long *us)
+{
+    char *end;
+    double value = strtod(str,&end);
+
+    if(end == str || value < 0)
+        return -1;
+    if(!strcmp(end,"us"))
+        *us = (long long)value;
+    else if(!strcmp(end,"ms") || *end == 0)
+        *us = (long long)(value * 1000);
+    else if(!strcmp(end,"s"))
+        *us = (long long)(value * 1000000);
+    else
+        return -1;
+    return 0;
+}
+
+static int parseRate(const char *str,double *bits)
+{
+    char *end;
+    double value = strtod(str,&end);
+
+    if(end == str || value < 0)
+        return -1;
+    if(!strcmp(end,"kbit"))
+        value *= 1e3;
+    else if(!strcmp(end,"mbit"))
+        value *= 1e6;
+    else if(!strcmp(end,"gbit"))
+        value *= 1e9;
+    else if(*end != 0)
+        return -1;
+    *bits = value;
+    return 0;
+}
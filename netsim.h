@@ -0,0 +1,131 @@
+/*******************************************************************************
+ *
+ * Simulated network: links with loss, reordering, duplication, delay,
+ * jitter and limited bandwidth, on a virtual clock.
+ *
+ * 1. Time is simulated, in microseconds since the start of the run.
+ *    netsimNext() jumps the clock to the next event, so a run takes as long
+ *    as its computation, not as long as the time it simulates. All chance
+ *    comes from one generator seeded by the caller: the same seed, links
+ *    and calls give the same run, event for event.
+ *
+ * 2. A datagram link delivers each datagram whole or not at all. It sends
+ *    one datagram at a time at Rate, so a datagram leaves once those before
+ *    it have, and arrives Delay plus up to Jitter after that. Loss drops
+ *    it; Dup delivers a second copy; Reorder holds it back for Hold more,
+ *    so datagrams sent after it overtake it. When Queue is set, a datagram
+ *    that would wait longer than that to leave is dropped, as a full router
+ *    queue would.
+ *
+ * 3. A stream link stands in for a TCP connection: bytes arrive once and
+ *    in order. They travel in segments of NETSIM_SEGMENT bytes. A segment
+ *    that Loss hits is sent again after a retransmission timeout, and the
+ *    segments behind it wait for it. Dup and Reorder do not apply. Bytes
+ *    occupy the link's send buffer until they arrive; netsimWritable() says
+ *    how much more it takes, like a non-blocking socket.
+ *
+ * 4. Timers are events too. netsimTimer() schedules one, and it comes out
+ *    of netsimNext() in time order with the deliveries; events due at the
+ *    same time come out in the order they were scheduled.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_NETSIM_H
+#define GEEKCHAT_NETSIM_H
+
+#include <stddef.h>
+
+#define NETSIM_SEGMENT 1448
+#define NETSIM_SEND_BUFFER (256 * 1024)
+#define NETSIM_MIN_RTO_US 200000
+#define NETSIM_HOLD_US 10000
+
+typedef enum {NETSIM_DATAGRAM,NETSIM_STREAM} netsimFraming;
+
+typedef struct netsimImpairment
+{
+    double Loss;              /* Probabilities, 0 to 1. */
+    double Dup;
+    double Reorder;
+    long long DelayUs;
+    long long JitterUs;
+    long long HoldUs;         /* Extra delay of a reordered datagram. */
+    long long QueueUs;        /* Longest wait to be sent, 0 for no limit. */
+    double Rate;              /* Bits per second, 0 for no limit. */
+}netsimImpairment;
+
+typedef struct netsimLink
+{
+    netsimFraming Framing;
+    netsimImpairment Impairment;
+    long long BusyUntil;      /* When the link is done sending what it has. */
+    long long LastArrival;    /* Streams only; arrivals keep their order. */
+    size_t InFlight;          /* Streams only; sent bytes not arrived yet. */
+    unsigned long long Sent;
+    unsigned long long Bytes;
+    unsigned long long Lost;
+    unsigned long long Dropped;       /* By the Queue limit. */
+    unsigned long long Duplicated;
+    unsigned long long Reordered;
+    unsigned long long Retransmitted;
+}netsimLink;
+
+typedef enum {NETSIM_DELIVERY,NETSIM_TIMER} netsimKind;
+
+typedef struct netsimEvent
+{
+    long long Due;
+    unsigned long long Order;     /* Scheduling order, breaks ties. */
+    netsimKind Kind;
+    int Link;                     /* Deliveries. */
+    long Tag;                     /* Timers. */
+    size_t Length;
+    char *Data;
+}netsimEvent;
+
+typedef struct netsim
+{
+    long long Now;
+    unsigned long long Rng;
+    unsigned long long Order;
+    netsimLink *Links;
+    int LinkCount;
+    netsimEvent *Heap;            /* Min-heap by Due, then Order. */
+    size_t Count;
+    size_t Capacity;
+    char *Current;                /* Data of the last event handed out. */
+}netsim;
+
+/*  Seed 0 is replaced by a fixed one, so every run is still repeatable.  */
+void initNetsim(netsim*,unsigned long long);
+void freeNetsim(netsim*);
+
+/*  Returns the index of the new link.  */
+int netsimAddLink(netsim*,netsimFraming,const netsimImpairment*);
+
+/*  Sends bytes on a link. On a stream, no more than netsimWritable().  */
+void netsimSend(netsim*,int,const char*,size_t);
+size_t netsimWritable(netsim*,int);
+
+/*  Schedules a timer event with the tag at the given time.  */
+void netsimTimer(netsim*,long long,long);
+
+/*
+ * Takes the next event and moves the clock to it. Returns 0 once nothing is
+ * left. The event's Data stays valid until the next call.
+ */
+int netsimNext(netsim*,netsimEvent*);
+
+/*  The run's random numbers, for the traffic as well as the links.  */
+unsigned long long netsimRandom(netsim*);
+double netsimUnit(netsim*);
+double netsimExp(netsim*,double);
+
+/*
+ * "loss=1%,dup=0.1%,reorder=2%,hold=10ms,delay=20ms,jitter=5ms,rate=10mbit,
+ * queue=50ms" in any order, any of them left out. Times take us, ms or s
+ * (ms if none), rates kbit, mbit or gbit (bits per second if none).
+ * Returns 0, or -1 if spec is not valid.
+ */
+int parseImpairment(const char*,netsimImpairment*);
+
+#endif
@@ -0,0 +1,330 @@
+/*******************************************************************************
+ *
+ * Socket helpers shared by the group and session front-ends.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/ip.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/filter.h>
+#include "netutil.h"
+#include "protocol.h"
+
+/*  Classic BPF sees the UDP header in front of the payload.  */
+#define UDP_HEADER_SIZE 8
+
+
+void getBinaryAddress(const char *hostname,struct in_addr *hostaddress)
+{
+    struct hostent *hostaddr;
+
+    if ((hostaddr = gethostbyname(hostname)) == NULL)
+    {
+        perror("Error during hostname resolution");
+        exit(EXIT_FAILURE);
+    }
+    hostaddress->s_addr = *(int*)*(hostaddr->h_addr_list);
+}
+
+
+/******************************************************************************
+ 
+ *                Multicast sockets.
+ 
+ ******************************************************************************/
+
+int getMultiCastSock(struct in_addr multicastIp, int port)
+{
+    int socketd,value;
+    struct sockaddr_in bindAddr;
+    struct ip_mreq multiProp;
+
+    if ((socketd = socket(AF_INET,SOCK_DGRAM,0)) == -1)
+    {	
+        perror("Error during multicast socket creation");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Both must be set before bind, for receive shards and local members. */
+    value = 1;
+    if(setsockopt(socketd,SOL_SOCKET,SO_REUSEADDR,(char*)&value,sizeof(value)) == -1)
+    {
+        perror("\nError during setting SO_REUSEADDR socket options:");
+        exit(EXIT_FAILURE);
+    }
+    if(setsockopt(socketd,SOL_SOCKET,SO_REUSEPORT,(char*)&value,sizeof(value)) == -1)
+    {
+        perror("\nError during setting SO_REUSEPORT socket options:");
+        exit(EXIT_FAILURE);
+    }
+
+    bindAddr.sin_family = AF_INET;
+    bindAddr.sin_port = htons(port);
+    bindAddr.sin_addr.s_addr = INADDR_ANY;
+    if(bind(socketd,(struct sockaddr*)&bindAddr,sizeof(bindAddr)) == -1)
+    {
+        perror("Error during socket bind.");
+        exit(EXIT_FAILURE);
+    }
+
+    multiProp.imr_multiaddr.s_addr = multicastIp.s_addr;
+    multiProp.imr_interface.s_addr = INADDR_ANY;
+
+    if(setsockopt(socketd,IPPROTO_IP,IP_ADD_MEMBERSHIP,(char*)&multiProp,sizeof(multiProp)) == -1)
+    {
+        perror("\nError during setting IP_ADD_MEMBERSHIP socket options:");
+        exit(EXIT_FAILURE);
+    }
+
+    value = 0;
+    if(setsockopt(socketd,IPPROTO_IP,IP_MULTICAST_LOOP,&value,sizeof(value)) == -1)
+    {
+        perror("\nError during setting IP_MULTICAST_LOOP socket options:");
+        exit(EXIT_FAILURE);
+    }
+
+    return socketd;
+}
+
+/*
+ * Multicast datagrams reach every socket of a SO_REUSEPORT group, so each
+ * receive shard gets a kernel filter that keeps only its share. Sequenced
+ * packets are spread by sender id plus sequence number; unsequenced ones
+ * all go to shard 0, which keeps them in arrival order.
+ */
+void attachShardFilter(int sd,int shard,int shardCount)
+{
+    struct sock_filter code[] =
+    {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS,UDP_HEADER_SIZE),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,GROUP_FLAG_SEQ,1,0),
+        BPF_STMT(BPF_RET | BPF_K,shard == 0 ? 0xFFFFFFFF : 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,UDP_HEADER_SIZE + GROUP_SEQUENCE_OFFSET),
+        BPF_STMT(BPF_MISC | BPF_TAX,0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,UDP_HEADER_SIZE + GROUP_SENDER_OFFSET),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_X,0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,shardCount),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,shard,0,1),
+        BPF_STMT(BPF_RET | BPF_K,0xFFFFFFFF),
+        BPF_STMT(BPF_RET | BPF_K,0)
+    };
+    struct sock_fprog prog;
+
+    prog.len = sizeof(code)/sizeof(code[0]);
+    prog.filter = code;
+    if(setsockopt(sd,SOL_SOCKET,SO_ATTACH_FILTER,&prog,sizeof(prog)) == -1)
+    {
+        perror("\nError during setting SO_ATTACH_FILTER socket options:");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void leaveGroup(int sd,struct in_addr multicastIp)
+{
+    struct ip_mreq multiProp;
+    multiProp.imr_multiaddr.s_addr = multicastIp.s_addr;
+    multiProp.imr_interface.s_addr = INADDR_ANY;
+    
+    if(setsockopt(sd,IPPROTO_IP,IP_DROP_MEMBERSHIP,(char*)&multiProp,sizeof(multiProp)) == -1)
+    {
+        perror("\nError while leaving the group");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Send-only socket for tools that feed a group. With loop set, members on
+ * this host get the packets too.
+ */
+int getMultiCastSender(int loop)
+{
+    int socketd,ttl=1;
+
+    if ((socketd = socket(AF_INET,SOCK_DGRAM,0)) == -1)
+    {
+        perror("Error during multicast socket creation");
+        exit(EXIT_FAILURE);
+    }
+    if(setsockopt(socketd,IPPROTO_IP,IP_MULTICAST_LOOP,&loop,sizeof(loop)) == -1)
+    {
+        perror("\nError during setting IP_MULTICAST_LOOP socket options:");
+        exit(EXIT_FAILURE);
+    }
+    if(setsockopt(socketd,IPPROTO_IP,IP_MULTICAST_TTL,&ttl,sizeof(ttl)) == -1)
+    {
+        perror("\nError during setting IP_MULTICAST_TTL socket options:");
+        exit(EXIT_FAILURE);
+    }
+    return socketd;
+}
+
+/*
+ * Lets blocking reads poll the device queue for up to us microseconds
+ * before sleeping (SO_BUSY_POLL). Raising it above net.core.busy_read needs
+ * CAP_NET_ADMIN; returns -1 if it cannot be set.
+ */
+int setBusyPoll(int sock,int us)
+{
+    if(setsockopt(sock,SOL_SOCKET,SO_BUSY_POLL,&us,sizeof(us)) == -1)
+    {
+        perror("\nError during setting SO_BUSY_POLL socket options:");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reads without blocking for up to spinUs microseconds, then blocks. A
+ * datagram that comes while spinning is read without the wakeup a sleeping
+ * thread needs; spinning after each datagram keeps bursts that fast. The
+ * sender's address goes to from.
+ */
+ssize_t spinRecv(int sock,void *buffer,size_t len,struct sockaddr_in *from,int spinUs)
+{
+    struct timespec start,now;
+    socklen_t fromLen = sizeof(*from);
+    ssize_t ret;
+
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    do
+    {
+        if((ret = recvfrom(sock,buffer,len,MSG_DONTWAIT,(struct sockaddr*)from,&fromLen)) != -1 ||
+           (errno != EAGAIN && errno != EWOULDBLOCK))
+            return ret;
+        clock_gettime(CLOCK_MONOTONIC,&now);
+    }while((now.tv_sec - start.tv_sec) * 1000000LL + (now.tv_nsec - start.tv_nsec) / 1000 < spinUs);
+    return recvfrom(sock,buffer,len,0,(struct sockaddr*)from,&fromLen);
+}
+
+
+/******************************************************************************
+ 
+ *                Tcp sockets.
+ 
+ ******************************************************************************/
+
+int activeSock(const char *host,int port)
+{
+    int socketd;
+
+    if((socketd = tryActiveSock(host,port)) == -1)
+        exit(EXIT_FAILURE);
+    return socketd;
+}
+
+/*  Like activeSock(), but returns -1 if the peer cannot be reached.  */
+int tryActiveSock(const char *host,int port)
+{
+    int socketd;
+    struct sockaddr_in address;
+    struct hostent *hostaddr;
+    
+    if((socketd = socket(AF_INET,SOCK_STREAM,0)) == -1)
+    {
+       perror("\nError during socket creation: ");
+       exit(EXIT_FAILURE);
+    }
+    
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    /* Resolved each time, a VPN that is down may take DNS with it. */
+    if((hostaddr = gethostbyname(host)) == NULL)
+    {
+        fprintf(stderr,"\nError during hostname resolution: %s",hstrerror(h_errno));
+        closeSocket(socketd,"Error while closing socket:");
+        return -1;
+    }
+    address.sin_addr.s_addr = *(int*)*(hostaddr->h_addr_list);
+    
+    if(connect(socketd,(struct sockaddr*)&address,(socklen_t)sizeof(address)) == -1)
+    {
+        perror("\nError during socket connection:");
+        closeSocket(socketd,"Error while closing socket:");
+        return -1;
+    }
+    setSessionOptions(socketd);
+
+    return socketd;
+}
+
+/*
+ * With reusePort several sockets, e.g. one per thread, can listen on the
+ * port and the kernel spreads connections over them.
+ */
+int passiveSock(int port,int reusePort)
+{
+    int socketd,value;
+    struct sockaddr_in address;
+    
+    if((socketd = socket(AF_INET,SOCK_STREAM,0)) == -1)
+    {
+       perror("\nError during socket creation: ");
+       exit(EXIT_FAILURE);
+    }
+
+    value = 1;
+    if(setsockopt(socketd,SOL_SOCKET,SO_REUSEADDR,&value,sizeof(int)) == -1)
+    {
+        perror("\nError during setting SO_REUSEADDR socket options:");
+        exit(EXIT_FAILURE);
+    }
+    if(reusePort && setsockopt(socketd,SOL_SOCKET,SO_REUSEPORT,&value,sizeof(int)) == -1)
+    {
+        perror("\nError during setting SO_REUSEPORT socket options:");
+        exit(EXIT_FAILURE);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = INADDR_ANY;
+    if(bind(socketd,(struct sockaddr*)&address,sizeof(address)) == -1)
+    {
+        perror("\nError during socket bind: ");
+        exit(EXIT_FAILURE);
+    }
+    
+    /* Servers sharing the port take many connections at once. */
+    if (listen(socketd, reusePort ? SOMAXCONN : QUEUE_SIZE) == -1)
+    {
+        perror("\nError during socket listen: ");
+        exit(EXIT_FAILURE);
+    }
+    return socketd;
+}
+
+/*  Options every chat session socket gets, on either side.  */
+void setSessionOptions(int sock)
+{
+    int value=1;
+    struct timeval timeout;
+
+    if(setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&value,sizeof(int)) == -1)
+    {
+        perror("\nError during setting TCP_NODELAY socket options:");
+        exit(EXIT_FAILURE);
+    }
+    timeout.tv_sec = READTIMEOUT_SEC;
+    timeout.tv_usec = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout)) == -1)
+    {
+        perror("\nError during setting of socket options:");
+    }
+}
+
+void closeSocket(int sd,const char *message)
+{
+    if(close(sd) == -1)
+    {
+        perror(message);
+    }
+}
@@ -0,0 +1,39 @@
+/*******************************************************************************
+ *
+ * Socket helpers shared by the group and session front-ends.
+ *
+ * 1. Like the rest of GeekChat, these print the failing call and exit on
+ *    errors the application cannot recover from.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_NETUTIL_H
+#define GEEKCHAT_NETUTIL_H
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+/*  Macros for Tcp.  */
+#define QUEUE_SIZE 5
+#define READTIMEOUT_SEC 900
+
+void getBinaryAddress(const char*,struct in_addr*);
+
+/*  Multicast sockets.  */
+int getMultiCastSock(struct in_addr,int);
+void attachShardFilter(int,int,int);
+void leaveGroup(int,struct in_addr);
+int getMultiCastSender(int);
+
+/*  Low latency receiving, see setBusyPoll() and spinRecv() in netutil.c.  */
+int setBusyPoll(int,int);
+ssize_t spinRecv(int,void*,size_t,struct sockaddr_in*,int);
+
+/*  Tcp sockets.  */
+int activeSock(const char*,int);
+int tryActiveSock(const char*,int);
+int passiveSock(int,int);
+void setSessionOptions(int);
+
+void closeSocket(int,const char*);
+
+#endif
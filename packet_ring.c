@@ -0,0 +1,303 @@
+/*******************************************************************************
+ *
+ * PACKET_MMAP receive backend for passive group observers.
+ *
+ * 1. The socket is SOCK_DGRAM, so the kernel strips the link layer and
+ *    every frame in a block starts at the IP header.
+ *
+ * 2. The filter loads the destination address and port of the datagram
+ *    once per configured group; the kernel keeps a packet if any matches.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include "packet_ring.h"
+#include "netutil.h"
+
+#define IP_PROTOCOL_OFFSET 9
+#define IP_FRAGMENT_OFFSET 6
+#define IP_DEST_OFFSET 16
+#define UDP_DEST_PORT_OFFSET 2
+#define IP_FRAGMENT_BITS 0x3FFF
+
+static void attachGroupFilter(packetRing*);
+static int joinGroup(struct in_addr);
+static void walkBlock(packetRing*,struct tpacket_block_desc*,ringHandler,void*);
+
+
+void openPacketRing(packetRing *ring,const char *ifname,const ringGroup *groups,int count)
+{
+    int version = TPACKET_V3,i;
+    struct tpacket_req3 req;
+    struct sockaddr_ll addr;
+
+    memset(ring,0,sizeof(*ring));
+    if(count < 1 || count > MAX_RING_GROUPS)
+    {
+        fprintf(stderr,"\nBetween 1 and %d groups can be followed.\n",MAX_RING_GROUPS);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(ring->Groups,groups,count * sizeof(ringGroup));
+    ring->GroupCount = count;
+
+    if((ring->Sock = socket(AF_PACKET,SOCK_DGRAM,htons(ETH_P_IP))) == -1)
+    {
+        perror("Error during packet socket creation");
+        exit(EXIT_FAILURE);
+    }
+    /* Filter before bind, so nothing unwanted lands in the ring. */
+    attachGroupFilter(ring);
+
+    if(setsockopt(ring->Sock,SOL_PACKET,PACKET_VERSION,&version,sizeof(version)) == -1)
+    {
+        perror("\nError during setting PACKET_VERSION socket options:");
+        exit(EXIT_FAILURE);
+    }
+    memset(&req,0,sizeof(req));
+    req.tp_block_size = RING_BLOCK_SIZE;
+    req.tp_block_nr = RING_BLOCK_COUNT;
+    req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    req.tp_frame_nr = (RING_BLOCK_SIZE / req.tp_frame_size) * RING_BLOCK_COUNT;
+    req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT_MS;
+    if(setsockopt(ring->Sock,SOL_PACKET,PACKET_RX_RING,&req,sizeof(req)) == -1)
+    {
+        perror("\nError during setting PACKET_RX_RING socket options:");
+        exit(EXIT_FAILURE);
+    }
+    ring->MapLength = (size_t)RING_BLOCK_SIZE * RING_BLOCK_COUNT;
+    ring->Map = mmap(NULL,ring->MapLength,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_LOCKED,ring->Sock,0);
+    if(ring->Map == MAP_FAILED)
+    {
+        /* MAP_LOCKED fails without enough RLIMIT_MEMLOCK; fall back. */
+        ring->Map = mmap(NULL,ring->MapLength,PROT_READ | PROT_WRITE,MAP_SHARED,ring->Sock,0);
+        if(ring->Map == MAP_FAILED)
+        {
+            perror("Error while mapping the packet ring");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(&addr,0,sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_IP);
+    if(ifname != NULL && (addr.sll_ifindex = if_nametoindex(ifname)) == 0)
+    {
+        perror("Unknown interface");
+        exit(EXIT_FAILURE);
+    }
+    if(bind(ring->Sock,(struct sockaddr*)&addr,sizeof(addr)) == -1)
+    {
+        perror("Error during packet socket bind.");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i=0;i<count;i++)
+    {
+        ring->Groups[i].MemberSock = joinGroup(groups[i].Group);
+        if((ring->Groups[i].Dedup = (dedupFilter*)malloc(sizeof(dedupFilter))) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+        initDedup(ring->Groups[i].Dedup);
+    }
+}
+
+void closePacketRing(packetRing *ring)
+{
+    int i;
+
+    for(i=0;i<ring->GroupCount;i++)
+    {
+        closeSocket(ring->Groups[i].MemberSock,"Error while closing socket:");
+        free(ring->Groups[i].Dedup);
+    }
+    if(munmap(ring->Map,ring->MapLength) == -1)
+        perror("Error while unmapping the packet ring");
+    closeSocket(ring->Sock,"Error while closing socket:");
+    ring->Map = NULL;
+}
+
+int readRingBlock(packetRing *ring,ringHandler handler,void *context,int timeoutMs)
+{
+    struct tpacket_block_desc *block;
+    unsigned long before = ring->Packets;
+
+    block = (struct tpacket_block_desc*)(ring->Map + (size_t)ring->Current * RING_BLOCK_SIZE);
+    if(!(block->hdr.bh1.block_status & TP_STATUS_USER))
+    {
+        struct pollfd pfd;
+        int ret;
+
+        pfd.fd = ring->Sock;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+        if((ret = poll(&pfd,1,timeoutMs)) == -1)
+        {
+            if(errno == EINTR)
+                return 0;
+            perror("Error while waiting for the packet ring");
+            return -1;
+        }
+        if(!(block->hdr.bh1.block_status & TP_STATUS_USER))
+            return 0;
+    }
+
+    walkBlock(ring,block,handler,context);
+    __atomic_store_n(&block->hdr.bh1.block_status,TP_STATUS_KERNEL,__ATOMIC_RELEASE);
+    ring->Current = (ring->Current + 1) % RING_BLOCK_COUNT;
+    return (int)(ring->Packets - before);
+}
+
+unsigned int ringDrops(packetRing *ring)
+{
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+
+    if(getsockopt(ring->Sock,SOL_PACKET,PACKET_STATISTICS,&stats,&len) == -1)
+    {
+        perror("\nError during getting PACKET_STATISTICS socket options:");
+        return 0;
+    }
+    return stats.tp_drops;
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static void walkBlock(packetRing *ring,struct tpacket_block_desc *block,ringHandler handler,void *context)
+{
+    struct tpacket3_hdr *frame;
+    unsigned int i;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    frame = (struct tpacket3_hdr*)((char*)block + block->hdr.bh1.offset_to_first_pkt);
+    for(i=0;i<block->hdr.bh1.num_pkts;i++)
+    {
+        struct sockaddr_ll *link;
+        struct iphdr *ip;
+        struct udphdr *udp;
+        size_t headerLength,udpLength;
+        packet msg;
+        int g,payloadLength;
+
+        link = (struct sockaddr_ll*)((char*)frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        ip = (struct iphdr*)((char*)frame + frame->tp_net);
+        headerLength = ip->ihl * 4;
+
+        /* Loopback shows local sends twice; the outgoing copy is skipped. */
+        if(link->sll_pkttype == PACKET_OUTGOING || frame->tp_snaplen < headerLength + sizeof(*udp))
+            goto next;
+        udp = (struct udphdr*)((char*)ip + headerLength);
+        udpLength = ntohs(udp->len);
+        if(udpLength < sizeof(*udp) || headerLength + udpLength > frame->tp_snaplen)
+        {
+            ring->Malformed++;
+            goto next;
+        }
+
+        for(g=0;g<ring->GroupCount;g++)
+        {
+            if(ip->daddr == ring->Groups[g].Group.s_addr && ntohs(udp->dest) == ring->Groups[g].Port)
+                break;
+        }
+        if(g == ring->GroupCount)
+            goto next;
+
+        payloadLength = udpLength - sizeof(*udp);
+        if(dedupSeen(ring->Groups[g].Dedup,(char*)(udp + 1),payloadLength))
+        {
+            ring->Duplicates++;
+            goto next;
+        }
+        if(ring->Groups[g].Crypto != NULL &&
+           (payloadLength = openGroupPacket(ring->Groups[g].Crypto,(char*)(udp + 1),payloadLength)) == -1)
+        {
+            ring->Malformed++;
+            goto next;
+        }
+        dedupRecord(ring->Groups[g].Dedup,(char*)(udp + 1),payloadLength);
+        if(decodePacket(&groupFormat,(char*)(udp + 1),payloadLength,&msg) == -1)
+        {
+            ring->Malformed++;
+            goto next;
+        }
+        ring->Packets++;
+        handler(g,&msg,context);
+next:
+        frame = (struct tpacket3_hdr*)((char*)frame + frame->tp_next_offset);
+    }
+}
+
+static void attachGroupFilter(packetRing *ring)
+{
+    struct sock_filter code[5 + 4 * MAX_RING_GROUPS + 2];
+    struct sock_fprog prog;
+    int n=0,g,accept;
+
+    /* Offsets are relative to the IP header. */
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,IP_PROTOCOL_OFFSET);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,IPPROTO_UDP,0,4 * ring->GroupCount + 3);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS,IP_FRAGMENT_OFFSET);
+    code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,IP_FRAGMENT_BITS,4 * ring->GroupCount + 1,0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_B | BPF_MSH,0);
+
+    /* Rejected packets fall through to drop, the one after it accepts. */
+    accept = 5 + 4 * ring->GroupCount + 1;
+    for(g=0;g<ring->GroupCount;g++)
+    {
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,IP_DEST_OFFSET);
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,ntohl(ring->Groups[g].Group.s_addr),0,2);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND,UDP_DEST_PORT_OFFSET);
+        code[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,ring->Groups[g].Port,accept - n - 1,0);
+        n++;
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,0xFFFFFFFF);
+
+    prog.len = n;
+    prog.filter = code;
+    if(setsockopt(ring->Sock,SOL_SOCKET,SO_ATTACH_FILTER,&prog,sizeof(prog)) == -1)
+    {
+        perror("\nError during setting SO_ATTACH_FILTER socket options:");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*  An unbound UDP socket: holds the membership but never receives.  */
+static int joinGroup(struct in_addr group)
+{
+    int sock;
+    struct ip_mreq multiProp;
+
+    if((sock = socket(AF_INET,SOCK_DGRAM,0)) == -1)
+    {
+        perror("Error during multicast socket creation");
+        exit(EXIT_FAILURE);
+    }
+    multiProp.imr_multiaddr.s_addr = group.s_addr;
+    multiProp.imr_interface.s_addr = INADDR_ANY;
+    if(setsockopt(sock,IPPROTO_IP,IP_ADD_MEMBERSHIP,(char*)&multiProp,sizeof(multiProp)) == -1)
+    {
+        perror("\nError during setting IP_ADD_MEMBERSHIP socket options:");
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
@@ -0,0 +1,72 @@
+/*******************************************************************************
+ *
+ * PACKET_MMAP receive backend for passive group observers.
+ *
+ * 1. An AF_PACKET socket with a TPACKET_V3 ring shared with the kernel.
+ *    The kernel fills whole blocks of packets and the reader walks them in
+ *    place, so many datagrams cost one poll() and no copies.
+ *
+ * 2. A kernel filter keeps only unfragmented UDP datagrams sent to one of
+ *    the configured groups and ports. Group messages large enough to be
+ *    fragmented by IP are not seen.
+ *
+ * 3. Copies of a packet, e.g. seen on two interfaces, are dropped.
+ *
+ * 4. Packets handed to the handler are opened and decoded in place: Name and Text
+ *    point into the ring and are valid until the handler returns.
+ *
+ * 5. Needs CAP_NET_RAW. The ring never sends.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_PACKET_RING_H
+#define GEEKCHAT_PACKET_RING_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include "protocol.h"
+#include "group_crypto.h"
+#include "dedup.h"
+
+#define MAX_RING_GROUPS 32
+#define RING_BLOCK_SIZE (1 << 20)
+#define RING_BLOCK_COUNT 32
+#define RING_BLOCK_TIMEOUT_MS 50
+
+typedef struct ringGroup
+{
+    struct in_addr Group;
+    int Port;
+    int MemberSock;     /* Plain UDP socket holding the group membership. */
+    groupCrypto *Crypto;    /* Opens sealed packets, NULL for plain groups. */
+    dedupFilter *Dedup;
+}ringGroup;
+
+/*  Called per packet with the index of the group it was sent to.  */
+typedef void (*ringHandler)(int,packet*,void*);
+
+typedef struct packetRing
+{
+    int Sock;
+    char *Map;
+    size_t MapLength;
+    unsigned int Current;     /* Next block to look at. */
+    ringGroup Groups[MAX_RING_GROUPS];
+    int GroupCount;
+    unsigned long Packets;
+    unsigned long Malformed;
+    unsigned long Duplicates;
+}packetRing;
+
+void openPacketRing(packetRing*,const char*,const ringGroup*,int);
+void closePacketRing(packetRing*);
+
+/*
+ * Waits up to timeoutMs for a block, hands its packets to the handler and
+ * gives the block back. Returns the number of packets, or -1 on error.
+ */
+int readRingBlock(packetRing*,ringHandler,void*,int);
+
+/*  Packets the kernel dropped because the ring was full, since last call.  */
+unsigned int ringDrops(packetRing*);
+
+#endif
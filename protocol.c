@@ -0,0 +1,584 @@
+/*******************************************************************************
+ *
+ * GeekChat wire formats.
+ *
+ * 1. decodePacket() makes one pass over the field table. Every field costs
+ *    a single bounds check against the bytes left, and nothing is copied.
+ *
+ * 2. The incremental decoder keeps a datagram's length in front of it in
+ *    the buffer, so datagram and stream formats share one buffer scheme.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+
+#define PACKET_INT(type,member,max) \
+    {type,offsetof(packet,member),0,max,0}
+#define PACKET_OPTIONAL(type,member,max,flag) \
+    {type,offsetof(packet,member),0,max,flag}
+#define PACKET_BYTES(type,length,data,max) \
+    {type,offsetof(packet,length),offsetof(packet,data),max,0}
+
+#define MEMBER_INT(pkt,offset) (*(unsigned int*)((char*)(pkt) + (offset)))
+#define MEMBER_U64(pkt,offset) (*(unsigned long long*)((char*)(pkt) + (offset)))
+#define MEMBER_PTR(pkt,offset) (*(char**)((char*)(pkt) + (offset)))
+
+#define DATAGRAM_PREFIX sizeof(unsigned int)
+#define DECODER_MIN_SPACE 4096
+
+
+/******************************************************************************
+
+ *                Wire format tables.
+
+ ******************************************************************************/
+
+static const fieldSpec groupTextFields[] =
+{
+    PACKET_INT(FIELD_OPCODE,Opcode,GROUP_OPCODE_MASK),
+    PACKET_OPTIONAL(FIELD_U32,SenderId,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_OPTIONAL(FIELD_U32,Sequence,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_OPTIONAL(FIELD_U16,Channel,0xFFFF,GROUP_FLAG_CHANNEL),
+    PACKET_OPTIONAL(FIELD_U64,SendTime,0,GROUP_FLAG_TIME),
+    PACKET_INT(FIELD_U8,NameLength,MAX_NAME_LENGTH),
+    PACKET_BYTES(FIELD_BYTES,NameLength,Name,MAX_NAME_LENGTH),
+    PACKET_INT(FIELD_U16,TextLength,MAX_TEXT_LENGTH),
+    PACKET_BYTES(FIELD_BYTES,TextLength,Text,MAX_TEXT_LENGTH)
+};
+
+static const fieldSpec groupByeFields[] =
+{
+    PACKET_INT(FIELD_OPCODE,Opcode,GROUP_OPCODE_MASK),
+    PACKET_OPTIONAL(FIELD_U32,SenderId,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_OPTIONAL(FIELD_U32,Sequence,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_BYTES(FIELD_REST,NameLength,Name,MAX_NAME_LENGTH)
+};
+
+static const fieldSpec groupFragFields[] =
+{
+    PACKET_INT(FIELD_OPCODE,Opcode,GROUP_OPCODE_MASK),
+    PACKET_OPTIONAL(FIELD_U32,SenderId,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_OPTIONAL(FIELD_U32,Sequence,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_BYTES(FIELD_REST,TextLength,Text,MAX_TEXT_LENGTH)
+};
+
+static const fieldSpec groupCatchupFields[] =
+{
+    PACKET_INT(FIELD_OPCODE,Opcode,GROUP_OPCODE_MASK),
+    PACKET_OPTIONAL(FIELD_U32,SenderId,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_OPTIONAL(FIELD_U32,Sequence,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_INT(FIELD_U32,Address,0xFFFFFFFF),
+    PACKET_INT(FIELD_U16,Port,0xFFFF),
+    PACKET_INT(FIELD_U16,Seconds,0xFFFF)
+};
+
+static const fieldSpec groupClaimFields[] =
+{
+    PACKET_INT(FIELD_OPCODE,Opcode,GROUP_OPCODE_MASK),
+    PACKET_OPTIONAL(FIELD_U32,SenderId,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_OPTIONAL(FIELD_U32,Sequence,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_INT(FIELD_U32,Target,0xFFFFFFFF)
+};
+
+static const fieldSpec groupPingFields[] =
+{
+    PACKET_INT(FIELD_OPCODE,Opcode,GROUP_OPCODE_MASK),
+    PACKET_OPTIONAL(FIELD_U32,SenderId,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_OPTIONAL(FIELD_U32,Sequence,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_INT(FIELD_U64,SendTime,0)
+};
+
+static const fieldSpec groupPongFields[] =
+{
+    PACKET_INT(FIELD_OPCODE,Opcode,GROUP_OPCODE_MASK),
+    PACKET_OPTIONAL(FIELD_U32,SenderId,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_OPTIONAL(FIELD_U32,Sequence,0xFFFFFFFF,GROUP_FLAG_SEQ),
+    PACKET_INT(FIELD_U32,Target,0xFFFFFFFF),
+    PACKET_INT(FIELD_U64,SendTime,0),
+    PACKET_BYTES(FIELD_REST,NameLength,Name,MAX_NAME_LENGTH)
+};
+
+static const messageSpec groupMessages[] =
+{
+    {GROUP_OP_TEXT,groupTextFields,sizeof(groupTextFields)/sizeof(fieldSpec),0},
+    {GROUP_OP_BYE,groupByeFields,sizeof(groupByeFields)/sizeof(fieldSpec),0},
+    {GROUP_OP_FRAG,groupFragFields,sizeof(groupFragFields)/sizeof(fieldSpec),0},
+    {GROUP_OP_CATCHUP,groupCatchupFields,sizeof(groupCatchupFields)/sizeof(fieldSpec),0},
+    {GROUP_OP_CLAIM,groupClaimFields,sizeof(groupClaimFields)/sizeof(fieldSpec),0},
+    {GROUP_OP_PING,groupPingFields,sizeof(groupPingFields)/sizeof(fieldSpec),0},
+    {GROUP_OP_PONG,groupPongFields,sizeof(groupPongFields)/sizeof(fieldSpec),0}
+};
+
+const wireFormat groupFormat =
+{
+    "group",FRAMING_DATAGRAM,0,GROUP_OPCODE_MASK,0,MAX_GROUP_PACKET_LENGTH,
+    groupMessages,sizeof(groupMessages)/sizeof(messageSpec)
+};
+
+static const fieldSpec sessionWindowFields[] =
+{
+    PACKET_INT(FIELD_FRAMELEN,TextLength,0xFFFF),
+    PACKET_INT(FIELD_OPCODE,Opcode,SESSION_OPCODE_MASK),
+    PACKET_OPTIONAL(FIELD_U16,Channel,0xFFFF,SESSION_FLAG_CHANNEL),
+    PACKET_INT(FIELD_U32,Credit,0xFFFFFFFF)
+};
+
+static const fieldSpec sessionCapsFields[] =
+{
+    PACKET_INT(FIELD_FRAMELEN,TextLength,0xFFFF),
+    PACKET_INT(FIELD_OPCODE,Opcode,SESSION_OPCODE_MASK),
+    PACKET_INT(FIELD_U8,Version,0xFF),
+    PACKET_INT(FIELD_U32,Caps,0xFFFFFFFF),
+    PACKET_INT(FIELD_U32,MaxText,0xFFFFFFFF),
+    PACKET_BYTES(FIELD_REST,TextLength,Text,MAX_SESSION_TEXT_LENGTH)
+};
+
+static const fieldSpec sessionFields[] =
+{
+    PACKET_INT(FIELD_FRAMELEN,TextLength,0xFFFF),
+    PACKET_INT(FIELD_OPCODE,Opcode,SESSION_OPCODE_MASK),
+    PACKET_OPTIONAL(FIELD_U16,Channel,0xFFFF,SESSION_FLAG_CHANNEL),
+    PACKET_OPTIONAL(FIELD_U64,SendTime,0,SESSION_FLAG_TIME),
+    PACKET_BYTES(FIELD_REST,TextLength,Text,MAX_SESSION_TEXT_LENGTH)
+};
+
+static const messageSpec sessionMessages[] =
+{
+    {SESSION_OP_WINDOW,sessionWindowFields,sizeof(sessionWindowFields)/sizeof(fieldSpec),0},
+    {SESSION_OP_CAPS,sessionCapsFields,sizeof(sessionCapsFields)/sizeof(fieldSpec),0},
+    {OPCODE_ANY,sessionFields,sizeof(sessionFields)/sizeof(fieldSpec),
+     SESSION_FLAG_DEFLATE | SESSION_FLAG_MORE}
+};
+
+const wireFormat sessionFormat =
+{
+    "session",FRAMING_STREAM,2,SESSION_OPCODE_MASK,0,MAX_SESSION_PACKET_LENGTH,
+    sessionMessages,sizeof(sessionMessages)/sizeof(messageSpec)
+};
+
+
+/******************************************************************************
+
+ *                Codec functions.
+
+ ******************************************************************************/
+
+static const messageSpec* findMessage(const wireFormat *format,unsigned int opcode)
+{
+    int i;
+    for(i=0;i<format->MessageCount;i++)
+    {
+        if(format->Messages[i].Opcode == (opcode & format->OpcodeMask) ||
+           format->Messages[i].Opcode == OPCODE_ANY)
+            return &format->Messages[i];
+    }
+    return NULL;
+}
+
+static void putU64(char *buffer,unsigned long long value)
+{
+    int i;
+    for(i=7;i>=0;i--,value >>= 8)
+        buffer[i] = (char)(value & 0xFF);
+}
+
+static unsigned long long getU64(const char *buffer)
+{
+    unsigned long long value=0;
+    int i;
+    for(i=0;i<8;i++)
+        value = (value << 8) | (unsigned char)buffer[i];
+    return value;
+}
+
+static unsigned int messageFlags(const messageSpec *msg)
+{
+    unsigned int flags=msg->Flags;
+    int i;
+    for(i=0;i<msg->FieldCount;i++)
+        flags |= msg->Fields[i].Flag;
+    return flags;
+}
+
+size_t encodedLength(const wireFormat *format,const packet *pkt)
+{
+    const messageSpec *msg;
+    size_t len=0;
+    int i;
+
+    if((msg = findMessage(format,pkt->Opcode)) == NULL)
+        return 0;
+    for(i=0;i<msg->FieldCount;i++)
+    {
+        const fieldSpec *field = &msg->Fields[i];
+        if(field->Flag && !(pkt->Flags & field->Flag))
+            continue;
+        switch(field->Type)
+        {
+            case FIELD_OPCODE:
+            case FIELD_U8:
+                len += 1;
+                break;
+            case FIELD_U16:
+            case FIELD_FRAMELEN:
+                len += 2;
+                break;
+            case FIELD_U32:
+                len += 4;
+                break;
+            case FIELD_U64:
+                len += 8;
+                break;
+            case FIELD_BYTES:
+            case FIELD_REST:
+                len += MEMBER_INT(pkt,field->Value);
+                break;
+        }
+    }
+    return len;
+}
+
+/*  Returns the encoded length, or -1 if a field is out of range.  */
+int encodePacket(const wireFormat *format,const packet *pkt,char *buffer,size_t capacity)
+{
+    const messageSpec *msg;
+    size_t pos=0,total;
+    int i;
+
+    if((msg = findMessage(format,pkt->Opcode)) == NULL)
+        return -1;
+    if((total = encodedLength(format,pkt)) > capacity)
+        return -1;
+
+    for(i=0;i<msg->FieldCount;i++)
+    {
+        const fieldSpec *field = &msg->Fields[i];
+        unsigned int value = MEMBER_INT(pkt,field->Value);
+        unsigned short int netValue;
+        unsigned int netValue32;
+
+        if(field->Flag && !(pkt->Flags & field->Flag))
+            continue;
+        if(field->Type == FIELD_FRAMELEN)
+            value = total - pos - 2;
+        /* Eight byte fields use their whole range. */
+        if(field->Type != FIELD_U64 && value > field->Max)
+            return -1;
+
+        switch(field->Type)
+        {
+            case FIELD_OPCODE:
+                if(pkt->Flags & field->Max)
+                    return -1;
+                buffer[pos++] = (char)(value | pkt->Flags);
+                break;
+            case FIELD_U8:
+                buffer[pos++] = (char)value;
+                break;
+            case FIELD_U32:
+                netValue32 = htonl(value);
+                memcpy(buffer + pos,&netValue32,4);
+                pos += 4;
+                break;
+            case FIELD_U64:
+                putU64(buffer + pos,MEMBER_U64(pkt,field->Value));
+                pos += 8;
+                break;
+            case FIELD_U16:
+            case FIELD_FRAMELEN:
+                netValue = htons((unsigned short int)value);
+                memcpy(buffer + pos,&netValue,2);
+                pos += 2;
+                break;
+            case FIELD_BYTES:
+            case FIELD_REST:
+                if(value > 0)
+                    memcpy(buffer + pos,MEMBER_PTR(pkt,field->Data),value);
+                pos += value;
+                break;
+        }
+    }
+    return pos;
+}
+
+/*
+ * Decodes one packet which fills buffer. Returns the number of bytes used,
+ * or -1 if the packet is malformed.
+ */
+int decodePacket(const wireFormat *format,char *buffer,size_t len,packet *pkt)
+{
+    const messageSpec *msg;
+    size_t pos=0;
+    int i;
+
+    if(len <= format->OpcodeOffset)
+        return -1;
+    if((msg = findMessage(format,(unsigned char)buffer[format->OpcodeOffset])) == NULL)
+        return -1;
+
+    memset(pkt,0,sizeof(*pkt));
+    for(i=0;i<msg->FieldCount;i++)
+    {
+        const fieldSpec *field = &msg->Fields[i];
+        size_t left = len - pos;
+        unsigned int value;
+        unsigned short int netValue;
+        unsigned int netValue32;
+
+        if(field->Flag && !(pkt->Flags & field->Flag))
+            continue;
+        switch(field->Type)
+        {
+            case FIELD_OPCODE:
+                if(left < 1)
+                    return -1;
+                value = (unsigned char)buffer[pos] & field->Max;
+                pkt->Flags = (unsigned char)buffer[pos++] & ~field->Max;
+                /* Flags this message has no fields for, e.g. an encrypted body. */
+                if(pkt->Flags & ~messageFlags(msg))
+                    return -1;
+                break;
+            case FIELD_U8:
+                if(left < 1)
+                    return -1;
+                value = (unsigned char)buffer[pos++];
+                break;
+            case FIELD_U32:
+                if(left < 4)
+                    return -1;
+                memcpy(&netValue32,buffer + pos,4);
+                value = ntohl(netValue32);
+                pos += 4;
+                break;
+            case FIELD_U64:
+                if(left < 8)
+                    return -1;
+                MEMBER_U64(pkt,field->Value) = getU64(buffer + pos);
+                pos += 8;
+                continue;
+            case FIELD_U16:
+            case FIELD_FRAMELEN:
+                if(left < 2)
+                    return -1;
+                memcpy(&netValue,buffer + pos,2);
+                value = ntohs(netValue);
+                pos += 2;
+                if(field->Type == FIELD_FRAMELEN)
+                {
+                    if(value != left - 2)
+                        return -1;
+                    continue;
+                }
+                break;
+            case FIELD_BYTES:
+                value = MEMBER_INT(pkt,field->Value);
+                if(value > left)
+                    return -1;
+                MEMBER_PTR(pkt,field->Data) = buffer + pos;
+                pos += value;
+                continue;
+            case FIELD_REST:
+                if(left > field->Max)
+                    return -1;
+                MEMBER_INT(pkt,field->Value) = left;
+                MEMBER_PTR(pkt,field->Data) = buffer + pos;
+                pos = len;
+                continue;
+            default:
+                return -1;
+        }
+        if(value > field->Max)
+            return -1;
+        MEMBER_INT(pkt,field->Value) = value;
+    }
+    return pos;
+}
+
+/*
+ * Size of the frame at the head of a stream, 0 if more bytes are needed to
+ * tell, -1 if the frame can never be valid.
+ */
+int frameLength(const wireFormat *format,const char *buffer,size_t avail)
+{
+    unsigned short int netValue;
+    size_t len;
+
+    if(format->Framing == FRAMING_DATAGRAM)
+        return avail;
+    if(avail < format->LengthOffset + 2)
+        return 0;
+    memcpy(&netValue,buffer + format->LengthOffset,2);
+    len = format->LengthOffset + 2 + ntohs(netValue);
+    if(len <= format->OpcodeOffset || len > format->MaxPacketLength)
+        return -1;
+    return len;
+}
+
+
+/******************************************************************************
+
+ *                Incremental decoder.
+
+ ******************************************************************************/
+
+void initDecoder(packetDecoder *dec,const wireFormat *format)
+{
+    memset(dec,0,sizeof(*dec));
+    dec->Format = format;
+}
+
+void freeDecoder(packetDecoder *dec)
+{
+    free(dec->Buffer);
+    dec->Buffer = NULL;
+    dec->Start = dec->End = dec->Capacity = 0;
+}
+
+void decoderCompact(packetDecoder *dec)
+{
+    if(dec->Start == dec->End)
+        freeDecoder(dec);
+}
+
+/*  Makes room for need more bytes after End.  */
+static void reserve(packetDecoder *dec,size_t need)
+{
+    if(dec->Start > 0 && dec->Capacity - dec->End < need)
+    {
+        memmove(dec->Buffer,dec->Buffer + dec->Start,dec->End - dec->Start);
+        dec->End -= dec->Start;
+        dec->Start = 0;
+    }
+    if(dec->Capacity - dec->End < need)
+    {
+        size_t capacity = dec->Capacity ? dec->Capacity : DECODER_MIN_SPACE;
+        while(capacity - dec->End < need)
+            capacity *= 2;
+        if((dec->Buffer = (char*)realloc(dec->Buffer,capacity)) == NULL)
+        {
+            fprintf(stderr,"\nFailed to allocate memory for decoder.");
+            exit(EXIT_FAILURE);
+        }
+        dec->Capacity = capacity;
+    }
+}
+
+/*
+ * Returns where the next bytes should be written, and how many fit. For
+ * datagram formats there is always room for the largest datagram.
+ */
+char* decoderSpace(packetDecoder *dec,size_t *avail)
+{
+    if(dec->Format->Framing == FRAMING_DATAGRAM)
+    {
+        reserve(dec,DATAGRAM_PREFIX + dec->Format->MaxPacketLength);
+        *avail = dec->Format->MaxPacketLength;
+        return dec->Buffer + dec->End + DATAGRAM_PREFIX;
+    }
+    reserve(dec,DECODER_MIN_SPACE);
+    *avail = dec->Capacity - dec->End;
+    return dec->Buffer + dec->End;
+}
+
+void decoderCommit(packetDecoder *dec,size_t len)
+{
+    if(dec->Format->Framing == FRAMING_DATAGRAM)
+    {
+        unsigned int prefix = len;
+        memcpy(dec->Buffer + dec->End,&prefix,DATAGRAM_PREFIX);
+        dec->End += DATAGRAM_PREFIX;
+    }
+    dec->End += len;
+}
+
+void feedDecoder(packetDecoder *dec,const void *data,size_t len)
+{
+    if(dec->Format->Framing == FRAMING_DATAGRAM)
+    {
+        reserve(dec,DATAGRAM_PREFIX + len);
+        memcpy(dec->Buffer + dec->End + DATAGRAM_PREFIX,data,len);
+    }
+    else
+    {
+        reserve(dec,len);
+        memcpy(dec->Buffer + dec->End,data,len);
+    }
+    decoderCommit(dec,len);
+}
+
+/*
+ * Takes the next packet out of the decoder. A malformed datagram is
+ * skipped; a malformed stream frame leaves the stream unusable.
+ */
+int nextPacket(packetDecoder *dec,packet *pkt)
+{
+    size_t avail = dec->End - dec->Start;
+    char *head = dec->Buffer + dec->Start;
+    int len;
+
+    if(dec->Format->Framing == FRAMING_DATAGRAM)
+    {
+        unsigned int prefix;
+        if(avail < DATAGRAM_PREFIX)
+            return DECODE_MORE;
+        memcpy(&prefix,head,DATAGRAM_PREFIX);
+        dec->Start += DATAGRAM_PREFIX + prefix;
+        if(dec->Start == dec->End)
+            dec->Start = dec->End = 0;
+        if(decodePacket(dec->Format,head + DATAGRAM_PREFIX,prefix,pkt) == -1)
+            return DECODE_ERROR;
+        return DECODE_PACKET;
+    }
+
+    if((len = frameLength(dec->Format,head,avail)) == -1)
+        return DECODE_ERROR;
+    if(len == 0 || (size_t)len > avail)
+        return DECODE_MORE;
+    if(decodePacket(dec->Format,head,len,pkt) == -1)
+        return DECODE_ERROR;
+    dec->Start += len;
+    if(dec->Start == dec->End)
+        dec->Start = dec->End = 0;
+    return DECODE_PACKET;
+}
+
+/*  Bytes up to and including the opcode, for stream formats.  */
+static size_t headerLength(const wireFormat *format)
+{
+    size_t len = format->LengthOffset + 2;
+    return format->OpcodeOffset + 1 > len ? format->OpcodeOffset + 1 : len;
+}
+
+size_t decoderWanted(packetDecoder *dec)
+{
+    size_t avail = dec->End - dec->Start;
+    size_t header = headerLength(dec->Format);
+    int len;
+
+    if(avail < header)
+        return header - avail;
+    /* A malformed frame wants nothing; nextPacket() reports it. */
+    if((len = frameLength(dec->Format,dec->Buffer + dec->Start,avail)) <= 0)
+        return 0;
+    return (size_t)len > avail ? len - avail : 0;
+}
+
+int peekFrame(packetDecoder *dec,unsigned int *opcode)
+{
+    size_t avail = dec->End - dec->Start;
+
+    if(avail < headerLength(dec->Format))
+        return 0;
+    *opcode = (unsigned char)dec->Buffer[dec->Start + dec->Format->OpcodeOffset];
+    return frameLength(dec->Format,dec->Buffer + dec->Start,avail);
+}
+
+void decoderSkip(packetDecoder *dec,size_t len)
+{
+    dec->Start += len;
+    if(dec->Start >= dec->End)
+        dec->Start = dec->End = 0;
+}
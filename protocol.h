@@ -0,0 +1,226 @@
+/*******************************************************************************
+ *
+ * GeekChat wire formats.
+ *
+ * 1. Both wire formats are described once, as tables of fields per opcode.
+ *    encodePacket() and decodePacket() walk those tables; there is no hand
+ *    written codec per message.
+ *
+ * 2. Group format (UDP multicast, one packet per datagram)-
+ *      OP_TEXT: Opcode(1) [Header] [Channel(2)] [SendTime(8)] NameLength(1) Name TextLength(2) Text
+ *      OP_BYE:  Opcode(1) [Header] Name (up to the end of the datagram)
+ *      OP_FRAG: Opcode(1) [Header] Text (up to the end of the datagram)
+ *      OP_CATCHUP: Opcode(1) [Header] Address(4) Port(2) Seconds(2)
+ *      OP_CLAIM: Opcode(1) [Header] Target(4)
+ *      OP_PING: Opcode(1) [Header] SendTime(8)
+ *      OP_PONG: Opcode(1) [Header] Target(4) SendTime(8) Name (up to the end of the datagram)
+ *    OP_FRAG carries one forward error corrected fragment of a larger
+ *    packet (fec.h); its Text is binary and not for display.
+ *    OP_CATCHUP asks for the messages of the last Seconds, to be sent to
+ *    the TCP port at Address; OP_CLAIM tells the other members that the
+ *    sender answers the OP_CATCHUP of member Target (history.h).
+ *    Members answer OP_PING with OP_PONG, naming the pinging member as
+ *    Target and sending its SendTime back, which it times round trips by.
+ *    The high bits of the opcode byte are flags. With GROUP_FLAG_SEQ set the
+ *    header SenderId(4) Sequence(4) follows; the sequence counts packets
+ *    per sender so receivers can restore the send order.
+ *    GROUP_FLAG_ENC marks a sealed packet (group_crypto.h); decodePacket()
+ *    rejects it until it has been opened.
+ *    GROUP_FLAG_TIME adds SendTime, microseconds since the epoch on the
+ *    sender's clock, for latency measurement (latency.h).
+ *    GROUP_FLAG_CHANNEL adds Channel, a channel of the group other than 0
+ *    (group_channels.h); messages without it belong to channel 0.
+ *
+ * 3. Session format (TCP stream)-
+ *      Length(2) Opcode(1) [Channel(2)] [SendTime(8)] Text
+ *    The length field counts the bytes after itself. OP_FILE offers a file
+ *    as Text "Size Name"; the file then follows in OP_DATA frames, between
+ *    which other frames may be sent. Readers splice OP_DATA payloads
+ *    straight to the file, see peekFrame().
+ *    With SESSION_FLAG_CHANNEL set in the opcode byte, Channel(2) follows
+ *    the opcode and the frame belongs to that channel (session_mux.h);
+ *    frames without it belong to channel 0. SESSION_FLAG_TIME adds SendTime,
+ *    as in the group format.
+ *      OP_WINDOW: Length(2) Opcode(1) [Channel(2)] Credit(4)
+ *      OP_CAPS:   Length(2) Opcode(1) Version(1) Caps(4) MaxText(4) [more]
+ *    OP_CAPS follows OP_NAME and says which optional features and limits
+ *    a peer supports (session_caps.h); bytes after MaxText are left for
+ *    later versions. Peers that predate it ignore it as an unknown opcode.
+ *    SESSION_FLAG_DEFLATE marks Text compressed with raw deflate and
+ *    SESSION_FLAG_MORE a message whose Text continues in the next OP_TEXT
+ *    of the channel; both are only sent to peers that announced support.
+ *
+ * 4. Integers are in network byte order. Decoded Name and Text point into
+ *    the buffer that was decoded and are not NUL terminated.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_PROTOCOL_H
+#define GEEKCHAT_PROTOCOL_H
+
+#include <stddef.h>
+
+/*  Group format opcodes and flags.  */
+#define GROUP_OP_TEXT 1
+#define GROUP_OP_BYE 2
+#define GROUP_OP_FRAG 3
+#define GROUP_OP_CATCHUP 4
+#define GROUP_OP_CLAIM 5
+#define GROUP_OP_PING 6
+#define GROUP_OP_PONG 7
+#define GROUP_OPCODE_MASK 0x0F
+#define GROUP_FLAG_SEQ 0x80
+#define GROUP_FLAG_ENC 0x40
+#define GROUP_FLAG_TIME 0x20
+#define GROUP_FLAG_CHANNEL 0x10
+
+/*  Byte offsets of the sequenced header, for kernel socket filters.  */
+#define GROUP_SENDER_OFFSET 1
+#define GROUP_SEQUENCE_OFFSET 5
+
+/*  Session format opcodes.  */
+#define SESSION_OP_NAME 1
+#define SESSION_OP_TEXT 2
+#define SESSION_OP_BYE 3
+#define SESSION_OP_FILE 4
+#define SESSION_OP_DATA 5
+#define SESSION_OP_WINDOW 6
+#define SESSION_OP_CAPS 7
+#define SESSION_OPCODE_MASK 0x0F
+#define SESSION_FLAG_CHANNEL 0x80
+#define SESSION_FLAG_TIME 0x40
+#define SESSION_FLAG_DEFLATE 0x20
+#define SESSION_FLAG_MORE 0x10
+
+/*  Length(2) and Opcode(1) of a session frame on channel 0.  */
+#define SESSION_HEADER_LENGTH 3
+
+/*  Limits of the wire formats.  */
+#define MAX_NAME_LENGTH 255
+#define MAX_TEXT_LENGTH 65535
+#define MAX_SESSION_TEXT_LENGTH 65534
+#define MAX_GROUP_HEADER_LENGTH 8
+#define MAX_GROUP_PACKET_LENGTH (4 + MAX_GROUP_HEADER_LENGTH + 2 + 8 + MAX_NAME_LENGTH + MAX_TEXT_LENGTH)
+#define MAX_SESSION_PACKET_LENGTH (2 + 0xFFFF)
+
+/*  Matches any opcode in a message table.  */
+#define OPCODE_ANY 0x100
+
+/*  Return values of nextPacket().  */
+#define DECODE_PACKET 1
+#define DECODE_MORE 0
+#define DECODE_ERROR -1
+
+typedef struct packet
+{
+    unsigned int Opcode;
+    unsigned int Flags;
+    unsigned int SenderId;
+    unsigned int Sequence;
+    unsigned int NameLength;
+    char *Name;
+    unsigned int TextLength;
+    char *Text;
+    unsigned int Channel;
+    unsigned int Credit;
+    unsigned long long SendTime;
+    unsigned int Version;
+    unsigned int Caps;
+    unsigned int MaxText;
+    unsigned int Address;
+    unsigned int Port;
+    unsigned int Seconds;
+    unsigned int Target;
+}packet;
+
+typedef enum
+{
+    FIELD_OPCODE,    /* One byte, opcode in the low bits and flags above. */
+    FIELD_U8,        /* One byte integer. */
+    FIELD_U16,       /* Two byte integer. */
+    FIELD_U32,       /* Four byte integer. */
+    FIELD_U64,       /* Eight byte integer, in an unsigned long long member. */
+    FIELD_FRAMELEN,  /* Two byte count of the bytes after this field. */
+    FIELD_BYTES,     /* Bytes counted by an earlier integer field. */
+    FIELD_REST       /* Bytes up to the end of the packet. */
+}fieldType;
+
+typedef struct fieldSpec
+{
+    fieldType Type;
+    size_t Value;    /* Offset of the integer member, or of the length member. */
+    size_t Data;     /* Offset of the char* member of byte fields. */
+    unsigned int Max;
+    unsigned int Flag;   /* Present only if this flag is set, 0 for always. */
+}fieldSpec;
+
+typedef struct messageSpec
+{
+    unsigned int Opcode;
+    const fieldSpec *Fields;
+    int FieldCount;
+    unsigned int Flags;     /* Flags allowed besides those of optional fields. */
+}messageSpec;
+
+typedef enum {FRAMING_DATAGRAM,FRAMING_STREAM} framingType;
+
+typedef struct wireFormat
+{
+    const char *Name;
+    framingType Framing;
+    size_t OpcodeOffset;       /* Where the opcode sits, to pick a message. */
+    unsigned int OpcodeMask;   /* Opcode bits of that byte, the rest are flags. */
+    size_t LengthOffset;       /* Where the FIELD_FRAMELEN sits, for streams. */
+    size_t MaxPacketLength;
+    const messageSpec *Messages;
+    int MessageCount;
+}wireFormat;
+
+extern const wireFormat groupFormat;
+extern const wireFormat sessionFormat;
+
+/*  Codec functions.  */
+size_t encodedLength(const wireFormat*,const packet*);
+int encodePacket(const wireFormat*,const packet*,char*,size_t);
+int decodePacket(const wireFormat*,char*,size_t,packet*);
+int frameLength(const wireFormat*,const char*,size_t);
+
+/*
+ * Incremental decoder: feed bytes as they arrive, take packets out. For
+ * datagram formats every feed is one datagram. Packets returned by
+ * nextPacket() stay valid until the decoder is fed again.
+ */
+typedef struct packetDecoder
+{
+    const wireFormat *Format;
+    char *Buffer;
+    size_t Start;
+    size_t End;
+    size_t Capacity;
+}packetDecoder;
+
+void initDecoder(packetDecoder*,const wireFormat*);
+void freeDecoder(packetDecoder*);
+void feedDecoder(packetDecoder*,const void*,size_t);
+char* decoderSpace(packetDecoder*,size_t*);
+void decoderCommit(packetDecoder*,size_t);
+int nextPacket(packetDecoder*,packet*);
+
+/*
+ * Frees the buffer if no bytes wait in it, for the many mostly idle
+ * decoders of a server; decoderSpace() allocates again when needed.
+ */
+void decoderCompact(packetDecoder*);
+
+/*
+ * Stream formats only. Reading no more than decoderWanted() bytes at a time
+ * stops at the end of the frame at the head, leaving the next one in the
+ * socket. peekFrame() returns that frame's length and opcode byte, flags
+ * included, once its header is in (0 before, -1 if malformed);
+ * decoderSkip() drops buffered bytes of it, for payloads the caller takes
+ * out of the socket itself.
+ */
+size_t decoderWanted(packetDecoder*);
+int peekFrame(packetDecoder*,unsigned int*);
+void decoderSkip(packetDecoder*,size_t);
+
+#endif
@@ -0,0 +1,307 @@
+/*******************************************************************************
+ *
+ * Multi-core receive for one multicast group.
+ *
+ * 1. Receivers hand decoded packets to the merge thread through one queue,
+ *    taking its lock once per recvmmsg() batch rather than once per packet.
+ *
+ * 2. Shard 0 uses the caller's socket, which is also the one the caller
+ *    sends on; the others are opened and closed here.
+ *
+ * ****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "recv_shards.h"
+#include "netutil.h"
+#include "affinity.h"
+#include "history.h"
+
+/*  Largest UDP payload over IPv4.  */
+#define MAX_DATAGRAM 65507
+
+static void* shardReceiver(void*);
+static void freeBatch(void*);
+static void freeCrypto(void*);
+static void deliverItem(void*,void*);
+static void unlockQueue(void*);
+static long long nowMs();
+
+
+void startShards(shardSet *set,int firstSock,struct in_addr group,int port,int count,
+                 const groupKey *key,packetHook prepare,packetHook deliver,datagramHook keep)
+{
+    pthread_condattr_t attr;
+    int i,res;
+
+    memset(set,0,sizeof(*set));
+    set->Count = count;
+    set->Key = key;
+    set->Prepare = prepare;
+    set->Deliver = deliver;
+    set->Keep = keep;
+    set->Tail = &set->Head;
+    pthread_mutex_init(&set->Lock,NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    pthread_cond_init(&set->Ready,&attr);
+    pthread_condattr_destroy(&attr);
+    initReorder(&set->Reorder,REORDER_TIMEOUT_MS,deliverItem,set);
+
+    for(i=0;i<count;i++)
+    {
+        shardThread *shard = &set->Shards[i];
+        shard->Set = set;
+        shard->Index = i;
+        shard->Sock = i == 0 ? firstSock : getMultiCastSock(group,port);
+        if((shard->Dedup = (dedupFilter*)malloc(sizeof(dedupFilter))) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+        initDedup(shard->Dedup);
+        attachShardFilter(shard->Sock,i,count);
+    }
+    for(i=0;i<count;i++)
+    {
+        if((res = pthread_create(&set->Shards[i].Thread,NULL,shardReceiver,&set->Shards[i])) != 0)
+        {
+            fprintf(stderr,"\nThread creation failed : %s",strerror(res));
+            exit(EXIT_FAILURE);
+        }
+        set->Shards[i].Started = 1;
+    }
+}
+
+/*  Never returns; cancel the calling thread and then call stopShards().  */
+void runMerge(shardSet *set)
+{
+    while(1)
+    {
+        shardItem *list,*next;
+        long long wait;
+
+        wait = reorderExpire(&set->Reorder,nowMs());
+
+        pthread_mutex_lock(&set->Lock);
+        pthread_cleanup_push(unlockQueue,set);
+            while(set->Head == NULL)
+            {
+                if(wait == -1)
+                    pthread_cond_wait(&set->Ready,&set->Lock);
+                else
+                {
+                    struct timespec deadline;
+                    clock_gettime(CLOCK_MONOTONIC,&deadline);
+                    deadline.tv_sec += wait / 1000;
+                    deadline.tv_nsec += (wait % 1000) * 1000000;
+                    if(deadline.tv_nsec >= 1000000000)
+                    {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000;
+                    }
+                    if(pthread_cond_timedwait(&set->Ready,&set->Lock,&deadline) == ETIMEDOUT)
+                        break;
+                }
+            }
+            list = set->Head;
+            set->Head = NULL;
+            set->Tail = &set->Head;
+        pthread_cleanup_pop(1);
+
+        for(;list != NULL;list = next)
+        {
+            next = list->Next;
+            if(list->Msg.Flags & GROUP_FLAG_SEQ)
+                reorderInsert(&set->Reorder,list->Msg.SenderId,list->Msg.Sequence,list,nowMs());
+            else
+                deliverItem(list,set);
+        }
+    }
+}
+
+void stopShards(shardSet *set)
+{
+    shardItem *item,*next;
+    int i;
+
+    for(i=0;i<set->Count;i++)
+    {
+        if(!set->Shards[i].Started)
+            continue;
+        pthread_cancel(set->Shards[i].Thread);
+        pthread_join(set->Shards[i].Thread,NULL);
+        if(i > 0)
+            closeSocket(set->Shards[i].Sock,"Error while closing socket:");
+        free(set->Shards[i].Dedup);
+    }
+    for(item = set->Head;item != NULL;item = next)
+    {
+        next = item->Next;
+        free(item);
+    }
+    set->Deliver = NULL;
+    freeReorder(&set->Reorder);
+    pthread_cond_destroy(&set->Ready);
+    pthread_mutex_destroy(&set->Lock);
+}
+
+
+/******************************************************************************
+
+ *                Receiver thread.
+
+ ******************************************************************************/
+
+static void* shardReceiver(void *arg)
+{
+    shardThread *shard = (shardThread*)arg;
+    shardSet *set = shard->Set;
+    struct mmsghdr msgs[SHARD_BATCH];
+    struct iovec iovs[SHARD_BATCH];
+    struct sockaddr_in sources[SHARD_BATCH];
+    groupCrypto crypto;
+    char *buffers;
+    int i;
+
+    if(set->Count > 1)
+        pinToCpu(shard->Index % onlineCpuCount());
+
+    if((buffers = (char*)malloc(SHARD_BATCH * MAX_DATAGRAM)) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+    pthread_cleanup_push(freeBatch,buffers);
+    /* Zeroed, it frees to nothing in groups without a key. */
+    memset(&crypto,0,sizeof(crypto));
+    pthread_cleanup_push(freeCrypto,&crypto);
+    if(set->Key != NULL)
+        initGroupCrypto(&crypto,set->Key);
+    memset(msgs,0,sizeof(msgs));
+    for(i=0;i<SHARD_BATCH;i++)
+    {
+        iovs[i].iov_base = buffers + i * MAX_DATAGRAM;
+        iovs[i].iov_len = MAX_DATAGRAM;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &sources[i];
+    }
+
+    while(1)
+    {
+        shardItem *head = NULL,**tail = &head;
+        int count,cancelState;
+
+        for(i=0;i<SHARD_BATCH;i++)
+            msgs[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+        if((count = recvmmsg(shard->Sock,msgs,SHARD_BATCH,MSG_WAITFORONE,NULL)) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("Failed to read message:");
+            break;
+        }
+
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+        /* Known duplicates are dropped before they cost a decryption. */
+        if(set->Key != NULL)
+        {
+            for(i=0;i<count;i++)
+            {
+                if(dedupSeen(shard->Dedup,iovs[i].iov_base,msgs[i].msg_len))
+                    msgs[i].msg_len = 0;
+            }
+            openGroupBatch(&crypto,msgs,count);
+        }
+        for(i=0;i<count;i++)
+        {
+            if(dedupPacket(shard->Dedup,iovs[i].iov_base,msgs[i].msg_len))
+                msgs[i].msg_len = 0;
+        }
+        for(i=0;i<count;i++)
+        {
+            shardItem *item;
+            packet msg;
+
+            if(msgs[i].msg_len == 0)
+                continue;
+            if(set->Keep != NULL)
+                set->Keep(iovs[i].iov_base,msgs[i].msg_len);
+            if(decodePacket(&groupFormat,iovs[i].iov_base,msgs[i].msg_len,&msg) == -1 ||
+               catchupForged(&msg,&sources[i]))
+                continue;
+            if(set->Prepare != NULL)
+                set->Prepare(&msg);
+
+            if((item = (shardItem*)malloc(sizeof(shardItem) + msg.NameLength + msg.TextLength)) == NULL)
+            {
+                perror("Failed during memory allocation:");
+                exit(EXIT_FAILURE);
+            }
+            item->Next = NULL;
+            item->Msg = msg;
+            item->Msg.Name = item->Data;
+            item->Msg.Text = item->Data + msg.NameLength;
+            memcpy(item->Msg.Name,msg.Name,msg.NameLength);
+            memcpy(item->Msg.Text,msg.Text,msg.TextLength);
+            *tail = item;
+            tail = &item->Next;
+        }
+
+        if(head != NULL)
+        {
+            pthread_mutex_lock(&set->Lock);
+                *set->Tail = head;
+                set->Tail = tail;
+                pthread_cond_signal(&set->Ready);
+            pthread_mutex_unlock(&set->Lock);
+        }
+        pthread_setcancelstate(cancelState,NULL);
+    }
+    pthread_cleanup_pop(1);
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static void freeBatch(void *buffers)
+{
+    free(buffers);
+}
+
+static void freeCrypto(void *crypto)
+{
+    freeGroupCrypto((groupCrypto*)crypto);
+}
+
+static void deliverItem(void *item,void *context)
+{
+    shardSet *set = (shardSet*)context;
+    if(set->Deliver != NULL)
+        set->Deliver(&((shardItem*)item)->Msg);
+    free(item);
+}
+
+static void unlockQueue(void *context)
+{
+    pthread_mutex_unlock(&((shardSet*)context)->Lock);
+}
+
+static long long nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
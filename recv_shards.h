@@ -0,0 +1,73 @@
+/*******************************************************************************
+ *
+ * Multi-core receive for one multicast group.
+ *
+ * 1. startShards() opens extra SO_REUSEPORT sockets on the group so there
+ *    are count in all, gives each a kernel shard filter and a receiver
+ *    thread pinned to its own CPU.
+ *
+ * 2. Receiver threads read datagrams in batches with recvmmsg(), drop
+ *    duplicates, open them if the group is encrypted, decode them and run the Prepare hook
+ *    (validation and the like) in parallel. The Keep hook, if any, sees each
+ *    datagram opened and before decoding, e.g. for history.h.
+ *
+ * 3. runMerge() runs on the calling thread. It puts each sender's packets
+ *    back into send order and hands them to the Deliver hook one by one.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_RECV_SHARDS_H
+#define GEEKCHAT_RECV_SHARDS_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include "protocol.h"
+#include "reorder.h"
+#include "group_crypto.h"
+#include "dedup.h"
+
+#define MAX_SHARDS 64
+#define SHARD_BATCH 16
+#define REORDER_TIMEOUT_MS 50
+
+typedef void (*packetHook)(packet*);
+typedef void (*datagramHook)(const char*,size_t);
+
+typedef struct shardItem
+{
+    struct shardItem *Next;
+    packet Msg;             /* Name and Text point into Data. */
+    char Data[];
+}shardItem;
+
+typedef struct shardSet shardSet;
+
+typedef struct shardThread
+{
+    shardSet *Set;
+    int Index;
+    int Sock;
+    dedupFilter *Dedup;
+    pthread_t Thread;
+    int Started;
+}shardThread;
+
+struct shardSet
+{
+    int Count;
+    shardThread Shards[MAX_SHARDS];
+    const groupKey *Key;    /* NULL for a plain group. */
+    packetHook Prepare;
+    packetHook Deliver;
+    datagramHook Keep;
+    pthread_mutex_t Lock;
+    pthread_cond_t Ready;
+    shardItem *Head;
+    shardItem **Tail;
+    reorderBuffer Reorder;
+};
+
+void startShards(shardSet*,int,struct in_addr,int,int,const groupKey*,packetHook,packetHook,datagramHook);
+void runMerge(shardSet*);
+void stopShards(shardSet*);
+
+#endif
@@ -0,0 +1,233 @@
+/*******************************************************************************
+ *
+ * Per-sender ordered merge of sequenced group packets.
+ *
+ * 1. Senders live in an open addressing hash table keyed by sender id.
+ *    Each sender has a window of REORDER_WINDOW slots indexed by sequence
+ *    number modulo the window size.
+ *
+ * 2. Sequence numbers wrap, so they are only ever compared by their
+ *    signed difference.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "reorder.h"
+
+#define INITIAL_SENDERS 64
+
+static senderState* findSender(reorderBuffer*,unsigned int);
+static void drain(reorderBuffer*,senderState*);
+static void skipGap(reorderBuffer*,senderState*);
+
+
+void initReorder(reorderBuffer *rb,long long timeoutMs,deliverFunc deliver,void *context)
+{
+    memset(rb,0,sizeof(*rb));
+    rb->TimeoutMs = timeoutMs;
+    rb->Deliver = deliver;
+    rb->Context = context;
+}
+
+/*  Delivers whatever is still held back, then frees the buffer.  */
+void freeReorder(reorderBuffer *rb)
+{
+    size_t i;
+    for(i=0;i<rb->Capacity;i++)
+    {
+        senderState *sender = &rb->Senders[i];
+        if(!sender->InUse)
+            continue;
+        while(sender->Pending > 0)
+            skipGap(rb,sender);
+        free(sender->Window);
+    }
+    free(rb->Senders);
+    memset(rb,0,sizeof(*rb));
+}
+
+void reorderInsert(reorderBuffer *rb,unsigned int senderId,unsigned int sequence,
+                   void *item,long long now)
+{
+    senderState *sender = findSender(rb,senderId);
+    reorderSlot *slot;
+    int distance;
+
+    if(!sender->InUse)
+    {
+        sender->InUse = 1;
+        sender->SenderId = senderId;
+        sender->NextSequence = sequence;
+        rb->Count++;
+    }
+
+    distance = (int)(sequence - sender->NextSequence);
+    if(distance < 0)
+    {
+        /* Its gap was already given up. */
+        rb->Deliver(item,rb->Context);
+        return;
+    }
+    if(distance == 0)
+    {
+        rb->Deliver(item,rb->Context);
+        sender->NextSequence++;
+        drain(rb,sender);
+        return;
+    }
+
+    while(distance >= REORDER_WINDOW)
+    {
+        if(sender->Pending == 0)
+        {
+            sender->NextSequence = sequence;
+            rb->Deliver(item,rb->Context);
+            sender->NextSequence++;
+            return;
+        }
+        skipGap(rb,sender);
+        distance = (int)(sequence - sender->NextSequence);
+        if(distance <= 0)
+        {
+            rb->Deliver(item,rb->Context);
+            if(distance == 0)
+            {
+                sender->NextSequence++;
+                drain(rb,sender);
+            }
+            return;
+        }
+    }
+
+    if(sender->Window == NULL)
+    {
+        if((sender->Window = (reorderSlot*)calloc(REORDER_WINDOW,sizeof(reorderSlot))) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+    }
+    slot = &sender->Window[sequence % REORDER_WINDOW];
+    if(slot->Item != NULL)
+    {
+        /* Same sequence number twice, nothing to hold it back for. */
+        rb->Deliver(item,rb->Context);
+        return;
+    }
+    slot->Item = item;
+    slot->Sequence = sequence;
+    slot->Arrival = now;
+    sender->Pending++;
+}
+
+/*
+ * Gives up gaps which have waited longer than the timeout. Returns the
+ * milliseconds until the next gap times out, or -1 if nothing is held.
+ */
+long long reorderExpire(reorderBuffer *rb,long long now)
+{
+    long long next = -1;
+    size_t i;
+
+    for(i=0;i<rb->Capacity;i++)
+    {
+        senderState *sender = &rb->Senders[i];
+        long long oldest;
+        int j;
+
+        while(sender->InUse && sender->Pending > 0)
+        {
+            oldest = -1;
+            for(j=0;j<REORDER_WINDOW;j++)
+            {
+                reorderSlot *slot = &sender->Window[j];
+                if(slot->Item != NULL && (oldest == -1 || slot->Arrival < oldest))
+                    oldest = slot->Arrival;
+            }
+            if(now - oldest < rb->TimeoutMs)
+            {
+                long long wait = oldest + rb->TimeoutMs - now;
+                if(next == -1 || wait < next)
+                    next = wait;
+                break;
+            }
+            skipGap(rb,sender);
+        }
+    }
+    return next;
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static senderState* findSender(reorderBuffer *rb,unsigned int senderId)
+{
+    size_t i,mask;
+
+    if(rb->Count * 2 >= rb->Capacity)
+    {
+        senderState *old = rb->Senders;
+        size_t oldCapacity = rb->Capacity;
+
+        rb->Capacity = oldCapacity ? oldCapacity * 2 : INITIAL_SENDERS;
+        if((rb->Senders = (senderState*)calloc(rb->Capacity,sizeof(senderState))) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+        mask = rb->Capacity - 1;
+        for(i=0;i<oldCapacity;i++)
+        {
+            size_t j;
+            if(!old[i].InUse)
+                continue;
+            j = (old[i].SenderId * 2654435761u) & mask;
+            while(rb->Senders[j].InUse)
+                j = (j + 1) & mask;
+            rb->Senders[j] = old[i];
+        }
+        free(old);
+    }
+
+    mask = rb->Capacity - 1;
+    i = (senderId * 2654435761u) & mask;
+    while(rb->Senders[i].InUse && rb->Senders[i].SenderId != senderId)
+        i = (i + 1) & mask;
+    return &rb->Senders[i];
+}
+
+/*  Delivers held packets for as long as they are next in sequence.  */
+static void drain(reorderBuffer *rb,senderState *sender)
+{
+    while(sender->Pending > 0)
+    {
+        reorderSlot *slot = &sender->Window[sender->NextSequence % REORDER_WINDOW];
+        if(slot->Item == NULL || slot->Sequence != sender->NextSequence)
+            break;
+        rb->Deliver(slot->Item,rb->Context);
+        slot->Item = NULL;
+        sender->Pending--;
+        sender->NextSequence++;
+    }
+}
+
+/*  Gives up the packets missing before the first held one.  */
+static void skipGap(reorderBuffer *rb,senderState *sender)
+{
+    int i;
+    for(i=0;i<REORDER_WINDOW;i++)
+    {
+        reorderSlot *slot = &sender->Window[(sender->NextSequence + i) % REORDER_WINDOW];
+        if(slot->Item != NULL)
+        {
+            sender->NextSequence = slot->Sequence;
+            break;
+        }
+    }
+    drain(rb,sender);
+}
@@ -0,0 +1,55 @@
+/*******************************************************************************
+ *
+ * Per-sender ordered merge of sequenced group packets.
+ *
+ * 1. Packets go in as they arrive, from any number of receivers, and come
+ *    out of the deliver callback in sequence order per sender.
+ *
+ * 2. A gap holds back later packets of that sender for at most the timeout
+ *    given to initReorder(); after that the missing packets are given up.
+ *    A packet older than the next expected one is delivered at once.
+ *
+ * 3. Not thread safe; one merge thread owns a reorderBuffer.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_REORDER_H
+#define GEEKCHAT_REORDER_H
+
+#include <stddef.h>
+
+#define REORDER_WINDOW 256
+
+typedef void (*deliverFunc)(void*,void*);
+
+typedef struct reorderSlot
+{
+    void *Item;
+    unsigned int Sequence;
+    long long Arrival;
+}reorderSlot;
+
+typedef struct senderState
+{
+    unsigned int SenderId;
+    int InUse;
+    unsigned int NextSequence;
+    int Pending;
+    reorderSlot *Window;    /* REORDER_WINDOW slots, allocated on first gap. */
+}senderState;
+
+typedef struct reorderBuffer
+{
+    senderState *Senders;
+    size_t Capacity;
+    size_t Count;
+    long long TimeoutMs;
+    deliverFunc Deliver;
+    void *Context;
+}reorderBuffer;
+
+void initReorder(reorderBuffer*,long long,deliverFunc,void*);
+void freeReorder(reorderBuffer*);
+void reorderInsert(reorderBuffer*,unsigned int,unsigned int,void*,long long);
+long long reorderExpire(reorderBuffer*,long long);
+
+#endif
@@ -0,0 +1,475 @@
+/*******************************************************************************
+ *
+ * Virtual screen: a message pane above a one-line input pane.
+ *
+ * 1. Rows are swapped, not copied, when the pane scrolls; the terminal is
+ *    scrolled to match with a scroll region, so an unchanged row is never
+ *    sent again just because it moved up.
+ *
+ * 2. Long lines wrap at the terminal width; a wide character that does not
+ *    fit moves to the next row.
+ *
+ * 3. A row with attributes in it is rewritten from its start when it
+ *    changes, as the attributes in force halfway along it are not known,
+ *    and attributes are reset after it.
+ *
+ * ****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "screen.h"
+#include "utf8.h"
+
+#define ALT_SCREEN_ON "\033[?1049h"
+#define ALT_SCREEN_OFF "\033[?1049l"
+#define CURSOR_HIDE "\033[?25l"
+#define CURSOR_SHOW "\033[?25h"
+
+static screen *openScreen;
+static volatile sig_atomic_t resized;
+
+static void* renderer(void*);
+static void renderFrame(screen*,screenRow*);
+static void layout(screen*);
+static void addLine(screen*,const char*,size_t);
+static void setRow(screenRow*,const char*,size_t,int);
+static void appendRow(screenRow*,const char*,size_t);
+static void allocRows(screen*);
+static void freeRows(screen*);
+static size_t fitColumns(const char*,size_t,int,int*);
+static size_t escapeLength(const char*,size_t);
+static void terminalSize(screen*);
+static void onResize(int);
+static void restoreScreen();
+static long long nowMs();
+
+
+void screenOpen(screen *scr,int fd)
+{
+    int res;
+
+    memset(scr,0,sizeof(*scr));
+    scr->Fd = fd;
+    terminalSize(scr);
+    allocRows(scr);
+    scr->FullRedraw = 1;
+    scr->Dirty = 1;
+    scr->Running = 1;
+    pthread_mutex_init(&scr->Lock,NULL);
+    pthread_cond_init(&scr->Wake,NULL);
+
+    openScreen = scr;
+    atexit(restoreScreen);
+    signal(SIGWINCH,onResize);
+    if(write(fd,ALT_SCREEN_ON,strlen(ALT_SCREEN_ON)) == -1)
+    {
+        perror("Error while writing to stdout:");
+    }
+    if((res = pthread_create(&scr->Thread,NULL,renderer,scr)) != 0)
+    {
+        fprintf(stderr,"\nThread creation failed : %s",strerror(res));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void screenClose(screen *scr)
+{
+    int i;
+
+    if(!scr->Running)
+        return;
+    pthread_mutex_lock(&scr->Lock);
+        scr->Running = 0;
+        pthread_cond_signal(&scr->Wake);
+    pthread_mutex_unlock(&scr->Lock);
+    pthread_join(scr->Thread,NULL);
+    restoreScreen();
+    freeRows(scr);
+    for(i=0;i<SCREEN_HISTORY;i++)
+        free(scr->History[i]);
+    pthread_cond_destroy(&scr->Wake);
+    pthread_mutex_destroy(&scr->Lock);
+}
+
+void screenPrint(screen *scr,const char *format,...)
+{
+    va_list args;
+    char *text;
+    int len;
+
+    va_start(args,format);
+    len = vasprintf(&text,format,args);
+    va_end(args);
+    if(len < 0)
+        return;
+    screenAddText(scr,text,len);
+    free(text);
+}
+
+void screenAddText(screen *scr,const char *text,size_t len)
+{
+    int cancelState;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+    pthread_mutex_lock(&scr->Lock);
+        while(len > 0)
+        {
+            const char *end = memchr(text,'\n',len);
+            size_t lineLen = end != NULL ? (size_t)(end - text) : len;
+
+            free(scr->History[scr->HistoryNext]);
+            if((scr->History[scr->HistoryNext] = strndup(text,lineLen)) == NULL)
+            {
+                perror("Failed during memory allocation:");
+                exit(EXIT_FAILURE);
+            }
+            scr->HistoryNext = (scr->HistoryNext + 1) % SCREEN_HISTORY;
+            addLine(scr,text,lineLen);
+            if(end == NULL)
+                break;
+            text += lineLen + 1;
+            len -= lineLen + 1;
+        }
+        scr->Dirty = 1;
+        pthread_cond_signal(&scr->Wake);
+    pthread_mutex_unlock(&scr->Lock);
+    pthread_setcancelstate(cancelState,NULL);
+}
+
+void screenSetInput(screen *scr,const char *prompt,const char *input,size_t len)
+{
+    screenRow *row;
+    size_t skip=0;
+    int width,promptWidth,cancelState;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+    pthread_mutex_lock(&scr->Lock);
+        row = &scr->Back[scr->Rows - 1];
+        promptWidth = utf8DisplayWidth(prompt,strlen(prompt));
+        /* Only the tail of a long input fits after the prompt. */
+        width = utf8DisplayWidth(input,len);
+        while(width > scr->Cols - promptWidth - 1 && skip < len)
+        {
+            int seq = utf8SequenceLength((const unsigned char*)input + skip,len - skip);
+            size_t next = skip + (seq > 0 ? seq : 1);
+            width -= utf8DisplayWidth(input + skip,next - skip);
+            skip = next;
+        }
+        setRow(row,prompt,strlen(prompt),promptWidth);
+        appendRow(row,input + skip,len - skip);
+        row->Width = promptWidth + (width > 0 ? width : 0);
+        scr->CursorCol = row->Width;
+        scr->Dirty = 1;
+        pthread_cond_signal(&scr->Wake);
+    pthread_mutex_unlock(&scr->Lock);
+    pthread_setcancelstate(cancelState,NULL);
+}
+
+
+/******************************************************************************
+
+ *                Rendering.
+
+ ******************************************************************************/
+
+static void* renderer(void *arg)
+{
+    screen *scr = (screen*)arg;
+    long long lastFrame = 0;
+    screenRow scratch = {NULL,0,0,0};
+
+    pthread_mutex_lock(&scr->Lock);
+    while(scr->Running)
+    {
+        struct timespec until;
+        long long now = nowMs(),wait;
+
+        if(resized)
+        {
+            screenRow input = scr->Back[scr->Rows - 1];
+
+            resized = 0;
+            scr->Back[scr->Rows - 1].Text = NULL;
+            freeRows(scr);
+            terminalSize(scr);
+            allocRows(scr);
+            scr->Back[scr->Rows - 1] = input;
+            layout(scr);
+            scr->FullRedraw = scr->Dirty = 1;
+        }
+        /* Idle screens draw at once, busy ones once per frame time. */
+        wait = !scr->Dirty ? SCREEN_POLL_MS : lastFrame + SCREEN_FRAME_MS - now;
+        if(wait <= 0)
+        {
+            renderFrame(scr,&scratch);
+            lastFrame = now;
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME,&until);
+        until.tv_sec += wait / 1000;
+        until.tv_nsec += (wait % 1000) * 1000000;
+        if(until.tv_nsec >= 1000000000)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&scr->Wake,&scr->Lock,&until);
+    }
+    pthread_mutex_unlock(&scr->Lock);
+    free(scratch.Text);
+    return NULL;
+}
+
+/*  Builds the escape sequences for one frame in out and writes them once.  */
+static void renderFrame(screen *scr,screenRow *out)
+{
+    int pane = scr->Rows - 1,r;
+    char seq[64];
+
+    out->Length = 0;
+    appendRow(out,CURSOR_HIDE,strlen(CURSOR_HIDE));
+    if(scr->FullRedraw)
+    {
+        appendRow(out,"\033[2J",4);
+        for(r=0;r<scr->Rows;r++)
+            scr->Front[r].Length = scr->Front[r].Width = 0;
+        scr->FullRedraw = 0;
+    }
+    else if(scr->Scrolled > 0 && scr->Scrolled < pane)
+    {
+        /* Scroll the terminal's pane as the back buffer scrolled. */
+        appendRow(out,seq,snprintf(seq,sizeof(seq),"\033[1;%dr\033[%dS\033[r",pane,scr->Scrolled));
+        for(r=0;r<scr->Scrolled;r++)
+        {
+            screenRow top = scr->Front[0];
+            memmove(scr->Front,scr->Front + 1,(pane - 1) * sizeof(screenRow));
+            top.Length = top.Width = 0;
+            scr->Front[pane - 1] = top;
+        }
+    }
+    scr->Scrolled = 0;
+
+    for(r=0;r<scr->Rows;r++)
+    {
+        screenRow *front = &scr->Front[r],*back = &scr->Back[r];
+        size_t same=0;
+        int col;
+
+        if(front->Length == back->Length && !memcmp(front->Text,back->Text,back->Length))
+            continue;
+        while(same < front->Length && same < back->Length && front->Text[same] == back->Text[same])
+            same++;
+        /* Start the rewrite at a character boundary. */
+        while(same > 0 && same < back->Length && ((unsigned char)back->Text[same] & 0xC0) == 0x80)
+            same--;
+        if(memchr(back->Text,'\033',same) != NULL)
+            same = 0;
+        col = utf8DisplayWidth(back->Text,same);
+        appendRow(out,seq,snprintf(seq,sizeof(seq),"\033[%d;%dH",r + 1,col + 1));
+        appendRow(out,back->Text + same,back->Length - same);
+        if(memchr(back->Text,'\033',back->Length) != NULL)
+            appendRow(out,"\033[m",3);
+        if(front->Width > back->Width)
+            appendRow(out,"\033[K",3);
+        setRow(front,back->Text,back->Length,back->Width);
+    }
+    appendRow(out,seq,snprintf(seq,sizeof(seq),"\033[%d;%dH",scr->Rows,scr->CursorCol + 1));
+    appendRow(out,CURSOR_SHOW,strlen(CURSOR_SHOW));
+
+    scr->Dirty = 0;
+    scr->Frames++;
+    scr->BytesOut += out->Length;
+    /* Written under the lock, frames cannot interleave. */
+    for(r=0;(size_t)r < out->Length;)
+    {
+        ssize_t ret = write(scr->Fd,out->Text + r,out->Length - r);
+        if(ret == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        r += ret;
+    }
+}
+
+
+/******************************************************************************
+
+ *                Layout.
+
+ ******************************************************************************/
+
+/*  Fills the pane again from history, after a resize.  */
+static void layout(screen *scr)
+{
+    int i;
+    for(i=0;i<SCREEN_HISTORY;i++)
+    {
+        const char *line = scr->History[(scr->HistoryNext + i) % SCREEN_HISTORY];
+        if(line != NULL)
+            addLine(scr,line,strlen(line));
+    }
+    scr->Scrolled = 0;
+}
+
+/*  Wraps one line into pane rows, scrolling the pane up for each.  */
+static void addLine(screen *scr,const char *text,size_t len)
+{
+    int pane = scr->Rows - 1;
+
+    do
+    {
+        screenRow spare = scr->Back[0];
+        size_t take;
+        int width,r;
+
+        for(r=0;r<pane - 1;r++)
+            scr->Back[r] = scr->Back[r + 1];
+        scr->Back[pane - 1] = spare;
+        take = fitColumns(text,len,scr->Cols,&width);
+        setRow(&scr->Back[pane - 1],text,take,width);
+        if(scr->Scrolled < pane)
+            scr->Scrolled++;
+        text += take;
+        len -= take;
+    }while(len > 0);
+}
+
+/*  Bytes of text that fit in cols columns, at least one character.  */
+static size_t fitColumns(const char *text,size_t len,int cols,int *width)
+{
+    size_t pos=0;
+
+    *width = 0;
+    while(pos < len)
+    {
+        int seq = utf8SequenceLength((const unsigned char*)text + pos,len - pos);
+        int w;
+
+        if(text[pos] == '\033')
+        {
+            pos += escapeLength(text + pos,len - pos);
+            continue;
+        }
+        if(seq == 0)
+            seq = 1;
+        w = utf8DisplayWidth(text + pos,seq);
+        if(*width + w > cols && pos > 0)
+            break;
+        *width += w;
+        pos += seq;
+    }
+    return pos;
+}
+
+/*  Bytes of the SGR sequence at text, which takes no columns.  */
+static size_t escapeLength(const char *text,size_t len)
+{
+    size_t pos=2;
+
+    if(len < 2 || text[1] != '[')
+        return 1;
+    while(pos < len && !((unsigned char)text[pos] >= 0x40 && (unsigned char)text[pos] <= 0x7E))
+        pos++;
+    return pos < len ? pos + 1 : len;
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static void setRow(screenRow *row,const char *text,size_t len,int width)
+{
+    row->Length = 0;
+    appendRow(row,text,len);
+    row->Width = width;
+}
+
+static void appendRow(screenRow *row,const char *text,size_t len)
+{
+    if(row->Length + len > row->Capacity)
+    {
+        size_t capacity = row->Capacity ? row->Capacity : 128;
+        while(capacity < row->Length + len)
+            capacity *= 2;
+        if((row->Text = (char*)realloc(row->Text,capacity)) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+        row->Capacity = capacity;
+    }
+    memcpy(row->Text + row->Length,text,len);
+    row->Length += len;
+}
+
+static void allocRows(screen *scr)
+{
+    if((scr->Front = (screenRow*)calloc(scr->Rows,sizeof(screenRow))) == NULL ||
+       (scr->Back = (screenRow*)calloc(scr->Rows,sizeof(screenRow))) == NULL)
+    {
+        perror("Failed during memory allocation:");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void freeRows(screen *scr)
+{
+    int r;
+    for(r=0;r<scr->Rows;r++)
+    {
+        free(scr->Front[r].Text);
+        free(scr->Back[r].Text);
+    }
+    free(scr->Front);
+    free(scr->Back);
+    scr->Front = scr->Back = NULL;
+}
+
+/*  Falls back to 24x80 when fd is not a terminal.  */
+static void terminalSize(screen *scr)
+{
+    struct winsize ws;
+
+    scr->Rows = 24;
+    scr->Cols = 80;
+    if(ioctl(scr->Fd,TIOCGWINSZ,&ws) == 0 && ws.ws_row >= 2 && ws.ws_col >= 8)
+    {
+        scr->Rows = ws.ws_row;
+        scr->Cols = ws.ws_col;
+    }
+}
+
+static void onResize(int signal_val)
+{
+    resized = 1;
+}
+
+static void restoreScreen()
+{
+    if(openScreen == NULL)
+        return;
+    if(write(openScreen->Fd,ALT_SCREEN_OFF,strlen(ALT_SCREEN_OFF)) == -1)
+    {
+        /* Nothing sensible to do while restoring. */
+    }
+    openScreen = NULL;
+}
+
+static long long nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,74 @@
+/*******************************************************************************
+ *
+ * Virtual screen: a message pane above a one-line input pane.
+ *
+ * 1. Callers change the screen in memory only. A render thread compares
+ *    what the terminal shows with what it should show and sends just the
+ *    difference: scrolling of the message pane, then per row the part
+ *    after the first changed column, all in one write.
+ *
+ * 2. A frame is drawn at once when the screen was idle, then at most every
+ *    SCREEN_FRAME_MS, so a burst of messages costs one update instead of
+ *    a line rewrite per message.
+ *
+ * 3. The terminal is switched to its alternate screen while open and back
+ *    by screenClose(), which is also registered with atexit(). Resizes are
+ *    picked up within SCREEN_POLL_MS and redraw the pane from the last
+ *    SCREEN_HISTORY lines.
+ *
+ * 4. Text must already be sanitized (utf8.h), except for SGR sequences
+ *    (ESC [ ... m), which set attributes and take no columns. Widths come
+ *    from the current LC_CTYPE locale.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_SCREEN_H
+#define GEEKCHAT_SCREEN_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define SCREEN_FRAME_MS 16
+#define SCREEN_POLL_MS 200
+#define SCREEN_HISTORY 512
+
+typedef struct screenRow
+{
+    char *Text;
+    size_t Length;
+    size_t Capacity;
+    int Width;
+}screenRow;
+
+typedef struct screen
+{
+    int Fd;
+    int Rows;
+    int Cols;
+    screenRow *Front;       /* What the terminal shows. */
+    screenRow *Back;        /* What it should show; the last row is input. */
+    int Scrolled;           /* Pane rows scrolled since the last frame. */
+    int CursorCol;
+    int Dirty;
+    int FullRedraw;
+    char *History[SCREEN_HISTORY];   /* Last lines, for redraws after a resize. */
+    int HistoryNext;
+    unsigned long long Frames;
+    unsigned long long BytesOut;
+    int Running;
+    pthread_mutex_t Lock;
+    pthread_cond_t Wake;
+    pthread_t Thread;
+}screen;
+
+void screenOpen(screen*,int);
+void screenClose(screen*);
+
+/* Adds text to the message pane; newlines start new lines. */
+void screenPrint(screen*,const char*,...)
+    __attribute__((format(printf,2,3)));
+void screenAddText(screen*,const char*,size_t);
+
+/* Shows prompt and input in the input pane, cursor after the input. */
+void screenSetInput(screen*,const char*,const char*,size_t);
+
+#endif
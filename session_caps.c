@@ -0,0 +1,111 @@
+/*******************************************************************************
+ *
+ * Capability negotiation for session peers.
+ *
+ * 1. Text is compressed as raw deflate (no zlib header or checksum); the
+ *    stream already has TCP's checksum and the frame its length.
+ *
+ * 2. Chat lines are short and compressed one by one, so the compressor
+ *    runs at its fastest level with a small window.
+ *
+ * ****************************************************************************/
+#include <string.h>
+#include <zlib.h>
+#include "session_caps.h"
+
+#define DEFLATE_LEVEL 1
+#define DEFLATE_WINDOW_BITS 12
+
+
+void localCaps(sessionCaps *caps,unsigned int features)
+{
+    caps->Version = CAPS_VERSION;
+    caps->Caps = features & CAPS_KNOWN;
+    caps->MaxText = MAX_SESSION_TEXT_LENGTH;
+}
+
+void baselineCaps(sessionCaps *caps)
+{
+    caps->Version = 0;
+    caps->Caps = 0;
+    caps->MaxText = MAX_SESSION_TEXT_LENGTH;
+}
+
+void capsPacket(const sessionCaps *caps,packet *pkt)
+{
+    memset(pkt,0,sizeof(*pkt));
+    pkt->Opcode = SESSION_OP_CAPS;
+    pkt->Version = caps->Version;
+    pkt->Caps = caps->Caps;
+    pkt->MaxText = caps->MaxText;
+}
+
+void negotiateCaps(const sessionCaps *mine,const packet *theirs,sessionCaps *agreed)
+{
+    agreed->Version = theirs->Version < mine->Version ? theirs->Version : mine->Version;
+    agreed->Caps = mine->Caps & theirs->Caps & CAPS_KNOWN;
+    agreed->MaxText = theirs->MaxText < mine->MaxText ? theirs->MaxText : mine->MaxText;
+    /* A limit too small for a timestamp and a few bytes is not usable. */
+    if(agreed->MaxText < 64)
+        agreed->MaxText = 64;
+}
+
+int deflateText(packet *pkt,char *buffer)
+{
+    z_stream zs;
+    int ret;
+
+    if(pkt->TextLength < DEFLATE_MIN_TEXT)
+        return 0;
+    memset(&zs,0,sizeof(zs));
+    if(deflateInit2(&zs,DEFLATE_LEVEL,Z_DEFLATED,-DEFLATE_WINDOW_BITS,8,Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    zs.next_in = (Bytef*)pkt->Text;
+    zs.avail_in = pkt->TextLength;
+    zs.next_out = (Bytef*)buffer;
+    zs.avail_out = pkt->TextLength - 1;
+    ret = deflate(&zs,Z_FINISH);
+    deflateEnd(&zs);
+    /* Z_OK or Z_BUF_ERROR: it did not get any shorter. */
+    if(ret != Z_STREAM_END)
+        return 0;
+    pkt->Text = buffer;
+    pkt->TextLength = zs.total_out;
+    pkt->Flags |= SESSION_FLAG_DEFLATE;
+    return 1;
+}
+
+int inflateText(packet *pkt,char *buffer,size_t size)
+{
+    z_stream zs;
+    int ret;
+
+    memset(&zs,0,sizeof(zs));
+    if(inflateInit2(&zs,-15) != Z_OK)
+        return -1;
+    zs.next_in = (Bytef*)pkt->Text;
+    zs.avail_in = pkt->TextLength;
+    zs.next_out = (Bytef*)buffer;
+    zs.avail_out = size;
+    ret = inflate(&zs,Z_FINISH);
+    inflateEnd(&zs);
+    if(ret != Z_STREAM_END)
+        return -1;
+    pkt->Text = buffer;
+    pkt->TextLength = zs.total_out;
+    pkt->Flags &= ~SESSION_FLAG_DEFLATE;
+    return 0;
+}
+
+size_t textPiece(const char *text,size_t len,size_t limit)
+{
+    size_t piece;
+
+    if(len <= limit)
+        return len;
+    piece = limit;
+    while(piece > 0 && ((unsigned char)text[piece] & 0xC0) == 0x80)
+        piece--;
+    /* Not UTF-8 after all, sanitizeText() will deal with it. */
+    return piece > 0 ? piece : limit;
+}
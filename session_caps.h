@@ -0,0 +1,83 @@
+/*******************************************************************************
+ *
+ * Capability negotiation for session peers.
+ *
+ * 1. Right after OP_NAME each side sends OP_CAPS with its protocol version,
+ *    a bitmap of the optional features it understands and the longest Text
+ *    it accepts. What a session may use is what both sides announced:
+ *    the lower version, the common bits and the smaller limit.
+ *
+ * 2. Until the peer's OP_CAPS arrives, and for peers that never send one,
+ *    a session uses the baseline: no optional features. TCP keeps the
+ *    frames in order, so a peer's OP_CAPS is read before anything it sends
+ *    that relies on it; nothing waits for the negotiation.
+ *
+ * 3. Feature bits-
+ *      CAP_TIMESTAMPS  SESSION_FLAG_TIME frames (latency.h).
+ *      CAP_DEFLATE     SESSION_FLAG_DEFLATE, raw deflate compressed Text.
+ *      CAP_FILES       OP_FILE and OP_DATA.
+ *      CAP_CHANNELS    Channels other than 0 (session_mux.h).
+ *      CAP_CHUNKS      SESSION_FLAG_MORE: long messages go out in pieces of
+ *                      CHUNK_TEXT, so control frames queued behind one
+ *                      wait for a piece and not the whole message.
+ *    Bits a peer sets that this version does not know are ignored.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_SESSION_CAPS_H
+#define GEEKCHAT_SESSION_CAPS_H
+
+#include <stddef.h>
+#include "protocol.h"
+
+#define CAPS_VERSION 1
+
+#define CAP_TIMESTAMPS 0x01
+#define CAP_DEFLATE 0x02
+#define CAP_FILES 0x04
+#define CAP_CHANNELS 0x08
+#define CAP_CHUNKS 0x10
+#define CAPS_KNOWN (CAP_TIMESTAMPS | CAP_DEFLATE | CAP_FILES | CAP_CHANNELS | CAP_CHUNKS)
+
+/*  Shorter Text rarely shrinks enough to pay for compressing it.  */
+#define DEFLATE_MIN_TEXT 256
+
+/*  Text per piece of a message split with CAP_CHUNKS.  */
+#define CHUNK_TEXT 4096
+
+typedef struct sessionCaps
+{
+    unsigned int Version;
+    unsigned int Caps;
+    unsigned int MaxText;
+}sessionCaps;
+
+/*  What this side supports, given the feature bits it offers.  */
+void localCaps(sessionCaps*,unsigned int);
+
+/*  What a peer that sent no OP_CAPS gets.  */
+void baselineCaps(sessionCaps*);
+
+/*  Fills pkt as an OP_CAPS frame announcing caps.  */
+void capsPacket(const sessionCaps*,packet*);
+
+/*  Combines this side's caps with the peer's OP_CAPS.  */
+void negotiateCaps(const sessionCaps*,const packet*,sessionCaps*);
+
+/*
+ * Compresses the Text of pkt into buffer (of the Text's length) when
+ * that makes it shorter, then points Text there and sets the flag.
+ * Returns 1 if it did, 0 if the Text was left as it was.
+ */
+int deflateText(packet*,char*);
+
+/*  Undoes deflateText() into buffer. Returns 0, or -1 for bad data.  */
+int inflateText(packet*,char*,size_t);
+
+/*
+ * Bytes of text for the next piece when it is split at limit: as many as
+ * fit, backed off to the start of a UTF-8 character so that no piece
+ * sanitises a split character into '?'.
+ */
+size_t textPiece(const char*,size_t,size_t);
+
+#endif
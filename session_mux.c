@@ -0,0 +1,426 @@
+/*******************************************************************************
+ *
+ * Channels: several conversations sharing one session connection.
+ *
+ * 1. Output goes into one buffer in the order frames are allowed out, and
+ *    each loop turn writes as much of it as the socket takes. Urgent frames
+ *    have a buffer of their own; while it is not empty, writes of the other
+ *    stop at the end of the frame in progress, so a frame is never split
+ *    by another.
+ *
+ * 2. Credit is sent once half a window is consumed rather than per frame,
+ *    which keeps OP_WINDOW traffic to a few frames per window.
+ *
+ * ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "session_mux.h"
+
+static int flowControlled(unsigned int);
+static int urgentFrame(const packet*);
+static int pendingOutput(const sessionMux*);
+static size_t frameText(const char*,size_t);
+static void appendBytes(char**,size_t*,size_t*,const char*,size_t);
+static void resetChannel(muxChannel*);
+static void resetWindows(muxChannel*);
+static void drainQueue(sessionMux*,unsigned int);
+static int readSocket(sessionMux*);
+static int handleFrames(sessionMux*);
+static int writeSocket(sessionMux*);
+static char* nextOutput(sessionMux*,size_t*);
+static void outputTaken(sessionMux*,size_t);
+
+
+void initMux(sessionMux *mux,int sock,muxHandler handler,muxInput input,void *ctx)
+{
+    int flags,i;
+
+    memset(mux,0,sizeof(*mux));
+    mux->Sock = sock;
+    mux->Handler = handler;
+    mux->Input = input;
+    mux->Context = ctx;
+    mux->FlowControl = 1;
+    initDecoder(&mux->Decoder,&sessionFormat);
+    for(i=0;i<MUX_MAX_CHANNELS;i++)
+        resetChannel(&mux->Channels[i]);
+    if(sock < 0)
+        return;
+    if((flags = fcntl(sock,F_GETFL)) == -1 || fcntl(sock,F_SETFL,flags | O_NONBLOCK) == -1)
+    {
+        perror("Error while setting socket non-blocking");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void freeMux(sessionMux *mux)
+{
+    int i;
+    for(i=0;i<MUX_MAX_CHANNELS;i++)
+        free(mux->Channels[i].Queue);
+    free(mux->Out);
+    free(mux->Urgent);
+    freeDecoder(&mux->Decoder);
+}
+
+int muxSend(sessionMux *mux,packet *pkt)
+{
+    muxChannel *ch;
+    char frame[MAX_SESSION_PACKET_LENGTH];
+    int len;
+
+    if(pkt->Channel >= MUX_MAX_CHANNELS)
+        return -1;
+    /* The channel flag follows the channel, the others the caller. */
+    pkt->Flags = (pkt->Flags & ~SESSION_FLAG_CHANNEL) | (pkt->Channel != 0 ? SESSION_FLAG_CHANNEL : 0);
+    if((len = encodePacket(&sessionFormat,pkt,frame,sizeof(frame))) == -1)
+        return -1;
+
+    ch = &mux->Channels[pkt->Channel];
+    if(urgentFrame(pkt))
+        appendBytes(&mux->Urgent,&mux->UrgentLength,&mux->UrgentCapacity,frame,len);
+    else if(ch->QueueLength > 0 && (flowControlled(pkt->Opcode) || pkt->Opcode == SESSION_OP_BYE))
+        appendBytes(&ch->Queue,&ch->QueueLength,&ch->QueueCapacity,frame,len);
+    else if(!flowControlled(pkt->Opcode) || !mux->FlowControl)
+        appendBytes(&mux->Out,&mux->OutLength,&mux->OutCapacity,frame,len);
+    else if(ch->SendWindow >= (long)pkt->TextLength)
+    {
+        ch->SendWindow -= pkt->TextLength;
+        appendBytes(&mux->Out,&mux->OutLength,&mux->OutCapacity,frame,len);
+    }
+    else
+        appendBytes(&ch->Queue,&ch->QueueLength,&ch->QueueCapacity,frame,len);
+
+    /* A closed channel starts over once its OP_BYE is out; the peer resets on it. */
+    if(pkt->Opcode == SESSION_OP_BYE && pkt->Channel != 0 && ch->QueueLength == 0)
+        resetWindows(ch);
+    return 0;
+}
+
+void muxFlowControl(sessionMux *mux,int on)
+{
+    int i;
+
+    mux->FlowControl = on;
+    if(on)
+        return;
+    for(i=0;i<MUX_MAX_CHANNELS;i++)
+        drainQueue(mux,i);
+}
+
+void muxConsumed(sessionMux *mux,unsigned int channel,size_t len)
+{
+    muxChannel *ch;
+    packet credit;
+
+    if(channel >= MUX_MAX_CHANNELS || !mux->FlowControl)
+        return;
+    ch = &mux->Channels[channel];
+    if((ch->Consumed += len) < MUX_WINDOW / 2)
+        return;
+    memset(&credit,0,sizeof(credit));
+    credit.Opcode = SESSION_OP_WINDOW;
+    credit.Channel = channel;
+    credit.Credit = ch->Consumed;
+    ch->RecvWindow += ch->Consumed;
+    ch->Consumed = 0;
+    muxSend(mux,&credit);
+}
+
+int muxRun(sessionMux *mux,int inputFd)
+{
+    struct pollfd fds[2];
+
+    while(!mux->Stop)
+    {
+        if(writeSocket(mux) == -1)
+            return -1;
+        fds[0].fd = mux->Sock;
+        fds[0].events = POLLIN | (pendingOutput(mux) ? POLLOUT : 0);
+        fds[1].fd = inputFd;
+        fds[1].events = POLLIN;
+        if(poll(fds,inputFd >= 0 ? 2 : 1,-1) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("Error while polling the session");
+            return -1;
+        }
+        if((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && readSocket(mux) == -1)
+            return -1;
+        if(inputFd >= 0 && (fds[1].revents & (POLLIN | POLLHUP)) &&
+           mux->Input(mux,inputFd,mux->Context) == -1)
+            break;
+    }
+    return 0;
+}
+
+int muxReceive(sessionMux *mux,const char *data,size_t len)
+{
+    feedDecoder(&mux->Decoder,data,len);
+    return handleFrames(mux);
+}
+
+size_t muxOutput(sessionMux *mux,char *buffer,size_t size)
+{
+    size_t done=0;
+
+    while(done < size && pendingOutput(mux))
+    {
+        size_t len;
+        char *next = nextOutput(mux,&len);
+
+        if(len > size - done)
+            len = size - done;
+        memcpy(buffer + done,next,len);
+        outputTaken(mux,len);
+        done += len;
+    }
+    return done;
+}
+
+void muxStop(sessionMux *mux)
+{
+    mux->Stop = 1;
+}
+
+int muxFlush(sessionMux *mux,int timeoutMs)
+{
+    struct pollfd fd;
+
+    fd.fd = mux->Sock;
+    fd.events = POLLOUT;
+    while(pendingOutput(mux))
+    {
+        if(writeSocket(mux) == -1)
+            return -1;
+        if(pendingOutput(mux) && poll(&fd,1,timeoutMs) <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+static int flowControlled(unsigned int opcode)
+{
+    return opcode == SESSION_OP_TEXT || opcode == SESSION_OP_DATA;
+}
+
+/*  A channel's OP_BYE stays behind its text, the peer resets on it.  */
+static int urgentFrame(const packet *pkt)
+{
+    return pkt->Opcode == SESSION_OP_WINDOW || pkt->Opcode == SESSION_OP_NAME ||
+           pkt->Opcode == SESSION_OP_CAPS || (pkt->Opcode == SESSION_OP_BYE && pkt->Channel == 0);
+}
+
+static int pendingOutput(const sessionMux *mux)
+{
+    return mux->OutStart < mux->OutLength || mux->UrgentStart < mux->UrgentLength;
+}
+
+/*  Text bytes of an encoded frame, from its flags and length.  */
+static size_t frameText(const char *frame,size_t len)
+{
+    unsigned char flags = (unsigned char)frame[sessionFormat.OpcodeOffset];
+    size_t header = SESSION_HEADER_LENGTH;
+    if(flags & SESSION_FLAG_CHANNEL)
+        header += 2;
+    if(flags & SESSION_FLAG_TIME)
+        header += 8;
+    return len - header;
+}
+
+static void appendBytes(char **data,size_t *length,size_t *capacity,const char *bytes,size_t len)
+{
+    if(*length + len > *capacity)
+    {
+        size_t newCapacity = *capacity ? *capacity : 4096;
+        while(newCapacity < *length + len)
+            newCapacity *= 2;
+        if((*data = (char*)realloc(*data,newCapacity)) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+        *capacity = newCapacity;
+    }
+    memcpy(*data + *length,bytes,len);
+    *length += len;
+}
+
+static void resetChannel(muxChannel *ch)
+{
+    resetWindows(ch);
+    ch->QueueLength = 0;
+}
+
+static void resetWindows(muxChannel *ch)
+{
+    ch->SendWindow = MUX_WINDOW;
+    ch->RecvWindow = MUX_WINDOW;
+    ch->Consumed = 0;
+}
+
+/*
+ * Moves queued frames out while the window lasts, in order. An OP_BYE that
+ * waited behind the channel's text resets the windows as it goes out.
+ */
+static void drainQueue(sessionMux *mux,unsigned int channel)
+{
+    muxChannel *ch = &mux->Channels[channel];
+    size_t pos=0;
+
+    while(pos < ch->QueueLength)
+    {
+        int len = frameLength(&sessionFormat,ch->Queue + pos,ch->QueueLength - pos);
+        unsigned char opcode = (unsigned char)ch->Queue[pos + sessionFormat.OpcodeOffset] & SESSION_OPCODE_MASK;
+        size_t text = opcode == SESSION_OP_BYE ? 0 : frameText(ch->Queue + pos,len);
+
+        if((long)text > ch->SendWindow && mux->FlowControl)
+            break;
+        ch->SendWindow -= text;
+        appendBytes(&mux->Out,&mux->OutLength,&mux->OutCapacity,ch->Queue + pos,len);
+        pos += len;
+        if(opcode == SESSION_OP_BYE)
+            resetWindows(ch);
+    }
+    if(pos == 0)
+        return;
+    memmove(ch->Queue,ch->Queue + pos,ch->QueueLength - pos);
+    ch->QueueLength -= pos;
+}
+
+/*  Reads what the socket has and hands out every complete frame.  */
+static int readSocket(sessionMux *mux)
+{
+    while(1)
+    {
+        size_t avail;
+        char *space = decoderSpace(&mux->Decoder,&avail);
+        ssize_t ret;
+
+        if((ret = read(mux->Sock,space,avail)) == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if(errno == EINTR)
+                continue;
+            perror("Failed to read message:");
+            return -1;
+        }
+        if(ret == 0)
+        {
+            fprintf(stderr,"\nConnection closed by peer.");
+            return -1;
+        }
+        decoderCommit(&mux->Decoder,ret);
+        if(handleFrames(mux) == -1)
+            return -1;
+        if(mux->Stop)
+            return 0;
+    }
+}
+
+/*  Hands out every complete frame in the decoder.  */
+static int handleFrames(sessionMux *mux)
+{
+    packet pkt;
+    int res;
+
+    while((res = nextPacket(&mux->Decoder,&pkt)) == DECODE_PACKET)
+    {
+        muxChannel *ch;
+
+        if(pkt.Channel >= MUX_MAX_CHANNELS)
+            continue;
+        ch = &mux->Channels[pkt.Channel];
+        if(pkt.Opcode == SESSION_OP_WINDOW)
+        {
+            ch->SendWindow += pkt.Credit;
+            drainQueue(mux,pkt.Channel);
+            continue;
+        }
+        if(mux->FlowControl && flowControlled(pkt.Opcode) && (ch->RecvWindow -= pkt.TextLength) < 0)
+        {
+            fprintf(stderr,"\nPeer overran the window of channel %u.",pkt.Channel);
+            return -1;
+        }
+        mux->Handler(mux,&pkt,mux->Context);
+        if(pkt.Opcode == SESSION_OP_BYE && pkt.Channel != 0)
+            resetChannel(ch);
+        if(mux->Stop)
+            return 0;
+    }
+    if(res == DECODE_ERROR)
+    {
+        fprintf(stderr,"\nInvalid incoming message.");
+        return -1;
+    }
+    return 0;
+}
+
+static int writeSocket(sessionMux *mux)
+{
+    while(pendingOutput(mux))
+    {
+        size_t len;
+        char *next = nextOutput(mux,&len);
+        ssize_t ret;
+
+        if((ret = write(mux->Sock,next,len)) == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if(errno == EINTR)
+                continue;
+            perror("Write failed while sending Chat Message:");
+            return -1;
+        }
+        outputTaken(mux,ret);
+    }
+    return 0;
+}
+
+/*  Where the next write starts and how long it may be.  */
+static char* nextOutput(sessionMux *mux,size_t *len)
+{
+    int urgent = mux->UrgentStart < mux->UrgentLength;
+
+    /* Urgent frames go out at a frame boundary and, once started, first. */
+    if(urgent && (mux->UrgentStart > 0 || mux->OutStart == mux->OutFrameEnd))
+    {
+        *len = mux->UrgentLength - mux->UrgentStart;
+        return mux->Urgent + mux->UrgentStart;
+    }
+    *len = (urgent ? mux->OutFrameEnd : mux->OutLength) - mux->OutStart;
+    return mux->Out + mux->OutStart;
+}
+
+/*  Moves past len bytes of what nextOutput() returned.  */
+static void outputTaken(sessionMux *mux,size_t len)
+{
+    if(mux->UrgentStart < mux->UrgentLength &&
+       (mux->UrgentStart > 0 || mux->OutStart == mux->OutFrameEnd))
+        mux->UrgentStart += len;
+    else
+        mux->OutStart += len;
+
+    while(mux->OutFrameEnd < mux->OutStart)
+        mux->OutFrameEnd += frameLength(&sessionFormat,mux->Out + mux->OutFrameEnd,
+                                        mux->OutLength - mux->OutFrameEnd);
+    if(mux->OutStart == mux->OutLength)
+        mux->OutStart = mux->OutLength = mux->OutFrameEnd = 0;
+    if(mux->UrgentStart == mux->UrgentLength)
+        mux->UrgentStart = mux->UrgentLength = 0;
+}
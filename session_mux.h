@@ -0,0 +1,108 @@
+/*******************************************************************************
+ *
+ * Channels: several conversations sharing one session connection.
+ *
+ * 1. Frames of channel 0 are plain session frames. Frames of any other
+ *    channel set SESSION_FLAG_CHANNEL and carry Channel(2) after the
+ *    opcode, so a connection that never opens a channel is an ordinary
+ *    session. OP_BYE on a channel closes only that channel.
+ *
+ * 2. OP_TEXT and OP_DATA are flow controlled. Every channel starts with a
+ *    MUX_WINDOW byte window of Text each way; frames over it wait in the
+ *    channel's queue. The receiver hands credit back with OP_WINDOW once
+ *    the application has consumed half a window (muxConsumed()), so a
+ *    channel whose reader stalls cannot fill the connection for the rest.
+ *    A peer that did not agree CAP_CHANNELS may not send credit, so once
+ *    the caps say so the windows are dropped (muxFlowControl()).
+ *
+ * 3. One thread runs muxRun(): a poll() loop over the socket, made
+ *    non-blocking, and one input descriptor, for every channel of the
+ *    connection. Handlers run on that thread and may call muxSend().
+ *
+ * 4. OP_WINDOW, OP_NAME, OP_CAPS and the OP_BYE of channel 0 take an
+ *    urgent lane: they are written as soon as the frame being written is
+ *    done, ahead of text queued before them, so credit and shutdown never
+ *    wait behind a backlog. Frames of a channel otherwise keep their order;
+ *    a channel's OP_BYE waits behind the text queued on it.
+ *
+ * 5. A mux made with no socket (-1) is driven by hand: muxReceive() takes
+ *    bytes the peer sent and muxOutput() hands over the bytes to send, in
+ *    the order writes to the socket would have taken them. Simulations
+ *    (netsim.h) run a session that way without a connection.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_SESSION_MUX_H
+#define GEEKCHAT_SESSION_MUX_H
+
+#include <stddef.h>
+#include <signal.h>
+#include "protocol.h"
+
+#define MUX_MAX_CHANNELS 256
+#define MUX_WINDOW 262144
+
+typedef struct muxChannel
+{
+    long SendWindow;      /* Text bytes this side may still send. */
+    long RecvWindow;      /* Text bytes the peer may still send. */
+    size_t Consumed;      /* Consumed but not credited back yet. */
+    char *Queue;          /* Encoded frames waiting for window. */
+    size_t QueueLength;
+    size_t QueueCapacity;
+}muxChannel;
+
+struct sessionMux;
+
+/* Called for every frame but OP_WINDOW. */
+typedef void (*muxHandler)(struct sessionMux*,packet*,void*);
+
+/* Called when the input descriptor is readable; -1 stops the loop. */
+typedef int (*muxInput)(struct sessionMux*,int,void*);
+
+typedef struct sessionMux
+{
+    int Sock;
+    packetDecoder Decoder;
+    muxChannel Channels[MUX_MAX_CHANNELS];
+    char *Out;            /* Encoded frames the socket has not taken yet. */
+    size_t OutStart;
+    size_t OutLength;
+    size_t OutCapacity;
+    size_t OutFrameEnd;   /* End of the frame OutStart is in. */
+    char *Urgent;         /* Control frames, written between those of Out. */
+    size_t UrgentStart;
+    size_t UrgentLength;
+    size_t UrgentCapacity;
+    muxHandler Handler;
+    muxInput Input;
+    void *Context;
+    int FlowControl;      /* Windows apply, see muxFlowControl(). */
+    volatile sig_atomic_t Stop;   /* Set by muxStop(), also from a signal handler. */
+}sessionMux;
+
+void initMux(sessionMux*,int,muxHandler,muxInput,void*);
+void freeMux(sessionMux*);
+
+/* Queues pkt on pkt->Channel. Returns -1 for a bad channel or frame. */
+int muxSend(sessionMux*,packet*);
+
+/* Windows are on from the start; a peer without CAP_CHANNELS gets them turned off. */
+void muxFlowControl(sessionMux*,int);
+
+/* Tells the peer len bytes of the channel's Text were dealt with. */
+void muxConsumed(sessionMux*,unsigned int,size_t);
+
+/* Returns 0 after muxStop() or a -1 from the input, -1 if the connection failed. */
+int muxRun(sessionMux*,int);
+void muxStop(sessionMux*);
+
+/* Without a socket: handles bytes from the peer, -1 if they were bad. */
+int muxReceive(sessionMux*,const char*,size_t);
+
+/* Without a socket: copies up to size bytes of output, returns how many. */
+size_t muxOutput(sessionMux*,char*,size_t);
+
+/* Writes out what is queued, waiting up to timeoutMs. Returns -1 on failure. */
+int muxFlush(sessionMux*,int);
+
+#endif
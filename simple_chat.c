@@ -11,92 +11,183 @@
  * 2. To end the chat session type and press Ctrl + c
  * 
  * 3. The length field contains the length of the packet after the length field.
+ * 
+ * 4. Type /send <file> to send a file. It goes out in OP_DATA frames between
+ *    the chat messages, with sendfile() on the sending side and splice() into
+ *    the new file on the receiving side, so its bytes are never copied
+ *    through the application. Received files are saved in the current
+ *    directory.
+ * 
+ * 5. With --reconnect, active mode outlives its connection. Messages go
+ *    through a memory-mapped spool (spool.h) and are kept there while the
+ *    peer is unreachable; reconnects back off exponentially with jitter,
+ *    and a new connection gets the whole spool in one write.
+ * 
+ * 6. With --channels, one connection carries many conversations
+ *    (session_mux.h) and a single thread runs it. /ch N switches to
+ *    channel N and /close closes it; channel 0 is the default one.
+ * 
+ * 7. With --timestamps messages carry their send time. Latency of the
+ *    peer's timestamped messages, per channel, is shown by typing /latency.
+ * 
+ * 8. After the names both sides send OP_CAPS (session_caps.h). Timestamps,
+ *    compression of long messages, files and channels are only used when
+ *    both sides announced them, so peers without OP_CAPS keep working.
+ *    Spooled messages are encoded before the peer is known and use none.
+ *    Long messages go out in CHUNK_TEXT pieces when the peer can join them
+ *    up again, so a message being written holds back shutdown and the
+ *    channels' control frames for one piece at most.
+ * 
+ * 9. --passive --hub N runs a hub (hub.h) on N reactor threads instead of
+ *    a chat: any number of --active peers connect and every message is
+ *    relayed to all the others. Ctrl + c stops it and prints its counts,
+ *    kill -USR1 prints them while it runs. --hub-budget MB caps the memory
+ *    its sessions may hold.
  *  
  *
  * ****************************************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
-#include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netinet/ip.h>
-#include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <netdb.h>
 #include <semaphore.h>
 #include <signal.h>
 #include <errno.h>
-#include <sys/time.h>
 #include <time.h>
+#include "geekchat.h"
 
 
-/*  Macros of argument validation functions.  */
-#define HOSTSIZE 50
-#define PORTSIZE 6
-#define MAXPORT 65535
-#define MINPORT 1
-#define HOSTNAME_DELIMITER 58 /* ASCII value of colon. */
-
-/*  Macros for Tcp.  */
-#define QUEUE_SIZE 5
-
 /*  Macro defining max length for myName and Friend name. */
 #define MAXNAME 40
 
 /* Macro defining maximum buffer size. */
 #define BUFFSIZE 65534
 
-#define READTIMEOUT_SEC 900
+/*  Typed lines up to this long never touch the heap.  */
+#define LINE_INLINE 256
 
-/*  Macros for chat packet.  */
-#define HEADERSIZE 3
-#define LENGTH_FIELD_SIZE 2
-#define OPCODE_FIELD_SIZE 1
-#define MAXTEXTSIZE 65533
-#define OP_NAME 1
-#define OP_TEXT 2
-#define OP_BYE 3
+/*  Frames up to this long are encoded on the stack.  */
+#define FRAME_INLINE 512
+
+/*  Opcodes of the session wire format, see protocol.h.  */
+#define OP_NAME SESSION_OP_NAME
+#define OP_TEXT SESSION_OP_TEXT
+#define OP_BYE SESSION_OP_BYE
+#define OP_FILE SESSION_OP_FILE
+#define OP_DATA SESSION_OP_DATA
+
+/*  OP_DATA payload; text and Ctrl + c wait for at most one chunk.  */
+#define FILE_CHUNK_SIZE 16384
+
+/*  Tries name, name.1 ... before giving up on a received file.  */
+#define MAX_FILE_SUFFIX 100
+
+/*  Reconnect backoff, see backoffSleep().  */
+#define BACKOFF_BASE_MS 250
+#define BACKOFF_MAX_MS 30000
+
+#define DEFAULT_SPOOL ".chatApp.spool"
+
+/*  Return values of chatSession().  */
+#define SESSION_ENDED 1
+#define SESSION_LOST 2
+
+#define USAGE "./chatApp  (--active | --passive) --port XXXX [--peer [IPADDRS | DNSNAME]] [--reconnect [--spool FILE]] [--channels] [--timestamps] [--hub N [--hub-budget MB]]"
 
 typedef enum {active,passive,undefined} AppMode;
 
-typedef struct packet
+/*  A line being typed. Text is Inline until the line outgrows it.  */
+typedef struct lineBuffer
 {
-    short int Length;
-    char Opcode;
-    char *Text;
-}packet;
-
+    char *Text;              /* NUL terminated. */
+    size_t Length;
+    size_t Capacity;
+    char Inline[LINE_INLINE];
+}lineBuffer;
+
+/*  A file being sent, owned by the file thread.  */
+typedef struct outgoingFile
+{
+    int Sock;
+    int Fd;
+    off_t Size;
+    char Name[NAME_MAX + 1];
+}outgoingFile;
+
+/*  The file being received, if any.  */
+typedef struct incomingFile
+{
+    int Fd;
+    off_t Size;
+    off_t Received;
+    char Name[NAME_MAX + 1];
+}incomingFile;
+
+/*  State of a session with --channels, owned by its loop.  */
+typedef struct channelState
+{
+    unsigned int Current;    /* Channel typed messages go to. */
+    int PeerLeft;
+    lineBuffer Line;         /* Input typed so far. */
+    int MidMessage;          /* The last piece printed had SESSION_FLAG_MORE, */
+    unsigned int MidChannel; /* on this channel. */
+}channelState;
 
 char myName[MAXNAME];
 char friendName[MAXNAME];
-char msgBuffer[BUFFSIZE];
 pthread_t recvT,sendT;
 sem_t sem;
+packetDecoder recvDecoder;
+pthread_mutex_t sendLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t fileT;
+int fileStarted,fileDone;
+outgoingFile sending;
+incomingFile receiving;
+int filePipe[2] = {-1,-1};
+int devNull = -1;
+int reconnect;
+char *spoolFile;
+outSpool spool;
+pthread_t inputT;
+int sessionSock = -1;      /* Guarded by sendLock, set once names are exchanged. */
+pthread_mutex_t fileLock = PTHREAD_MUTEX_INITIALIZER;
+int useChannels;
+sessionMux *activeMux;
+int useTimestamps;
+latencyTable peerLatency;
+int hubReactors;
+size_t hubBudget;
+volatile sig_atomic_t hubReportRequested;
+hubServer hub;
+sessionCaps myCaps;
+sessionCaps agreedCaps;    /* Set by the receiving side, read by the sender. */
+int peerMidMessage;        /* Receiver only: the last piece shown had SESSION_FLAG_MORE. */
 
 
 void processArgs(int,char**,AppMode*,int*,char**);
-void extractArgs(int,char**,AppMode*,char**,char**);
-int validatePort(const char*);
-int validateHost(const char*);
 void validateArgs(AppMode,char*,char*,int*);
-void invalidArgs(const char*);
-
-
-int passiveSock(int);
-int activeSock(char*,int);
-void closeSocket(int,char *);
 
 
 void passiveApp(int);
+void hubApp(int);
 void activeApp(char*,int);
-void chatSession(int);
+void reconnectingApp(char*,int);
+int chatSession(int);
 
 
 void* receiver(void*);
 void* sender(void*);
+void* spooler(void*);
 
 
 int writePacket(int, const packet*);
@@ -104,17 +195,58 @@ int readPacket(int,packet*);
 
 
 void sendNameMsg(int);
+void sendCapsMsg(int);
+void sendCreditMsg(int,size_t);
 void sendByeMsg(int);
 void sendTextMsg(int,char*);
 
 
+/* File transfer functions. */
+void startFileSend(int,const char*);
+void stopFileSend();
+void* fileSender(void*);
+int writeChunk(int,int,off_t*,size_t);
+void receiveOffer(packet);
+int receiveChunk(int,size_t);
+void finishIncoming(const char*);
+
+
+/* Spool functions. */
+void spoolTextMsg(char*);
+void spoolFileSend(const char*);
+void startSpooledSession(int);
+void endSpooledSession();
+void backoffSleep(int);
+
+
+/* Channel session functions. */
+int channelSession(int);
+void channelHandler(sessionMux*,packet*,void*);
+int channelInput(sessionMux*,int,void*);
+void channelLine(sessionMux*,channelState*,char*);
+void channelPrompt(const channelState*);
+void muxKiller(int);
+
+
 int getFrndName(int);
 void setMyNameIfNotSet();
 void setMyName();
 
 
-int readMsgFromUser(char *);
+int readMsgFromUser(lineBuffer*);
+void initLine(lineBuffer*);
+int appendLine(lineBuffer*,char);
+void resetLine(void*);
+void resetCaps();
+void agreeCaps(const packet*);
+unsigned int peerCaps();
+int expandText(packet*);
+void stampText(packet*);
+void recordLatency(const packet*);
+void showLatency();
 void sessionKiller(int);
+void hubKiller(int);
+void requestHubReport(int);
 void displayMsg(packet);
 
 
@@ -126,6 +258,7 @@ int main(int argc,char **argv)
     mode = undefined;
     
     processArgs(argc,argv,&mode,&port,&peerHost);
+    initLatency(&peerLatency);
     #ifdef DEBUG
     printf("\nIn debug mode.");
     #endif
@@ -144,40 +277,90 @@ int main(int argc,char **argv)
 void activeApp(char *peerHost,int peerPort)
 {
     int sock;
+    if(reconnect)
+    {
+        reconnectingApp(peerHost,peerPort);
+        return;
+    }
     sock = activeSock(peerHost,peerPort);
     chatSession(sock);    
     closeSocket(sock,"Error while closing socket:");
 }
 
+/*
+ * Active mode with --reconnect. One input thread reads messages for the
+ * whole run and spools them; each connection only exchanges names, flushes
+ * the spool and receives. Ends with Ctrl + c or the peer's Bye.
+ */
+void reconnectingApp(char *peerHost,int peerPort)
+{
+    int res,attempt=0;
+
+    setMyName();
+    openSpool(&spool,spoolFile);
+    if(spoolPending(&spool) > 0)
+        printf("\n %zu bytes of unsent messages in %s.",spoolPending(&spool),spoolFile);
+    srandom(time(NULL) ^ getpid());
+    /* A write to a lost peer must fail, not kill the process. */
+    signal(SIGPIPE,SIG_IGN);
+    if((res = pthread_create(&inputT,NULL,spooler,NULL)) != 0)
+    {
+        fprintf(stderr,"\nThread creation failed : %s",strerror(res));
+        exit(EXIT_FAILURE);
+    }
+
+    while(1)
+    {
+        int sock;
+
+        if((sock = tryActiveSock(peerHost,peerPort)) == -1)
+        {
+            backoffSleep(attempt++);
+            continue;
+        }
+        res = chatSession(sock);
+        closeSocket(sock,"Error while closing socket:");
+        if(res == SESSION_ENDED)
+            break;
+        /* Only a session that got going resets the backoff. */
+        if(friendName[0] != 0)
+            attempt = 0;
+        printf("\n Connection lost, reconnecting...\n");
+        fflush(stdout);
+        backoffSleep(attempt++);
+    }
+
+    pthread_cancel(inputT);
+    pthread_join(inputT,NULL);
+    if(spoolPending(&spool) > 0)
+        printf("\n %zu bytes of unsent messages kept in %s.\n",spoolPending(&spool),spoolFile);
+    closeSpool(&spool);
+}
+
 void passiveApp(int port)
 {
-    int sock,value=1;
-    struct timeval timeout;
+    int sock;
+    if(hubReactors > 0)
+    {
+        hubApp(port);
+        return;
+    }
     setMyName();
-    sock = passiveSock(port);
+    sock = passiveSock(port,0);
     while(1)
     {
-        int newSock,size;
+        int newSock;
+        socklen_t size = sizeof(struct sockaddr_in);
         struct sockaddr_in clientAddr;
 
         printf("\n Waiting for new connection...");
         fflush(stdout);
-        if((newSock = accept(sock,(struct sockaddr*)&clientAddr,(socklen_t*)&size)) == -1)
+        if((newSock = accept(sock,(struct sockaddr*)&clientAddr,&size)) == -1)
         {
             perror("\nError during connection accept: ");
             exit(EXIT_FAILURE);
         }
-        if(setsockopt(newSock,IPPROTO_TCP,TCP_NODELAY,&value,sizeof(int)) == -1)
-        {
-            perror("\nError during setting TCP_NODELAY socket options:");
-            exit(EXIT_FAILURE);
-        }
-        timeout.tv_sec = READTIMEOUT_SEC;
-        timeout.tv_usec = 1;
-        if (setsockopt(newSock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout)) == -1)
-        {
-            perror("\nError during setting of socket options:");
-        }
+        setSessionOptions(newSock);
         chatSession(newSock);
         closeSocket(newSock,"Error while closing socket:");
     }
@@ -185,15 +368,61 @@ void passiveApp(int port)
     
 }
 
-void chatSession(int newSock)
+/*
+ * Passive mode with --hub. The reactors do everything until Ctrl + c; this
+ * thread only prints the counts on SIGUSR1, the signal cuts its sleep short.
+ */
+void hubApp(int port)
 {
-    int res;
+    setMyName();
+    startHub(&hub,port,hubReactors,myName,hubBudget);
+    signal(SIGINT,hubKiller);
+    signal(SIGUSR1,requestHubReport);
+    printf("\n Hub running on port %d with %d reactors\n",port,hubReactors);
+    fflush(stdout);
+    while(!hub.Stop)
+    {
+        sleep(1);
+        if(hubReportRequested)
+        {
+            hubReportRequested = 0;
+            hubReport(&hub,stdout);
+            fflush(stdout);
+        }
+    }
+    joinHub(&hub);
+    printf("\n");
+    hubReport(&hub,stdout);
+}
+
+/*  Returns SESSION_ENDED, or SESSION_LOST if the connection failed.  */
+int chatSession(int newSock)
+{
+    int res,ret=SESSION_ENDED;
     void *sendT_result,*recvT_result;
     
+    if(useChannels)
+        return channelSession(newSock);
+
     sendT_result = NULL;
     recvT_result = NULL;
     
     signal(SIGINT,sessionKiller);
+    initDecoder(&recvDecoder,&sessionFormat);
+    friendName[0] = 0;
+    resetCaps();
+    peerMidMessage = 0;
+    receiving.Fd = -1;
+    if(pipe(filePipe) == -1)
+    {
+        perror("Error while creating pipe:");
+        exit(EXIT_FAILURE);
+    }
+    if(devNull == -1 && (devNull = open("/dev/null",O_WRONLY)) == -1)
+    {
+        perror("Error while opening /dev/null:");
+        exit(EXIT_FAILURE);
+    }
     if(sem_init(&sem,0,0) != 0)
     {
         perror("Error during semaphore initialization.");
@@ -229,6 +458,10 @@ void chatSession(int newSock)
         printf("\n[chatSession] Send thread ended.");
         fflush(stdout);
     #endif
+    if(reconnect)
+        endSpooledSession();
+    else
+        stopFileSend();
     if(recvT_result == PTHREAD_CANCELED)
     {
         sendByeMsg(newSock);
@@ -238,9 +471,15 @@ void chatSession(int newSock)
     else
     {
         signal(SIGINT,SIG_DFL);
+        ret = *(int*)recvT_result;
         free(recvT_result);
         
     }
+    finishIncoming("Incomplete file");
+    close(filePipe[0]);
+    close(filePipe[1]);
+    freeDecoder(&recvDecoder);
+    return ret;
 }
 
 
@@ -256,6 +495,7 @@ void* receiver(void *newSock)
 {
     int *retval;
     int sock = *(int*)newSock;
+    size_t consumed=0;
     #ifdef DEBUG
         printf("\n[receiver] Waiting for Friend's name.");
         fflush(stdout);
@@ -275,7 +515,7 @@ void* receiver(void *newSock)
             perror("Failed during memory allocation:");
             exit(EXIT_FAILURE);                
         }
-        *retval = 1;
+        *retval = SESSION_LOST;
         pthread_exit(retval);        
     }
     sem_post(&sem);
@@ -305,16 +545,37 @@ void* receiver(void *newSock)
                 perror("Failed during memory allocation:");
                 exit(EXIT_FAILURE);                
             }
-            *retval = 1;
+            *retval = SESSION_LOST;
             pthread_exit(retval);
         }
         #ifdef DEBUG
-            printf("\n[receiver] Packet received: %hu %d %s",msg.Length,msg.Opcode,msg.Text);
+            printf("\n[receiver] Packet received: %u %u %.*s",msg.TextLength,msg.Opcode,
+                   (int)msg.TextLength,msg.Text);
             fflush(stdout);
         #endif            
+        /* Channels are only read with --channels. */
+        if(msg.Channel != 0)
+            continue;
         if(msg.Opcode == OP_TEXT)
         {
-            displayMsg(msg);
+            size_t len = msg.TextLength;
+            recordLatency(&msg);
+            if(expandText(&msg) == 0)
+                displayMsg(msg);
+            /* Credit for peers running --channels, ignored by the others. */
+            if((consumed += len) >= MUX_WINDOW / 2)
+            {
+                sendCreditMsg(sock,consumed);
+                consumed = 0;
+            }
+        }
+        else if(msg.Opcode == SESSION_OP_CAPS)
+        {
+            agreeCaps(&msg);
+        }
+        else if(msg.Opcode == OP_FILE)
+        {
+            receiveOffer(msg);
         }
         else if(msg.Opcode == OP_BYE)
         {
@@ -331,10 +592,9 @@ void* receiver(void *newSock)
                 perror("Failed during memory allocation:");
                 exit(EXIT_FAILURE);                
             }
-            *retval = 1;
+            *retval = SESSION_ENDED;
             pthread_exit(retval);
         }
-        free(msg.Text);
     }
     fflush(stdout);
     pthread_exit(NULL);
@@ -343,10 +603,11 @@ void* receiver(void *newSock)
 void* sender(void *newSock)
 {
     int sock = *(int*)newSock;
-    char *msg;
+    lineBuffer line;
 
     setMyNameIfNotSet();
     sendNameMsg(sock);
+    sendCapsMsg(sock);
     #ifdef DEBUG
         printf("\n[sender] myName send.");
         fflush(stdout);
@@ -354,28 +615,33 @@ void* sender(void *newSock)
     sem_wait(&sem);
     printf("\n Chat session started with %s\n",friendName);
     fflush(stdout);
-    
-    msg = (char*)malloc(BUFFSIZE);
-    if(msg == NULL)
+    /* With --reconnect the spooler reads input for every connection. */
+    if(reconnect)
     {
-        perror("Failed during memory allocation:");
-        exit(EXIT_FAILURE);
+        startSpooledSession(sock);
+        pthread_exit(NULL);
     }
+    
+    initLine(&line);
+    pthread_cleanup_push(resetLine,&line);
     printf("\n");
     /* Start sending.*/
     while(1)
     {
-        memset(msg,0,BUFFSIZE);
         printf("You> ");
 
-        if(readMsgFromUser(msg) == -1)
-        {
-            pthread_exit(NULL);
-        }
+        if(readMsgFromUser(&line) == -1)
+            break;
+        else if(!strncmp(line.Text,"/send ",6))
+            startFileSend(sock,line.Text + 6);
+        else if(!strcmp(line.Text,"/latency"))
+            showLatency();
         else
-            sendTextMsg(sock,msg);
+            sendTextMsg(sock,line.Text);
+        /* A long line's heap storage goes back right away. */
+        resetLine(&line);
     }
-    free(msg);
+    pthread_cleanup_pop(1);
     
     pthread_exit(NULL);
 }
@@ -396,11 +662,16 @@ int getFrndName(int sock)
     }
     #ifdef DEBUG
         printf("\n[getFrndName]Name packet received: ");
-        printf("%hu %d %s",pt.Length,pt.Opcode,pt.Text);
+        printf("%u %u %.*s",pt.TextLength,pt.Opcode,(int)pt.TextLength,pt.Text);
         fflush(stdout);
     #endif
     if(pt.Opcode == OP_NAME)
-        strcpy(friendName,pt.Text);
+    {
+        if(pt.TextLength >= MAXNAME)
+            pt.TextLength = MAXNAME - 1;
+        memcpy(friendName,pt.Text,pt.TextLength);
+        friendName[pt.TextLength] = 0;
+    }
     else
         return -1;
     return 0;
@@ -428,32 +699,75 @@ void setMyName()
  ******************************************************************************/
 
 
+/*
+ * Messages longer than the peer takes go out in several pieces, joined up
+ * again by peers with CAP_CHUNKS. Ctrl + c takes effect between pieces.
+ */
 void sendTextMsg(int sock,char *msg)
 {
     packet sendMsg;
-    sendMsg.Opcode = OP_TEXT;
-    sendMsg.Length = OPCODE_FIELD_SIZE + strlen(msg);
-    sendMsg.Text = msg;
-    writePacket(sock,&sendMsg);
+    char zipped[BUFFSIZE];
+    size_t len = strlen(msg);
+    size_t limit = __atomic_load_n(&agreedCaps.MaxText,__ATOMIC_ACQUIRE) - 8;
+    int chunks = peerCaps() & CAP_CHUNKS;
+
+    if(chunks && limit > CHUNK_TEXT)
+        limit = CHUNK_TEXT;
+    do
+    {
+        size_t piece = textPiece(msg,len,limit);
+
+        memset(&sendMsg,0,sizeof(sendMsg));
+        sendMsg.Opcode = OP_TEXT;
+        sendMsg.TextLength = piece;
+        sendMsg.Text = msg;
+        if(chunks && piece < len)
+            sendMsg.Flags = SESSION_FLAG_MORE;
+        stampText(&sendMsg);
+        if(peerCaps() & CAP_DEFLATE)
+            deflateText(&sendMsg,zipped);
+        writePacket(sock,&sendMsg);
+        msg += piece;
+        len -= piece;
+        pthread_testcancel();
+    }while(len > 0);
 }
 
 void sendNameMsg(int sock)
 {    
     packet pt;
-    int nameLen;
 
-    nameLen = strlen(myName);
+    memset(&pt,0,sizeof(pt));
     pt.Opcode = OP_NAME;
-    pt.Length = nameLen + OPCODE_FIELD_SIZE;
+    pt.TextLength = strlen(myName);
     pt.Text = myName;
     writePacket(sock,&pt);
 }
 
+void sendCapsMsg(int sock)
+{
+    packet pt;
+
+    capsPacket(&myCaps,&pt);
+    writePacket(sock,&pt);
+}
+
+void sendCreditMsg(int sock,size_t credit)
+{
+    packet pt;
+
+    memset(&pt,0,sizeof(pt));
+    pt.Opcode = SESSION_OP_WINDOW;
+    pt.Credit = credit;
+    writePacket(sock,&pt);
+}
+
 void sendByeMsg(int sock)
 {
     packet sendMsg;
+    memset(&sendMsg,0,sizeof(sendMsg));
     sendMsg.Opcode = OP_BYE;
-    sendMsg.Length = OPCODE_FIELD_SIZE;
+    sendMsg.TextLength = 0;
     sendMsg.Text = NULL;
     writePacket(sock,&sendMsg);    
 }
@@ -464,405 +778,1019 @@ void sendByeMsg(int sock)
  
  ******************************************************************************/
 
+/*
+ * Text of msg points into the receive buffer and stays valid until the next
+ * call.
+ */
 int readPacket(int sock,packet *msg)
 {
-    int ret,textLen;
-    unsigned short int len;
-    char *bufPtr;
-    
-    if((ret = read(sock,&len,sizeof(msg->Length))) == -1)
-    {
-        perror("Failed to read message:");
-        return -1;
-    }
-    msg->Length = ntohs(len);
-    if((ret = read(sock,&(msg->Opcode),sizeof(msg->Opcode))) == -1)
-    {
-        perror("Failed to read message:");
-        return -1;
-    }
-    textLen = msg->Length - OPCODE_FIELD_SIZE;
-    msg->Text = (char*)malloc(textLen+1);
-    if(msg->Text == NULL)
-    {
-	fprintf(stderr,"\nFailed to allocate memory for host.");
-	exit(EXIT_FAILURE);        
-    }
-    memset(msg->Text,0,textLen+1);
+    int ret;
 
-    bufPtr = msg->Text;
-    while(textLen!=0)
+    while((ret = nextPacket(&recvDecoder,msg)) == DECODE_MORE)
     {
-        if((ret = read(sock,bufPtr,textLen)) == -1)
+        size_t avail,wanted;
+        unsigned int opcode;
+        char *space;
+
+        /* File data goes from the socket to the file, not through here. */
+        if((ret = peekFrame(&recvDecoder,&opcode)) > 0 && opcode == OP_DATA)
+        {
+            decoderSkip(&recvDecoder,SESSION_HEADER_LENGTH);
+            if(receiveChunk(sock,ret - SESSION_HEADER_LENGTH) == -1)
+                return -1;
+            continue;
+        }
+        /* Stops at the frame end, so file data is left in the socket. */
+        space = decoderSpace(&recvDecoder,&avail);
+        if((wanted = decoderWanted(&recvDecoder)) < avail)
+            avail = wanted;
+        if((ret = read(sock,space,avail)) == -1)
         {
             perror("Failed to read message:");
             return -1;
         }
-        textLen-=ret;
-        bufPtr+=ret;
+        if(ret == 0)
+        {
+            fprintf(stderr,"\nConnection closed by peer.");
+            return -1;
+        }
+        decoderCommit(&recvDecoder,ret);
     }
+    if(ret == DECODE_ERROR)
+    {
+        fprintf(stderr,"\nInvalid incoming message.");
+        return -1;
+    }
+    /* Compressed text is sanitised once expandText() has inflated it. */
+    if(!(msg->Flags & SESSION_FLAG_DEFLATE))
+        msg->TextLength = sanitizeText(msg->Text,msg->TextLength);
     return 0;
 }
 
-int writePacket(int sock, const packet *pt)
+/*  Chat lines fit in small on the stack, only long ones are allocated.  */
+int writePacket(int sock,const packet *pt)
 {
-    int textLen,ret;
-    unsigned short int pktLen;
-    char *bufPtr;
+    int totalLen,ret,cancelState;
+    char small[FRAME_INLINE],*buffer = small,*bufPtr;
 
-    pktLen = htons(pt->Length);
-    textLen = pt->Length - OPCODE_FIELD_SIZE;
-    if(write(sock,&pktLen,sizeof(pt->Length)) == -1)
+    totalLen = encodedLength(&sessionFormat,pt);
+    if(totalLen > FRAME_INLINE && (buffer = (char*)malloc(totalLen)) == NULL)
     {
-        perror("Write failed while sending Length:");
-        return -1;
+        fprintf(stderr,"\nFailed to allocate memory for host.");
+        exit(EXIT_FAILURE);
     }
-    
-    if(write(sock,&(pt->Opcode),sizeof(pt->Opcode)) == -1)
+    if(encodePacket(&sessionFormat,pt,buffer,totalLen) == -1)
     {
-        perror("Write failed while sending Opcode:");
+        fprintf(stderr,"\nMessage too long to be sent.");
+        if(buffer != small)
+            free(buffer);
         return -1;
     }
-    
-    bufPtr = pt->Text;
-    while(textLen != 0)
-    {
-        if((ret = write(sock,bufPtr,textLen)) == -1)
+
+    /* Frames must not interleave with a file chunk being written. */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+    pthread_mutex_lock(&sendLock);
+        bufPtr = buffer;
+        while(totalLen != 0)
         {
-            perror("Write failed while sending Chat Message:");
-            return -1;
+            if((ret = write(sock,bufPtr,totalLen)) == -1)
+            {
+                perror("Write failed while sending Chat Message:");
+                break;
+            }
+            totalLen-=ret;
+            bufPtr+=ret;
         }
-        textLen-=ret;
-        bufPtr+=ret;
-        
-    }
-    return 0;
+    pthread_mutex_unlock(&sendLock);
+    pthread_setcancelstate(cancelState,NULL);
+    if(buffer != small)
+        free(buffer);
+    return totalLen == 0 ? 0 : -1;
 }
 
 /******************************************************************************
  
- *                Other utility functions.
+ *                File transfer functions.
  
  ******************************************************************************/
 
-int readMsgFromUser(char *msg)
+/*  Runs on the sender thread; one file is sent at a time.  */
+void startFileSend(int sock,const char *path)
 {
-    int i=0;
-    char ch;
-    
-    if(scanf("%c",&ch) == EOF)
+    char offer[32 + NAME_MAX];
+    const char *name;
+    struct stat st;
+    packet pt;
+    int res;
+
+    if(!(peerCaps() & CAP_FILES))
     {
-        if(errno == EINTR)
-        {
-            return -1;
-        }
+        printf("\n %s cannot receive files.\n",friendName);
+        return;
     }
-    if(ch != 10)
+    if(fileStarted && !__atomic_load_n(&fileDone,__ATOMIC_ACQUIRE))
     {
-        msg[i] = ch;
-        msgBuffer[i++] = ch;
+        printf("\n Still sending %s.\n",sending.Name);
+        return;
     }
-    
-    while(i<BUFFSIZE)
+    stopFileSend();
+    if((sending.Fd = open(path,O_RDONLY)) == -1 || fstat(sending.Fd,&st) == -1)
     {
-        if(scanf("%c",&ch) == EOF)
+        fprintf(stderr,"\n Cannot send %s: %s\n",path,strerror(errno));
+        if(sending.Fd != -1)
+            close(sending.Fd);
+        return;
+    }
+    if(!S_ISREG(st.st_mode))
+    {
+        fprintf(stderr,"\n Cannot send %s: not a regular file\n",path);
+        close(sending.Fd);
+        return;
+    }
+    name = (name = strrchr(path,'/')) != NULL ? name + 1 : path;
+    snprintf(sending.Name,sizeof(sending.Name),"%s",name);
+    sending.Sock = sock;
+    sending.Size = st.st_size;
+
+    memset(&pt,0,sizeof(pt));
+    pt.Opcode = OP_FILE;
+    pt.TextLength = snprintf(offer,sizeof(offer),"%lld %s",(long long)sending.Size,sending.Name);
+    pt.Text = offer;
+    if(writePacket(sock,&pt) == -1)
+    {
+        close(sending.Fd);
+        return;
+    }
+    fileDone = 0;
+    if((res = pthread_create(&fileT,NULL,fileSender,&sending)) != 0)
+    {
+        fprintf(stderr,"\nThread creation failed : %s",strerror(res));
+        exit(EXIT_FAILURE);
+    }
+    fileStarted = 1;
+    printf("\n Sending %s (%lld bytes)\n",sending.Name,(long long)sending.Size);
+}
+
+/*  Cancels the file thread, if any, between chunks.  */
+void stopFileSend()
+{
+    if(!fileStarted)
+        return;
+    pthread_cancel(fileT);
+    if(pthread_join(fileT,NULL) != 0)
+    {
+        perror("File Thread join failed:");
+        exit(EXIT_FAILURE);
+    }
+    close(sending.Fd);
+    fileStarted = 0;
+}
+
+void* fileSender(void *arg)
+{
+    outgoingFile *file = (outgoingFile*)arg;
+    off_t offset = 0;
+
+    while(offset < file->Size)
+    {
+        size_t chunk = file->Size - offset < FILE_CHUNK_SIZE ? file->Size - offset : FILE_CHUNK_SIZE;
+
+        pthread_testcancel();
+        if(writeChunk(file->Sock,file->Fd,&offset,chunk) == -1)
+            break;
+    }
+    if(offset >= file->Size)
+    {
+        printf("\r Sent %s      \nYou> ",file->Name);
+        fflush(stdout);
+    }
+    __atomic_store_n(&fileDone,1,__ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Writes one OP_DATA frame: the header, then len bytes of the file straight
+ * from the page cache. A file that shrank meanwhile is padded with zeros,
+ * since the frame length is already on the wire.
+ */
+int writeChunk(int sock,int fd,off_t *offset,size_t len)
+{
+    static const char zeros[4096];
+    unsigned char header[SESSION_HEADER_LENGTH];
+    int cancelState,ret=0;
+
+    header[0] = (len + 1) >> 8;
+    header[1] = (len + 1) & 0xFF;
+    header[2] = OP_DATA;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+    pthread_mutex_lock(&sendLock);
+        if(send(sock,header,sizeof(header),MSG_MORE) != sizeof(header))
         {
-            if(errno == EINTR)
+            perror("Write failed while sending file:");
+            ret = -1;
+        }
+        while(ret == 0 && len > 0)
+        {
+            ssize_t sent = sendfile(sock,fd,offset,len);
+            if(sent == 0)
+                sent = write(sock,zeros,len < sizeof(zeros) ? len : sizeof(zeros));
+            if(sent == -1)
             {
-                return -1;
+                if(errno == EINTR)
+                    continue;
+                perror("Write failed while sending file:");
+                ret = -1;
+                break;
             }
+            len -= sent;
         }
-        if(ch == 10)
-        {
-            msg[i] = '\0';
-            msgBuffer[i] = '\0';
+    pthread_mutex_unlock(&sendLock);
+    pthread_setcancelstate(cancelState,NULL);
+    return ret;
+}
+
+/*  Runs on the receiver thread. A new offer ends the previous file.  */
+void receiveOffer(packet msg)
+{
+    char text[32 + NAME_MAX],*name;
+    long long size;
+    int i;
+
+    finishIncoming("Incomplete file");
+    if(msg.TextLength >= sizeof(text))
+        msg.TextLength = sizeof(text) - 1;
+    memcpy(text,msg.Text,msg.TextLength);
+    text[msg.TextLength] = 0;
+    if((size = strtoll(text,&name,10)) < 0 || *name != ' ')
+        return;
+    name++;
+    /* Only a plain name in the current directory is accepted. */
+    if(name[0] == 0 || name[0] == '.' || strchr(name,'/') != NULL)
+    {
+        fprintf(stderr,"\n Refusing file named %s\n",name);
+        return;
+    }
+
+    receiving.Size = size;
+    receiving.Received = 0;
+    for(i=0;i<MAX_FILE_SUFFIX && receiving.Fd == -1;i++)
+    {
+        if(i == 0)
+            snprintf(receiving.Name,sizeof(receiving.Name),"%s",name);
+        else
+            snprintf(receiving.Name,sizeof(receiving.Name),"%s.%d",name,i);
+        if((receiving.Fd = open(receiving.Name,O_WRONLY|O_CREAT|O_EXCL,0600)) == -1 && errno != EEXIST)
             break;
+    }
+    if(receiving.Fd == -1)
+    {
+        fprintf(stderr,"\n Cannot save %s: %s\n",name,strerror(errno));
+        return;
+    }
+    printf("\r%s is sending %s (%lld bytes)      \nYou> ",friendName,receiving.Name,size);
+    fflush(stdout);
+    if(size == 0)
+        finishIncoming("Received");
+}
+
+/*
+ * Moves one OP_DATA payload from the socket to the file through a pipe,
+ * or to /dev/null when no file is being received.
+ */
+int receiveChunk(int sock,size_t len)
+{
+    int out = receiving.Fd != -1 ? receiving.Fd : devNull;
+
+    while(len > 0)
+    {
+        ssize_t in,moved;
+
+        if((in = splice(sock,NULL,filePipe[1],NULL,len,SPLICE_F_MOVE|SPLICE_F_MORE)) <= 0)
+        {
+            if(in == -1 && errno == EINTR)
+                continue;
+            if(in == 0)
+                fprintf(stderr,"\nConnection closed by peer.");
+            else
+                perror("Failed to read file data:");
+            return -1;
         }
-        else
+        len -= in;
+        while(in > 0)
         {
-            msg[i] = ch;
-            msgBuffer[i++] = ch;
+            if((moved = splice(filePipe[0],NULL,out,NULL,in,SPLICE_F_MOVE)) == -1)
+            {
+                if(errno == EINTR)
+                    continue;
+                perror("Failed to write file data:");
+                return -1;
+            }
+            in -= moved;
+            if(out == receiving.Fd)
+                receiving.Received += moved;
         }
     }
+    if(receiving.Fd != -1 && receiving.Received >= receiving.Size)
+        finishIncoming("Received");
     return 0;
 }
 
-/*  Signal Handler for SIGINT */
-void sessionKiller(int signal_val)
+void finishIncoming(const char *what)
 {
-    if(pthread_cancel(recvT) != 0)
+    if(receiving.Fd == -1)
+        return;
+    close(receiving.Fd);
+    receiving.Fd = -1;
+    printf("\r %s %s (%lld of %lld bytes)      \nYou> ",what,receiving.Name,
+           (long long)receiving.Received,(long long)receiving.Size);
+    fflush(stdout);
+}
+
+
+/******************************************************************************
+ 
+ *                Spool functions.
+ 
+ ******************************************************************************/
+
+/*  The input thread of reconnecting mode, alive across connections.  */
+void* spooler(void *unused)
+{
+    lineBuffer line;
+
+    initLine(&line);
+    printf("\n");
+    while(1)
     {
-        perror("Thread cancellation failed.");
-        fflush(stderr);
-        exit(EXIT_FAILURE);
+        printf("You> ");
+        fflush(stdout);
+        if(readMsgFromUser(&line) == -1)
+            break;
+        if(!strncmp(line.Text,"/send ",6))
+            spoolFileSend(line.Text + 6);
+        else if(!strcmp(line.Text,"/latency"))
+            showLatency();
+        else
+            spoolTextMsg(line.Text);
+        resetLine(&line);
     }
-    if(pthread_cancel(sendT) != 0)
+    resetLine(&line);
+    pthread_exit(NULL);
+}
+
+/*  Every message is spooled first and sent from the spool if connected.  */
+void spoolTextMsg(char *msg)
+{
+    packet pt;
+    char small[FRAME_INLINE],*frame = small;
+    int len,cancelState;
+
+    memset(&pt,0,sizeof(pt));
+    pt.Opcode = OP_TEXT;
+    pt.TextLength = strlen(msg);
+    pt.Text = msg;
+    len = encodedLength(&sessionFormat,&pt);
+    if(len > FRAME_INLINE && (frame = (char*)malloc(len)) == NULL)
     {
-        perror("Thread cancellation failed.");
+        perror("Failed during memory allocation:");
         exit(EXIT_FAILURE);
     }
-    signal(SIGINT,SIG_DFL);
+    if(encodePacket(&sessionFormat,&pt,frame,len) == -1)
+    {
+        fprintf(stderr,"\nMessage too long to be sent.");
+        if(frame != small)
+            free(frame);
+        return;
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+    pthread_mutex_lock(&sendLock);
+        spoolAppend(&spool,frame,len);
+        /* A failed write leaves the rest for the next connection. */
+        if(sessionSock != -1)
+            spoolFlush(&spool,sessionSock);
+    pthread_mutex_unlock(&sendLock);
+    pthread_setcancelstate(cancelState,NULL);
+    if(frame != small)
+        free(frame);
 }
 
-void displayMsg(packet msg)
-{    
-    printf("\r%s> %s      ",friendName,msg.Text);
-    printf("\nYou> ");
-    fflush(stdout);
+/*  fileLock keeps a transfer from starting on a connection being closed.  */
+void spoolFileSend(const char *path)
+{
+    int sock,cancelState;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+    pthread_mutex_lock(&fileLock);
+        pthread_mutex_lock(&sendLock);
+            sock = sessionSock;
+        pthread_mutex_unlock(&sendLock);
+        if(sock == -1)
+            printf("\n Not connected, %s not sent.\n",path);
+        else
+            startFileSend(sock,path);
+    pthread_mutex_unlock(&fileLock);
+    pthread_setcancelstate(cancelState,NULL);
+}
+
+/*  Sends what was spooled while disconnected as one batch.  */
+void startSpooledSession(int sock)
+{
+    int cancelState;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,&cancelState);
+    pthread_mutex_lock(&sendLock);
+        if(spoolPending(&spool) > 0)
+            printf(" Sending %zu spooled bytes\n",spoolPending(&spool));
+        if(spoolFlush(&spool,sock) == 0)
+            sessionSock = sock;
+    pthread_mutex_unlock(&sendLock);
+    pthread_setcancelstate(cancelState,NULL);
+}
+
+void endSpooledSession()
+{
+    pthread_mutex_lock(&fileLock);
+        pthread_mutex_lock(&sendLock);
+            sessionSock = -1;
+        pthread_mutex_unlock(&sendLock);
+        stopFileSend();
+    pthread_mutex_unlock(&fileLock);
+}
+
+/*
+ * Sleeps between half and all of BACKOFF_BASE_MS * 2^attempt, capped at
+ * BACKOFF_MAX_MS. The random half spreads out clients that lost the peer
+ * together, the fixed half keeps them from retrying in a tight loop.
+ */
+void backoffSleep(int attempt)
+{
+    long delay = BACKOFF_MAX_MS;
+    struct timespec wait;
+
+    if(attempt < 16 && ((long)BACKOFF_BASE_MS << attempt) < BACKOFF_MAX_MS)
+        delay = (long)BACKOFF_BASE_MS << attempt;
+    delay = delay / 2 + random() % (delay / 2 + 1);
+    wait.tv_sec = delay / 1000;
+    wait.tv_nsec = (delay % 1000) * 1000000;
+    while(nanosleep(&wait,&wait) == -1 && errno == EINTR);
 }
 
 
 /******************************************************************************
  
- *                Network Utility functions.
+ *                Channel session functions.
  
  ******************************************************************************/
 
+/*  Runs the whole session on this thread; returns like chatSession().  */
+int channelSession(int sock)
+{
+    channelState state;
+    sessionMux mux;
+    packet pt;
+    int ret;
+
+    memset(&state,0,sizeof(state));
+    initLine(&state.Line);
+    friendName[0] = 0;
+    resetCaps();
+    setMyNameIfNotSet();
+    initMux(&mux,sock,channelHandler,channelInput,&state);
+    activeMux = &mux;
+    signal(SIGINT,muxKiller);
+
+    memset(&pt,0,sizeof(pt));
+    pt.Opcode = OP_NAME;
+    pt.TextLength = strlen(myName);
+    pt.Text = myName;
+    muxSend(&mux,&pt);
+    capsPacket(&myCaps,&pt);
+    muxSend(&mux,&pt);
+    ret = muxRun(&mux,STDIN_FILENO);
+
+    if(ret == 0 && !state.PeerLeft)
+    {
+        memset(&pt,0,sizeof(pt));
+        pt.Opcode = OP_BYE;
+        muxSend(&mux,&pt);
+        muxFlush(&mux,1000);
+        printf("\n Closing chat session with %s\n",friendName);
+        fflush(stdout);
+    }
+    signal(SIGINT,SIG_DFL);
+    activeMux = NULL;
+    freeMux(&mux);
+    resetLine(&state.Line);
+    return ret == 0 ? SESSION_ENDED : SESSION_LOST;
+}
 
-int activeSock(char *host,int port)
+void channelHandler(sessionMux *mux,packet *msg,void *ctx)
 {
-    int socketd,value;
-    struct sockaddr_in address;
-    struct in_addr hostname;
-    struct hostent *hostaddr;
-    struct timeval timeout;
-    
-    if((socketd = socket(AF_INET,SOCK_STREAM,0)) == -1)
+    channelState *state = (channelState*)ctx;
+
+    /* Anything but the next piece ends the line a message left open. */
+    if(state->MidMessage && (msg->Opcode != OP_TEXT || msg->Channel != state->MidChannel))
     {
-       perror("\nError during socket creation: ");
-       exit(EXIT_FAILURE);
+        printf("\n");
+        state->MidMessage = 0;
     }
-    
-    if ((hostaddr = gethostbyname(host)) == NULL)
+
+    if(msg->Opcode == OP_NAME && msg->Channel == 0)
     {
-        perror("Failed to get host address:");
-        exit(0);
+        msg->TextLength = sanitizeText(msg->Text,msg->TextLength);
+        if(msg->TextLength >= MAXNAME)
+            msg->TextLength = MAXNAME - 1;
+        memcpy(friendName,msg->Text,msg->TextLength);
+        friendName[msg->TextLength] = 0;
+        printf("\n Chat session started with %s\n\n",friendName);
     }
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port);
-    hostname.s_addr = *(int*)*(hostaddr->h_addr_list);
-    address.sin_addr = hostname;
-    
-    if(connect(socketd,(struct sockaddr*)&address,(socklen_t)sizeof(address)) == -1)
+    else if(msg->Opcode == SESSION_OP_CAPS && msg->Channel == 0)
     {
-        perror("\nError during socket connection:");
-        exit(EXIT_FAILURE);
+        agreeCaps(msg);
+        /* A peer without channels never credits the window back. */
+        muxFlowControl(mux,(agreedCaps.Caps & CAP_CHANNELS) != 0);
+        return;
     }
-    value = 1;
-    if(setsockopt(socketd,SOL_SOCKET,SO_REUSEADDR,&value,sizeof(int)) == -1)
+    else if(msg->Opcode == OP_TEXT)
     {
-        perror("\nError during setting SO_REUSEADDR socket options:");
-        exit(EXIT_FAILURE);
+        size_t len = msg->TextLength;
+        recordLatency(msg);
+        /* Credit counts the bytes on the wire, compressed or not. */
+        if(expandText(msg) == -1)
+        {
+            muxConsumed(mux,msg->Channel,len);
+            return;
+        }
+        msg->TextLength = sanitizeText(msg->Text,msg->TextLength);
+        if(!state->MidMessage && msg->Channel == 0)
+            printf("\r%s> ",friendName);
+        else if(!state->MidMessage)
+            printf("\r[%u] %s> ",msg->Channel,friendName);
+        printf("%.*s",(int)msg->TextLength,msg->Text);
+        /* Printed is consumed; a slow terminal holds the loop, not the window. */
+        muxConsumed(mux,msg->Channel,len);
+        if((state->MidMessage = (msg->Flags & SESSION_FLAG_MORE) != 0))
+        {
+            state->MidChannel = msg->Channel;
+            fflush(stdout);
+            return;
+        }
+        printf("      \n");
     }
-    if(setsockopt(socketd,IPPROTO_TCP,TCP_NODELAY,&value,sizeof(int)) == -1)
+    else if(msg->Opcode == OP_BYE && msg->Channel == 0)
     {
-        perror("\nError during setting TCP_NODELAY socket options:");
-        exit(EXIT_FAILURE);
+        printf("\r%s> Bye      \n",friendName);
+        fflush(stdout);
+        state->PeerLeft = 1;
+        muxStop(mux);
+        return;
     }
-    
-    timeout.tv_sec = READTIMEOUT_SEC;
-    timeout.tv_usec = 1;
-    if (setsockopt(socketd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout)) == -1)
+    else if(msg->Opcode == OP_BYE)
     {
-        perror("\nError during setting of socket options:");
+        printf("\r[%u] %s closed the channel      \n",msg->Channel,friendName);
+        if(state->Current == msg->Channel)
+            state->Current = 0;
     }
+    else
+        return;
+    channelPrompt(state);
+}
+
+/*  Reads what was typed and acts on every complete line.  */
+int channelInput(sessionMux *mux,int fd,void *ctx)
+{
+    channelState *state = (channelState*)ctx;
+    char buffer[4096];
+    ssize_t ret,i;
 
-    return socketd;
+    if((ret = read(fd,buffer,sizeof(buffer))) <= 0)
+    {
+        if(ret == -1 && errno == EINTR)
+            return 0;
+        /* Without input left there is nothing more to send. */
+        return -1;
+    }
+    for(i=0;i<ret;i++)
+    {
+        if(buffer[i] == '\n')
+        {
+            channelLine(mux,state,state->Line.Text);
+            resetLine(&state->Line);
+        }
+        else
+            appendLine(&state->Line,buffer[i]);
+    }
+    return 0;
 }
 
-int passiveSock(int port)
+void channelLine(sessionMux *mux,channelState *state,char *line)
 {
-    int socketd,value;
-    struct sockaddr_in address;
-    struct in_addr hostname;
-    
-    if((socketd = socket(AF_INET,SOCK_STREAM,0)) == -1)
+    packet pt;
+    char *end;
+    long channel;
+
+    memset(&pt,0,sizeof(pt));
+    if(line[0] == 0)
+        return;
+    if(!strncmp(line,"/ch ",4))
     {
-       perror("\nError during socket creation: ");
-       exit(EXIT_FAILURE);
+        channel = strtol(line + 4,&end,10);
+        if(end == line + 4 || *end != 0 || channel < 0 || channel >= MUX_MAX_CHANNELS)
+            printf("\n Channels are 0 to %d.\n",MUX_MAX_CHANNELS - 1);
+        else if(channel != 0 && !(peerCaps() & CAP_CHANNELS))
+            printf("\n %s does not support channels.\n",friendName);
+        else
+            state->Current = channel;
     }
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port);
-    hostname.s_addr = INADDR_ANY;
-    address.sin_addr = hostname;
-    if(bind(socketd,(struct sockaddr*)&address,sizeof(address)) == -1)
+    else if(!strcmp(line,"/close"))
     {
-        perror("\nError during socket bind: ");
-        exit(EXIT_FAILURE);
+        if(state->Current != 0)
+        {
+            pt.Opcode = OP_BYE;
+            pt.Channel = state->Current;
+            muxSend(mux,&pt);
+            state->Current = 0;
+        }
     }
-    
-    if (listen(socketd, QUEUE_SIZE) == -1)
+    else if(!strncmp(line,"/send ",6))
     {
-        perror("\nError during socket listen: ");
-        exit(EXIT_FAILURE);
+        printf("\n File transfer needs a session without --channels.\n");
     }
-
-    value = 1;
-    if(setsockopt(socketd,SOL_SOCKET,SO_REUSEADDR,&value,sizeof(int)) == -1)
+    else if(!strcmp(line,"/latency"))
     {
-        perror("\nError during setting SO_REUSEADDR socket options:");
-        exit(EXIT_FAILURE);
+        showLatency();
+    }
+    else
+    {
+        /* One thread runs the channels, the caps cannot change meanwhile. */
+        size_t len = strlen(line);
+        size_t limit = agreedCaps.MaxText - 8;
+        int chunks = agreedCaps.Caps & CAP_CHUNKS;
+        char zipped[BUFFSIZE];
+
+        if(!chunks && len > limit)
+            len = limit;
+        else if(chunks && limit > CHUNK_TEXT)
+            limit = CHUNK_TEXT;
+        do
+        {
+            size_t piece = textPiece(line,len,limit);
+
+            memset(&pt,0,sizeof(pt));
+            pt.Opcode = OP_TEXT;
+            pt.Channel = state->Current;
+            pt.TextLength = piece;
+            pt.Text = line;
+            if(piece < len)
+                pt.Flags = SESSION_FLAG_MORE;
+            stampText(&pt);
+            if(peerCaps() & CAP_DEFLATE)
+                deflateText(&pt,zipped);
+            if(muxSend(mux,&pt) == -1)
+            {
+                fprintf(stderr,"\nMessage too long to be sent.");
+                break;
+            }
+            line += piece;
+            len -= piece;
+        }while(len > 0);
     }
-    return socketd;
+    channelPrompt(state);
 }
 
-void closeSocket(int sd,char *message)
+void channelPrompt(const channelState *state)
 {
-    if(close(sd) == -1)
-    {
-        perror(message);
-    }
+    if(state->Current == 0)
+        printf("You> ");
+    else
+        printf("You[%u]> ",state->Current);
+    fflush(stdout);
 }
 
-/*******************************************************************************
+/*  Signal Handler for SIGINT with --channels.  */
+void muxKiller(int signal_val)
+{
+    if(activeMux != NULL)
+        muxStop(activeMux);
+    signal(SIGINT,SIG_DFL);
+}
+
+
+/******************************************************************************
  
- *      Arguments extraction and validation functions.
+ *                Other utility functions.
  
  ******************************************************************************/
 
-void processArgs(int argc,char **argv,AppMode *mode,int *port,char **peerHost)
+int readMsgFromUser(lineBuffer *line)
 {
-    char *strPort=NULL;
-    extractArgs(argc,argv,mode,&strPort,peerHost);
-    validateArgs(*mode,strPort,*peerHost,port);
+    char ch;
+    
+    /* Without input left there is nothing more to send. */
+    if(scanf("%c",&ch) == EOF)
+    {
+        return -1;
+    }
+    if(ch != 10)
+    {
+        appendLine(line,ch);
+    }
+    
+    while(line->Length + 1 < BUFFSIZE)
+    {
+        if(scanf("%c",&ch) == EOF)
+        {
+            return -1;
+        }
+        if(ch == 10)
+        {
+            break;
+        }
+        appendLine(line,ch);
+    }
+    return 0;
 }
 
-void extractArgs(int argc,char **argv,AppMode *mode,char **port,char **host)
+void initLine(lineBuffer *line)
 {
-    int i;
-    for (i=1;i<argc;i++)
-    {
-	char *argument = argv[i];
-	if(!strcmp(argument,"--active"))
-	{
-	    if(*mode==undefined)
-		*mode = active;
-	     else
-	     {
-		invalidArgs("Mode defined more than one time.");
-		exit(EXIT_FAILURE);
-	     }
-	}
-	else if(!strcmp(argument,"--passive"))
-        {
-	    if(*mode==undefined)
-	         *mode = passive;
-	    else
-	    {
-		invalidArgs("Mode defined more than one time.");
-		exit(EXIT_FAILURE);
-	    }
-	}
-	else if(!strcmp(argument,"--port"))
-	{
-	    if(++i < argc)
-	    {
-	        *port = argv[i];
-	    }
-	    else
-	    {
-	        invalidArgs("Port missing.");
-		exit(EXIT_FAILURE);
-	    }
-	}
-	else if(!strcmp(argument,"--peer"))
-	{
-	    if(++i < argc)
-	    {
-		 *host = argv[i];
-            }
-	    else
-	    {
-		 invalidArgs("Peer hostname missing.");
-		 exit(EXIT_FAILURE);
-            }
-	}
+    line->Text = line->Inline;
+    line->Text[0] = 0;
+    line->Length = 0;
+    line->Capacity = sizeof(line->Inline);
+}
+
+/*  Returns -1, dropping ch, once the line holds BUFFSIZE - 1 bytes.  */
+int appendLine(lineBuffer *line,char ch)
+{
+    if(line->Length + 1 >= line->Capacity)
+    {
+        size_t capacity = line->Capacity * 2 < BUFFSIZE ? line->Capacity * 2 : BUFFSIZE;
+        char *text;
+
+        if(line->Capacity >= BUFFSIZE)
+            return -1;
+        if((text = (char*)malloc(capacity)) == NULL)
+        {
+            perror("Failed during memory allocation:");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(text,line->Text,line->Length + 1);
+        if(line->Text != line->Inline)
+            free(line->Text);
+        line->Text = text;
+        line->Capacity = capacity;
     }
+    line->Text[line->Length++] = ch;
+    line->Text[line->Length] = 0;
+    return 0;
 }
 
-void validateArgs(AppMode mode,char *strPort,char *strPeer,int *port)
+/*  Empties the line and gives back its heap storage. Also a cleanup handler.  */
+void resetLine(void *arg)
 {
-    if(mode == passive)
+    lineBuffer *line = (lineBuffer*)arg;
+
+    if(line->Text != line->Inline)
+        free(line->Text);
+    initLine(line);
+}
+
+void stampText(packet *pt)
+{
+    if(!useTimestamps || !(peerCaps() & CAP_TIMESTAMPS))
+        return;
+    pt->Flags |= SESSION_FLAG_TIME;
+    pt->SendTime = wallClockUs();
+}
+
+/*  Baseline until the peer's OP_CAPS; channel mode offers no files.  */
+void resetCaps()
+{
+    localCaps(&myCaps,CAP_TIMESTAMPS | CAP_DEFLATE | CAP_CHUNKS | (useChannels ? CAP_CHANNELS : CAP_FILES));
+    baselineCaps(&agreedCaps);
+}
+
+void agreeCaps(const packet *msg)
+{
+    sessionCaps agreed;
+
+    negotiateCaps(&myCaps,msg,&agreed);
+    __atomic_store_n(&agreedCaps.Version,agreed.Version,__ATOMIC_RELEASE);
+    __atomic_store_n(&agreedCaps.MaxText,agreed.MaxText,__ATOMIC_RELEASE);
+    __atomic_store_n(&agreedCaps.Caps,agreed.Caps,__ATOMIC_RELEASE);
+}
+
+unsigned int peerCaps()
+{
+    return __atomic_load_n(&agreedCaps.Caps,__ATOMIC_ACQUIRE);
+}
+
+/*  Decompresses Text, then sanitises it like readPacket() would have. Returns -1 if it is bad.  */
+int expandText(packet *msg)
+{
+    static char expanded[MAX_SESSION_TEXT_LENGTH];
+
+    if(!(msg->Flags & SESSION_FLAG_DEFLATE))
+        return 0;
+    if(inflateText(msg,expanded,sizeof(expanded)) == -1)
     {
-	if(strPort == NULL || strPort[0] == 0)
-	{
-	    invalidArgs("No port specified for passive mode.");
-	    exit(EXIT_FAILURE);
-	}
-	else
-	{
-            if(validatePort(strPort) && (*port=atoi(strPort)) >= MINPORT && *port <= MAXPORT)
-	    {
-		/*  Do nothing  */
-	    }
-	    else
-	    {
-		invalidArgs("Invalid Port.");
-		exit(EXIT_FAILURE);
-	    }
-	}
+        fprintf(stderr,"\nDropped a message that failed to decompress.");
+        return -1;
     }
-    else if(mode == active)
+    msg->TextLength = sanitizeText(msg->Text,msg->TextLength);
+    return 0;
+}
+
+/*  Channels of the one peer are kept apart as "name[N]".  */
+void recordLatency(const packet *msg)
+{
+    char label[MAXNAME + 16];
+    int len;
+
+    if(!(msg->Flags & SESSION_FLAG_TIME))
+        return;
+    if(msg->Channel == 0)
+        len = snprintf(label,sizeof(label),"%s",friendName);
+    else
+        len = snprintf(label,sizeof(label),"%s[%u]",friendName,msg->Channel);
+    latencyRecord(&peerLatency,msg->Channel,label,len,msg->SendTime,wallClockUs());
+}
+
+void showLatency()
+{
+    printf("\n");
+    latencyReport(&peerLatency,stdout);
+    fflush(stdout);
+}
+
+/*  Signal Handler for SIGINT */
+void sessionKiller(int signal_val)
+{
+    if(pthread_cancel(recvT) != 0)
     {
-	if(strPeer == NULL || strPeer[0] == 0)
-	{
-	    invalidArgs("No peer hostname specified for active mode.");
-	    exit(EXIT_FAILURE);
-	}
-	if(strPort == NULL || strPort[0] == 0)
-	{
-	    invalidArgs("No peer port specified for active mode.");
-	    exit(EXIT_FAILURE);
-	}
-	else
-	{
-            if(!validateHost(strPeer))
-            {
-                invalidArgs("Invalid Peer hostname.");
-	        exit(EXIT_FAILURE);
-            }
-	    if(validatePort(strPort) && (*port=atoi(strPort)) >= MINPORT && *port <= MAXPORT)
-            {
-		/*  Do Nothing   */
-            }
-	    else
-	    {
-		invalidArgs("Invalid Peer port.");
-		exit(EXIT_FAILURE);
-	    }
-	}
+        perror("Thread cancellation failed.");
+        fflush(stderr);
+        exit(EXIT_FAILURE);
     }
-    else if(mode == undefined)
+    if(pthread_cancel(sendT) != 0)
     {
-        invalidArgs("Mode not specified.");
+        perror("Thread cancellation failed.");
         exit(EXIT_FAILURE);
     }
+    signal(SIGINT,SIG_DFL);
 }
 
+/*  Signal Handler for SIGINT with --hub.  */
+void hubKiller(int signal_val)
+{
+    stopHub(&hub);
+    signal(SIGINT,SIG_DFL);
+}
 
-int validatePort(const char *portStr)
+/*  Signal Handler for SIGUSR1 with --hub, hubApp() prints the report.  */
+void requestHubReport(int signal_val)
 {
-    int i;
-    for(i=0;portStr[i] != '\0';i++)
-    {
-        if(isdigit(portStr[i]) == 0)
-            return 0;
-    }
-    return 1;
+    hubReportRequested = 1;
 }
 
-int validateHost(const char *hostStr)
+/*  Pieces of a message continue the line the first one started.  */
+void displayMsg(packet msg)
+{    
+    if(!peerMidMessage)
+        printf("\r%s> ",friendName);
+    printf("%.*s",(int)msg.TextLength,msg.Text);
+    if(!(peerMidMessage = (msg.Flags & SESSION_FLAG_MORE) != 0))
+        printf("      \nYou> ");
+    fflush(stdout);
+}
+
+
+/*******************************************************************************
+ 
+ *      Arguments extraction and validation functions.
+ 
+ ******************************************************************************/
+
+void processArgs(int argc,char **argv,AppMode *mode,int *port,char **peerHost)
 {
-    if(hostStr == NULL)
-        return 0;
-    if(hostStr[0] == 0)
-	return 0;
-    return 1;
+    char *strPort=NULL,*hubStr=NULL,*budgetStr=NULL,*end;
+    int activeFlag=0,passiveFlag=0;
+    const argSpec specs[] =
+    {
+        {"--active",ARG_FLAG,&activeFlag,NULL},
+        {"--passive",ARG_FLAG,&passiveFlag,NULL},
+        {"--port",ARG_VALUE,&strPort,"Port missing."},
+        {"--peer",ARG_VALUE,peerHost,"Peer hostname missing."},
+        {"--reconnect",ARG_FLAG,&reconnect,NULL},
+        {"--spool",ARG_VALUE,&spoolFile,"Spool file missing."},
+        {"--channels",ARG_FLAG,&useChannels,NULL},
+        {"--timestamps",ARG_FLAG,&useTimestamps,NULL},
+        {"--hub",ARG_VALUE,&hubStr,"Reactor count missing."},
+        {"--hub-budget",ARG_VALUE,&budgetStr,"Budget missing."},
+        {NULL}
+    };
+
+    extractArgs(argc,argv,specs,USAGE);
+    if(activeFlag + passiveFlag > 1)
+    {
+        invalidArgs("Mode defined more than one time.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(activeFlag)
+        *mode = active;
+    else if(passiveFlag)
+        *mode = passive;
+    validateArgs(*mode,strPort,*peerHost,port);
+    if(reconnect && *mode != active)
+    {
+        invalidArgs("--reconnect is for active mode.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(spoolFile != NULL && !reconnect)
+    {
+        invalidArgs("--spool needs --reconnect.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(spoolFile == NULL)
+        spoolFile = DEFAULT_SPOOL;
+    if(useChannels && reconnect)
+    {
+        invalidArgs("--channels does not work with --reconnect.",USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if(hubStr != NULL)
+    {
+        long count = strtol(hubStr,&end,10);
+        if(*end != 0 || count < 1 || count > HUB_MAX_REACTORS)
+        {
+            invalidArgs("Invalid reactor count.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        if(*mode != passive || useChannels)
+        {
+            invalidArgs("--hub is for passive mode without --channels.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        hubReactors = (int)count;
+    }
+    if(budgetStr != NULL)
+    {
+        long megabytes = strtol(budgetStr,&end,10);
+        if(*end != 0 || megabytes < 1 || hubStr == NULL)
+        {
+            invalidArgs("--hub-budget takes megabytes and needs --hub.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        hubBudget = (size_t)megabytes * 1024 * 1024;
+    }
+    /* The channel loop reads the terminal directly, after the name. */
+    if(useChannels)
+        setvbuf(stdin,NULL,_IONBF,0);
 }
 
-void invalidArgs(const char*message)
+void validateArgs(AppMode mode,char *strPort,char *strPeer,int *port)
 {
-    fprintf(stderr,"\n%s",message);
-    fprintf(stderr,"\n\nCommand should adhere to the following format:");
-    fprintf(stderr,"\n\n     ./chatApp  (--active | --passive) --port XXXX [--peer [IPADDRS | DNSNAME]]\n\n");
+    if(mode == passive)
+    {
+        if(strPort == NULL || strPort[0] == 0)
+        {
+            invalidArgs("No port specified for passive mode.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        if((*port = validateAndGetPort(strPort)) == -1)
+        {
+            invalidArgs("Invalid Port.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if(mode == active)
+    {
+        if(strPeer == NULL || strPeer[0] == 0)
+        {
+            invalidArgs("No peer hostname specified for active mode.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        if(strPort == NULL || strPort[0] == 0)
+        {
+            invalidArgs("No peer port specified for active mode.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        if(validateHost(strPeer) == -1)
+        {
+            invalidArgs("Invalid Peer hostname.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+        if((*port = validateAndGetPort(strPort)) == -1)
+        {
+            invalidArgs("Invalid Peer port.",USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if(mode == undefined)
+    {
+        invalidArgs("Mode not specified.",USAGE);
+        exit(EXIT_FAILURE);
+    }
 }
@@ -0,0 +1,173 @@
+/*******************************************************************************
+ *
+ * Outgoing spool: session frames waiting to be written to a peer.
+ *
+ * ****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spool.h"
+#include "protocol.h"
+
+#define SPOOL_MAGIC "GSPL"
+
+typedef struct spoolHeader
+{
+    char Magic[4];
+    unsigned int Version;
+    unsigned long long Pending;
+}spoolHeader;
+
+static void resizeSpool(outSpool*,size_t);
+static size_t wholeFrames(const char*,size_t);
+
+
+/*  A spool that is new, or not one of ours, starts out empty.  */
+void openSpool(outSpool *spool,const char *path)
+{
+    spoolHeader *header;
+    struct stat st;
+
+    if((spool->Fd = open(path,O_RDWR|O_CREAT,0600)) == -1)
+    {
+        perror("Error while opening the spool file");
+        exit(EXIT_FAILURE);
+    }
+    if(flock(spool->Fd,LOCK_EX|LOCK_NB) == -1)
+    {
+        fprintf(stderr,"\nSpool file %s is in use.\n",path);
+        exit(EXIT_FAILURE);
+    }
+    if(fstat(spool->Fd,&st) == -1)
+    {
+        perror("Error while reading the spool file");
+        exit(EXIT_FAILURE);
+    }
+
+    spool->Map = NULL;
+    spool->MapLength = 0;
+    resizeSpool(spool,(size_t)st.st_size > SPOOL_MIN_SIZE ? (size_t)st.st_size : SPOOL_MIN_SIZE);
+    header = (spoolHeader*)spool->Map;
+    if(memcmp(header->Magic,SPOOL_MAGIC,4) != 0 || header->Version != SPOOL_VERSION ||
+       header->Pending > spool->MapLength - sizeof(spoolHeader))
+    {
+        memcpy(header->Magic,SPOOL_MAGIC,4);
+        header->Version = SPOOL_VERSION;
+        header->Pending = 0;
+    }
+    /* A frame cut short by a crash mid-append is dropped. */
+    header->Pending = wholeFrames(spool->Map + sizeof(spoolHeader),header->Pending);
+}
+
+void closeSpool(outSpool *spool)
+{
+    munmap(spool->Map,spool->MapLength);
+    close(spool->Fd);
+    spool->Map = NULL;
+    spool->Fd = -1;
+}
+
+void spoolAppend(outSpool *spool,const char *frame,size_t len)
+{
+    spoolHeader *header = (spoolHeader*)spool->Map;
+    size_t need = sizeof(spoolHeader) + header->Pending + len;
+
+    if(need > spool->MapLength)
+    {
+        size_t length = spool->MapLength;
+        while(length < need)
+            length *= 2;
+        resizeSpool(spool,length);
+        header = (spoolHeader*)spool->Map;
+    }
+    /* The frame is in place before Pending counts it. */
+    memcpy(spool->Map + sizeof(spoolHeader) + header->Pending,frame,len);
+    __atomic_store_n(&header->Pending,header->Pending + len,__ATOMIC_RELEASE);
+}
+
+size_t spoolPending(const outSpool *spool)
+{
+    return ((const spoolHeader*)spool->Map)->Pending;
+}
+
+/*  Returns 0 once everything was written, -1 if the socket failed.  */
+int spoolFlush(outSpool *spool,int sock)
+{
+    spoolHeader *header = (spoolHeader*)spool->Map;
+    char *data = spool->Map + sizeof(spoolHeader);
+    size_t done=0,kept;
+
+    while(done < header->Pending)
+    {
+        ssize_t ret;
+        if((ret = write(sock,data + done,header->Pending - done)) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        done += ret;
+    }
+    if(done == header->Pending)
+    {
+        header->Pending = 0;
+        return 0;
+    }
+    done = wholeFrames(data,done);
+    kept = header->Pending - done;
+    memmove(data,data + done,kept);
+    header->Pending = kept;
+    return -1;
+}
+
+
+/******************************************************************************
+
+ *                Helper functions.
+
+ ******************************************************************************/
+
+/*  Grows the file and its mapping to length bytes.  */
+static void resizeSpool(outSpool *spool,size_t length)
+{
+    void *map;
+
+    if(ftruncate(spool->Fd,length) == -1)
+    {
+        perror("Error while growing the spool file");
+        exit(EXIT_FAILURE);
+    }
+    if(spool->Map == NULL)
+        map = mmap(NULL,length,PROT_READ|PROT_WRITE,MAP_SHARED,spool->Fd,0);
+    else
+        map = mremap(spool->Map,spool->MapLength,length,MREMAP_MAYMOVE);
+    if(map == MAP_FAILED)
+    {
+        perror("Error while mapping the spool file");
+        exit(EXIT_FAILURE);
+    }
+    spool->Map = (char*)map;
+    spool->MapLength = length;
+}
+
+/*  Bytes taken by the whole frames at the start of data.  */
+static size_t wholeFrames(const char *data,size_t len)
+{
+    size_t done=0;
+
+    while(done < len)
+    {
+        int frame = frameLength(&sessionFormat,data + done,len - done);
+        if(frame <= 0 || (size_t)frame > len - done)
+            break;
+        done += frame;
+    }
+    return done;
+}
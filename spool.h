@@ -0,0 +1,43 @@
+/*******************************************************************************
+ *
+ * Outgoing spool: session frames waiting to be written to a peer.
+ *
+ * 1. The spool is a file mapped with MAP_SHARED. Frames queued while the
+ *    peer is unreachable survive the process being killed, and the next
+ *    run that opens the same file sends them.
+ *
+ * 2. Layout-
+ *      Header: Magic "GSPL"(4) Version(4) Pending(8)
+ *      Frames: whole session frames, back to back
+ *    Integers are in host byte order; the file never leaves the machine.
+ *
+ * 3. spoolFlush() sends everything pending with one write() and drops
+ *    the frames the socket took whole. A frame cut by a failed write is
+ *    kept and sent again on the next connection.
+ *
+ * 4. The file is locked while open, so two processes cannot share it. Not
+ *    thread safe; callers hold their send lock.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_SPOOL_H
+#define GEEKCHAT_SPOOL_H
+
+#include <stddef.h>
+
+#define SPOOL_VERSION 1
+#define SPOOL_MIN_SIZE 65536
+
+typedef struct outSpool
+{
+    int Fd;
+    char *Map;
+    size_t MapLength;
+}outSpool;
+
+void openSpool(outSpool*,const char*);
+void closeSpool(outSpool*);
+void spoolAppend(outSpool*,const char*,size_t);
+size_t spoolPending(const outSpool*);
+int spoolFlush(outSpool*,int);
+
+#endif
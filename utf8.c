@@ -0,0 +1,436 @@
+/*******************************************************************************
+ *
+ * UTF-8 validation and terminal-safe sanitization of chat text.
+ *
+ * 1. The vector kernels implement the lookup-table validator of Keiser and
+ *    Lemire: three 16 entry tables indexed by nibbles of the current and
+ *    previous byte flag every malformed two byte window, and a saturating
+ *    subtraction catches missing third and fourth continuation bytes.
+ *
+ * 2. Blocks that are pure ASCII skip the table lookups entirely.
+ *
+ * 3. The same pass records whether the text holds a C0 control, DEL or a
+ *    C1 control. Only then does sanitizeText() fall back to the scalar
+ *    repair loop.
+ *
+ * ****************************************************************************/
+#define _XOPEN_SOURCE 700
+#include <string.h>
+#include <wchar.h>
+#include "utf8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/*  Error classes of the lookup-table validator.  */
+#define TOO_SHORT      (1<<0)
+#define TOO_LONG       (1<<1)
+#define OVERLONG_3     (1<<2)
+#define TOO_LARGE      (1<<3)
+#define SURROGATE      (1<<4)
+#define OVERLONG_2     (1<<5)
+#define TOO_LARGE_1000 (1<<6)
+#define OVERLONG_4     (1<<6)
+#define TWO_CONTS      (1<<7)
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+/* Replacement for bytes which must not reach the terminal. */
+#define REPLACEMENT_CHAR '?'
+
+/*  Result bits of a scan.  */
+#define SCAN_INVALID 1
+#define SCAN_UNSAFE  2
+
+typedef int (*scanFunc)(const unsigned char *, size_t);
+
+static int scanScalar(const unsigned char *, size_t);
+static int scanDispatch(const unsigned char *, size_t);
+
+static scanFunc scanKernel = scanDispatch;
+
+
+int validateUtf8(const char *text, size_t len)
+{
+    return (scanKernel((const unsigned char*)text,len) & SCAN_INVALID) == 0;
+}
+
+int isTerminalSafe(const char *text, size_t len)
+{
+    return scanKernel((const unsigned char*)text,len) == 0;
+}
+
+size_t sanitizeText(char *text, size_t len)
+{
+    unsigned char *s = (unsigned char*)text;
+    size_t in,out;
+
+    if(scanKernel(s,len) == 0)
+        return len;
+
+    in = out = 0;
+    while(in < len)
+    {
+        unsigned char ch = s[in];
+        int seqLen;
+
+        if(ch < 0x80)
+        {
+            if(ch == '\t')
+                s[out++] = ' ';
+            else if(ch < 0x20 || ch == 0x7F)
+                s[out++] = REPLACEMENT_CHAR;
+            else
+                s[out++] = ch;
+            in++;
+            continue;
+        }
+
+        seqLen = utf8SequenceLength(s + in,len - in);
+        if(seqLen == 0)
+        {
+            s[out++] = REPLACEMENT_CHAR;
+            in++;
+        }
+        else if(seqLen == 2 && ch == 0xC2 && s[in+1] < 0xA0)
+        {
+            /* U+0080 to U+009F, the C1 controls. */
+            s[out++] = REPLACEMENT_CHAR;
+            in += 2;
+        }
+        else
+        {
+            memmove(s + out,s + in,seqLen);
+            out += seqLen;
+            in += seqLen;
+        }
+    }
+    return out;
+}
+
+int utf8SequenceLength(const unsigned char *s, size_t avail)
+{
+    unsigned char lo = 0x80,hi = 0xBF;
+    int len,i;
+
+    if(avail == 0)
+        return 0;
+    if(s[0] < 0x80)
+        return 1;
+    if(s[0] >= 0xC2 && s[0] <= 0xDF)
+        len = 2;
+    else if(s[0] >= 0xE0 && s[0] <= 0xEF)
+    {
+        len = 3;
+        if(s[0] == 0xE0)
+            lo = 0xA0;
+        else if(s[0] == 0xED)
+            hi = 0x9F;
+    }
+    else if(s[0] >= 0xF0 && s[0] <= 0xF4)
+    {
+        len = 4;
+        if(s[0] == 0xF0)
+            lo = 0x90;
+        else if(s[0] == 0xF4)
+            hi = 0x8F;
+    }
+    else
+        return 0;
+
+    if(avail < (size_t)len)
+        return 0;
+    if(s[1] < lo || s[1] > hi)
+        return 0;
+    for(i=2;i<len;i++)
+    {
+        if(s[i] < 0x80 || s[i] > 0xBF)
+            return 0;
+    }
+    return len;
+}
+
+size_t utf8PrevCharStart(const char *text, size_t len)
+{
+    size_t start = len;
+    while(start > 0 && ((unsigned char)text[start-1] & 0xC0) == 0x80)
+        start--;
+    return start > 0 ? start - 1 : 0;
+}
+
+int utf8DisplayWidth(const char *text, size_t len)
+{
+    mbstate_t state;
+    int width=0;
+
+    memset(&state,0,sizeof(state));
+    while(len > 0)
+    {
+        wchar_t wc;
+        size_t used;
+        int w;
+
+        used = mbrtowc(&wc,text,len,&state);
+        if(used == (size_t)-1 || used == (size_t)-2)
+        {
+            /* Not decodable in this locale, the terminal shows one cell. */
+            memset(&state,0,sizeof(state));
+            used = 1;
+            w = 1;
+        }
+        else
+        {
+            if(used == 0)
+                used = 1;
+            w = wcwidth(wc);
+        }
+        width += w > 0 ? w : 0;
+        text += used;
+        len -= used;
+    }
+    return width;
+}
+
+
+/******************************************************************************
+
+ *                Scan kernels.
+
+ ******************************************************************************/
+
+static int scanScalar(const unsigned char *s, size_t len)
+{
+    size_t i=0;
+    int result=0;
+
+    while(i < len)
+    {
+        int seqLen;
+
+        if(s[i] < 0x80)
+        {
+            if(s[i] < 0x20 || s[i] == 0x7F)
+                result |= SCAN_UNSAFE;
+            i++;
+            continue;
+        }
+        if((seqLen = utf8SequenceLength(s + i,len - i)) == 0)
+            return SCAN_INVALID | SCAN_UNSAFE;
+        if(s[i] == 0xC2 && s[i+1] < 0xA0)
+            result |= SCAN_UNSAFE;
+        i += seqLen;
+    }
+    return result;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+#define TABLE_BYTE1_HIGH \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+    TOO_SHORT | OVERLONG_2, \
+    TOO_SHORT, \
+    TOO_SHORT | OVERLONG_3 | SURROGATE, \
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define TABLE_BYTE1_LOW \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+    CARRY | OVERLONG_2, \
+    CARRY, \
+    CARRY, \
+    CARRY | TOO_LARGE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define TABLE_BYTE2_HIGH \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+/* C0 controls and DEL. */
+#define CONTROL_MASK(in,ctrlMax,del,cmpeq,min,or) \
+    or(cmpeq(min(in,ctrlMax),in),cmpeq(in,del))
+
+/* Second bytes of U+0080 to U+009F, the C1 controls. */
+#define C1_MASK(in,prev1,c1Lead,c1Max,cmpeq,min,and) \
+    and(cmpeq(prev1,c1Lead),cmpeq(min(in,c1Max),in))
+
+__attribute__((target("ssse3")))
+static __m128i checkBlockSsse3(__m128i in, __m128i prev)
+{
+    const __m128i byte1High = _mm_setr_epi8(TABLE_BYTE1_HIGH);
+    const __m128i byte1Low = _mm_setr_epi8(TABLE_BYTE1_LOW);
+    const __m128i byte2High = _mm_setr_epi8(TABLE_BYTE2_HIGH);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i prev1,prev2,prev3,special,must23;
+
+    prev1 = _mm_alignr_epi8(in,prev,15);
+    special = _mm_and_si128(
+        _mm_and_si128(
+            _mm_shuffle_epi8(byte1High,_mm_and_si128(_mm_srli_epi16(prev1,4),nibble)),
+            _mm_shuffle_epi8(byte1Low,_mm_and_si128(prev1,nibble))),
+        _mm_shuffle_epi8(byte2High,_mm_and_si128(_mm_srli_epi16(in,4),nibble)));
+
+    prev2 = _mm_alignr_epi8(in,prev,14);
+    prev3 = _mm_alignr_epi8(in,prev,13);
+    must23 = _mm_or_si128(_mm_subs_epu8(prev2,_mm_set1_epi8(0xE0 - 0x80)),
+                          _mm_subs_epu8(prev3,_mm_set1_epi8((char)(0xF0 - 0x80))));
+    must23 = _mm_and_si128(must23,_mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23,special);
+}
+
+__attribute__((target("ssse3")))
+static int scanSsse3(const unsigned char *s, size_t len)
+{
+    const __m128i maxValue = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                           (char)0xEF,(char)0xDF,(char)0xBF);
+    const __m128i ctrlMax = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i c1Lead = _mm_set1_epi8((char)0xC2);
+    const __m128i c1Max = _mm_set1_epi8((char)0x9F);
+    __m128i prev,error,incomplete,unsafe,in;
+    unsigned char tail[16];
+    size_t i=0;
+
+    prev = error = incomplete = unsafe = _mm_setzero_si128();
+    for(;;)
+    {
+        if(i + 16 <= len)
+            in = _mm_loadu_si128((const __m128i*)(s + i));
+        else
+        {
+            /* Spaces are ASCII, so a truncated sequence shows as TOO_SHORT. */
+            memset(tail,' ',sizeof(tail));
+            memcpy(tail,s + i,len - i);
+            in = _mm_loadu_si128((const __m128i*)tail);
+        }
+        unsafe = _mm_or_si128(unsafe,CONTROL_MASK(in,ctrlMax,del,
+                               _mm_cmpeq_epi8,_mm_min_epu8,_mm_or_si128));
+        if(_mm_movemask_epi8(in) == 0)
+            error = _mm_or_si128(error,incomplete);
+        else
+        {
+            error = _mm_or_si128(error,checkBlockSsse3(in,prev));
+            unsafe = _mm_or_si128(unsafe,C1_MASK(in,_mm_alignr_epi8(in,prev,15),c1Lead,c1Max,
+                                  _mm_cmpeq_epi8,_mm_min_epu8,_mm_and_si128));
+            incomplete = _mm_subs_epu8(in,maxValue);
+        }
+        prev = in;
+        if(i + 16 > len)
+            break;
+        i += 16;
+    }
+    error = _mm_or_si128(error,incomplete);
+
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(error,_mm_setzero_si128())) != 0xFFFF)
+        return SCAN_INVALID | SCAN_UNSAFE;
+    return _mm_movemask_epi8(unsafe) ? SCAN_UNSAFE : 0;
+}
+
+__attribute__((target("avx2")))
+static __m256i checkBlockAvx2(__m256i in, __m256i prev)
+{
+    const __m256i byte1High = _mm256_setr_epi8(TABLE_BYTE1_HIGH,TABLE_BYTE1_HIGH);
+    const __m256i byte1Low = _mm256_setr_epi8(TABLE_BYTE1_LOW,TABLE_BYTE1_LOW);
+    const __m256i byte2High = _mm256_setr_epi8(TABLE_BYTE2_HIGH,TABLE_BYTE2_HIGH);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i carried,prev1,prev2,prev3,special,must23;
+
+    /* Upper half of prev followed by lower half of in, per 128 bit lane. */
+    carried = _mm256_permute2x128_si256(prev,in,0x21);
+    prev1 = _mm256_alignr_epi8(in,carried,15);
+    special = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte1High,_mm256_and_si256(_mm256_srli_epi16(prev1,4),nibble)),
+            _mm256_shuffle_epi8(byte1Low,_mm256_and_si256(prev1,nibble))),
+        _mm256_shuffle_epi8(byte2High,_mm256_and_si256(_mm256_srli_epi16(in,4),nibble)));
+
+    prev2 = _mm256_alignr_epi8(in,carried,14);
+    prev3 = _mm256_alignr_epi8(in,carried,13);
+    must23 = _mm256_or_si256(_mm256_subs_epu8(prev2,_mm256_set1_epi8(0xE0 - 0x80)),
+                             _mm256_subs_epu8(prev3,_mm256_set1_epi8((char)(0xF0 - 0x80))));
+    must23 = _mm256_and_si256(must23,_mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23,special);
+}
+
+__attribute__((target("avx2")))
+static int scanAvx2(const unsigned char *s, size_t len)
+{
+    const __m256i maxValue = _mm256_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                              -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                                              (char)0xEF,(char)0xDF,(char)0xBF);
+    const __m256i ctrlMax = _mm256_set1_epi8(0x1F);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    const __m256i c1Lead = _mm256_set1_epi8((char)0xC2);
+    const __m256i c1Max = _mm256_set1_epi8((char)0x9F);
+    __m256i prev,prev1,error,incomplete,unsafe,in;
+    unsigned char tail[32];
+    size_t i=0;
+
+    prev = error = incomplete = unsafe = _mm256_setzero_si256();
+    for(;;)
+    {
+        if(i + 32 <= len)
+            in = _mm256_loadu_si256((const __m256i*)(s + i));
+        else
+        {
+            memset(tail,' ',sizeof(tail));
+            memcpy(tail,s + i,len - i);
+            in = _mm256_loadu_si256((const __m256i*)tail);
+        }
+        unsafe = _mm256_or_si256(unsafe,CONTROL_MASK(in,ctrlMax,del,
+                                 _mm256_cmpeq_epi8,_mm256_min_epu8,_mm256_or_si256));
+        if(_mm256_movemask_epi8(in) == 0)
+            error = _mm256_or_si256(error,incomplete);
+        else
+        {
+            error = _mm256_or_si256(error,checkBlockAvx2(in,prev));
+            prev1 = _mm256_alignr_epi8(in,_mm256_permute2x128_si256(prev,in,0x21),15);
+            unsafe = _mm256_or_si256(unsafe,C1_MASK(in,prev1,c1Lead,c1Max,
+                                     _mm256_cmpeq_epi8,_mm256_min_epu8,_mm256_and_si256));
+            incomplete = _mm256_subs_epu8(in,maxValue);
+        }
+        prev = in;
+        if(i + 32 > len)
+            break;
+        i += 32;
+    }
+    error = _mm256_or_si256(error,incomplete);
+
+    if(!_mm256_testz_si256(error,error))
+        return SCAN_INVALID | SCAN_UNSAFE;
+    return _mm256_movemask_epi8(unsafe) ? SCAN_UNSAFE : 0;
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+/*  Picks the widest kernel the CPU supports on first use.  */
+static int scanDispatch(const unsigned char *s, size_t len)
+{
+    scanFunc kernel = scanScalar;
+
+    #ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        kernel = scanAvx2;
+    else if(__builtin_cpu_supports("ssse3"))
+        kernel = scanSsse3;
+    #endif
+    __atomic_store_n(&scanKernel,kernel,__ATOMIC_RELAXED);
+    return kernel(s,len);
+}
@@ -0,0 +1,36 @@
+/*******************************************************************************
+ *
+ * UTF-8 validation and terminal-safe sanitization of chat text.
+ *
+ * 1. validateUtf8() and sanitizeText() pick an AVX2, SSSE3 or scalar kernel
+ *    once at first use, depending on what the CPU supports.
+ *
+ * 2. sanitizeText() works in place and never grows the text. Invalid byte
+ *    sequences, C0/C1 control characters and DEL are replaced by '?', tabs
+ *    by a space, so a peer cannot send terminal escape sequences.
+ *
+ * ****************************************************************************/
+#ifndef GEEKCHAT_UTF8_H
+#define GEEKCHAT_UTF8_H
+
+#include <stddef.h>
+
+/* Returns 1 if text holds only well formed UTF-8, 0 otherwise. */
+int validateUtf8(const char *text, size_t len);
+
+/* Returns 1 if text can be written to a terminal as it is. */
+int isTerminalSafe(const char *text, size_t len);
+
+/* Sanitizes text in place and returns its new length. */
+size_t sanitizeText(char *text, size_t len);
+
+/* Length of the valid UTF-8 sequence at text, or 0 if it is malformed. */
+int utf8SequenceLength(const unsigned char *text, size_t avail);
+
+/* Offset of the code point which ends at text[len-1]. */
+size_t utf8PrevCharStart(const char *text, size_t len);
+
+/* Terminal columns taken by text, per the current LC_CTYPE locale. */
+int utf8DisplayWidth(const char *text, size_t len);
+
+#endif